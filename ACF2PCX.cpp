@@ -25,1279 +25,3897 @@
 //   Able to properly decompress almost all the videos, but still some issues on a couple of them
 //
 
-#include <cassert>
-#include <vector>
-#include <string>
-#include <fstream>
-#include <cstdint>
-#include <cstddef>
-#include <filesystem> 
-#include <iostream>
-#include <format>
+#include "ACFDecoder.h"
+#include "FrameServer.h"
+#include "SharedMemorySink.h"
+#include "AudioSink.h"
+#include "IsoImage.h"
+#include "FrameScaler.h"
 
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cstdlib>
+#include <optional>
+#include <new>
+#include <emmintrin.h>
 
-uint32_t g_DiagonalOffsets_1[64] =
-{ 0, 1, 320, 640, 321, 2, 3, 322, 641, 960, 1280, 961, 642, 323, 4, 5, 324, 643, 962, 1281, 1600, 1920, 1601, 1282, 963, 644, 325, 6, 7,
-  326, 645,  964, 1283, 1602, 1921, 2240, 2241, 1922, 1603, 1284, 965, 646, 327, 647, 966, 1285, 1604, 1923, 2242, 2243, 1924, 1605, 1286,
-  967, 1287, 1606, 1925, 2244, 2245, 1926, 1607, 1927, 2246, 2247 };
 
-uint32_t g_DiagonalOffsets_2[64] =
-{ 7, 6, 327, 647, 326, 5, 4, 325, 646, 967, 1287, 966, 645, 324, 3, 2, 323, 644, 965, 1286, 1607, 1927, 1606, 1285, 964, 643, 322, 1, 0,
-  321, 642, 963, 1284, 1605, 1926, 2247, 2246, 1925, 1604, 1283, 962, 641, 320, 640, 961, 1282, 1603, 1924, 2245, 2244, 1923, 1602, 1281,
-  960, 1280, 1601, 1922, 2243, 2242, 1921, 1600, 1920, 2241, 2240 };
 
-uint32_t g_SplitTileOffsets[4] = { 0, 4, 320*4, 320*4 + 4 };
-
-
-uint16_t ReadU16(const uint8_t*& ptr)                 { uint16_t value = (*(uint16_t*)(ptr)); ptr += 2; return value; }
-int16_t ReadS16(const uint8_t*& ptr)                  { int16_t value = (*(int16_t*)(ptr)); ptr += 2; return value; }
-
-uint32_t ReadU32(const uint8_t*& ptr, int skip = 4)   { uint32_t value = (*(uint32_t*)(ptr)); ptr += skip; return value; }
-
-int16_t ReadXYOffset(const uint8_t*& ptr, int stride) { int16_t value = (*(int8_t*)(ptr)) + (*(int8_t*)(ptr + 1)) * stride / 2; ptr += 2; return value; }
-
-
-class Format
-{
-public:
-  uint32_t     struct_size;
-  uint32_t     width;
-  uint32_t     height;
-  uint32_t     frame_size;
-  uint32_t     key_size;
-  uint32_t     key_rate;
-  uint32_t     play_rate;
-  uint32_t     sampling_rate;
-  uint32_t     sample_type;
-  uint32_t     sample_flags;
-  uint32_t     compressor;         ///< 0==ACF / 1==XCF
-};
 
+//
+// ACF Encoder
+//
+// This is the reverse of the ACFDecoder: each 8x8 tile is encoded with all the opcodes able to represent it
+// exactly, and the one needing the smallest amount of bytes is kept, so the result is lossless and decoding
+// it gives back exactly the source pictures.
+//
+// The motion search compares each tile with all the 8x8 blocks of the previous frame in a small window,
+// which gives for each displacement the exact list of pixels an Update4/Update8/Update16 has to fix.
+// Tiles only depend on the previous frame, so the tile lines are shared between a few worker threads.
+//
+// Limitations:
+// - The pictures have to be made of whole tiles, and all have the same size (IsValid and AddFrame check it).
+// - The decoder has a 320 pixels stride hardcoded in the diagonal and split tiles opcodes, so these are
+//   not used when the width is not 320, and the opcode array has room for 40 tiles per line at most.
+// - The absolute Motion8/Motion4 offsets are 16 bit values, so they only reach the top of a 320x240 frame,
+//   the relative ROMotion opcodes are used for the rest.
+//
+constexpr uint32_t g_SectorSize = 2048;             ///< ACF files are laid out in CD sectors
+constexpr int32_t  g_MotionSearchRange = 16;        ///< Maximum displacement tested by the motion search, in pixels
 
+const uint64_t g_QuadrantMasks[4] = { 0x000000000F0F0F0Full, 0x00000000F0F0F0F0ull, 0x0F0F0F0F00000000ull, 0xF0F0F0F000000000ull };
 
 
-class FrameLen
+// Best displacement found so far by the motion search, and which pixels still need to be updated
+class MotionCandidate
 {
 public:
-  const uint8_t* GetFrameSizeArray() const { return &frame_size_in_sectors;  }
+  void Update(uint64_t mask, int32_t count, int32_t x, int32_t y)
+  {
+    if (count < m_Count)
+    {
+      m_Mask = mask; m_Count = count; m_X = x; m_Y = y;
+    }
+  }
 
 public:
-  uint32_t     biggest_frame_size;
-  uint8_t      frame_size_in_sectors;  // Actual first entry, it's an array, but the size depends of the actual chunk size
+  uint64_t  m_Mask = ~0ull;
+  int32_t   m_Count = 64;
+  int32_t   m_X = 0;
+  int32_t   m_Y = 0;
 };
 
 
-
-class FrameData
+class TileCode
 {
 public:
-  const uint8_t* GetOpcodesArray() const                    { return opcodes; }
-  const uint8_t* GetAlignedData(uint32_t height) const      { return ((uint8_t*)opcodes) + (height / 8) * 30; }
-  const uint8_t* GetUnalignedData() const                   { return ((uint8_t*)this) + color_offset; }
+  void Reset(uint8_t opcode)                { m_Opcode = opcode; m_AlignedSize = 0; m_UnAlignedSize = 0; }
+  uint32_t GetSize() const                  { return m_AlignedSize + m_UnAlignedSize; }
+
+  void PushAligned(uint8_t value)           { m_Aligned[m_AlignedSize++] = value; }
+  void PushUnAligned(uint8_t value)         { m_UnAligned[m_UnAlignedSize++] = value; }
+  void PushAligned16(uint16_t value)        { PushAligned(value & 255); PushAligned(value >> 8); }
+  void PushUnAligned16(uint16_t value)      { PushUnAligned(value & 255); PushUnAligned(value >> 8); }
+  void PushAligned24(uint32_t value)        { PushAligned16(value & 65535); PushAligned((value >> 16) & 255); }
+  void PushAligned32(uint32_t value)        { PushAligned16(value & 65535); PushAligned16(value >> 16); }
 
 public:
-  uint32_t     color_offset;
-  uint8_t      opcodes[30];       // Actually (height/8)*30 bytes, opcodes are stored as 6 bits per 8x8 bloc in the picture
+  uint8_t   m_Opcode = 0;
+  uint32_t  m_AlignedSize = 0;
+  uint32_t  m_UnAlignedSize = 0;
+  uint8_t   m_Aligned[96];
+  uint8_t   m_UnAligned[96];
 };
 
 
-class PaletteEntry
+class ACFEncoder
 {
 public:
-  uint8_t   m_Red;
-  uint8_t   m_Green;
-  uint8_t   m_Blue;
-};
-
-
+  ACFEncoder(uint32_t width, uint32_t height, uint32_t keyRate = 10, uint32_t playRate = 12)
+    : m_Width(width)
+    , m_Height(height)
+    , m_KeyRate(keyRate ? keyRate : 1)
+    , m_PlayRate(playRate)
+    , m_PreviousFrame(width, height)
+  {
+    m_IsValid = width && height && !(width % 8) && !(height % 8) && (width <= 320);
+    m_HasFixedStride = (m_Width == 320);
+    m_TileCodes.resize((m_Width / 8) * (m_Height / 8));
+    m_ThreadCount = std::max(1u, std::thread::hardware_concurrency());
+  }
 
 
-class Palette
-{
-public:
-  const uint8_t* GetBuffer() const { return &m_PaletteEntries[0].m_Red; }
+  // The width has to be a multiple of 8 up to 320 (the opcode array has room for 40 tiles per line), and the height a
+  // multiple of 8
+  bool IsValid() const { return m_IsValid; }
 
-public:
-  PaletteEntry  m_PaletteEntries[256];
-};
+  uint32_t GetWidth() const   { return m_Width; }
+  uint32_t GetHeight() const  { return m_Height; }
 
 
-class Camera
-{
-public:
-  std::string GetCameraString(int frameId) const
+  // The palette is only stored when it changes. Fails if the picture does not have the size given to the constructor.
+  bool AddFrame(const ImageBuffer& image, const Palette& palette)
   {
-    double computedAngle = (1200.0 * 3.14159265359) / atan((320.0 / 2) / (focal - 0.5)) / 180.0;
-    return std::format("frame {} \r\ncamera {} {} {} {} {} {} {} {}\r\n", frameId, cam_x, cam_y, cam_z, target_x, target_y, target_z, gamma, computedAngle);   // Almost OK but wobbly!
-  }
+    if (!m_IsValid || (image.m_Width != m_Width) || (image.m_Height != m_Height))
+    {
+      return false;
+    }
 
-public:
-  int32_t     cam_x;
-  int32_t     cam_z;
-  int32_t     cam_y;
-  int32_t     target_x;
-  int32_t     target_z;
-  int32_t     target_y;
-  int32_t     gamma;       ///< Aka "roll" but apparently ignored in the game?
-  int32_t     focal;
-};
+    std::vector<std::byte> frameChunks;
+    if (m_Frames.empty() || memcmp(&m_LastPalette, &palette, sizeof(Palette)) != 0)
+    {
+      m_LastPalette = palette;
+      AppendChunk(frameChunks, "Palette ", &palette, sizeof(Palette));
+    }
 
+    bool isKeyFrame = (m_Frames.size() % m_KeyRate) == 0;
+    EncodeTiles(image, isKeyFrame);
 
-enum class ChunkType
-{
-  e_Unknown = 0,  // We don't know that one
-  e_End,
-  e_FrameLen,     ///< Used to know the size of each frame
-  e_Format,
-  e_Palette,
-  e_NulChunk,     ///< Used to pad data on aligned sectors to improve the loading performance 
-  e_KeyFrame,
-  e_DltFrame,
-  e_Recouvre,
-  e_Camera,
-  e_SoundBuf,
-  e_SoundFrm,
-  e_SoundEnd,
-  e_SAL_STRT,
-  e_SAL_PART,
-  e_SAL_END,
-  e_SAL_COMP,
-};
+    std::vector<std::byte> frameData = SerializeTiles();
+    AppendChunk(frameChunks, isKeyFrame ? "KeyFrame" : "DltFrame", frameData.data(), frameData.size());
 
-class Chunk
-{
-public:
-  ChunkType GetChunkType() const
-  {
-    if (memcmp("NulChunk", m_Name, 8) == 0)		return ChunkType::e_NulChunk;
-    if (memcmp("KeyFrame", m_Name, 8) == 0)		return ChunkType::e_KeyFrame;
-    if (memcmp("DltFrame", m_Name, 8) == 0)		return ChunkType::e_DltFrame;
-    if (memcmp("FrameLen", m_Name, 8) == 0)		return ChunkType::e_FrameLen;
-    if (memcmp("Format  ", m_Name, 8) == 0)		return ChunkType::e_Format;
-    if (memcmp("Palette ", m_Name, 8) == 0)		return ChunkType::e_Palette;
-    if (memcmp("SoundBuf", m_Name, 8) == 0)		return ChunkType::e_SoundBuf;
-    if (memcmp("SoundFrm", m_Name, 8) == 0)		return ChunkType::e_SoundFrm;
-    if (memcmp("SoundEnd", m_Name, 8) == 0)		return ChunkType::e_SoundEnd;
-    if (memcmp("SAL_STRT", m_Name, 8) == 0)		return ChunkType::e_SAL_STRT;
-    if (memcmp("SAL_PART", m_Name, 8) == 0)		return ChunkType::e_SAL_PART;
-    if (memcmp("SAL_END ", m_Name, 8) == 0)		return ChunkType::e_SAL_END;
-    if (memcmp("SAL_COMP", m_Name, 8) == 0)		return ChunkType::e_SAL_COMP;
-    if (memcmp("Recouvre", m_Name, 8) == 0)		return ChunkType::e_Recouvre;
-    if (memcmp("Camera  ", m_Name, 8) == 0)		return ChunkType::e_Camera;
-    if (memcmp("End     ", m_Name, 8) == 0)		return ChunkType::e_End;
+    if (isKeyFrame)   m_BiggestKeyFrame   = std::max(m_BiggestKeyFrame, (uint32_t)frameData.size());
+    else              m_BiggestDeltaFrame = std::max(m_BiggestDeltaFrame, (uint32_t)frameData.size());
 
-    return ChunkType::e_Unknown;
+    m_Frames.push_back(std::move(frameChunks));
+    m_PreviousFrame.m_Buffer = image.m_Buffer;     // Lossless, so the decoder will have exactly that in its previous buffer
+    return true;
   }
 
-  std::string GetChunkName() const
-  {
-    return std::string(m_Name, 8);
-  }
 
-  uint32_t GetChunkSize() const
+  // Format and FrameLen first, then the frames, each of them padded with a NulChunk to fill the last sector
+  std::vector<std::byte> GetACFFile() const
   {
-    return m_Size;
-  }
+    std::vector<std::byte> acfFile;
+
+    Format format = {};
+    format.struct_size = sizeof(Format);
+    format.width       = m_Width;
+    format.height      = m_Height;
+    format.frame_size  = m_BiggestDeltaFrame;
+    format.key_size    = m_BiggestKeyFrame;
+    format.key_rate    = m_KeyRate;
+    format.play_rate   = m_PlayRate;
+    format.compressor  = 0;
+    AppendChunk(acfFile, "Format  ", &format, sizeof(Format));
+
+    std::vector<uint8_t> frameLen(sizeof(uint32_t) + m_Frames.size());
+    uint32_t biggestFrame = 0;
+    for (size_t frame = 0; frame < m_Frames.size(); frame++)
+    {
+      uint32_t paddedSize = GetPaddedSize((uint32_t)m_Frames[frame].size());
+      biggestFrame = std::max(biggestFrame, paddedSize);
+      frameLen[sizeof(uint32_t) + frame] = (uint8_t)std::min(255u, paddedSize / g_SectorSize);
+    }
+    memcpy(frameLen.data(), &biggestFrame, sizeof(uint32_t));
+    AppendChunk(acfFile, "FrameLen", frameLen.data(), frameLen.size());
+    PadToSector(acfFile);
 
-  const Chunk* GetNextChunk() const
-  {
-    assert(sizeof(Chunk) == 12);
-    return GetChunkAtOffset(sizeof(Chunk) + m_Size);
+    for (const auto& frameChunks : m_Frames)
+    {
+      acfFile.insert(acfFile.end(), frameChunks.begin(), frameChunks.end());
+      PadToSector(acfFile);
+    }
+    AppendChunk(acfFile, "End     ", nullptr, 0);
+    return acfFile;
   }
 
-  const Chunk* GetChunkAtOffset(size_t offset) const
-  {
-    const char* pointer((const char*)this);
-    pointer += offset;
-    return (const Chunk*)pointer;
-  }
 
-  template<typename T>
-  const T* GetData() const
+  bool SaveACF(const std::filesystem::path& targetPath) const
   {
-    const char* pointer((const char*)(this + 1));
-    return (const T*)pointer;
+    std::vector<std::byte> acfFile = GetACFFile();
+    std::ofstream os(targetPath, std::ios::binary);
+    os.write((const char*)acfFile.data(), acfFile.size());
+    return os.good();
   }
 
-private:
-  char	    m_Name[8];
-  uint32_t  m_Size;
-};
-
-
-
 
+  // One bit per opcode, the raw tile (opcode 0) is always allowed since it can encode anything
+  void SetAllowedOpcodes(uint64_t allowedOpcodes)   { m_AllowedOpcodes = allowedOpcodes | 1; }
 
-struct PCXHeader
-{
-  char password = 10;
-  char version = 5;
-  char encoding = 1;
-  char bits_per_pixel = 8;                  // 256 colors
-  short int xmin = 0, ymin = 0, xmax =0, ymax =0;
-  short int xres, yres;
-  unsigned char palette[48] = {0};
-  char reserved = 0;
-  char no_of_planes = 1;
-  short int bytes_per_line = 0;
-  short int palette_type = 0;
-  char filler[58] = { 0 };
-};
+  // How many times each opcode has been selected, for statistics
+  const uint32_t* GetOpcodeUsage() const { return m_OpcodeUsage; }
 
 
-class ImageBuffer
-{
-public:
-  ImageBuffer(uint32_t width, uint32_t height)
-    : m_Width(width)
-    , m_Height(height)
+private:
+  static void AppendChunk(std::vector<std::byte>& file, const char* name, const void* data, size_t size)
   {
-    m_Buffer.resize((size_t)m_Width * (size_t)m_Height);
+    uint32_t chunkSize = (uint32_t)size;
+    const std::byte* header = (const std::byte*)name;
+    file.insert(file.end(), header, header + 8);
+    file.insert(file.end(), (const std::byte*)&chunkSize, (const std::byte*)&chunkSize + 4);
+    if (size)
+    {
+      file.insert(file.end(), (const std::byte*)data, (const std::byte*)data + size);
+    }
   }
 
-  uint8_t* GetBuffer() { return m_Buffer.data(); }
-
-  void SaveToPcx(const char* filename, const uint8_t* ptrpalette)
+  static uint32_t GetPaddedSize(uint32_t size)
   {
-    short int index = 0, i, k, num_out;
-    unsigned char ch, file_buf[320 * 2];
-
-    PCXHeader pcx_header;
-    pcx_header.xmax = m_Width - 1;
-    pcx_header.ymax = m_Height - 1;
-    pcx_header.xres = m_Width;
-    pcx_header.yres = m_Height;
-    pcx_header.bytes_per_line = m_Width;
-
-    std::ofstream os(filename, std::ios::binary);
-
-    os.write((char*)&pcx_header, 128);
-
-    const uint8_t* screen = GetBuffer();
+    return (size + g_SectorSize - 1) / g_SectorSize * g_SectorSize;
+  }
 
-    for (k = pcx_header.ymin; k <= pcx_header.ymax; k++)
+  static void PadToSector(std::vector<std::byte>& file)
+  {
+    size_t padding = (g_SectorSize - (file.size() % g_SectorSize)) % g_SectorSize;
+    if (padding)
     {
-      short int number = 1;
-      unsigned char old_ch = *(screen + m_Width * k);
-
-      for (i = 1; i <= (int32_t)m_Width; i++)
+      if (padding < 12)
       {
-        if (i == m_Width)   ch = old_ch - 1;
-        else		    ch = *(screen + m_Width * k + i);
+        padding += g_SectorSize;   // Not even enough room for a chunk header
+      }
+      std::vector<std::byte> zeroes(padding - 12);
+      AppendChunk(file, "NulChunk", zeroes.data(), zeroes.size());
+    }
+  }
 
-        if ((ch == old_ch) && number < 63)
-        {
-          number++;
-        }
-        else
+
+  void EncodeTiles(const ImageBuffer& image, bool isKeyFrame)
+  {
+    std::atomic<int32_t> nextTileLine = 0;
+    auto worker = [&]()
+      {
+        int32_t tileY;
+        while ((tileY = nextTileLine++) < (int32_t)(m_Height / 8))
         {
-          num_out = ((unsigned char)number | 0xC0);
-          if ((number != 1) || ((old_ch & 0xC0) == 0xC0))
+          for (int32_t tileX = 0; tileX < (int32_t)(m_Width / 8); tileX++)
           {
-            file_buf[index++] = (unsigned char)num_out;
+            EncodeTile(image, tileX, tileY, isKeyFrame, m_TileCodes[tileX + tileY * (m_Width / 8)]);
           }
-          file_buf[index++] = old_ch;
-          old_ch = ch;
-          number = 1;
         }
-      }
-      os.write((char*)file_buf, index);
+      };
 
-      index = 0;
+    std::vector<std::thread> threads;
+    for (uint32_t thread = 1; thread < m_ThreadCount; thread++)
+    {
+      threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads)
+    {
+      thread.join();
     }
 
-    uint8_t c = 0x0C;
-    os.write((char*)&c, 1);
-    os.write((char*)ptrpalette, 768);
-    os.close();
-  }
-
-  void SaveToRaw(const char* filename, const uint8_t* ptrpalette)
-  {
-    std::ofstream os(filename, std::ios::binary);
-    os.write((char*)m_Buffer.data(), m_Buffer.size());
-    os.close();
+    for (const TileCode& tileCode : m_TileCodes)
+    {
+      m_OpcodeUsage[tileCode.m_Opcode]++;
+    }
   }
 
-public:
-  uint32_t                m_Width;
-  uint32_t                m_Height;
-  std::vector<uint8_t>    m_Buffer;
-};
-
-
-
-
 
+  // Same layout as what the FrameData class reads
+  std::vector<std::byte> SerializeTiles() const
+  {
+    uint32_t opcodeSize = (m_Height / 8) * 30;
+    uint32_t alignedSize = 0;
+    uint32_t unAlignedSize = 0;
+    for (const TileCode& tileCode : m_TileCodes)
+    {
+      alignedSize += tileCode.m_AlignedSize;
+      unAlignedSize += tileCode.m_UnAlignedSize;
+    }
 
-class ACFDecoder
-{
-public:
+    uint32_t colorOffset = sizeof(uint32_t) + opcodeSize + alignedSize;
+    std::vector<std::byte> frameData(colorOffset + unAlignedSize + 4);    // Some opcodes read 32 bits at a time, so a bit of padding is needed at the end
+    uint8_t* data = (uint8_t*)frameData.data();
+    memcpy(data, &colorOffset, sizeof(uint32_t));
 
-  void SetPixel(int x, int y, uint8_t color)
-  {
-    m_CurrentTile[x + (y * m_Width)] = color;
+    uint8_t* opcodes = data + sizeof(uint32_t);
+    uint8_t* aligned = opcodes + opcodeSize;
+    uint8_t* unAligned = data + colorOffset;
+    for (size_t tile = 0; tile < m_TileCodes.size(); tile++)
+    {
+      const TileCode& tileCode = m_TileCodes[tile];
+
+      assert(((tile % 4) != 3) || (tileCode.m_Opcode != 63));
+
+      // 4 opcodes of 6 bits in each group of 3 bytes
+      uint32_t bitPosition = (uint32_t)(tile % 4) * 6;
+      uint8_t* group = opcodes + (tile / 4) * 3;
+      uint32_t value = group[0] | (group[1] << 8) | (group[2] << 16);
+      value |= tileCode.m_Opcode << bitPosition;
+      group[0] = value & 255;
+      group[1] = (value >> 8) & 255;
+      group[2] = (value >> 16) & 255;
+
+      memcpy(aligned, tileCode.m_Aligned, tileCode.m_AlignedSize);
+      aligned += tileCode.m_AlignedSize;
+      memcpy(unAligned, tileCode.m_UnAligned, tileCode.m_UnAlignedSize);
+      unAligned += tileCode.m_UnAlignedSize;
+    }
+    return frameData;
   }
 
 
-  // 3 bytes (6 bitsx4) for the position, 4 bytes for colors
-  void Update4()
+  static uint8_t GetMostFrequentColor(const uint8_t* pixels, int32_t stride, int32_t size)
   {
-    uint32_t value = *(uint32_t*)m_UnAlignedStream;	// Que 3 octets int‚ressants (Little Endian)
-    m_UnAlignedStream += 3;
-
-    for (int32_t i = 0; i < 4; i++)
+    uint8_t counts[256] = { 0 };
+    uint8_t bestColor = pixels[0];
+    for (int32_t y = 0; y < size; y++)
     {
-      SetPixel(value & 7 , ((value >> 3) & 7), *m_AlignedStream++);
-      value >>= 6;
+      for (int32_t x = 0; x < size; x++)
+      {
+        uint8_t color = pixels[x + y * stride];
+        if (++counts[color] > counts[bestColor])
+        {
+          bestColor = color;
+        }
+      }
     }
+    return bestColor;
   }
 
-
-  void Update8()
+  // Cost in bytes of the Update4/Update8/Update16 needed to fix 'count' pixels, and the matching opcode increment
+  static uint32_t GetUpdateCost(uint32_t count, uint32_t& opcodeIncrement)
   {
-    Update4();
-    Update4();
+    if (count == 0)                       { opcodeIncrement = 0; return 0; }
+    if (count <= 4)                       { opcodeIncrement = 1; return 7; }
+    if ((count <= 8) && (8 + count > 14)) { opcodeIncrement = 2; return 14; }
+    opcodeIncrement = 3;
+    return 8 + count;
   }
 
-
-
-  void Update16()
+  // Writes the Update4/Update8/Update16 part after the motion or fill data
+  static void PushUpdate(TileCode& code, const uint8_t* tile, uint64_t differences, uint32_t opcodeIncrement)
   {
-    for (int32_t y = 0; y < 8; y++)
+    if (opcodeIncrement == 3)
+    {
+      for (int32_t y = 0; y < 8; y++)
+      {
+        code.PushAligned((uint8_t)(differences >> (y * 8)));
+      }
+      for (uint32_t index = 0; index < 64; index++)
+      {
+        if (differences & (1ull << index))    code.PushUnAligned(tile[index]);
+      }
+    }
+    else if (opcodeIncrement)
     {
-      uint8_t mask = *m_AlignedStream++;
-      for (int32_t x = 0; x < 8; x++)
+      // Update4 sets 4 pixels, if there's less than 4 differences the last one is simply set again
+      uint32_t updates = (opcodeIncrement == 2) ? 8 : 4;
+      uint32_t index = 0;
+      for (uint32_t update = 0; update < updates; update += 4)
       {
-        if (mask & 1)
+        uint32_t positions = 0;
+        for (uint32_t i = 0; i < 4; i++)
         {
-          SetPixel(x,y, *m_UnAlignedStream++);
+          if (differences)
+          {
+            index = std::countr_zero(differences);
+            differences &= differences - 1;
+          }
+          positions |= index << (i * 6);
+          code.PushAligned(tile[index]);
         }
-        mask >>= 1;
+        code.PushUnAligned16(positions & 65535);
+        code.PushUnAligned((positions >> 16) & 255);
       }
     }
   }
 
 
-
-  void BlockCopy8x8(uint8_t* dest, uint8_t* source)
+  // The pixels not matching the prediction are fixed by an update
+  static void TryPrediction(TileCode& bestCode, TileCode& code, uint64_t allowedOpcodes, const uint8_t* tile, uint8_t opcode, uint32_t baseCost, uint64_t differences, const auto& pushBase)
   {
-    for (int32_t y = 0; y < 8; y++)
+    uint32_t opcodeIncrement;
+    uint32_t cost = baseCost + GetUpdateCost(std::popcount(differences), opcodeIncrement);
+    if ((cost < bestCode.GetSize()) && ((allowedOpcodes >> (opcode + opcodeIncrement)) & 1))
     {
-      memcpy(dest + y * m_Width, source + y * m_Width, 8);
+      code.Reset(opcode + opcodeIncrement);
+      pushBase(code);
+      PushUpdate(code, tile, differences, opcodeIncrement);
+      assert(code.GetSize() == cost);
+      bestCode = code;
     }
   }
 
-  void BlockCopy4x4(uint8_t* dest, uint8_t* source)
+  static void KeepIfSmaller(TileCode& bestCode, const TileCode& code, uint64_t allowedOpcodes, bool valid)
   {
-    for (int32_t y = 0; y < 4; y++)
+    if (valid && (code.GetSize() < bestCode.GetSize()) && ((allowedOpcodes >> code.m_Opcode) & 1))
     {
-      memcpy(dest + y * m_Width, source + y * m_Width, 4);
+      bestCode = code;
     }
   }
 
 
-  
-
-  void ZeroMotionDecode()
-  {
-    BlockCopy8x8(m_CurrentTile, m_PreviousTile);
-  }
-
-
-  void ShortMotion8Decode()
-  {
-    int32_t value = *m_UnAlignedStream++;
-    int32_t dx = (((value & 15) << 28) >> 28);
-    int32_t dy = ((value << 24) >> 28);
-    BlockCopy8x8(m_CurrentTile, m_PreviousTile + (4 + m_Width * 4) + dx + dy * m_Width);
-  }
-
-  void ShortMotion4Decode()
+  void EncodeTile(const ImageBuffer& image, int32_t tileX, int32_t tileY, bool isKeyFrame, TileCode& bestCode)
   {
-    int32_t value = *m_AlignedStream++;
-    int32_t dx = (((value & 15) << 28) >> 28);
-    int32_t dy = ((value << 24) >> 28);
-    BlockCopy4x4(m_CurrentTile, m_PreviousTile + 2 + m_Width * 2 + dx + dy * m_Width);
-    value = *m_AlignedStream++;
-    dx = (((value & 15) << 28) >> 28);
-    dy = ((value << 24) >> 28);
-    BlockCopy4x4(m_CurrentTile + 4, m_PreviousTile + 2 + m_Width * 2 + dx + dy * m_Width + 4);
-    value = *m_AlignedStream++;
-    dx = (((value & 15) << 28) >> 28);
-    dy = ((value << 24) >> 28);
-    BlockCopy4x4(m_CurrentTile + m_Width * 4, m_PreviousTile + 2 + m_Width * 2 + dx + dy * m_Width + m_Width * 4);
-    value = *m_AlignedStream++;
-    dx = (((value & 15) << 28) >> 28);
-    dy = ((value << 24) >> 28);
-    BlockCopy4x4(m_CurrentTile + m_Width * 4 + 4, m_PreviousTile + 2 + m_Width * 2 + dx + dy * m_Width + m_Width * 4 + 4);
-  }
+    uint8_t tile[64];
+    const uint8_t* source = image.GetBuffer() + tileX * 8 + tileY * 8 * m_Width;
+    for (int32_t y = 0; y < 8; y++)
+    {
+      memcpy(tile + y * 8, source + y * m_Width, 8);
+    }
 
+    // Raw tile always works, and gives the upper bound
+    bestCode.Reset(0);
+    for (uint8_t color : tile)
+    {
+      bestCode.PushAligned(color);
+    }
 
-  void Motion8Decode()
-  {
-    BlockCopy8x8(m_CurrentTile, m_PreviousFrameBuffer + (*(uint16_t*)m_UnAlignedStream));
-    m_UnAlignedStream += 2;
-  }
+    // The decoder reloads the opcodes when the shifted value reaches -1, so a group of 4 opcodes ending with 63 would be cut short
+    uint64_t allowedOpcodes = m_AllowedOpcodes;
+    if (((tileX + tileY * (m_Width / 8)) % 4) == 3)
+    {
+      allowedOpcodes &= ~(1ull << 63);
+    }
 
-  void Motion4Decode()
-  {
-    BlockCopy4x4(m_CurrentTile, m_PreviousFrameBuffer + ReadU16(m_AlignedStream));
-    BlockCopy4x4(m_CurrentTile + 4, m_PreviousFrameBuffer + ReadU16(m_AlignedStream));
-    BlockCopy4x4(m_CurrentTile + m_Width * 4, m_PreviousFrameBuffer + ReadU16(m_AlignedStream));
-    BlockCopy4x4(m_CurrentTile + m_Width * 4 + 4, m_PreviousFrameBuffer + ReadU16(m_AlignedStream));
+    TileCode code;
+    if (!isKeyFrame)
+    {
+      TryMotion(bestCode, code, allowedOpcodes, tile, tileX * 8, tileY * 8);
+      if (!bestCode.GetSize())
+      {
+        return;
+      }
+    }
+    TryFills(bestCode, code, allowedOpcodes, tile);
+    TryPalettized(bestCode, code, allowedOpcodes, tile);
+    TrySplitTiles(bestCode, code, allowedOpcodes, tile);
+    TryBanks(bestCode, code, allowedOpcodes, tile);
+    TryBlocks(bestCode, code, allowedOpcodes, tile);
   }
 
 
-  void ROMotion8Decode()
-  {
-    BlockCopy8x8(m_CurrentTile, m_PreviousTile + ReadS16(m_UnAlignedStream) + 4 + m_Width * 4);
-  }
-  void ROMotion4Decode()
+  void TryMotion(TileCode& bestCode, TileCode& code, uint64_t allowedOpcodes, const uint8_t* tile, int32_t tileX, int32_t tileY)
   {
-    BlockCopy4x4(m_CurrentTile, m_PreviousTile + ReadS16(m_AlignedStream) + 2 + m_Width * 2);
-    BlockCopy4x4(m_CurrentTile + 4, m_PreviousTile + 4 + ReadS16(m_AlignedStream) + 2 + m_Width * 2);
-    BlockCopy4x4(m_CurrentTile + m_Width * 4, m_PreviousTile + m_Width * 4 + ReadS16(m_AlignedStream) + 2 + m_Width * 2);
-    BlockCopy4x4(m_CurrentTile + m_Width * 4 + 4, m_PreviousTile + m_Width * 4 + 4 + ReadS16(m_AlignedStream) + 2 + m_Width * 2);
-  }
-
-
-
-
+    const uint8_t* previous = m_PreviousFrame.GetBuffer();
 
-  void RCMotion8Decode()
-  {
-    BlockCopy8x8(m_CurrentTile, m_PreviousTile + ReadXYOffset(m_UnAlignedStream,m_Width) + 4 + m_Width * 4);
-  }
-  void RCMotion4Decode()
-  {
-    BlockCopy4x4(m_CurrentTile, m_PreviousTile + ReadXYOffset(m_AlignedStream, m_Width) + 2 + m_Width * 2);
-    BlockCopy4x4(m_CurrentTile + 4, m_PreviousTile + ReadXYOffset(m_AlignedStream, m_Width) + 2 + m_Width * 2 + 4);
-    BlockCopy4x4(m_CurrentTile + m_Width * 4, m_PreviousTile + ReadXYOffset(m_AlignedStream, m_Width) + 2 + m_Width * 2 + m_Width * 4);
-    BlockCopy4x4(m_CurrentTile + m_Width * 4 + 4, m_PreviousTile + ReadXYOffset(m_AlignedStream, m_Width) + 2 + m_Width * 2 + m_Width * 4 + 4);
-  }
+    // Nothing can be cheaper than an unchanged tile
+    uint64_t zeroMask;
+    g_CpuKernels.m_GetDifferenceMasks(tile, previous + tileX + tileY * m_Width, m_Width, 1, &zeroMask);
+    if (!zeroMask)
+    {
+      TryPrediction(bestCode, code, allowedOpcodes, tile, 1, 0, zeroMask, [](TileCode&) {});
+      return;
+    }
 
+    // Best displacements for the whole tile and for each quadrant
+    MotionCandidate short8, long8, short4[4], long4[4];
+    for (int32_t quadrant = 0; quadrant < 4; quadrant++)
+    {
+      short4[quadrant].m_Mask = long4[quadrant].m_Mask = g_QuadrantMasks[quadrant];
+      short4[quadrant].m_Count = long4[quadrant].m_Count = 16;
+    }
 
+    int32_t minY = std::max(-g_MotionSearchRange, -tileY), maxY = std::min(g_MotionSearchRange, (int32_t)m_Height - 8 - tileY);
+    int32_t minX = std::max(-g_MotionSearchRange, -tileX), maxX = std::min(g_MotionSearchRange, (int32_t)m_Width - 8 - tileX);
+    uint64_t masks[2 * g_MotionSearchRange + 1];
+    for (int32_t dy = minY; dy <= maxY; dy++)
+    {
+      const uint8_t* source = previous + tileX + (tileY + dy) * m_Width;
+      bool shortLine8 = (dy >= -4) && (dy <= 11);
+      bool shortLine4 = (dy >= -6) && (dy <= 9);
+      g_CpuKernels.m_GetDifferenceMasks(tile, source + minX, m_Width, maxX - minX + 1, masks);
+      for (int32_t dx = minX; dx <= maxX; dx++)
+      {
+        uint64_t mask = masks[dx - minX];
+        int32_t count = std::popcount(mask);
+        if (shortLine8 && (dx >= -4) && (dx <= 11))
+        {
+          short8.Update(mask, count, dx, dy);
+        }
+        long8.Update(mask, count, dx, dy);
 
+        bool shortMotion4 = shortLine4 && (dx >= -6) && (dx <= 9);
+        for (int32_t quadrant = 0; quadrant < 4; quadrant++)
+        {
+          uint64_t quadrantMask = mask & g_QuadrantMasks[quadrant];
+          int32_t quadrantCount = std::popcount(quadrantMask);
+          if (shortMotion4)
+          {
+            short4[quadrant].Update(quadrantMask, quadrantCount, dx, dy);
+          }
+          long4[quadrant].Update(quadrantMask, quadrantCount, dx, dy);
+        }
+      }
+    }
 
-  // Load one byte, apply it to the entire tile
-  void SingleColorFillDecode()
-  {
-    uint8_t colorTile = *m_UnAlignedStream++;
+    int32_t width = m_Width;
+    TryPrediction(bestCode, code, allowedOpcodes, tile, 1, 0, zeroMask, [](TileCode&) {});
+    TryPrediction(bestCode, code, allowedOpcodes, tile, 5, 1, short8.m_Mask, [&](TileCode& baseCode)
+      {
+        baseCode.PushUnAligned(((short8.m_X - 4) & 15) | (((short8.m_Y - 4) & 15) << 4));
+      });
 
-    for (int32_t y = 0; y < 8; y++)
+    // Motion8, ROMotion8 and RCMotion8 all cost 2 bytes, the absolute offset is used when it fits in 16 bits
+    uint32_t absolute8 = (tileX + long8.m_X) + (tileY + long8.m_Y) * width;
+    if (absolute8 < 65536)
     {
-      memset(m_CurrentTile + y * m_Width, colorTile, 8);
+      TryPrediction(bestCode, code, allowedOpcodes, tile, 9, 2, long8.m_Mask, [&](TileCode& baseCode) { baseCode.PushUnAligned16(absolute8); });
     }
-  }
-
-  // Load four bytes, one for each quadrant of the tile
-  void FourColorFillDecode()
-  {
-    uint8_t colorTopLeft = *m_AlignedStream++;
-    uint8_t colorTopRight = *m_AlignedStream++;
-    uint8_t colorBottomLeft = *m_AlignedStream++;
-    uint8_t colorBottomRight = *m_AlignedStream++;
+    TryPrediction(bestCode, code, allowedOpcodes, tile, 48, 2, long8.m_Mask, [&](TileCode& baseCode)
+      {
+        baseCode.PushUnAligned16((uint16_t)((long8.m_X - 4) + (long8.m_Y - 4) * width));
+      });
+    TryPrediction(bestCode, code, allowedOpcodes, tile, 52, 2, long8.m_Mask, [&](TileCode& baseCode)
+      {
+        baseCode.PushUnAligned((uint8_t)(long8.m_X - 4));
+        baseCode.PushUnAligned((uint8_t)((long8.m_Y - 4) * 2));
+      });
+
+    const int32_t quadrantX[4] = { 0, 4, 0, 4 };
+    const int32_t quadrantY[4] = { 0, 0, 4, 4 };
+    uint64_t short4Total = short4[0].m_Mask | short4[1].m_Mask | short4[2].m_Mask | short4[3].m_Mask;
+    uint64_t long4Total  = long4[0].m_Mask | long4[1].m_Mask | long4[2].m_Mask | long4[3].m_Mask;
+    TryPrediction(bestCode, code, allowedOpcodes, tile, 13, 4, short4Total, [&](TileCode& baseCode)
+      {
+        for (int32_t quadrant = 0; quadrant < 4; quadrant++)
+        {
+          baseCode.PushAligned(((short4[quadrant].m_X - 2) & 15) | (((short4[quadrant].m_Y - 2) & 15) << 4));
+        }
+      });
 
-    for (int32_t y = 0; y < 4; y++)
+    bool absolute4Fits = true;
+    for (int32_t quadrant = 0; quadrant < 4; quadrant++)
+    {
+      absolute4Fits &= (tileX + quadrantX[quadrant] + long4[quadrant].m_X) + (tileY + quadrantY[quadrant] + long4[quadrant].m_Y) * width < 65536;
+    }
+    if (absolute4Fits)
     {
-      memset(m_CurrentTile + y * m_Width, colorTopLeft, 4);
-      memset(m_CurrentTile + y * m_Width + 4, colorTopRight, 4);
-      memset(m_CurrentTile + (y + 4) * m_Width, colorBottomLeft, 4);
-      memset(m_CurrentTile + (y + 4) * m_Width + 4, colorBottomRight, 4);
+      TryPrediction(bestCode, code, allowedOpcodes, tile, 17, 8, long4Total, [&](TileCode& baseCode)
+        {
+          for (int32_t quadrant = 0; quadrant < 4; quadrant++)
+          {
+            baseCode.PushAligned16((uint16_t)((tileX + quadrantX[quadrant] + long4[quadrant].m_X) + (tileY + quadrantY[quadrant] + long4[quadrant].m_Y) * width));
+          }
+        });
     }
+    TryPrediction(bestCode, code, allowedOpcodes, tile, 56, 8, long4Total, [&](TileCode& baseCode)
+      {
+        for (int32_t quadrant = 0; quadrant < 4; quadrant++)
+        {
+          baseCode.PushAligned16((uint16_t)((long4[quadrant].m_X - 2) + (long4[quadrant].m_Y - 2) * width));
+        }
+      });
+    TryPrediction(bestCode, code, allowedOpcodes, tile, 60, 8, long4Total, [&](TileCode& baseCode)
+      {
+        for (int32_t quadrant = 0; quadrant < 4; quadrant++)
+        {
+          baseCode.PushAligned((uint8_t)(long4[quadrant].m_X - 2));
+          baseCode.PushAligned((uint8_t)((long4[quadrant].m_Y - 2) * 2));
+        }
+      });
   }
 
 
-
-
-
-  //
-  //
-  // 10 octets:
-  // - 8 octets formant 8x8x1 bits d‚signant chacun la couleur … utiliser
-  // - 2 octets de couleur (indice dans la palette)
-  //
-  //
-  void OneBitTileDecode()
+  void TryFills(TileCode& bestCode, TileCode& code, uint64_t allowedOpcodes, const uint8_t* tile)
   {
-    for (int32_t y = 0; y < 8; y++)
+    uint8_t color = GetMostFrequentColor(tile, 8, 8);
+    uint64_t differences = 0;
+    for (uint32_t index = 0; index < 64; index++)
     {
-      uint8_t a = *m_AlignedStream++;
-      for (int32_t x = 0; x < 8; x++)
-      {
-        SetPixel(x, y, m_UnAlignedStream[a & 1]);
-        a >>= 1;
-      }
+      if (tile[index] != color)   differences |= 1ull << index;
     }
-    m_UnAlignedStream += 2;
-  }
-
+    TryPrediction(bestCode, code, allowedOpcodes, tile, 21, 1, differences, [&](TileCode& baseCode) { baseCode.PushUnAligned(color); });
 
-  //
-  // 20 octets:
-  // - 4 octets de couleur (indice dans la palette)
-  // - 16 octets formant 8x8x2 bits d‚signant chacun la couleur … utiliser
-  //
-  void TwoBitTileDecode()
-  {
-    const uint8_t* colors = m_AlignedStream;
-    m_AlignedStream += 4;
-    for (int32_t y = 0; y < 8; y++)
+    uint8_t colors[4];
+    differences = 0;
+    for (uint32_t quadrant = 0; quadrant < 4; quadrant++)
     {
-      int32_t a = *(uint16_t*)m_AlignedStream;
-      m_AlignedStream += 2;
-      for (int32_t x = 0; x < 8; x++)
+      const uint8_t* quadrantPixels = tile + (quadrant & 1) * 4 + (quadrant >> 1) * 32;
+      colors[quadrant] = GetMostFrequentColor(quadrantPixels, 8, 4);
+      for (uint32_t index = 0; index < 64; index++)
       {
-        SetPixel(x, y, colors[a & 3]);
-        a >>= 2;
+        if ((g_QuadrantMasks[quadrant] & (1ull << index)) && (tile[index] != colors[quadrant]))   differences |= 1ull << index;
       }
     }
+    TryPrediction(bestCode, code, allowedOpcodes, tile, 25, 4, differences, [&](TileCode& baseCode)
+      {
+        for (uint8_t color : colors)    baseCode.PushAligned(color);
+      });
   }
 
 
-
-
-
-  //
-  // 32 octets:
-  // - 24 octets formant 8x8x3 bits d‚signant chacun la couleur … utiliser
-  // - 8 octets de couleur (indice dans la palette)
-  //
-  void ThreeBitTileDecode()
+  // Builds the list of distinct colors (in order of appearance), returns false if there are more than maxColors
+  static bool GetColorIndices(const uint8_t* pixels, const uint32_t* positions, uint32_t count, uint32_t maxColors, uint8_t* colors, uint32_t& colorCount, uint8_t* indices)
   {
-    for (int32_t y = 0; y < 8; y++)
+    colorCount = 0;
+    for (uint32_t i = 0; i < count; i++)
     {
-      uint32_t a = ReadU32(m_AlignedStream, 3);
-      for (int32_t x = 0; x < 8; x++)
+      uint8_t color = pixels[positions[i]];
+      uint32_t index = 0;
+      while ((index < colorCount) && (colors[index] != color))    index++;
+      if (index == colorCount)
       {
-        SetPixel(x, y, m_UnAlignedStream[a & 7]);
-        a >>= 3;
+        if (colorCount == maxColors)
+        {
+          return false;
+        }
+        colors[colorCount++] = color;
       }
+      indices[i] = (uint8_t)index;
+    }
+    for (uint32_t index = colorCount; index < maxColors; index++)
+    {
+      colors[index] = colors[0];
     }
-    m_UnAlignedStream += 8;
+    return true;
   }
 
 
+  void TryPalettized(TileCode& bestCode, TileCode& code, uint64_t allowedOpcodes, const uint8_t* tile)
+  {
+    uint32_t raster[64];
+    for (uint32_t index = 0; index < 64; index++)   raster[index] = index;
 
+    uint8_t colors[16];
+    uint8_t indices[64];
+    uint32_t colorCount;
+    if (!GetColorIndices(tile, raster, 64, 16, colors, colorCount, indices))
+    {
+      return;
+    }
 
-  //
-  // 48 octets:
-  // - 32 octets formant 8x8x4 bits d‚signant chacun la couleur … utiliser
-  // - 16 octets de couleur (indice dans la palette)
-  //
-  void FourBitTileDecode()
-  {
-    for (int32_t y = 0; y < 8; y++)
+    if (colorCount <= 2)
     {
-      uint32_t a = ReadU32(m_AlignedStream);
-      for (int32_t x = 0; x < 8; x++)
+      code.Reset(29);
+      for (uint32_t y = 0; y < 8; y++)
       {
-        SetPixel(x, y, m_UnAlignedStream[a & 15]);
-        a >>= 4;
+        uint8_t mask = 0;
+        for (uint32_t x = 0; x < 8; x++)    mask |= indices[x + y * 8] << x;
+        code.PushAligned(mask);
       }
+      code.PushUnAligned(colors[0]);
+      code.PushUnAligned(colors[1]);
+      KeepIfSmaller(bestCode, code, allowedOpcodes, true);
     }
-    m_UnAlignedStream += 16;
-  }
-
 
-
-  void OneBitSplitTileDecode()
-  {
-    for (uint32_t offset : g_SplitTileOffsets)
+    if (colorCount <= 4)
     {
-      uint16_t a = ReadU16(m_AlignedStream);
-      for (int32_t y = 0; y < 4; y++)
+      code.Reset(30);
+      for (uint32_t index = 0; index < 4; index++)    code.PushAligned(colors[index]);
+      for (uint32_t y = 0; y < 8; y++)
       {
-        for (int32_t x = 0; x < 4; x++)
-        {
-          m_CurrentTile[x + y * m_Width + offset] = m_AlignedStream[a & 1];
-          a >>= 1;
-        }
+        uint32_t mask = 0;
+        for (uint32_t x = 0; x < 8; x++)    mask |= indices[x + y * 8] << (x * 2);
+        code.PushAligned16(mask);
       }
-      m_AlignedStream += 2;
+      KeepIfSmaller(bestCode, code, allowedOpcodes, true);
     }
-  }
-  
 
-  void TwoBitSplitTileDecode()
-  {
-    for (uint32_t offset : g_SplitTileOffsets)
+    if (colorCount <= 8)
     {
-      uint32_t a = ReadU32(m_AlignedStream);
-      for (int32_t y = 0; y < 4; y++)
+      code.Reset(31);
+      for (uint32_t y = 0; y < 8; y++)
       {
-        for (int32_t x = 0; x < 4; x++)
-        {
-          m_CurrentTile[x + y * m_Width + offset] = m_AlignedStream[a & 3];
-          a >>= 2;
-        }
+        uint32_t mask = 0;
+        for (uint32_t x = 0; x < 8; x++)    mask |= indices[x + y * 8] << (x * 3);
+        code.PushAligned24(mask);
       }
-      m_AlignedStream += 4;
+      for (uint32_t index = 0; index < 8; index++)    code.PushUnAligned(colors[index]);
+      KeepIfSmaller(bestCode, code, allowedOpcodes, true);
     }
-  }
 
- 
-  void ThreeBitSplitTileDecode()
-  {
-    for (uint32_t offset : g_SplitTileOffsets)
+    code.Reset(32);
+    for (uint32_t y = 0; y < 8; y++)
+    {
+      uint32_t mask = 0;
+      for (uint32_t x = 0; x < 8; x++)    mask |= indices[x + y * 8] << (x * 4);
+      code.PushAligned32(mask);
+    }
+    for (uint32_t index = 0; index < 16; index++)    code.PushUnAligned(colors[index]);
+    KeepIfSmaller(bestCode, code, allowedOpcodes, true);
+
+    // Prime: the most used color is implicit, the other ones are stored as is
+    uint8_t primeColor = GetMostFrequentColor(tile, 8, 8);
+    code.Reset(37);
+    code.PushUnAligned(primeColor);
+    for (uint32_t y = 0; y < 8; y++)
     {
-      uint32_t a;
-      for (int32_t y = 0; y < 4; y++)
+      uint8_t mask = 0;
+      for (uint32_t x = 0; x < 8; x++)
       {
-        if (!(y & 1))
-        {
-          a = ReadU32(m_AlignedStream, 3);
-        }
-        for (int32_t x = 0; x < 4; x++)
+        if (tile[x + y * 8] != primeColor)
         {
-          m_CurrentTile[x + y * m_Width + offset] = m_UnAlignedStream[a & 7];
-          a >>= 3;
+          mask |= 1 << x;
+          code.PushUnAligned(tile[x + y * 8]);
         }
       }
-      m_UnAlignedStream += 8;
+      code.PushAligned(mask);
     }
+    KeepIfSmaller(bestCode, code, allowedOpcodes, true);
   }
 
 
-  //
-  // 20 bytes:
-  // - 4 octets (Couleurs de base)
-  // - 16 octets (4x4) pour indiquer les correspondances.
-  //
-  void CrossDecode()
+  // Split tiles and the cross pattern use a 320 pixels stride in the decoder
+  void TrySplitTiles(TileCode& bestCode, TileCode& code, uint64_t allowedOpcodes, const uint8_t* tile)
   {
-    uint32_t value = ReadU32(m_AlignedStream);
-    for (uint32_t offset : g_SplitTileOffsets)
+    if (!m_HasFixedStride)
     {
-      uint8_t* dest = m_CurrentTile + offset;
-      if (value & 1)  dest[0] = m_AlignedStream[1];
-      else	      dest[0] = m_AlignedStream[0];
-
-      dest[0] = m_AlignedStream[(value & 1)];	    // 0 ou 1
-      dest[1] = m_AlignedStream[0];		    // 0
-      dest[2] = m_AlignedStream[0];		    // 0
-      dest[3] = m_AlignedStream[((value & 2) >> 1) * 3];    // 0 ou 3
-
-      dest[320] = m_AlignedStream[1];		    // 1
-      dest[321] = m_AlignedStream[(value & 4) >> 2];	    // 0 ou 1
-      dest[322] = m_AlignedStream[((value & 8) >> 3) * 3];    // 0 ou 3
-      dest[323] = m_AlignedStream[3];		    // 3
-
-      dest[640] = m_AlignedStream[1];		    // 1
-      dest[641] = m_AlignedStream[1 + ((value & 16) >> 4)];   // 1 ou 2
-      dest[642] = m_AlignedStream[2 + ((value & 32) >> 5)];   // 2 ou 3
-      dest[643] = m_AlignedStream[3];		    // 3
-
-      dest[960] = m_AlignedStream[1 + ((value & 64) >> 6)];   // 1 ou 2
-      dest[961] = m_AlignedStream[2];		    // 2
-      dest[962] = m_AlignedStream[2];		    // 2
-      dest[963] = m_AlignedStream[2 + ((value & 128) >> 7)];  // 2 ou 3
-
-      m_AlignedStream += 4;
-      value >>= 8;
+      return;
     }
-  }
-
-
 
-  void PrimeDecode()
-  {
-    int32_t prime_color = *m_UnAlignedStream++;
-    for (int32_t y = 0; y < 8; y++)
+    uint32_t quadrantPositions[4][16];
+    for (uint32_t quadrant = 0; quadrant < 4; quadrant++)
     {
-      uint8_t a = *m_AlignedStream++;
-      for (int32_t x = 0; x < 8; x++)
+      for (uint32_t index = 0; index < 16; index++)
       {
-        if (a & 1)  SetPixel(x, y, *m_UnAlignedStream++);
-        else	    SetPixel(x, y, prime_color);
-        a >>= 1;
+        quadrantPositions[quadrant][index] = (quadrant & 1) * 4 + (quadrant >> 1) * 32 + (index & 3) + (index >> 2) * 8;
       }
     }
-  }
-
 
-
-
-  // All 64 colors to directly copy to the buffer. No trick of any kind
-  void RawTileDecode()
-  {
-    for (int32_t y = 0; y < 8; y++)
+    uint8_t colors[4][8];
+    uint8_t indices[4][16];
+    uint32_t colorCount[4];
+    uint32_t maxColorCount = 0;
+    for (uint32_t quadrant = 0; quadrant < 4; quadrant++)
     {
-      memcpy(m_CurrentTile + y * m_Width, m_AlignedStream, 8);
-      m_AlignedStream += 8;
+      if (!GetColorIndices(tile, quadrantPositions[quadrant], 16, 8, colors[quadrant], colorCount[quadrant], indices[quadrant]))
+      {
+        maxColorCount = 9;
+        break;
+      }
+      maxColorCount = std::max(maxColorCount, colorCount[quadrant]);
     }
-  }
 
-
-
-  
-  // Similar to RawTileDecode, but all the colors are in the same bank, thus using only 4 bits per pixel
-  void OneBankTileDecode()
-  {
-    uint8_t bank = *m_UnAlignedStream++;
-
-    for (int32_t y = 0; y < 8; y++)
+    if (maxColorCount <= 2)
     {
-      for (int32_t x = 0; x < 8; x++)
+      code.Reset(33);
+      for (uint32_t quadrant = 0; quadrant < 4; quadrant++)
       {
-        if (x & 1)    SetPixel(x,y, bank + ((*m_AlignedStream++) >> 4));
-        else	      SetPixel(x,y, bank + ((*m_AlignedStream) & 15));
+        uint32_t mask = 0;
+        for (uint32_t index = 0; index < 16; index++)   mask |= indices[quadrant][index] << index;
+        code.PushAligned16(mask);
+        code.PushAligned(colors[quadrant][0]);
+        code.PushAligned(colors[quadrant][1]);
       }
+      KeepIfSmaller(bestCode, code, allowedOpcodes, true);
     }
-  }
-
-  // Similar to OneBankTileDecode, but with colors in two different banks, and thus using 5 bits per pixel
-  // 41 octets:
-  // - 40 octets formant 8x8x5 bits qui d‚finissent la couleur (dans l'intervalle [0,15]), et le num‚ro de la banque.
-  // - 1 octet formant 2x4 bits qui donnent les num‚ros des 2 banques de couleur … utiliser. (Il faut multiplier par 16)
-  //
-  void TwoBanksTileDecode()
-  {
-    uint8_t bank[2];
 
-    bank[0] = ((*m_UnAlignedStream) & 0x0f) << 4;
-    bank[1] = ((*m_UnAlignedStream) & 0xf0);
-    m_UnAlignedStream++;
-
-    for (uint32_t y = 0; y < 8; y++)
+    if (maxColorCount <= 4)
     {
-      uint32_t part1 = *(int32_t*)m_AlignedStream;		// On r‚cupŠre ainsi 5 octets...
-      uint32_t part2 = *(int32_t*)(m_AlignedStream + 4);
-      m_AlignedStream += 5;
-      for (uint32_t x = 0; x < 8; x++)
+      code.Reset(34);
+      for (uint32_t quadrant = 0; quadrant < 4; quadrant++)
       {
-        SetPixel(x, y, bank[(part1 & 16) >> 4] + (part1 & 15));   // Bit 4: Banque … utiliser / Bits 0-3:Couleur
-        part1 >>= 5;
-        part1 |= (part2 << 27);
-        part2 >>= 5;
+        uint32_t mask = 0;
+        for (uint32_t index = 0; index < 16; index++)   mask |= indices[quadrant][index] << (index * 2);
+        code.PushAligned32(mask);
+        for (uint32_t index = 0; index < 4; index++)    code.PushAligned(colors[quadrant][index]);
       }
+      KeepIfSmaller(bestCode, code, allowedOpcodes, true);
     }
-  }
-
-
-
-  void BlockDecodeHorizontal()
-  {
-    uint8_t last_color = 0;
 
-    for (uint32_t y = 0; y < 8; y++)
+    if (maxColorCount <= 8)
     {
-      uint8_t a = *m_AlignedStream++;
-      for (uint32_t x = 0; x < 8; x++)
+      code.Reset(35);
+      for (uint32_t quadrant = 0; quadrant < 4; quadrant++)
       {
-        if (a & 1)	last_color = *m_UnAlignedStream++;
-        a >>= 1;
-        SetPixel(x, y, last_color);
+        for (uint32_t half = 0; half < 2; half++)
+        {
+          uint32_t mask = 0;
+          for (uint32_t index = 0; index < 8; index++)    mask |= indices[quadrant][half * 8 + index] << (index * 3);
+          code.PushAligned24(mask);
+        }
+        for (uint32_t index = 0; index < 8; index++)    code.PushUnAligned(colors[quadrant][index]);
       }
+      KeepIfSmaller(bestCode, code, allowedOpcodes, true);
     }
-  }
-  void BlockDecodeVertical()
-  {
-    uint8_t last_color = 0;
 
-    for (int32_t x = 0; x < 8; x++)
+    // The cross has 8 fixed pixels per quadrant, and 8 pixels which can take one of two colors
+    // Table of (x, y, color if bit is 0, color if bit is 1) matching what CrossDecode does
+    static const uint8_t crossPattern[8][4] = { {0,0,0,1}, {3,0,0,3}, {1,1,0,1}, {2,1,0,3}, {1,2,1,2}, {2,2,2,3}, {0,3,1,2}, {3,3,2,3} };
+    code.Reset(36);
+    code.PushAligned32(0);
+    uint32_t value = 0;
+    bool valid = true;
+    for (uint32_t quadrant = 0; (quadrant < 4) && valid; quadrant++)
     {
-      uint8_t a = *m_AlignedStream++;
-      for (int32_t y = 0; y < 8; y++)
+      const uint8_t* pixels = tile + (quadrant & 1) * 4 + (quadrant >> 1) * 32;
+      uint8_t crossColors[4] = { pixels[1], pixels[8], pixels[25], pixels[11] };
+      valid = (pixels[2] == crossColors[0]) && (pixels[16] == crossColors[1]) && (pixels[19] == crossColors[3]) && (pixels[26] == crossColors[2]);
+      for (uint32_t bit = 0; (bit < 8) && valid; bit++)
       {
-        if (a & 1)	last_color = *m_UnAlignedStream++;
-        a >>= 1;
-        SetPixel(x, y, last_color);
+        uint8_t pixel = pixels[crossPattern[bit][0] + crossPattern[bit][1] * 8];
+        if (pixel == crossColors[crossPattern[bit][3]])         value |= 1u << (quadrant * 8 + bit);
+        else if (pixel != crossColors[crossPattern[bit][2]])    valid = false;
       }
+      for (uint8_t color : crossColors)   code.PushAligned(color);
     }
+    memcpy(code.m_Aligned, &value, sizeof(uint32_t));
+    KeepIfSmaller(bestCode, code, allowedOpcodes, valid);
   }
 
 
-
-  void BlockDecode2()
+  void TryBanks(TileCode& bestCode, TileCode& code, uint64_t allowedOpcodes, const uint8_t* tile)
   {
-    uint8_t last_color = 0;
-
-    uint32_t* offsets = g_DiagonalOffsets_1;
-
-    for (int32_t y = 0; y < 8; y++)
+    uint8_t minColor = *std::min_element(tile, tile + 64);
+    uint8_t maxColor = *std::max_element(tile, tile + 64);
+    if (maxColor - minColor <= 15)
     {
-      uint8_t a = *m_AlignedStream++;
-      for (int32_t x = 0; x < 8; x++)
+      code.Reset(38);
+      code.PushUnAligned(minColor);
+      for (uint32_t index = 0; index < 64; index += 2)
       {
-        if (a & 1)	last_color = *m_UnAlignedStream++;
-        a >>= 1;
-        m_CurrentTile[*offsets++] = last_color;
+        code.PushAligned((tile[index] - minColor) | ((tile[index + 1] - minColor) << 4));
       }
+      KeepIfSmaller(bestCode, code, allowedOpcodes, true);
     }
-  }
 
-  void BlockDecode3()
-  {
-    uint8_t last_color = 0;
-
-    uint32_t* offsets = g_DiagonalOffsets_2;
-
-    for (int32_t y = 0; y < 8; y++)
+    // Two banks of 16 colors, each pixel is 4 bits of color and one bit of bank
+    uint8_t banks[2] = { (uint8_t)(tile[0] & 0xF0), (uint8_t)(tile[0] & 0xF0) };
+    bool valid = true;
+    for (uint32_t index = 0; (index < 64) && valid; index++)
     {
-      uint8_t a = *m_AlignedStream++;
-      for (int32_t x = 0; x < 8; x++)
+      uint8_t bank = tile[index] & 0xF0;
+      if ((bank != banks[0]) && (bank != banks[1]))
       {
-        if (a & 1)	last_color = *m_UnAlignedStream++;
-        a >>= 1;
-        m_CurrentTile[*offsets++] = last_color;
+        valid = (banks[0] == banks[1]);
+        banks[1] = bank;
       }
     }
-  }
-
-
-
-
-
-  void BlockBank1DecodeHorizontal()
-  {
-    uint8_t last_color = 0;
-    uint8_t bank = (*m_UnAlignedStream) << 4;	// R‚cupŠre la banque
-    uint8_t flag = 1;
-
-    for (int32_t y = 0; y < 8; y++)
+    if (valid)
     {
-      uint8_t a = *m_AlignedStream++;
-      for (int32_t x = 0; x < 8; x++)
+      code.Reset(39);
+      code.PushUnAligned((banks[0] >> 4) | banks[1]);
+      for (uint32_t y = 0; y < 8; y++)
       {
-        if (a & 1)
+        uint64_t bits = 0;
+        for (uint32_t x = 0; x < 8; x++)
         {
-          if (flag)
-          {
-            last_color = (*m_UnAlignedStream) >> 4;
-            flag = 0;
-            m_UnAlignedStream++;
-          }
-          else
-          {
-            last_color = (*m_UnAlignedStream) & 15;
-            flag++;
-          }
+          uint8_t color = tile[x + y * 8];
+          bits |= (uint64_t)((color & 15) | (((color & 0xF0) == banks[0]) ? 0 : 16)) << (x * 5);
         }
-        a >>= 1;
-        SetPixel(x, y, bank + last_color);
+        for (uint32_t byte = 0; byte < 5; byte++)   code.PushAligned((uint8_t)(bits >> (byte * 8)));
       }
+      KeepIfSmaller(bestCode, code, allowedOpcodes, true);
     }
-    if (flag)	m_UnAlignedStream++;
   }
 
 
-  void BlockBank1DecodeVertical()
+  // The block opcodes read a new color each time the bit is set, in horizontal, vertical or diagonal order
+  void TryBlocks(TileCode& bestCode, TileCode& code, uint64_t allowedOpcodes, const uint8_t* tile)
   {
-    uint8_t last_color = 0;
-    uint8_t bank = (*m_UnAlignedStream) << 4;	// R‚cupŠre la banque
-    uint8_t flag = 1;
+    uint32_t orders[4][64];
+    for (uint32_t index = 0; index < 64; index++)
+    {
+      orders[0][index] = index;
+      orders[1][index] = (index >> 3) + (index & 7) * 8;
+      orders[2][index] = (g_DiagonalOffsets_1[index] % 320) + (g_DiagonalOffsets_1[index] / 320) * 8;
+      orders[3][index] = (g_DiagonalOffsets_2[index] % 320) + (g_DiagonalOffsets_2[index] / 320) * 8;
+    }
 
-    for (int32_t x = 0; x < 8; x++)
+    bool singleBank = true;
+    for (uint32_t index = 0; index < 64; index++)
     {
-      uint8_t a = *m_AlignedStream++;
-      for (int32_t y = 0; y < 8; y++)
+      singleBank &= (tile[index] & 0xF0) == (tile[0] & 0xF0);
+    }
+
+    uint32_t orderCount = m_HasFixedStride ? 4 : 2;
+    for (uint32_t order = 0; order < orderCount; order++)
+    {
+      code.Reset(40 + order);
+      uint8_t lastColor = 0;
+      for (uint32_t row = 0; row < 8; row++)
       {
-        if (a & 1)
+        uint8_t mask = 0;
+        for (uint32_t bit = 0; bit < 8; bit++)
         {
-          if (flag)
+          uint8_t color = tile[orders[order][row * 8 + bit]];
+          if (color != lastColor)
           {
-            last_color = (*m_UnAlignedStream) >> 4;
-            flag = 0;
-            m_UnAlignedStream++;
+            mask |= 1 << bit;
+            code.PushUnAligned(color);
+            lastColor = color;
           }
-          else
+        }
+        code.PushAligned(mask);
+      }
+      KeepIfSmaller(bestCode, code, allowedOpcodes, true);
+
+      if (singleBank)
+      {
+        // The bank number and the color changes are all stored as nibbles
+        uint8_t nibbles[65];
+        uint32_t nibbleCount = 0;
+        nibbles[nibbleCount++] = tile[0] >> 4;
+
+        code.Reset(44 + order);
+        lastColor = 0;
+        for (uint32_t row = 0; row < 8; row++)
+        {
+          uint8_t mask = 0;
+          for (uint32_t bit = 0; bit < 8; bit++)
           {
-            last_color = (*m_UnAlignedStream) & 15;
-            flag++;
+            uint8_t color = tile[orders[order][row * 8 + bit]] & 15;
+            if (color != lastColor)
+            {
+              mask |= 1 << bit;
+              nibbles[nibbleCount++] = color;
+              lastColor = color;
+            }
           }
+          code.PushAligned(mask);
         }
-        a >>= 1;
-        SetPixel(x, y, bank + last_color);
+        for (uint32_t nibble = 0; nibble < nibbleCount; nibble += 2)
+        {
+          code.PushUnAligned(nibbles[nibble] | ((nibble + 1 < nibbleCount) ? (nibbles[nibble + 1] << 4) : 0));
+        }
+        KeepIfSmaller(bestCode, code, allowedOpcodes, true);
       }
     }
-    if (flag)	m_UnAlignedStream++;
   }
 
 
-  void BlockBank1Decode2()
-  {
-    uint8_t last_color = 0;
-    uint8_t bank = (*m_UnAlignedStream) << 4;	// R‚cupŠre la banque
-    uint8_t flag = 1;
+private:
+  uint32_t                m_Width;
+  uint32_t                m_Height;
+  uint32_t                m_KeyRate;
+  uint32_t                m_PlayRate;
+  uint32_t                m_ThreadCount = 1;
+  bool                    m_IsValid = false;
+  bool                    m_HasFixedStride = true;
+
+  ImageBuffer             m_PreviousFrame;
+  Palette                 m_LastPalette = {};
+  std::vector<TileCode>   m_TileCodes;
+
+  std::vector<std::vector<std::byte>> m_Frames;
+  uint32_t                m_BiggestKeyFrame = 0;
+  uint32_t                m_BiggestDeltaFrame = 0;
+  uint32_t                m_OpcodeUsage[64] = { 0 };
+  uint64_t                m_AllowedOpcodes = ~0ull;
+};
 
-    uint32_t* offsets = g_DiagonalOffsets_1;
 
-    for (int32_t y = 0; y < 8; y++)
+
+
+// Encodes back a folder of PCX_<n>.pcx files as written by the ACFDecoder
+bool EncodePcxFolder(const std::filesystem::path& sourceFolder, const std::filesystem::path& targetPath, uint32_t keyRate, uint32_t playRate)
+{
+  std::vector<std::pair<int32_t, std::filesystem::path>> frameFiles;
+  for (auto& directoryEntry : std::filesystem::directory_iterator(sourceFolder))
+  {
+    std::string name = directoryEntry.path().stem().string();
+    if ((directoryEntry.path().extension() == ".pcx") && (name.rfind("PCX_", 0) == 0))
     {
-      uint8_t a = *m_AlignedStream++;
-      for (int32_t x = 0; x < 8; x++)
-      {
-        if (a & 1)
-        {
-          if (flag)
-          {
-            last_color = (*m_UnAlignedStream) >> 4;
-            flag = 0;
-            m_UnAlignedStream++;
-          }
-          else
-          {
-            last_color = (*m_UnAlignedStream) & 15;
-            flag++;
-          }
-        }
-        a >>= 1;
-        m_CurrentTile[*offsets++] = bank + last_color;
-      }
+      frameFiles.emplace_back(std::atoi(name.c_str() + 4), directoryEntry.path());
     }
-    if (flag)	m_UnAlignedStream++;
   }
-
-  void BlockBank1Decode3()
+  std::sort(frameFiles.begin(), frameFiles.end());
+  if (frameFiles.empty())
   {
-    uint8_t last_color = 0;
-    uint8_t bank = (*m_UnAlignedStream) << 4;	// Get the bank number
-    uint8_t flag = 1;
-
-    uint32_t* offsets = g_DiagonalOffsets_2;
+    std::cout << sourceFolder << " does not contain any PCX_<n>.pcx file" << std::endl;
+    return false;
+  }
 
-    for (int32_t y = 0; y < 8; y++)
+  ImageBuffer image(0, 0);
+  Palette palette;
+  std::optional<ACFEncoder> encoder;       // Created with the size of the first picture
+  for (const auto& frameFile : frameFiles)
+  {
+    if (!image.LoadFromPcx(frameFile.second.string().c_str(), &palette.m_PaletteEntries[0].m_Red))
+    {
+      std::cout << frameFile.second << " : could not load PCX file" << std::endl;
+      return false;
+    }
+    if (!encoder)
     {
-      uint8_t a = *m_AlignedStream++;
-      for (int32_t x = 0; x < 8; x++)
+      encoder.emplace(image.m_Width, image.m_Height, keyRate, playRate);
+      if (!encoder->IsValid())
       {
-        if (a & 1)
-        {
-          if (flag)
-          {
-            last_color = (*m_UnAlignedStream) >> 4;
-            flag = 0;
-            m_UnAlignedStream++;
-          }
-          else
-          {
-            last_color = (*m_UnAlignedStream) & 15;
-            flag++;
-          }
-        }
-        a >>= 1;
-        m_CurrentTile[*offsets++] = bank + last_color;
+        std::cout << frameFile.second << " : " << image.m_Width << "x" << image.m_Height << " can not be encoded, the width has to be a multiple of 8 up to 320 and the height a multiple of 8" << std::endl;
+        return false;
       }
     }
-    if (flag)	m_UnAlignedStream++;
+    if (!encoder->AddFrame(image, palette))
+    {
+      std::cout << frameFile.second << " : " << image.m_Width << "x" << image.m_Height << " instead of the " << encoder->GetWidth() << "x" << encoder->GetHeight() << " of the first picture" << std::endl;
+      return false;
+    }
   }
 
+  bool result = encoder->SaveACF(targetPath);
+  std::cout << targetPath << " : " << frameFiles.size() << " frames encoded" << std::endl;
+  return result;
+}
 
 
 
+//
+// Contact sheets: only the keyframes are decoded, reduced through the palette and put side by side in one picture per clip.
+//
+const uint32_t g_ContactSheetSpacing = 2;
 
-  void DecompressFrame()
-  {
-    m_PreviousTile = m_PreviousFrameBuffer = m_PreviousBuffer->GetBuffer();
-    m_CurrentTile = m_CurrentBuffer->GetBuffer();
-
-    const FrameData* frameData = m_CurrentChunk->GetData<FrameData>();
-    m_UnAlignedStream = frameData->GetUnalignedData();                      // Pointer on things that can be out of alignment 
-    m_AlignedStream   = frameData->GetAlignedData(m_Height);                // Pointer on data guaranteed to be aligned on a 32 bit multiple
-
-    const uint8_t* ptr_opcode = frameData->GetOpcodesArray();               // Pointer on the list of decoding methods
 
-    int32_t codes = -1;                                                     // "-1" means "need to read the 3 next bytes from the stream"
-    for (int32_t y = 0; y < (m_Height/8); y++)
+// Box filter through the palette: each thumbnail pixel is the average color of a block of (1 << scaleShift) pixels square.
+// The scale is at most 8, so the sum of 64 components still fits in 16 bits and the average is a shift.
+// Two thumbnail pixels are accumulated per SSE2 register, as 4 components of 16 bits each; the output is R,G,B,0 bytes.
+void DownscaleFrame(const FrameView& frame, uint32_t scaleShift, uint32_t* output, uint32_t outputStride)
+{
+  uint32_t colors[256];
+  GetPaletteColors(*frame.m_Palette, colors);
+
+  const uint32_t scale = 1 << scaleShift;
+  const uint32_t thumbnailWidth  = frame.m_Width >> scaleShift;
+  const uint32_t thumbnailHeight = frame.m_Height >> scaleShift;
+  const __m128i zero = _mm_setzero_si128();
+  for (uint32_t thumbnailY = 0; thumbnailY < thumbnailHeight; thumbnailY++)
+  {
+    uint32_t* dest = output + thumbnailY * outputStride;
+    for (uint32_t thumbnailX = 0; thumbnailX < thumbnailWidth; thumbnailX += 2)
     {
-      for (int32_t x = 0; x < (m_Width/8); x++)
+      const bool hasPair = (thumbnailX + 1 < thumbnailWidth);
+      const uint32_t pairOffset = hasPair ? scale : 0;      // Odd width: the last pixel is computed twice
+      __m128i sum = zero;
+      for (uint32_t y = 0; y < scale; y++)
       {
-        if (codes == -1)
+        const uint8_t* source = frame.m_Pixels + ((thumbnailY << scaleShift) + y) * frame.m_Width + (thumbnailX << scaleShift);
+        for (uint32_t x = 0; x < scale; x++)
         {
-          codes = ((*(int32_t*)ptr_opcode) | 0xff000000);
-          ptr_opcode += 3;
+          __m128i pair = _mm_unpacklo_epi32(_mm_cvtsi32_si128(colors[source[x]]), _mm_cvtsi32_si128(colors[source[x + pairOffset]]));
+          sum = _mm_add_epi16(sum, _mm_unpacklo_epi8(pair, zero));
         }
-
-        switch (codes & 63)
-        {
-        case 0: RawTileDecode(); break;
-
-        case 1: ZeroMotionDecode(); break;
-        case 2: ZeroMotionDecode(); Update4(); break;
-        case 3: ZeroMotionDecode(); Update8(); break;
-        case 4: ZeroMotionDecode(); Update16(); break;
-
-        case 5: ShortMotion8Decode(); break;
-        case 6: ShortMotion8Decode(); Update4(); break;
-        case 7: ShortMotion8Decode(); Update8(); break;
-        case 8: ShortMotion8Decode(); Update16(); break;
-
-        case 9: Motion8Decode(); break;
-        case 10: Motion8Decode(); Update4(); break;
-        case 11: Motion8Decode(); Update8(); break;
-        case 12: Motion8Decode(); Update16(); break;
-
-        case 13: ShortMotion4Decode(); break;
-        case 14: ShortMotion4Decode(); Update4(); break;
-        case 15: ShortMotion4Decode(); Update8(); break;
-        case 16: ShortMotion4Decode(); Update16(); break;
-
-        case 17: Motion4Decode(); break;
-        case 18: Motion4Decode(); Update4(); break;
-        case 19: Motion4Decode(); Update8(); break;
-        case 20: Motion4Decode(); Update16(); break;
-
-        case 21: SingleColorFillDecode(); break;
-        case 22: SingleColorFillDecode(); Update4(); break;
-        case 23: SingleColorFillDecode(); Update8(); break;
-        case 24: SingleColorFillDecode(); Update16(); break;
-
-        case 25: FourColorFillDecode(); break;
-        case 26: FourColorFillDecode(); Update4(); break;
-        case 27: FourColorFillDecode(); Update8(); break;
-        case 28: FourColorFillDecode(); Update16(); break;
-
-        case 29: OneBitTileDecode(); break;
-        case 30: TwoBitTileDecode(); break;
-        case 31: ThreeBitTileDecode(); break;
-        case 32: FourBitTileDecode(); break;
-
-        case 33: OneBitSplitTileDecode(); break;
-        case 34: TwoBitSplitTileDecode(); break;
-        case 35: ThreeBitSplitTileDecode(); break;
-
-        case 36: CrossDecode(); break;
-        case 37: PrimeDecode(); break;
-
-        case 38: OneBankTileDecode(); break;
-        case 39: TwoBanksTileDecode(); break;
-
-        case 40: BlockDecodeHorizontal(); break;
-        case 41: BlockDecodeVertical(); break;
-        case 42: BlockDecode2(); break;
-        case 43: BlockDecode3(); break;
-
-        case 44: BlockBank1DecodeHorizontal(); break;
-        case 45: BlockBank1DecodeVertical(); break;
-        case 46: BlockBank1Decode2(); break;
-        case 47: BlockBank1Decode3(); break;
-
-        case 48: ROMotion8Decode(); break;
-        case 49: ROMotion8Decode(); Update4(); break;
-        case 50: ROMotion8Decode(); Update8(); break;
-        case 51: ROMotion8Decode(); Update16(); break;
-
-        case 52: RCMotion8Decode(); break;
-        case 53: RCMotion8Decode(); Update4(); break;
-        case 54: RCMotion8Decode(); Update8(); break;
-        case 55: RCMotion8Decode(); Update16(); break;
-
-        case 56: ROMotion4Decode(); break;
-        case 57: ROMotion4Decode(); Update4(); break;
-        case 58: ROMotion4Decode(); Update8(); break;
-        case 59: ROMotion4Decode(); Update16(); break;
-
-        case 60: RCMotion4Decode(); break;
-        case 61: RCMotion4Decode(); Update4(); break;
-        case 62: RCMotion4Decode(); Update8(); break;
-        case 63: RCMotion4Decode(); Update16(); break;
-        }
-
-        codes >>= 6;		        // Get the next opcode by shifting. We will reload the next 3 bytes when the variable reaches the value -1
-
-        m_PreviousTile += 8;	        // Next 8x8 block
-        m_CurrentTile += 8;	        // Next 8x8 block
       }
-      m_PreviousTile += m_Width * 7;	// Next 8x8 Line
-      m_CurrentTile  += m_Width * 7;	// Next 8x8 Line
+      __m128i average = _mm_packus_epi16(_mm_srli_epi16(sum, 2 * scaleShift), zero);
+      if (hasPair)
+      {
+        _mm_storel_epi64((__m128i*)(dest + thumbnailX), average);
+      }
+      else
+      {
+        dest[thumbnailX] = _mm_cvtsi128_si32(average);
+      }
     }
+  }
+}
 
-    // Save the decoded picture to PCX format
-    std::string pcxPath = m_OutputFolder + "PCX_" + std::to_string(m_FrameNumber++) + ".pcx";
-    m_CurrentBuffer->SaveToPcx(pcxPath.c_str(), m_Palette->GetBuffer());
 
-    // Swap the buffers
-    std::swap(m_CurrentBuffer, m_PreviousBuffer);
+// Uncompressed 24 bit TGA, stored top to bottom
+bool SaveToTga(const std::filesystem::path& targetPath, const std::vector<uint32_t>& pixels, uint32_t width, uint32_t height)
+{
+  uint8_t header[18] = { 0 };
+  header[2]  = 2;                   // Uncompressed true color
+  header[12] = (uint8_t)width;
+  header[13] = (uint8_t)(width >> 8);
+  header[14] = (uint8_t)height;
+  header[15] = (uint8_t)(height >> 8);
+  header[16] = 24;
+  header[17] = 0x20;                // First line is the top one
+
+  std::vector<uint8_t> content(header, header + sizeof(header));
+  content.reserve(sizeof(header) + pixels.size() * 3);
+  for (uint32_t color : pixels)
+  {
+    content.push_back((uint8_t)(color >> 16));
+    content.push_back((uint8_t)(color >> 8));
+    content.push_back((uint8_t)color);
   }
+  std::ofstream os(targetPath, std::ios::binary);
+  os.write((const char*)content.data(), content.size());
+  return os.good();
+}
 
 
-  void CreateBuffers()
+//
+// The clips of the batch commands: the ACF files of a folder, the ACF files of an ISO 9660 image, or a single file.
+// The clips of an image are not copied, their content is a view on the mapped image.
+//
+class ClipSource
+{
+public:
+  // Loads the file, or gives the view on the image. Only the repacked clips can have compressed frames, the view of
+  // these is copied to fileContent to unpack them
+  bool GetContent(std::vector<std::byte>& fileContent, std::span<const std::byte>& content) const
   {
-    delete m_CurrentBuffer;
-    delete m_PreviousBuffer;
-    m_CurrentBuffer  = new ImageBuffer(m_Width, m_Height);
-    m_PreviousBuffer = new ImageBuffer(m_Width, m_Height);
+    if (m_Image)
+    {
+      content = m_Image->GetFileData(m_IsoFile);
+      if (!ChunkDirectory::FindSeekIndex(content))
+      {
+        return true;
+      }
+      fileContent.assign(content.begin(), content.end());
+      if (!ACFDecoder::UnpackFrames(fileContent))
+      {
+        return false;
+      }
+      content = fileContent;
+      return true;
+    }
+    if (!ACFDecoder::LoadClip(m_Path, fileContent))
+    {
+      return false;
+    }
+    content = fileContent;
+    return true;
   }
 
+public:
+  std::filesystem::path   m_Path;               ///< For the clips of an image, the image path followed by the path in the image
+  uint64_t                m_Size = 0;
+  int64_t                 m_WriteTime = 0;      ///< For the clips of an image, the image date
+  const IsoImage*         m_Image = nullptr;
+  IsoFile                 m_IsoFile;
+};
 
 
-  bool ParseACF(const std::vector<std::byte>& acfFile)
-  {
-    m_CurrentChunk = (const Chunk*)acfFile.data();
-    const Chunk* lastChunk(m_CurrentChunk->GetChunkAtOffset(acfFile.size()));
-
-    CreateBuffers();
+bool IsIsoImage(const std::filesystem::path& path)
+{
+  std::string extension = path.extension().string();
+  return (extension == ".iso") || (extension == ".ISO");
+}
 
-    m_FrameNumber = 0;
-    std::string cameraFrames;
 
-    while (m_CurrentChunk < lastChunk)
+// isoImage is used to open the image when source is an image, and has to stay alive as long as the clips are used
+bool FindClips(const std::filesystem::path& source, IsoImage& isoImage, std::vector<ClipSource>& clips)
+{
+  std::error_code errorCode;
+  if (std::filesystem::is_directory(source, errorCode))
+  {
+    for (auto& directoryEntry : std::filesystem::directory_iterator(source))
     {
-      // Show the name of the current chunk
-      std::cout << "Chunk: '" << m_CurrentChunk->GetChunkName() << "' (" << m_CurrentChunk->GetChunkSize() << " bytes long)" << std::endl;
-
-      // Process the current chunk
-      switch (m_CurrentChunk->GetChunkType())
+      std::string extension = directoryEntry.path().extension().string();
+      if ((extension == ".ACF") || (extension == ".acf"))
       {
-      case ChunkType::e_End:
-        std::cout << "Reached the end" << std::endl;
-        return true;
-
-      case ChunkType::e_Unknown:
-        std::cout << "Unknown chunk detected." << std::endl;
-        break;
+        clips.push_back({ directoryEntry.path(), directoryEntry.file_size(errorCode), directoryEntry.last_write_time(errorCode).time_since_epoch().count(), nullptr, {} });
+      }
+    }
+  }
+  else if (IsIsoImage(source))
+  {
+    if (!isoImage.Open(source))
+    {
+      return false;
+    }
+    int64_t writeTime = std::filesystem::last_write_time(source, errorCode).time_since_epoch().count();
+    for (const IsoFile& isoFile : isoImage.FindFiles(".ACF"))
+    {
+      clips.push_back({ source / isoFile.m_Path, isoFile.m_Size, writeTime, &isoImage, isoFile });
+    }
+  }
+  else
+  {
+    clips.push_back({ source, std::filesystem::file_size(source, errorCode), std::filesystem::last_write_time(source, errorCode).time_since_epoch().count(), nullptr, {} });
+  }
+  return true;
+}
 
-      case ChunkType::e_NulChunk:  // Nothing to do, nul chunks are just for padding/alignment to get better CD streaming performance
-        break;
 
-      case ChunkType::e_Format:
-        m_Format = m_CurrentChunk->GetData<Format>();
-        m_Width = m_Format->width;
-        m_Height = m_Format->height;
-        CreateBuffers();
-        break;
+//
+// Sharded extraction: several machines extract the same source to the same (shared) output folder, each one its
+// part of the clips. The clips are sorted by weight, their file size or their frame count, and each one goes to the
+// shard with the lowest total weight so far. All the shards compute the same assignment from the same clip list,
+// so they do not need to talk to each other.
+// Each shard has its own manifest and stats report (manifest-<i>-of-<N>.txt and stats-<i>-of-<N>.txt), and "merge"
+// combines them in manifest.txt and stats.txt, after checking that each clip was extracted by exactly one shard.
+//
+enum class ShardBalance
+{
+  e_Size,
+  e_Frames,         ///< Reads the chunk directory of every clip, in every shard
+};
 
-      case ChunkType::e_FrameLen:
-        m_FrameLen = m_CurrentChunk->GetData<FrameLen>();
-        break;
+inline constexpr const char* g_ShardBalanceNames[] = { "size", "frames" };
 
-      case ChunkType::e_Palette:
-        m_Palette = m_CurrentChunk->GetData<Palette>();
-        break;
+// Set by "--shard": the batch extraction only extracts its part of the clips
+uint32_t      g_ShardIndex = 0;           ///< From 0 to g_ShardCount - 1, shown from 1 to g_ShardCount
+uint32_t      g_ShardCount = 1;
+ShardBalance  g_ShardBalance = ShardBalance::e_Size;
 
-      case ChunkType::e_Camera:
-        m_Camera = m_CurrentChunk->GetData<Camera>();
-        cameraFrames += m_Camera->GetCameraString(m_FrameNumber);
-        break;
 
-      case ChunkType::e_KeyFrame:
-        DecompressFrame();
-        break;
+std::string GetShardFileName(const char* name, uint32_t shardIndex, uint32_t shardCount)
+{
+  return std::string(name) + "-" + std::to_string(shardIndex + 1) + "-of-" + std::to_string(shardCount) + ".txt";
+}
 
-      case ChunkType::e_DltFrame:
-        DecompressFrame();
-        break;
 
-      default:
-        break;
-      }
+uint64_t GetClipWeight(const ClipSource& clip, ShardBalance balance)
+{
+  if (balance == ShardBalance::e_Size)
+  {
+    return clip.m_Size;
+  }
+  std::vector<std::byte> fileContent;
+  std::span<const std::byte> content;
+  ChunkDirectory chunkDirectory;
+  return (clip.GetContent(fileContent, content) && chunkDirectory.Build(content)) ? chunkDirectory.GetFrameCount() : 0;
+}
 
-      // Jump to next one
-      m_CurrentChunk = m_CurrentChunk->GetNextChunk();
-    };
 
-    // Save the VUE file with all the camera data
-    // D:\PROJET\TIME\SCENE\STAGE00\RUN0\SCENE.VUE
-    //std::string cameraPath = m_OutputFolder + "SCENE.VUE";
-    std::string cameraPath = "D:\\TimeCo\\Mount_D\\Projet\\Time\\Scene\\STAGE00\\RUN0\\SCENE.VUE";
-    std::ofstream os(cameraPath, std::ios::binary);
-    os.write(cameraFrames.data(), cameraFrames.length());
-    os.close();
+// Shard of each clip: the heaviest clips are placed first, the paths only decide between clips of the same weight
+std::vector<uint32_t> AssignShards(const std::vector<ClipSource>& clips, const std::vector<uint64_t>& weights, uint32_t shardCount)
+{
+  std::vector<uint32_t> order(clips.size());
+  for (uint32_t clip = 0; clip < clips.size(); clip++)
+  {
+    order[clip] = clip;
+  }
+  std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b)
+    {
+      return (weights[a] != weights[b]) ? (weights[a] > weights[b]) : (clips[a].m_Path < clips[b].m_Path);
+    });
 
-    return true;  // Sometimes there's no End chunk
+  std::vector<uint32_t> shards(clips.size());
+  std::vector<uint64_t> shardWeights(shardCount, 0);
+  for (uint32_t clip : order)
+  {
+    shards[clip] = (uint32_t)(std::min_element(shardWeights.begin(), shardWeights.end()) - shardWeights.begin());
+    shardWeights[shards[clip]] += weights[clip];
   }
+  return shards;
+}
 
 
+//
+// Repacking for the disks: the NulChunk padding is removed, the SeekIndx chunk is added after the End chunk, and the
+// frames can be compressed with BlockCodec (see SeekIndexEntry in ACFDecoder.h). The FrameLen chunk is kept as it is,
+// its sector counts are only meaningful for the original files.
+// A compressed frame is only kept if it is smaller, and the readers which do not know the PackedFr chunks just skip
+// them, so only the uncompressed repacked files can still be read by the older tools.
+//
+class RepackStats
+{
+public:
+  uint64_t    m_SourceSize = 0;
+  uint64_t    m_RepackedSize = 0;
+  uint64_t    m_PaddingSize = 0;          ///< NulChunk bytes removed, headers included
+  uint32_t    m_FrameCount = 0;
+  uint32_t    m_PackedFrameCount = 0;     ///< Frames stored compressed
+};
+
 
-  bool ExportACF(const std::filesystem::path& sourcePath,
-    //const std::string& sourcePath,
-    const std::string& outputFolder)
+// Only the files with an End chunk are repacked, the damaged ones would lose their last chunks
+bool RepackACF(std::span<const std::byte> acfFile, bool compressFrames, std::vector<std::byte>& repackedFile, RepackStats& stats)
+{
+  ChunkDirectory chunkDirectory;
+  if (!chunkDirectory.Build(acfFile) || chunkDirectory.GetEntries().empty() || (chunkDirectory.GetEntries().back().m_Type != ChunkType::e_End))
   {
-    m_SourcePath = sourcePath;
-    //m_SourceFile   = sourceFile;
-    m_OutputFolder = outputFolder;
+    return false;
+  }
 
-    // Let's load the file
-    std::vector<std::byte> fileContent;
-    if (std::filesystem::exists(sourcePath))
+  auto append = [&](const void* data, size_t size) { repackedFile.insert(repackedFile.end(), (const std::byte*)data, (const std::byte*)data + size); };
+  repackedFile.clear();
+  std::vector<SeekIndexEntry> seekIndex;
+  std::vector<std::byte> packedData;
+  for (const ChunkEntry& entry : chunkDirectory.GetEntries())
+  {
+    const std::byte* chunk = (const std::byte*)chunkDirectory.GetChunk(entry);
+    if (entry.m_Type == ChunkType::e_NulChunk)
     {
-      // We have a valid file, let's get the size and try to load it
-      std::error_code errorCode;
-      const auto fileSize = std::filesystem::file_size(sourcePath, errorCode);  // errorCode is available since C++17, without it, error handling is done by throwing an exception
-      if (!errorCode)
-      {
-        std::cout << sourcePath << " size= " << fileSize << std::endl;
-        fileContent.resize(fileSize);
-        std::ifstream is(sourcePath, std::ios::binary);
-        is.read(reinterpret_cast<char*>(fileContent.data()), fileSize);
+      stats.m_PaddingSize += sizeof(Chunk) + entry.m_Size;
+      continue;
+    }
 
-        if (is.gcount() == fileSize)
-        {
-          // It's in the box
-          if (ParseACF(fileContent))
-          {
-            // Yeah \o/
-            return true;
-          }
-          else
-          {
-            // Got an error when trying to parse the ACF file
-            std::cout << sourcePath << " : could not parse ACF format" << std::endl;
-          }
-        }
-        else
-        {
-          // Got an error when trying to get the size
-          std::cout << sourcePath << " file size " << fileSize << " does not match loaded size " << is.gcount() << std::endl;
-        }
-      }
-      else
-      {
-        // Got an error when trying to get the size
-        std::cout << sourcePath << " : " << errorCode.message() << std::endl;
-      }
+    SeekIndexEntry indexEntry;
+    memcpy(indexEntry.m_Name, chunk, 8);
+    indexEntry.m_Offset = (uint32_t)repackedFile.size();
+    indexEntry.m_Size   = entry.m_Size;
+    bool isFrame = (entry.m_Type == ChunkType::e_KeyFrame) || (entry.m_Type == ChunkType::e_DltFrame);
+    stats.m_FrameCount += isFrame ? 1 : 0;
+    packedData.clear();
+    if (isFrame && compressFrames)
+    {
+      BlockCodec::Compress({ chunk + sizeof(Chunk), entry.m_Size }, packedData);
+    }
+    if (!packedData.empty() && (sizeof(Chunk) + packedData.size() < entry.m_Size))
+    {
+      // The header of the frame is the start of the PackedFr data
+      memcpy(indexEntry.m_Name, g_ChunkNames[(int32_t)ChunkType::e_PackedFr], 8);
+      indexEntry.m_Size = (uint32_t)(sizeof(Chunk) + packedData.size());
+      append(indexEntry.m_Name, 8);
+      append(&indexEntry.m_Size, 4);
+      append(chunk, sizeof(Chunk));
+      append(packedData.data(), packedData.size());
+      stats.m_PackedFrameCount++;
     }
     else
     {
-      // Not found
-      std::cout << sourcePath << " was not found" << std::endl;
+      append(chunk, sizeof(Chunk) + entry.m_Size);
     }
-    return false;
+    seekIndex.push_back(indexEntry);
   }
 
-public:
-  int32_t         m_Width  = 320;
-  int32_t         m_Height = 240;
-  int32_t         m_FrameNumber = 0;
-
-  const Chunk*    m_CurrentChunk = nullptr;
-
-  const Format*   m_Format   = nullptr;
-  const Palette*  m_Palette  = nullptr;
-  const FrameLen* m_FrameLen = nullptr;
-  const Camera*   m_Camera   = nullptr;
+  uint32_t entryCount = (uint32_t)seekIndex.size();
+  uint32_t indexSize  = (uint32_t)(4 + seekIndex.size() * sizeof(SeekIndexEntry) + 4);
+  uint32_t chunkSize  = (uint32_t)sizeof(Chunk) + indexSize;
+  append(g_ChunkNames[(int32_t)ChunkType::e_SeekIndx], 8);
+  append(&indexSize, 4);
+  append(&entryCount, 4);
+  append(seekIndex.data(), seekIndex.size() * sizeof(SeekIndexEntry));
+  append(&chunkSize, 4);
+
+  stats.m_SourceSize   += acfFile.size();
+  stats.m_RepackedSize += repackedFile.size();
+  return true;
+}
 
-  ImageBuffer*    m_PreviousBuffer = nullptr;
-  uint8_t*        m_PreviousFrameBuffer = nullptr;
-  uint8_t*        m_PreviousTile = nullptr;
 
-  ImageBuffer*    m_CurrentBuffer = nullptr;
-  uint8_t*        m_CurrentTile = nullptr;
+// Each clip is written with the same name in the output folder
+bool RepackFolder(const std::filesystem::path& source, const std::filesystem::path& outputFolder, bool compressFrames)
+{
+  IsoImage isoImage;
+  std::vector<ClipSource> clips;
+  if (!FindClips(source, isoImage, clips))
+  {
+    return false;
+  }
+  std::error_code errorCode;
+  std::filesystem::create_directories(outputFolder, errorCode);
+
+  auto startTime = std::chrono::steady_clock::now();
+  RepackStats stats;
+  uint32_t repackedCount = 0;
+  uint32_t failedCount = 0;
+  std::vector<std::byte> repackedFile;
+  for (const ClipSource& clip : clips)
+  {
+    // The clips already repacked are unpacked when loaded, so they can be repacked again with the other setting
+    std::vector<std::byte> fileContent;
+    std::span<const std::byte> content;
+    if (!clip.GetContent(fileContent, content) || !RepackACF(content, compressFrames, repackedFile, stats))
+    {
+      std::cout << clip.m_Path << " : could not be repacked" << std::endl;
+      failedCount++;
+      continue;
+    }
+    std::ofstream os(outputFolder / clip.m_Path.filename(), std::ios::binary);
+    os.write((const char*)repackedFile.data(), repackedFile.size());
+    if (!os.good())
+    {
+      std::cout << (outputFolder / clip.m_Path.filename()) << " : could not be written" << std::endl;
+      failedCount++;
+      continue;
+    }
+    repackedCount++;
+  }
+  auto repackTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
 
-  const uint8_t* m_AlignedStream = nullptr;
-  const uint8_t* m_UnAlignedStream = nullptr;
+  std::cout << repackedCount << " clips repacked in " << repackTime << "s, " << failedCount << " failed: " << stats.m_SourceSize << " bytes to " << stats.m_RepackedSize
+            << " (" << stats.m_PaddingSize << " bytes of padding removed, " << stats.m_PackedFrameCount << " of " << stats.m_FrameCount << " frames compressed)" << std::endl;
+  return failedCount == 0;
+}
 
-  std::filesystem::path   m_SourcePath;
-  std::string             m_OutputFolder;
-};
 
+bool CreateContactSheet(const ClipSource& clip, const std::filesystem::path& targetPath, uint32_t scaleShift, uint32_t columns)
+{
+  std::vector<std::byte> fileContent;
+  std::span<const std::byte> acfFile;
+  if (!clip.GetContent(fileContent, acfFile))
+  {
+    return false;
+  }
+  const std::filesystem::path& sourcePath = clip.m_Path;
 
+  ACFDecoder acfDecoder;
+  std::vector<std::vector<uint32_t>> thumbnails;
+  uint32_t thumbnailWidth = 0;
+  uint32_t thumbnailHeight = 0;
+  for (const FrameView& frame : acfDecoder.DecodeFrames(acfFile, 0, INT32_MAX, true))
+  {
+    if (thumbnails.empty())
+    {
+      thumbnailWidth  = frame.m_Width >> scaleShift;
+      thumbnailHeight = frame.m_Height >> scaleShift;
+    }
+    if (((frame.m_Width >> scaleShift) == thumbnailWidth) && ((frame.m_Height >> scaleShift) == thumbnailHeight))   // Format changes are ignored
+    {
+      thumbnails.emplace_back(thumbnailWidth * thumbnailHeight);
+      DownscaleFrame(frame, scaleShift, thumbnails.back().data(), thumbnailWidth);
+    }
+  }
+  if (thumbnails.empty() || !thumbnailWidth || !thumbnailHeight)
+  {
+    std::cout << sourcePath << " : no keyframe to show" << std::endl;
+    return false;
+  }
 
+  const uint32_t columnCount = std::min<uint32_t>(columns, (uint32_t)thumbnails.size());
+  const uint32_t rowCount    = ((uint32_t)thumbnails.size() + columnCount - 1) / columnCount;
+  const uint32_t sheetWidth  = columnCount * (thumbnailWidth + g_ContactSheetSpacing) + g_ContactSheetSpacing;
+  const uint32_t sheetHeight = rowCount * (thumbnailHeight + g_ContactSheetSpacing) + g_ContactSheetSpacing;
+  std::vector<uint32_t> sheet((size_t)sheetWidth * sheetHeight, 0);
+  for (uint32_t thumbnail = 0; thumbnail < thumbnails.size(); thumbnail++)
+  {
+    uint32_t left = g_ContactSheetSpacing + (thumbnail % columnCount) * (thumbnailWidth + g_ContactSheetSpacing);
+    uint32_t top  = g_ContactSheetSpacing + (thumbnail / columnCount) * (thumbnailHeight + g_ContactSheetSpacing);
+    for (uint32_t y = 0; y < thumbnailHeight; y++)
+    {
+      memcpy(&sheet[(top + y) * sheetWidth + left], &thumbnails[thumbnail][y * thumbnailWidth], thumbnailWidth * sizeof(uint32_t));
+    }
+  }
+  return SaveToTga(targetPath, sheet, sheetWidth, sheetHeight);
+}
 
-static_assert(sizeof(PaletteEntry) == 3 , "Palette entries are supposed to be 8 bit RGB triplets (3 bytes)");
-static_assert(sizeof(Palette) == 256 * 3, "A Palette should contain 256 8 bit RGB triples (768 bytes)");
-static_assert(_HAS_CXX17 == 1           , "C++17 or higher required");
 
-int main()
+// One TGA per clip in the output folder, the clips are shared between threads
+bool CreateContactSheets(const std::filesystem::path& source, const std::filesystem::path& outputFolder, uint32_t scaleShift, uint32_t columns)
 {
-  std::cout << "ACF Extractor 1.0" << std::endl;
-  //std::cout << _HAS_CXX17 << ":" << std::endl;
-
-
-  try
+  IsoImage isoImage;
+  std::vector<ClipSource> clips;
+  if (!FindClips(source, isoImage, clips))
   {
+    return false;
+  }
+  std::error_code errorCode;
+  std::filesystem::create_directories(outputFolder, errorCode);
+
+  auto startTime = std::chrono::steady_clock::now();
+  std::atomic<size_t> nextClip = 0;
+  std::atomic<uint32_t> failureCount = 0;
+  auto worker = [&]()
+    {
+      size_t clip;
+      while ((clip = nextClip++) < clips.size())
+      {
+        std::filesystem::path targetPath = outputFolder / clips[clip].m_Path.stem();
+        targetPath += ".tga";
+        if (!CreateContactSheet(clips[clip], targetPath, scaleShift, columns))
+        {
+          failureCount++;
+        }
+      }
+    };
+
+  std::vector<std::thread> threads;
+  uint32_t threadCount = std::min<uint32_t>(std::max(1u, std::thread::hardware_concurrency()), (uint32_t)clips.size());
+  for (uint32_t thread = 1; thread < threadCount; thread++)
+  {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : threads)
+  {
+    thread.join();
+  }
+
+  auto time = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+  std::cout << clips.size() << " clips, " << failureCount << " failed, in " << time << "s" << std::endl;
+  return failureCount == 0;
+}
+
+
+
+//
+// Bit exactness check of the decoder: each tile of each frame gets a CRC32C, and the frame hash is the CRC32C of
+// the tile hashes and of the palette. The golden file keeps everything, so the first different tile can be told.
+//
+// Same result with or without the crc32 instruction
+uint32_t ComputeCrc32c(const uint8_t* data, size_t size)
+{
+  return ~g_CpuKernels.m_Crc32c(~0u, data, size);
+}
+
+
+class FrameHashes
+{
+public:
+  void Compute(const FrameView& frame)
+  {
+    m_FrameNumber = frame.m_FrameNumber;
+    m_Width       = frame.m_Width;
+    m_Height      = frame.m_Height;
+    m_TileHashes.resize((m_Width / 8) * (m_Height / 8));
+
+    uint8_t tile[64];
+    for (uint32_t tileIndex = 0; tileIndex < m_TileHashes.size(); tileIndex++)
+    {
+      const uint8_t* source = frame.m_Pixels + (tileIndex % (m_Width / 8)) * 8 + (tileIndex / (m_Width / 8)) * 8 * m_Width;
+      for (uint32_t y = 0; y < 8; y++)
+      {
+        memcpy(tile + y * 8, source + y * m_Width, 8);
+      }
+      m_TileHashes[tileIndex] = ComputeCrc32c(tile, sizeof(tile));
+    }
+
+    std::vector<uint8_t> summary(m_TileHashes.size() * 4 + sizeof(Palette));
+    memcpy(summary.data(), m_TileHashes.data(), m_TileHashes.size() * 4);
+    memcpy(summary.data() + m_TileHashes.size() * 4, frame.m_Palette, sizeof(Palette));
+    m_PaletteHash = ComputeCrc32c((const uint8_t*)frame.m_Palette, sizeof(Palette));
+    m_FrameHash   = ComputeCrc32c(summary.data(), summary.size());
+  }
+
+public:
+  int32_t                 m_FrameNumber = 0;
+  uint32_t                m_Width = 0;
+  uint32_t                m_Height = 0;
+  uint32_t                m_FrameHash = 0;
+  uint32_t                m_PaletteHash = 0;
+  std::vector<uint32_t>   m_TileHashes;
+};
+
+
+//
+// Records the hashes in the golden file if it does not exist yet, or compares with it.
+// Golden file: "ACFG" and a version, then for each frame the frame number, width, height, frame hash,
+// palette hash and all the tile hashes, as 32 bit values.
+//
+class VerifySink : public FrameSink
+{
+public:
+  static constexpr uint32_t g_GoldenVersion = 1;
+
+  VerifySink(const std::filesystem::path& goldenPath)
+    : m_GoldenPath(goldenPath)
+  {
+    m_IsRecording = !std::filesystem::exists(goldenPath);
+    if (!m_IsRecording)
+    {
+      std::vector<std::byte> golden;
+      uint32_t header[2] = {};
+      if (ACFDecoder::LoadFile(goldenPath, golden) && (golden.size() >= 8))
+      {
+        memcpy(header, golden.data(), 8);
+      }
+      if (memcmp(header, "ACFG", 4))
+      {
+        std::cout << goldenPath << " : not a golden file" << std::endl;
+        m_IsSuccess = false;
+      }
+      else if (header[1] != g_GoldenVersion)
+      {
+        std::cout << goldenPath << " : golden file version " << header[1] << ", this version only reads version " << g_GoldenVersion << std::endl;
+        m_IsSuccess = false;
+      }
+      else
+      {
+        m_Golden.resize((golden.size() - 8) / 4);
+        memcpy(m_Golden.data(), golden.data() + 8, m_Golden.size() * 4);
+      }
+    }
+  }
+
+  void OnFrame(const FrameView& frame) override
+  {
+    m_Hashes.Compute(frame);
+    m_FrameCount++;
+
+    std::vector<uint32_t> record = { (uint32_t)m_Hashes.m_FrameNumber, m_Hashes.m_Width, m_Hashes.m_Height, m_Hashes.m_FrameHash, m_Hashes.m_PaletteHash };
+    record.insert(record.end(), m_Hashes.m_TileHashes.begin(), m_Hashes.m_TileHashes.end());
+    if (m_IsRecording)
+    {
+      m_Golden.insert(m_Golden.end(), record.begin(), record.end());
+      return;
+    }
+    if (!m_IsSuccess)
+    {
+      return;     // Only the first difference matters, the next frames depend on it
+    }
+
+    if ((m_GoldenOffset + 5 > m_Golden.size()) || (m_GoldenOffset + 5 + (size_t)(m_Golden[m_GoldenOffset + 1] / 8) * (m_Golden[m_GoldenOffset + 2] / 8) > m_Golden.size()))
+    {
+      std::cout << "Frame " << frame.m_FrameNumber << ": not in the golden file" << std::endl;
+      m_IsSuccess = false;
+      return;
+    }
+    const uint32_t* golden = &m_Golden[m_GoldenOffset];
+    m_GoldenOffset += 5 + (size_t)(golden[1] / 8) * (golden[2] / 8);
+    if ((golden[0] != record[0]) || (golden[1] != record[1]) || (golden[2] != record[2]))
+    {
+      std::cout << "Frame " << frame.m_FrameNumber << " of " << frame.m_Width << "x" << frame.m_Height << ": golden file has frame " << golden[0] << " of " << golden[1] << "x" << golden[2] << std::endl;
+      m_IsSuccess = false;
+    }
+    else if (golden[3] != record[3])
+    {
+      m_IsSuccess = false;
+      if (golden[4] != record[4])
+      {
+        std::cout << "Frame " << frame.m_FrameNumber << ": the palette is different" << std::endl;
+      }
+      for (uint32_t tile = 0; tile < m_Hashes.m_TileHashes.size(); tile++)
+      {
+        if (golden[5 + tile] != record[5 + tile])
+        {
+          std::cout << "Frame " << frame.m_FrameNumber << ": first different tile is " << tile % (frame.m_Width / 8) << "," << tile / (frame.m_Width / 8)
+                    << " (pixel " << (tile % (frame.m_Width / 8)) * 8 << "," << (tile / (frame.m_Width / 8)) * 8 << ")" << std::endl;
+          break;
+        }
+      }
+    }
+  }
+
+  void OnEnd() override
+  {
+    if (m_IsRecording)
+    {
+      std::ofstream os(m_GoldenPath, std::ios::binary);
+      uint32_t header[2];
+      memcpy(header, "ACFG", 4);
+      header[1] = g_GoldenVersion;
+      os.write((const char*)header, sizeof(header));
+      os.write((const char*)m_Golden.data(), m_Golden.size() * 4);
+      m_IsSuccess = os.good();
+      std::cout << m_FrameCount << " frame hashes written to " << m_GoldenPath << std::endl;
+    }
+    else if (m_IsSuccess && (m_GoldenOffset != m_Golden.size()))
+    {
+      std::cout << "The golden file has more frames than the " << m_FrameCount << " decoded" << std::endl;
+      m_IsSuccess = false;
+    }
+    else if (m_IsSuccess)
+    {
+      std::cout << m_FrameCount << " frames identical to the golden file" << std::endl;
+    }
+  }
+
+  bool IsSuccess() const { return m_IsSuccess; }
+
+private:
+  std::filesystem::path   m_GoldenPath;
+  bool                    m_IsRecording;
+  bool                    m_IsSuccess = true;
+  int32_t                 m_FrameCount = 0;
+  FrameHashes             m_Hashes;
+  std::vector<uint32_t>   m_Golden;
+  size_t                  m_GoldenOffset = 0;
+};
+
+
+bool VerifyACF(const char* sourcePath, const std::filesystem::path& goldenPath)
+{
+  VerifySink verifySink(goldenPath);
+  ACFDecoder acfDecoder;
+  acfDecoder.AddFrameSink(&verifySink);
+  return acfDecoder.DecodeFile(sourcePath) && verifySink.IsSuccess();
+}
+
+
+
+//
+// Allocation counting, for TestSteadyStateAllocations: only in the test builds (ACF_COUNT_ALLOCATIONS), the global
+// operator new is replaced by one counting the allocations of each thread, so the test only sees the ones made by the
+// decoding thread. The sized operator delete keeps its default, which calls the one below.
+//
+#ifdef ACF_COUNT_ALLOCATIONS
+thread_local uint64_t g_AllocationCount = 0;
+
+void* operator new(size_t size)
+{
+  g_AllocationCount++;
+  if (void* pointer = std::malloc(size ? size : 1))
+  {
+    return pointer;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* pointer) noexcept
+{
+  std::free(pointer);
+}
+#endif
+
+
+
+// Synthetic content made to exercise as many opcodes as possible: banked gradients scrolling, flat areas with
+// a few changes, dithering, noise and a sprite moving fast enough to need the long motion vectors.
+void GenerateTestFrame(ImageBuffer& image, Palette& palette, int32_t frameNumber)
+{
+  uint32_t seed = 12345 + frameNumber * 7919;
+  auto random = [&seed]() { seed = seed * 1103515245 + 12345; return (seed >> 16) & 0x7FFF; };
+
+  for (int32_t color = 0; color < 256; color++)
+  {
+    PaletteEntry& entry = palette.m_PaletteEntries[color];
+    entry.m_Red   = (uint8_t)(color * (frameNumber < 12 ? 1 : 3));
+    entry.m_Green = (uint8_t)(255 - color);
+    entry.m_Blue  = (uint8_t)((color * 7) & 255);
+  }
+
+  uint8_t* buffer = image.GetBuffer();
+  for (uint32_t y = 0; y < image.m_Height; y++)
+  {
+    for (uint32_t x = 0; x < image.m_Width; x++)
+    {
+      uint32_t hash = (x * 2654435761u) ^ (y * 40503u);
+      hash ^= hash >> 13;
+      uint32_t quadrant = ((x / 4) & 1) + ((y / 4) & 1) * 2;
+      uint8_t color = (uint8_t)(16 * ((y / 16) % 8) + ((x + frameNumber * 2) / 8) % 16);
+      if ((x < 64) && (y < 64))                         color = 200;
+      else if ((x < 128) && (y < 48))                   color = ((x ^ y) & 1) ? 3 : 250;
+      else if ((x < 160) && (y < 48))                   color = (uint8_t)(129 + ((x / 2 + y) & 3) * 5);
+      else if ((x < 208) && (y < 48))                   color = (uint8_t)(10 + (hash & 7) * 3);
+      else if ((x < 256) && (y < 48))                   color = (uint8_t)(0x50 + (hash & 15));
+      else if ((x < 320) && (y < 48))                   color = (uint8_t)(((hash & 16) ? 0x20 : 0x70) + (hash & 15));
+      else if ((x < 208) && (y >= 48) && (y < 80))     color = (uint8_t)((hash & 15) * 13);
+      else if ((x < 256) && (y >= 48) && (y < 80))     color = (uint8_t)(quadrant * 40 + (hash & 1) * 7);
+      else if ((x < 320) && (y >= 48) && (y < 80))     color = (uint8_t)(quadrant * 16 + (hash & 3) * 3);
+      else if ((x < 64) && (y >= 224))                  color = (uint8_t)(quadrant * 40 + (hash & 7) * 4);
+      else if ((x < 72) && (y >= 232))                  color = (x - 64 == y - 232) ? (uint8_t)(frameNumber * 37) : (uint8_t)hash;
+      else if ((x < 64) && (y >= 64) && (y < 96))       color = 90;
+      else if ((x >= 256) && (y >= 192))                color = (uint8_t)random();
+      buffer[x + y * image.m_Width] = color;
+    }
+  }
+
+  for (int32_t change = 0; change < 6; change++)
+  {
+    buffer[(random() % 64) + (random() % 64) * image.m_Width] = (uint8_t)random();
+  }
+  for (uint32_t tile = 0; tile < 32; tile++)
+  {
+    for (int32_t change = 0; change < 7; change++)
+    {
+      buffer[(tile % 8) * 8 + (change % 8) + (64 + (tile / 8) * 8 + (change + frameNumber) % 8) * image.m_Width] = (uint8_t)(random() | 1);
+    }
+  }
+
+  int32_t spriteX = 40 + (frameNumber * 5) % 200;
+  int32_t spriteY = 80 + (frameNumber * 3) % 100;
+  for (int32_t y = 0; y < 32; y++)
+  {
+    for (int32_t x = 0; x < 32; x++)
+    {
+      buffer[(spriteX + x) + (spriteY + y) * image.m_Width] = (uint8_t)(((x * 37) ^ (y * 11)) & 255);
+    }
+  }
+}
+
+
+// Compares the decoded frames with the pictures given to the encoder
+class CompareSink : public FrameSink
+{
+public:
+  CompareSink(const std::vector<ImageBuffer>& images, const std::vector<Palette>& palettes)
+    : m_Images(images)
+    , m_Palettes(palettes)
+  {}
+
+  void OnFrame(const FrameView& frame) override
+  {
+    m_FrameCount++;
+    if (!m_Success)
+    {
+      return;
+    }
+    if (frame.m_FrameNumber >= (int32_t)m_Images.size())
+    {
+      std::cout << "Frame " << frame.m_FrameNumber << " : more frames than encoded" << std::endl;
+      m_Success = false;
+    }
+    else if (memcmp(frame.m_Palette, &m_Palettes[frame.m_FrameNumber], sizeof(Palette)) != 0)
+    {
+      std::cout << "Frame " << frame.m_FrameNumber << " : palette mismatch" << std::endl;
+      m_Success = false;
+    }
+    else
+    {
+      const ImageBuffer& image = m_Images[frame.m_FrameNumber];
+      for (uint32_t index = 0; index < image.m_Buffer.size(); index++)
+      {
+        if (frame.m_Pixels[index] != image.m_Buffer[index])
+        {
+          std::cout << "Frame " << frame.m_FrameNumber << " : mismatch in tile " << (index % frame.m_Width) / 8 << "," << (index / frame.m_Width) / 8 << std::endl;
+          m_Success = false;
+          break;
+        }
+      }
+    }
+  }
+
+  bool IsSuccess() const { return IsSuccess((int32_t)m_Images.size()); }
+  bool IsSuccess(int32_t expectedFrameCount) const { return m_Success && (m_FrameCount == expectedFrameCount); }
+
+private:
+  const std::vector<ImageBuffer>&   m_Images;
+  const std::vector<Palette>&       m_Palettes;
+  int32_t                           m_FrameCount = 0;
+  bool                              m_Success = true;
+};
+
+
+// Round trip: synthetic frames are encoded, decoded by the ACFDecoder with both layouts, then compared with the source
+bool TestEncoderRoundTrip(const char* name, uint64_t allowedOpcodes, uint32_t* opcodeUsage)
+{
+  const int32_t frameCount = 30;
+  std::vector<ImageBuffer> images(frameCount, ImageBuffer(320, 240));
+  std::vector<Palette> palettes(frameCount);
+  ACFEncoder encoder(320, 240, 8, 12);
+  encoder.SetAllowedOpcodes(allowedOpcodes);
+  auto startTime = std::chrono::steady_clock::now();
+  for (int32_t frame = 0; frame < frameCount; frame++)
+  {
+    GenerateTestFrame(images[frame], palettes[frame], frame);
+    encoder.AddFrame(images[frame], palettes[frame]);
+  }
+  auto encodeTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+  std::vector<std::byte> acfFile = encoder.GetACFFile();
+
+  bool success = true;
+  for (FrameLayout frameLayout : { FrameLayout::e_Linear, FrameLayout::e_Tiled })
+  {
+    CompareSink compareSink(images, palettes);
+    ACFDecoder acfDecoder;
+    acfDecoder.SetFrameLayout(frameLayout);
+    acfDecoder.AddFrameSink(&compareSink);
+    success &= acfDecoder.ParseACF(acfFile) && compareSink.IsSuccess();
+  }
+
+  for (int32_t opcode = 0; opcode < 64; opcode++)
+  {
+    opcodeUsage[opcode] += encoder.GetOpcodeUsage()[opcode];
+  }
+  std::cout << name << ": " << frameCount << " frames encoded in " << encodeTime << "s, " << acfFile.size() << " bytes, " << (success ? "round trip OK" : "round trip FAILED") << std::endl;
+  return success;
+}
+
+
+// Picture sizes the encoder can not represent: the folder is refused instead of writing tiles out of the pictures
+bool TestEncoderSizes()
+{
+  std::error_code errorCode;
+  const std::filesystem::path folder = std::filesystem::temp_directory_path(errorCode) / "ACF2PCX-sizes";
+  const std::pair<uint32_t, uint32_t> folderSizes[][2] = { { { 321, 240 }, { 321, 240 } }, { { 316, 240 }, { 316, 240 } }, { { 320, 240 }, { 320, 200 } }, { { 160, 120 }, { 160, 120 } } };
+  Palette palette = {};
+
+  bool success = true;
+  for (const auto& sizes : folderSizes)
+  {
+    std::filesystem::remove_all(folder, errorCode);
+    std::filesystem::create_directories(folder, errorCode);
+    for (int32_t frame = 0; frame < 2; frame++)
+    {
+      ImageBuffer image(sizes[frame].first, sizes[frame].second);
+      image.SaveToPcx((folder / ("PCX_" + std::to_string(frame) + ".pcx")).string().c_str(), &palette.m_PaletteEntries[0].m_Red);
+    }
+    bool isValid = (sizes[0] == sizes[1]) && !(sizes[0].first % 8) && (sizes[0].first <= 320);
+    success &= (EncodePcxFolder(folder, folder / "CLIP.ACF", 8, 12) == isValid) && (std::filesystem::exists(folder / "CLIP.ACF", errorCode) == isValid);
+  }
+  std::filesystem::remove_all(folder, errorCode);
+
+  std::cout << "Encoder sizes: " << (success ? "OK" : "FAILED") << std::endl;
+  return success;
+}
+
+
+// Test clip: frameCount synthetic frames (kept in images and palettes to compare with the decoded ones) encoded with
+// a keyframe every 8 frames, optionally with only some of the opcodes and giving how many times each one was used
+std::vector<std::byte> EncodeTestClip(int32_t frameCount, std::vector<ImageBuffer>& images, std::vector<Palette>& palettes, uint64_t allowedOpcodes = ~0ull, uint32_t* opcodeUsage = nullptr)
+{
+  images.assign(frameCount, ImageBuffer(320, 240));
+  palettes.assign(frameCount, Palette());
+  ACFEncoder encoder(320, 240, 8, 12);
+  encoder.SetAllowedOpcodes(allowedOpcodes);
+  for (int32_t frame = 0; frame < frameCount; frame++)
+  {
+    GenerateTestFrame(images[frame], palettes[frame], frame);
+    encoder.AddFrame(images[frame], palettes[frame]);
+  }
+  if (opcodeUsage)
+  {
+    std::copy(encoder.GetOpcodeUsage(), encoder.GetOpcodeUsage() + 64, opcodeUsage);
+  }
+  return encoder.GetACFFile();
+}
+
+
+// Lazy decoding: a range in the middle of the clip has to match, and stopping early has to leave the decoder usable
+bool TestFrameGenerator()
+{
+  const int32_t frameCount = 30;
+  std::vector<ImageBuffer> images;
+  std::vector<Palette> palettes;
+  std::vector<std::byte> acfFile = EncodeTestClip(frameCount, images, palettes);
+
+  bool success = true;
+  for (FrameLayout frameLayout : { FrameLayout::e_Linear, FrameLayout::e_Tiled })
+  {
+    CompareSink compareSink(images, palettes);
+    ACFDecoder acfDecoder;
+    acfDecoder.SetFrameLayout(frameLayout);
+
+    // Frame 13 is between the keyframes 8 and 16
+    int32_t expectedFrame = 13;
+    for (const FrameView& frame : acfDecoder.DecodeFrames(acfFile, 13, 7))
+    {
+      success &= (frame.m_FrameNumber == expectedFrame++);
+      compareSink.OnFrame(frame);
+    }
+    success &= (expectedFrame == 20);
+
+    for (const FrameView& frame : acfDecoder.DecodeFrames(acfFile))
+    {
+      if (frame.m_FrameNumber == 3)
+      {
+        break;
+      }
+    }
+
+    expectedFrame = 25;
+    for (const FrameView& frame : acfDecoder.DecodeFrames(acfFile, 25))
+    {
+      success &= (frame.m_FrameNumber == expectedFrame++);
+      compareSink.OnFrame(frame);
+    }
+    success &= (expectedFrame == frameCount);
+
+    // Keyframes every 8 frames
+    expectedFrame = 0;
+    for (const FrameView& frame : acfDecoder.DecodeFrames(acfFile, 0, INT32_MAX, true))
+    {
+      success &= (frame.m_FrameNumber == expectedFrame);
+      expectedFrame += 8;
+      compareSink.OnFrame(frame);
+    }
+    success &= (expectedFrame == 32);
+
+    // Restarting from a frame already decoded (the source picture here) instead of the keyframe 8
+    FrameView knownFrame = { images[10].GetBuffer(), 320, 240, &palettes[10], 10 };
+    expectedFrame = 13;
+    for (const FrameView& frame : acfDecoder.DecodeFrames(acfFile, 13, 3, false, &knownFrame))
+    {
+      success &= (frame.m_FrameNumber == expectedFrame++);
+      compareSink.OnFrame(frame);
+    }
+    success &= (expectedFrame == 16) && compareSink.IsSuccess(19);
+  }
+
+  std::cout << "Frame generator: " << (success ? "OK" : "FAILED") << std::endl;
+  return success;
+}
+
+
+// Region decoding: the pixels of the region have to be the ones of the full decoding, with motion in all directions
+bool TestRegionDecoding()
+{
+  const int32_t frameCount = 30;
+  const uint64_t allowedOpcodes[] = { ~0ull, ~((1ull << 48) - 1), ((1ull << 21) - 1) & ~1ull };     // All, relative motion, motion with updates
+  const FrameRegion regions[] = { { 40, 100, 16, 16 }, { 3, 5, 21, 13 }, { 300, 230, 20, 10 }, { 0, 0, 320, 240 }, { 100, 100, 0, 0 } };
+  std::vector<ImageBuffer> images;
+  std::vector<Palette> palettes;
+
+  bool success = true;
+  for (uint64_t opcodes : allowedOpcodes)
+  {
+    std::vector<std::byte> acfFile = EncodeTestClip(frameCount, images, palettes, opcodes);
+
+    ACFDecoder acfDecoder;
+    for (const FrameRegion& region : regions)
+    {
+      for (int32_t firstFrame : { 0, 13, 29 })
+      {
+        int32_t expectedFrame = firstFrame;
+        for (const FrameView& frame : acfDecoder.DecodeRegion(acfFile, region, firstFrame, 9))
+        {
+          success &= (frame.m_FrameNumber == expectedFrame++);
+          for (int32_t y = region.m_Y; y < std::min<int32_t>(region.m_Y + region.m_Height, frame.m_Height); y++)
+          {
+            size_t offset = (size_t)y * frame.m_Width + region.m_X;
+            size_t width = std::min<int32_t>(region.m_Width, frame.m_Width - region.m_X);
+            success &= !memcmp(frame.m_Pixels + offset, images[frame.m_FrameNumber].GetBuffer() + offset, width);
+          }
+        }
+        success &= (expectedFrame == std::min(firstFrame + 9, frameCount));
+      }
+    }
+  }
+
+  std::cout << "Region decoding: " << (success ? "OK" : "FAILED") << std::endl;
+  return success;
+}
+
+
+// Motion scan: the opcodes have to be the ones the encoder used, and the tiles copied from the previous frame
+// without any update have to be found at the place their motion vector tells
+bool TestMotionScan()
+{
+  const int32_t frameCount = 30;
+  std::vector<ImageBuffer> images;
+  std::vector<Palette> palettes;
+  uint32_t encodedOpcodeUsage[64] = { 0 };
+  std::vector<std::byte> acfFile = EncodeTestClip(frameCount, images, palettes, ~0ull, encodedOpcodeUsage);
+
+  bool success = true;
+  uint32_t opcodeUsage[64] = { 0 };
+  int32_t expectedFrame = 0;
+  uint32_t movingTileCount = 0;
+  ACFDecoder acfDecoder;
+  for (const MotionView& motion : acfDecoder.ScanMotion(acfFile))
+  {
+    success &= (motion.m_FrameNumber == expectedFrame++) && (motion.m_IsKeyFrame == !(motion.m_FrameNumber % 8));
+    for (uint32_t tile = 0; tile < motion.m_TileColumns * motion.m_TileRows; tile++)
+    {
+      const TileReference& reference = motion.m_Tiles[tile];
+      opcodeUsage[reference.m_Opcode]++;
+      if (motion.m_FrameNumber && ((reference.m_Opcode == 1) || (reference.m_Opcode == 5) || (reference.m_Opcode == 9) || (reference.m_Opcode == 48) || (reference.m_Opcode == 52)))
+      {
+        int32_t x = (tile % motion.m_TileColumns) * 8;
+        int32_t y = (tile / motion.m_TileColumns) * 8;
+        int32_t motionX, motionY;
+        reference.GetMotion(y * 320 + x, 320, motionX, motionY);
+        const uint8_t* current = images[motion.m_FrameNumber].GetBuffer() + y * 320 + x;
+        const uint8_t* previous = images[motion.m_FrameNumber - 1].GetBuffer() + (y + motionY) * 320 + x + motionX;
+        for (int32_t line = 0; line < 8; line++)
+        {
+          success &= !memcmp(current + line * 320, previous + line * 320, 8);
+        }
+        movingTileCount += (motionX || motionY) ? 1 : 0;
+      }
+    }
+  }
+  success &= (expectedFrame == frameCount) && (movingTileCount > 0);
+  success &= std::equal(opcodeUsage, opcodeUsage + 64, encodedOpcodeUsage);
+
+  std::cout << "Motion scan: " << (success ? "OK" : "FAILED") << std::endl;
+  return success;
+}
+
+
+// Each kernel version the processor supports has to give the same result as the scalar version, and so does the
+// whole encoder and decoder: the test clip is encoded and decoded with each level, and compared with the scalar one
+bool TestCpuKernels()
+{
+  std::vector<ImageBuffer> images(8, ImageBuffer(320, 240));
+  std::vector<Palette> palettes(8);
+  for (int32_t frame = 0; frame < 8; frame++)
+  {
+    GenerateTestFrame(images[frame], palettes[frame], frame * 3);
+  }
+  const ImageBuffer& image = images[5];
+  uint32_t colors[256];
+  GetPaletteColors(palettes[5], colors);
+
+  bool success = (~ScalarKernels::Crc32c(~0u, (const uint8_t*)"123456789", 9) == 0xE3069283);
+  const CpuKernels scalar = GetCpuKernels(CpuLevel::e_Scalar);
+  std::vector<std::byte> scalarFile;
+  for (int32_t level = 0; level <= (int32_t)g_DetectedCpuLevel; level++)
+  {
+    const CpuKernels kernels = GetCpuKernels((CpuLevel)level);
+    bool levelSuccess = true;
+
+    std::vector<uint8_t> rgb(image.m_Buffer.size() * 3 + 1), scalarRgb(image.m_Buffer.size() * 3 + 1);    // The byte after the last pixel must stay 0
+    for (size_t pixelCount : { (size_t)0, (size_t)1, (size_t)7, (size_t)11, (size_t)12, (size_t)333, image.m_Buffer.size() })
+    {
+      std::fill(rgb.begin(), rgb.end(), 0);
+      kernels.m_ExpandPalette(image.GetBuffer(), pixelCount, colors, rgb.data());
+      scalar.m_ExpandPalette(image.GetBuffer(), pixelCount, colors, scalarRgb.data());
+      levelSuccess &= !memcmp(rgb.data(), scalarRgb.data(), pixelCount * 3) && !rgb[pixelCount * 3];
+    }
+
+    uint8_t line[640], scalarLine[640];
+    for (uint32_t y = 0; y < image.m_Height; y++)
+    {
+      const uint8_t* source = image.GetBuffer() + y * image.m_Width;
+      uint32_t size = ImageBuffer::EncodePcxLine(source, image.m_Width, line, kernels);
+      levelSuccess &= (size == ImageBuffer::EncodePcxLine(source, image.m_Width, scalarLine, scalar)) && !memcmp(line, scalarLine, size);
+      for (uint32_t x = 0; x < image.m_Width; x += 13)
+      {
+        for (uint32_t maxLength : { 1u, 15u, 16u, 17u, 63u, 100u })
+        {
+          maxLength = std::min(maxLength, image.m_Width - x);
+          levelSuccess &= (kernels.m_GetRunLength(source + x, maxLength) == scalar.m_GetRunLength(source + x, maxLength));
+        }
+      }
+    }
+
+    uint64_t masks[33], scalarMasks[33];
+    for (uint32_t tileY = 0; tileY + 8 <= image.m_Height; tileY += 24)
+    {
+      const uint8_t* tile = images[4].GetBuffer() + tileY * image.m_Width + 64;
+      uint8_t tilePixels[64];
+      for (uint32_t y = 0; y < 8; y++)
+      {
+        memcpy(tilePixels + y * 8, tile + y * image.m_Width, 8);
+      }
+      kernels.m_GetDifferenceMasks(tilePixels, image.GetBuffer() + tileY * image.m_Width + 48, image.m_Width, 33, masks);
+      scalar.m_GetDifferenceMasks(tilePixels, image.GetBuffer() + tileY * image.m_Width + 48, image.m_Width, 33, scalarMasks);
+      levelSuccess &= !memcmp(masks, scalarMasks, sizeof(masks));
+    }
+
+    for (size_t size = 0; size <= 64; size++)
+    {
+      levelSuccess &= (kernels.m_Crc32c(~0u, image.GetBuffer() + 3, size) == scalar.m_Crc32c(~0u, image.GetBuffer() + 3, size));
+    }
+
+    // Whole encoder and decoder with this level
+    SetCpuLevel((CpuLevel)level);
+    ACFEncoder encoder(320, 240, 4, 12);
+    for (int32_t frame = 0; frame < 8; frame++)
+    {
+      encoder.AddFrame(images[frame], palettes[frame]);
+    }
+    std::vector<std::byte> acfFile = encoder.GetACFFile();
+    CompareSink compareSink(images, palettes);
+    ACFDecoder acfDecoder;
+    for (const FrameView& frame : acfDecoder.DecodeFrames(acfFile))
+    {
+      compareSink.OnFrame(frame);
+    }
+    levelSuccess &= compareSink.IsSuccess() && (!level || (acfFile == scalarFile));
+    if (!level)
+    {
+      scalarFile = acfFile;
+    }
+
+    std::cout << "CPU kernels " << g_CpuLevelNames[level] << ": " << (levelSuccess ? "OK" : "FAILED") << std::endl;
+    success &= levelSuccess;
+  }
+  SetCpuLevel(g_DetectedCpuLevel);
+  return success;
+}
+
+
+// The SIMD scalers have to give the same result as the scalar ones, on a clip frame and on noise with few colors
+// (lots of edges), with widths which are not multiples of 16
+bool TestFrameScaler()
+{
+  ImageBuffer image(320, 240);
+  Palette palette;
+  GenerateTestFrame(image, palette, 7);
+  std::vector<uint8_t> noise(37 * 11);
+  uint32_t seed = 1234;
+  for (uint8_t& pixel : noise)
+  {
+    seed = seed * 1103515245 + 12345;
+    pixel = (seed >> 16) & 3;
+  }
+
+  const FrameView frames[] = { { image.GetBuffer(), 320, 240, &palette, 0 }, { noise.data(), 37, 11, &palette, 1 }, { noise.data(), 18, 2, &palette, 2 } };
+  bool success = true;
+  for (ScaleFilter filter : { ScaleFilter::e_Nearest, ScaleFilter::e_PixelArt })
+  {
+    for (uint32_t factor = 2; factor <= 4; factor++)
+    {
+      FrameScaler scaler(filter, factor);
+      FrameScaler scalarScaler(filter, factor, false);
+      for (const FrameView& frame : frames)
+      {
+        FrameView scaled = scaler.Scale(frame);
+        FrameView scalarScaled = scalarScaler.Scale(frame);
+        success &= (scaled.m_Width == frame.m_Width * factor) && (scaled.m_Height == frame.m_Height * factor) &&
+                   !memcmp(scaled.m_Pixels, scalarScaled.m_Pixels, (size_t)scaled.m_Width * scaled.m_Height);
+      }
+    }
+  }
+
+  // Scale2x rounds the corner of a diagonal edge, and nearest only repeats the pixels
+  const uint8_t corner[4] = { 1, 0, 0, 0 };
+  const uint8_t scale2xCorner[16] = { 1, 1, 0, 0,   1, 0, 0, 0,   0, 0, 0, 0,   0, 0, 0, 0 };
+  const uint8_t nearestCorner[16] = { 1, 1, 0, 0,   1, 1, 0, 0,   0, 0, 0, 0,   0, 0, 0, 0 };
+  FrameScaler scale2x(ScaleFilter::e_PixelArt, 2);
+  FrameScaler nearest(ScaleFilter::e_Nearest, 2);
+  success &= !memcmp(scale2x.Scale({ corner, 2, 2, &palette, 0 }).m_Pixels, scale2xCorner, 16);
+  success &= !memcmp(nearest.Scale({ corner, 2, 2, &palette, 0 }).m_Pixels, nearestCorner, 16);
+
+  std::cout << "Frame scaler: " << (success ? "OK" : "FAILED") << std::endl;
+  return success;
+}
+
+
+// Shard assignment: every clip in exactly one shard, the same assignment whatever the clip order, and shards which
+// differ by at most the heaviest clip
+bool TestShardAssignment()
+{
+  std::vector<ClipSource> clips;
+  std::vector<uint64_t> weights;
+  for (uint32_t clip = 0; clip < 23; clip++)
+  {
+    clips.push_back({ "CLIP" + std::to_string(clip) + ".ACF", 0, 0, nullptr, {} });
+    weights.push_back(1000 + (clip * 7919) % 5000 + ((clip % 5) ? 0 : 2000));     // A few clips of the same weight
+  }
+
+  bool success = true;
+  for (uint32_t shardCount : { 1, 2, 3, 7, 30 })
+  {
+    std::vector<uint32_t> shards = AssignShards(clips, weights, shardCount);
+    std::vector<uint64_t> shardWeights(shardCount, 0);
+    for (uint32_t clip = 0; clip < clips.size(); clip++)
+    {
+      success &= (shards[clip] < shardCount);
+      shardWeights[shards[clip]] += weights[clip];
+    }
+    if (shardCount <= clips.size())
+    {
+      success &= (*std::max_element(shardWeights.begin(), shardWeights.end()) - *std::min_element(shardWeights.begin(), shardWeights.end()) <= *std::max_element(weights.begin(), weights.end()));
+    }
+
+    std::vector<ClipSource> reversedClips(clips.rbegin(), clips.rend());
+    std::vector<uint64_t> reversedWeights(weights.rbegin(), weights.rend());
+    std::vector<uint32_t> reversedShards = AssignShards(reversedClips, reversedWeights, shardCount);
+    success &= std::equal(shards.begin(), shards.end(), reversedShards.rbegin());
+  }
+
+  std::cout << "Shard assignment: " << (success ? "OK" : "FAILED") << std::endl;
+  return success;
+}
+
+
+// The clips the decoder cannot decode have to fail before any frame is given to the sinks
+bool TestRejectedClips()
+{
+  std::vector<ImageBuffer> images;
+  std::vector<Palette> palettes;
+  const std::vector<std::byte> acfFile = EncodeTestClip(10, images, palettes);
+
+  // The encoder starts the file with the Format chunk
+  std::vector<std::byte> xcfFile = acfFile;
+  uint32_t compressor = (uint32_t)Compressor::e_XCF;
+  memcpy(xcfFile.data() + sizeof(Chunk) + offsetof(Format, compressor), &compressor, 4);
+  std::vector<std::byte> shortFormatFile = acfFile;
+  uint32_t formatSize = 8;
+  memcpy(shortFormatFile.data() + 8, &formatSize, 4);
+
+  bool success = true;
+  g_LogLevel = LogLevel::e_Off;
+  for (const std::vector<std::byte>* file : { &xcfFile, &shortFormatFile })
+  {
+    CompareSink compareSink(images, palettes);
+    ACFDecoder acfDecoder;
+    acfDecoder.AddFrameSink(&compareSink);
+    success &= !acfDecoder.ParseACF(*file) && compareSink.IsSuccess(0);
+  }
+  g_LogLevel = LogLevel::e_Summary;
+
+  std::cout << "Rejected clips: " << (success ? "OK" : "FAILED") << std::endl;
+  return success;
+}
+
+
+// Damaged clips: the Palette, Camera and FrameLen chunks too short for their structure are ignored, so the last frame
+// keeps its palette and scanning does not read past them
+bool TestShortChunks()
+{
+  const int32_t frameCount = 10;
+  std::vector<ImageBuffer> images;
+  std::vector<Palette> palettes;
+  const std::vector<std::byte> acfFile = EncodeTestClip(frameCount, images, palettes);
+
+  // The short chunks go just before the last frame
+  ChunkDirectory chunkDirectory;
+  chunkDirectory.Build(acfFile);
+  size_t lastFrameOffset = chunkDirectory.GetFrameEntry(frameCount - 1).m_Offset;
+  std::vector<std::byte> shortChunksFile(acfFile.begin(), acfFile.begin() + lastFrameOffset);
+  for (const char* name : { "Palette ", "Camera  ", "FrameLen" })
+  {
+    uint32_t size = 2;
+    shortChunksFile.insert(shortChunksFile.end(), (const std::byte*)name, (const std::byte*)name + 8);
+    shortChunksFile.insert(shortChunksFile.end(), (const std::byte*)&size, (const std::byte*)&size + 4);
+    shortChunksFile.insert(shortChunksFile.end(), size, (std::byte)0xff);
+  }
+  shortChunksFile.insert(shortChunksFile.end(), acfFile.begin() + lastFrameOffset, acfFile.end());
+
+  bool success = true;
+  g_LogLevel = LogLevel::e_Off;
+  {
+    CompareSink compareSink(images, palettes);
+    ACFDecoder acfDecoder;
+    acfDecoder.AddFrameSink(&compareSink);
+    success &= acfDecoder.ParseACF(shortChunksFile) && compareSink.IsSuccess();
+  }
+  {
+    std::ostringstream metadata;
+    TextWriter metadataWriter(metadata);
+    MetadataSink metadataSink(metadataWriter, true);
+    ACFDecoder acfDecoder;
+    acfDecoder.AddFrameSink(&metadataSink);
+    success &= acfDecoder.ScanACF(shortChunksFile);
+  }
+  g_LogLevel = LogLevel::e_Summary;
+
+  std::cout << "Short chunks: " << (success ? "OK" : "FAILED") << std::endl;
+  return success;
+}
+
+
+// Keeps a copy of the decoded frames, and stops the decoding like a killed process when the given frame is reached
+class RecordSink : public FrameSink
+{
+public:
+  RecordSink(int32_t interruptedFrame = -1)
+    : m_InterruptedFrame(interruptedFrame)
+  {}
+
+  void OnFrame(const FrameView& frame) override
+  {
+    if (frame.m_FrameNumber == m_InterruptedFrame)
+    {
+      throw std::runtime_error("Interrupted");
+    }
+    ImageBuffer& image = m_Images.emplace_back(frame.m_Width, frame.m_Height);
+    memcpy(image.m_Buffer.data(), frame.m_Pixels, image.m_Buffer.size());
+    m_Palettes.push_back(*frame.m_Palette);
+  }
+
+  std::vector<ImageBuffer>  m_Images;
+  std::vector<Palette>      m_Palettes;
+
+private:
+  int32_t                   m_InterruptedFrame;
+};
+
+
+// Resuming: a decoding stopped in the middle of the clip restarts from its checkpoint, and gives the frames which
+// were not given before the interruption, identical to the ones of a decoding which was never interrupted
+bool TestCheckpointResume()
+{
+  const int32_t frameCount = 40;
+  const int32_t interruptedFrame = g_CheckpointInterval * 2 + 3;
+  const int32_t resumedFrame = g_CheckpointInterval * 2;
+  std::vector<ImageBuffer> images;
+  std::vector<Palette> palettes;
+  const std::vector<std::byte> acfFile = EncodeTestClip(frameCount, images, palettes);
+
+  std::error_code errorCode;
+  const std::filesystem::path folder = std::filesystem::temp_directory_path(errorCode) / "ACF2PCX-checkpoint";
+  std::filesystem::create_directories(folder, errorCode);
+  const std::filesystem::path checkpointPath = folder / g_CheckpointName;
+
+  bool success = true;
+  for (FrameLayout frameLayout : { FrameLayout::e_Linear, FrameLayout::e_Tiled })
+  {
+    std::filesystem::remove(checkpointPath, errorCode);
+    RecordSink completeSink;
+    {
+      ACFDecoder acfDecoder;
+      acfDecoder.SetFrameLayout(frameLayout);
+      acfDecoder.AddFrameSink(&completeSink);
+      success &= acfDecoder.ParseACF(acfFile) && (completeSink.m_Images.size() == frameCount);
+    }
+
+    RecordSink interruptedSink(interruptedFrame);
+    try
+    {
+      ACFDecoder acfDecoder;
+      acfDecoder.SetFrameLayout(frameLayout);
+      acfDecoder.AddFrameSink(&interruptedSink);
+      acfDecoder.ParseACF(acfFile, checkpointPath);
+      success = false;
+    }
+    catch (const std::runtime_error&)
+    {
+    }
+    success &= (interruptedSink.m_Images.size() == interruptedFrame) && std::filesystem::exists(checkpointPath, errorCode);
+
+    // The checkpoint was saved after the frame before resumedFrame, the next frames come from the keyframe before it
+    std::vector<ImageBuffer> resumedImages(completeSink.m_Images.begin() + resumedFrame, completeSink.m_Images.end());
+    std::vector<Palette> resumedPalettes(completeSink.m_Palettes.begin() + resumedFrame, completeSink.m_Palettes.end());
+    RecordSink resumedSink;
+    {
+      ACFDecoder acfDecoder;
+      acfDecoder.SetFrameLayout(frameLayout);
+      acfDecoder.AddFrameSink(&resumedSink);
+      g_LogLevel = LogLevel::e_Off;
+      success &= acfDecoder.ParseACF(acfFile, checkpointPath);
+      g_LogLevel = LogLevel::e_Summary;
+    }
+    success &= (resumedSink.m_Images.size() == resumedImages.size()) && !std::filesystem::exists(checkpointPath, errorCode);
+    for (size_t frame = 0; success && (frame < resumedImages.size()); frame++)
+    {
+      success &= (resumedSink.m_Images[frame].m_Buffer == resumedImages[frame].m_Buffer) && !memcmp(&resumedSink.m_Palettes[frame], &resumedPalettes[frame], sizeof(Palette));
+    }
+  }
+  std::filesystem::remove_all(folder, errorCode);
+
+  std::cout << "Checkpoint resume: " << (success ? "OK" : "FAILED") << std::endl;
+  return success;
+}
+
+
+#ifdef ACF_COUNT_ALLOCATIONS
+// Allocations made from the first frame given to the sinks to the end of the clip
+class AllocationSink : public FrameSink
+{
+public:
+  void OnFrame(const FrameView& frame) override
+  {
+    if (!m_FrameCount++)
+    {
+      m_FirstFrameAllocationCount = g_AllocationCount;
+    }
+  }
+
+  void OnEnd() override
+  {
+    m_AllocationCount = g_AllocationCount - m_FirstFrameAllocationCount;
+  }
+
+  bool IsSteady(int32_t expectedFrameCount) const { return (m_FrameCount == expectedFrameCount) && !m_AllocationCount; }
+
+private:
+  int32_t     m_FrameCount = 0;
+  uint64_t    m_FirstFrameAllocationCount = 0;
+  uint64_t    m_AllocationCount = 0;
+};
+
+
+// Steady state: once the first frame is written, the frames, the checkpoints and the sound blocks must not allocate,
+// and the next clips of the same size must not allocate at all when the decoder and the sinks are reused
+bool TestSteadyStateAllocations()
+{
+  const int32_t frameCount = 30;
+  std::vector<ImageBuffer> images;
+  std::vector<Palette> palettes;
+  std::vector<std::byte> acfFile = EncodeTestClip(frameCount, images, palettes);
+
+  std::error_code errorCode;
+  const std::filesystem::path folder = std::filesystem::temp_directory_path(errorCode) / "ACF2PCX-allocations";
+  std::filesystem::create_directories(folder, errorCode);
+  const std::string outputFolder = folder.string() + (char)std::filesystem::path::preferred_separator;
+  const std::filesystem::path checkpointPath = folder / g_CheckpointName;
+  const std::filesystem::path noCheckpointPath;
+
+  bool success = true;
+  for (FrameLayout frameLayout : { FrameLayout::e_Linear, FrameLayout::e_Tiled })
+  {
+    PcxSink pcxSink(outputFolder);
+    RawSink rawSink(outputFolder);
+    ACFDecoder acfDecoder;
+    acfDecoder.SetFrameLayout(frameLayout);
+    acfDecoder.AddFrameSink(&pcxSink);
+    acfDecoder.AddFrameSink(&rawSink);
+    for (int32_t clip = 0; clip < 3; clip++)
+    {
+      AllocationSink allocationSink;
+      acfDecoder.AddFrameSink(&allocationSink);
+      uint64_t allocationCount = g_AllocationCount;
+      success &= acfDecoder.ParseACF(acfFile, (clip < 2) ? checkpointPath : noCheckpointPath) && allocationSink.IsSteady(frameCount);
+      success &= (clip < 2) || (g_AllocationCount == allocationCount);
+      acfDecoder.RemoveFrameSink(&allocationSink);
+    }
+
+    // The files written without allocating have to be complete
+    ImageBuffer image;
+    Palette palette;
+    success &= image.LoadFromPcx((outputFolder + "PCX_29.pcx").c_str(), &palette.m_PaletteEntries[0].m_Red) && (image.m_Buffer == images[29].m_Buffer);
+    success &= !memcmp(&palette, &palettes[29], sizeof(Palette)) && (std::filesystem::file_size(outputFolder + "RAW_29.raw", errorCode) == 320 * 240);
+  }
+
+  // Sound blocks: the queue keeps the memory of the blocks once each one went through it
+  {
+    const uint32_t blockSize = 3674;
+    const uint32_t blockCount = g_AudioQueueSize * 4;
+    Format format = {};
+    format.sampling_rate = 22050;
+    format.sample_type   = e_SampleMono16;
+    format.sample_flags  = e_SampleSigned;
+    std::vector<std::byte> formatChunk(sizeof(Chunk) + sizeof(Format));
+    std::vector<std::byte> soundChunk(sizeof(Chunk) + blockSize);
+    memcpy(formatChunk.data() + sizeof(Chunk), &format, sizeof(Format));
+
+    WavSink wavSink(folder / "SOUND.WAV");
+    wavSink.OnChunk({ ChunkType::e_Format, 0, sizeof(Format), 0 }, *(const Chunk*)formatChunk.data());
+    uint64_t allocationCount = 0;
+    for (uint32_t block = 0; block < blockCount; block++)
+    {
+      if (block == g_AudioQueueSize * 2)
+      {
+        allocationCount = g_AllocationCount;
+      }
+      wavSink.OnChunk({ ChunkType::e_SoundBuf, 0, blockSize, 0 }, *(const Chunk*)soundChunk.data());
+    }
+    success &= (g_AllocationCount == allocationCount);
+    wavSink.OnEnd();
+    success &= (wavSink.GetDataSize() == blockSize * blockCount);
+  }
+  std::filesystem::remove_all(folder, errorCode);
+
+  std::cout << "Steady state allocations: " << (success ? "OK" : "FAILED") << std::endl;
+  return success;
+}
+#endif
+
+
+// Repacking: the codec has to give back any block, and a repacked clip has no padding, gets its directory from the
+// seek index, decodes to the same frames with or without compression, and a damaged compressed frame is detected
+bool TestRepack()
+{
+  bool success = true;
+  std::vector<std::vector<std::byte>> blocks(4);
+  blocks[1].resize(1, (std::byte)7);
+  blocks[2].resize(100000, (std::byte)0);
+  for (uint32_t index = 0; index < 70000; index++)
+  {
+    blocks[3].push_back((std::byte)((index * 2654435761u) >> 24));
+  }
+  for (const std::vector<std::byte>& block : blocks)
+  {
+    std::vector<std::byte> packedBlock;
+    std::vector<std::byte> unpackedBlock(block.size());
+    BlockCodec::Compress(block, packedBlock);
+    success &= BlockCodec::Decompress(packedBlock, unpackedBlock) && (unpackedBlock == block);
+  }
+
+  const int32_t frameCount = 30;
+  std::vector<ImageBuffer> images;
+  std::vector<Palette> palettes;
+  std::vector<std::byte> acfFile = EncodeTestClip(frameCount, images, palettes);
+
+  for (bool compressFrames : { false, true })
+  {
+    RepackStats stats;
+    std::vector<std::byte> repackedFile;
+    success &= RepackACF(acfFile, compressFrames, repackedFile, stats) && (stats.m_PaddingSize > 0) && (stats.m_FrameCount == frameCount);
+    success &= compressFrames ? (stats.m_PackedFrameCount > 0) : (stats.m_PackedFrameCount == 0);
+
+    // The same entries as the chunk walk, which does not go past the End chunk
+    ChunkDirectory indexDirectory;
+    ChunkDirectory walkDirectory;
+    const Chunk* seekIndex = ChunkDirectory::FindSeekIndex(repackedFile);
+    success &= (seekIndex != nullptr) && indexDirectory.Build(repackedFile) && walkDirectory.Build({ repackedFile.data(), repackedFile.size() - 1 });
+    success &= (indexDirectory.GetEntries().size() == walkDirectory.GetEntries().size()) && (indexDirectory.GetKeyFrames() == walkDirectory.GetKeyFrames());
+    for (size_t index = 0; success && (index < indexDirectory.GetEntries().size()); index++)
+    {
+      const ChunkEntry& entry = indexDirectory.GetEntries()[index];
+      success &= (entry.m_Type != ChunkType::e_NulChunk) && (entry.m_Type == walkDirectory.GetEntries()[index].m_Type) && (entry.m_Offset == walkDirectory.GetEntries()[index].m_Offset);
+    }
+
+    // A stale index entry, giving another name than the header of its chunk (the last frame is not a keyframe): the
+    // chunks are walked instead
+    const auto& entries = indexDirectory.GetEntries();
+    auto lastFrame = std::find_if(entries.rbegin(), entries.rend(), [](const ChunkEntry& entry) { return (entry.m_Type == ChunkType::e_DltFrame) || (entry.m_Type == ChunkType::e_PackedFr); });
+    std::vector<std::byte> staleIndexFile = repackedFile;
+    size_t nameOffset = ((const std::byte*)seekIndex - repackedFile.data()) + sizeof(Chunk) + 4 + (entries.rend() - lastFrame - 1) * sizeof(SeekIndexEntry);
+    memcpy(staleIndexFile.data() + nameOffset, "KeyFrame", 8);
+    ChunkDirectory staleIndexDirectory;
+    g_LogLevel = LogLevel::e_Off;
+    success &= (lastFrame != entries.rend()) && staleIndexDirectory.Build(staleIndexFile) && (staleIndexDirectory.GetEntries().size() == walkDirectory.GetEntries().size());
+    g_LogLevel = LogLevel::e_Summary;
+    for (size_t index = 0; success && (index < staleIndexDirectory.GetEntries().size()); index++)
+    {
+      success &= (staleIndexDirectory.GetEntries()[index].m_Type == walkDirectory.GetEntries()[index].m_Type);
+    }
+
+    std::vector<std::byte> unpackedFile = repackedFile;
+    CompareSink compareSink(images, palettes);
+    ACFDecoder acfDecoder;
+    acfDecoder.AddFrameSink(&compareSink);
+    success &= ACFDecoder::UnpackFrames(unpackedFile) && acfDecoder.ParseACF(unpackedFile) && compareSink.IsSuccess();
+
+    // One byte more in the size of the first compressed frame
+    if (compressFrames)
+    {
+      auto packedFrame = std::find_if(entries.begin(), entries.end(), [](const ChunkEntry& entry) { return entry.m_Type == ChunkType::e_PackedFr; });
+      std::vector<std::byte> damagedFile = repackedFile;
+      damagedFile[packedFrame->m_Offset + sizeof(Chunk) + 8] = (std::byte)((uint8_t)damagedFile[packedFrame->m_Offset + sizeof(Chunk) + 8] + 1);
+      g_LogLevel = LogLevel::e_Off;
+      success &= !ACFDecoder::UnpackFrames(damagedFile);
+      g_LogLevel = LogLevel::e_Summary;
+    }
+  }
+
+  std::cout << "Repacking: " << (success ? "OK" : "FAILED") << std::endl;
+  return success;
+}
+
+
+// Each pass restricts the encoder to a set of opcodes, so the less efficient ones get used as well
+bool TestEncoder()
+{
+  auto opcodes = [](uint32_t first, uint32_t last) { return (~0ull >> (63 - last)) & (~0ull << first); };
+
+  uint32_t opcodeUsage[64] = { 0 };
+  bool success = true;
+  success &= TestEncoderRoundTrip("All opcodes", ~0ull, opcodeUsage);
+  success &= TestEncoderRoundTrip("Intra tiles", opcodes(29, 47), opcodeUsage);
+  success &= TestEncoderRoundTrip("Motion with updates", opcodes(2, 4) | opcodes(6, 8) | opcodes(10, 20), opcodeUsage);
+  success &= TestEncoderRoundTrip("Fills with updates", opcodes(21, 28), opcodeUsage);
+  success &= TestEncoderRoundTrip("Quadrant fills with updates", opcodes(25, 28), opcodeUsage);
+  success &= TestEncoderRoundTrip("Relative motion", opcodes(48, 63), opcodeUsage);
+  success &= TestEncoderRoundTrip("Coordinates motion", opcodes(52, 55) | opcodes(60, 63), opcodeUsage);
+  success &= TestEncoderRoundTrip("Less efficient intra tiles", opcodes(31, 36) | opcodes(38, 39) | opcodes(42, 47), opcodeUsage);
+  success &= TestEncoderRoundTrip("Cross tiles", opcodes(36, 36), opcodeUsage);
+  success &= TestEncoderRoundTrip("Bank diagonal blocks", opcodes(46, 46), opcodeUsage);
+  success &= TestEncoderRoundTrip("Bank other diagonal blocks", opcodes(47, 47), opcodeUsage);
+  success &= TestEncoderSizes();
+  success &= TestFrameGenerator();
+  success &= TestRegionDecoding();
+  success &= TestMotionScan();
+  success &= TestShardAssignment();
+  success &= TestRepack();
+#ifdef ACF_COUNT_ALLOCATIONS
+  success &= TestSteadyStateAllocations();
+#else
+  std::cout << "Steady state allocations: not counted, this needs a build with ACF_COUNT_ALLOCATIONS defined" << std::endl;
+#endif
+  success &= TestRejectedClips();
+  success &= TestShortChunks();
+  success &= TestCheckpointResume();
+  success &= TestCpuKernels();
+  success &= TestFrameScaler();
+
+  // Every opcode is reached by one of the passes, so the decoder of each one gets round tripped
+  bool allOpcodesUsed = true;
+  std::cout << "Opcodes never used:";
+  for (int32_t opcode = 0; opcode < 64; opcode++)
+  {
+    if (!opcodeUsage[opcode])
+    {
+      std::cout << " " << opcode;
+      allOpcodesUsed = false;
+    }
+  }
+  std::cout << (allOpcodesUsed ? " none" : ", FAILED") << std::endl;
+  success &= allOpcodesUsed;
+  std::cout << (success ? "Encoder test passed" : "Encoder test FAILED") << std::endl;
+  return success;
+}
+
+
+
+
+//
+// Incremental batch extraction: the manifest remembers what was extracted from each clip, so the next runs only
+// decode the new or modified clips. A clip is "started" in the manifest before its extraction and "done" after,
+// so the outputs of an interrupted run are known and get removed before the clip is extracted again. A clip the
+// decoder rejects is "failed": nothing is kept from it, and the next runs try it again.
+// The file is one tab separated line per clip, rewritten to a temporary file and renamed after each change.
+//
+class ManifestEntry
+{
+public:
+  std::string   m_SourcePath;
+  uint64_t      m_Size = 0;
+  int64_t       m_WriteTime = 0;
+  uint64_t      m_ContentHash = 0;
+  uint32_t      m_DecoderVersion = 0;
+  std::string   m_OutputFormat;
+  std::string   m_Status;             ///< "started", "done" or "failed"
+  int32_t       m_FrameCount = 0;
+  std::string   m_OutputFolder;       ///< Contains PCX_0.pcx to PCX_<m_FrameCount - 1>.pcx, and SCENE.VUE
+};
+
+
+class ExtractionManifest
+{
+public:
+  bool Load(const std::filesystem::path& manifestPath)
+  {
+    m_ManifestPath = manifestPath;
+    m_Entries.clear();
+    std::ifstream is(manifestPath, std::ios::binary);
+    std::string line;
+    while (std::getline(is, line))
+    {
+      std::vector<std::string> fields;
+      size_t start = 0;
+      size_t tab;
+      while ((tab = line.find('\t', start)) != std::string::npos)
+      {
+        fields.push_back(line.substr(start, tab - start));
+        start = tab + 1;
+      }
+      fields.push_back(line.substr(start));
+      if (fields.size() != 9)
+      {
+        continue;
+      }
+
+      try
+      {
+        ManifestEntry entry;
+        entry.m_SourcePath     = fields[0];
+        entry.m_Size           = std::stoull(fields[1]);
+        entry.m_WriteTime      = std::stoll(fields[2]);
+        entry.m_ContentHash    = std::stoull(fields[3], nullptr, 16);
+        entry.m_DecoderVersion = std::stoul(fields[4]);
+        entry.m_OutputFormat   = fields[5];
+        entry.m_Status         = fields[6];
+        entry.m_FrameCount     = std::stoi(fields[7]);
+        entry.m_OutputFolder   = fields[8];
+        m_Entries[entry.m_SourcePath] = entry;
+      }
+      catch (const std::exception&)
+      {
+        // Damaged line: the clip will just be extracted again
+      }
+    }
+    return true;
+  }
+
+  bool Save() const
+  {
+    std::filesystem::path temporaryPath = m_ManifestPath;
+    temporaryPath += ".tmp";
+    {
+      TextWriter writer(temporaryPath);
+      char hash[17];
+      for (const auto& [sourcePath, entry] : m_Entries)
+      {
+        *std::to_chars(hash, hash + 16, entry.m_ContentHash, 16).ptr = 0;
+        writer << entry.m_SourcePath << "\t" << entry.m_Size << "\t" << entry.m_WriteTime << "\t" << hash << "\t" << entry.m_DecoderVersion << "\t"
+               << entry.m_OutputFormat << "\t" << entry.m_Status << "\t" << entry.m_FrameCount << "\t" << entry.m_OutputFolder << "\n";
+      }
+      writer.Flush();
+      if (!writer.IsValid())
+      {
+        return false;
+      }
+    }
+    std::error_code errorCode;
+    std::filesystem::rename(temporaryPath, m_ManifestPath, errorCode);
+    return !errorCode;
+  }
+
+  const ManifestEntry* Find(const std::string& sourcePath) const
+  {
+    auto entry = m_Entries.find(sourcePath);
+    return (entry == m_Entries.end()) ? nullptr : &entry->second;
+  }
+
+  void Set(const ManifestEntry& entry)
+  {
+    m_Entries[entry.m_SourcePath] = entry;
+  }
+
+  void Erase(const std::string& sourcePath)
+  {
+    m_Entries.erase(sourcePath);
+  }
+
+  const std::map<std::string, ManifestEntry>& GetEntries() const  { return m_Entries; }
+
+private:
+  std::filesystem::path                 m_ManifestPath;
+  std::map<std::string, ManifestEntry>  m_Entries;
+};
+
+
+// Only used to know if a file changed, 8 bytes at a time
+uint64_t ComputeContentHash(std::span<const std::byte> content)
+{
+  uint64_t hash = content.size();
+  size_t offset = 0;
+  for (; offset + 8 <= content.size(); offset += 8)
+  {
+    uint64_t value;
+    memcpy(&value, content.data() + offset, 8);
+    hash = (hash ^ value) * 0x9E3779B97F4A7C15ull;
+    hash ^= hash >> 29;
+  }
+  for (; offset < content.size(); offset++)
+  {
+    hash = (hash ^ (uint8_t)content[offset]) * 0x9E3779B97F4A7C15ull;
+  }
+  return hash;
+}
+
+
+// Removes what a previous extraction of the clip wrote
+void RemoveClipOutputs(const ManifestEntry& entry)
+{
+  std::error_code errorCode;
+  for (int32_t frame = 0; frame < entry.m_FrameCount; frame++)
+  {
+    std::filesystem::remove(entry.m_OutputFolder + "PCX_" + std::to_string(frame) + ".pcx", errorCode);
+  }
+  std::filesystem::remove(entry.m_OutputFolder + "SCENE.VUE", errorCode);
+  std::filesystem::remove(entry.m_OutputFolder + "SOUND.WAV", errorCode);
+  std::filesystem::remove(entry.m_OutputFolder + g_CheckpointName, errorCode);
+}
+
+
+// Set by "--scale": the batch extraction writes upscaled frames
+ScaleFilter g_ScaleFilter = ScaleFilter::e_Nearest;
+uint32_t    g_ScaleFactor = 1;
+
+
+// What a shard did, one "name<tab>value" line per field; "merge" adds them up
+class ShardStats
+{
+public:
+  bool Load(const std::filesystem::path& statsPath)
+  {
+    std::ifstream is(statsPath, std::ios::binary);
+    std::string line;
+    uint32_t fieldCount = 0;
+    while (std::getline(is, line))
+    {
+      size_t tab = line.find('\t');
+      if (tab == std::string::npos)
+      {
+        continue;
+      }
+      std::string name = line.substr(0, tab);
+      const char* value = line.c_str() + tab + 1;
+      if (name == "balance")          { m_Balance = value; fieldCount++; }
+      else if (name == "clips")       { m_ClipCount = std::strtoul(value, nullptr, 10); fieldCount++; }
+      else if (name == "weight")      { m_Weight = std::strtoull(value, nullptr, 10); fieldCount++; }
+      else if (name == "extracted")   { m_ExtractedCount = std::strtoul(value, nullptr, 10); fieldCount++; }
+      else if (name == "unchanged")   { m_SkippedCount = std::strtoul(value, nullptr, 10); fieldCount++; }
+      else if (name == "failed")      { m_FailedCount = std::strtoul(value, nullptr, 10); fieldCount++; }
+      else if (name == "frames")      { m_FrameCount = std::strtoull(value, nullptr, 10); fieldCount++; }
+      else if (name == "bytes")       { m_ByteCount = std::strtoull(value, nullptr, 10); fieldCount++; }
+      else if (name == "seconds")     { m_Seconds = std::strtod(value, nullptr); fieldCount++; }
+    }
+    return fieldCount == 9;
+  }
+
+  bool Save(const std::filesystem::path& statsPath) const
+  {
+    TextWriter writer(statsPath);
+    writer << "balance\t" << m_Balance << "\n";
+    writer << "clips\t" << m_ClipCount << "\n";
+    writer << "weight\t" << m_Weight << "\n";
+    writer << "extracted\t" << m_ExtractedCount << "\n";
+    writer << "unchanged\t" << m_SkippedCount << "\n";
+    writer << "failed\t" << m_FailedCount << "\n";
+    writer << "frames\t" << m_FrameCount << "\n";
+    writer << "bytes\t" << m_ByteCount << "\n";
+    writer << "seconds\t" << TextWriter::Fixed{ m_Seconds, 3 } << "\n";
+    writer.Flush();
+    return writer.IsValid();
+  }
+
+  // The shards run at the same time, so the time of the merged stats is the one of the slowest shard
+  void Add(const ShardStats& stats)
+  {
+    m_Balance         = stats.m_Balance;
+    m_ClipCount      += stats.m_ClipCount;
+    m_Weight         += stats.m_Weight;
+    m_ExtractedCount += stats.m_ExtractedCount;
+    m_SkippedCount   += stats.m_SkippedCount;
+    m_FailedCount    += stats.m_FailedCount;
+    m_FrameCount     += stats.m_FrameCount;
+    m_ByteCount      += stats.m_ByteCount;
+    m_Seconds         = std::max(m_Seconds, stats.m_Seconds);
+  }
+
+public:
+  std::string   m_Balance = g_ShardBalanceNames[0];
+  uint32_t      m_ClipCount = 0;
+  uint64_t      m_Weight = 0;             ///< Total weight of the clips of the shard, in bytes or frames
+  uint32_t      m_ExtractedCount = 0;
+  uint32_t      m_SkippedCount = 0;
+  uint32_t      m_FailedCount = 0;
+  uint64_t      m_FrameCount = 0;         ///< Frames of the extracted and unchanged clips
+  uint64_t      m_ByteCount = 0;          ///< Size of the clips of the shard
+  double        m_Seconds = 0;
+};
+
+
+// Extracts the clips of the source folder or disc image which are not already extracted, each one in its own output folder
+bool ExtractFolder(const std::filesystem::path& sourceFolder, const std::filesystem::path& outputFolder)
+{
+  auto startTime = std::chrono::steady_clock::now();
+  IsoImage isoImage;
+  std::vector<ClipSource> clips;
+  if (!FindClips(sourceFolder, isoImage, clips))
+  {
+    return false;
+  }
+
+  ShardStats shardStats;
+  bool isSharded = (g_ShardCount > 1);
+  if (isSharded)
+  {
+    std::vector<uint64_t> weights;
+    for (const ClipSource& clip : clips)
+    {
+      weights.push_back(GetClipWeight(clip, g_ShardBalance));
+    }
+    std::vector<uint32_t> shards = AssignShards(clips, weights, g_ShardCount);
+    std::vector<ClipSource> shardClips;
+    for (uint32_t clip = 0; clip < clips.size(); clip++)
+    {
+      if (shards[clip] == g_ShardIndex)
+      {
+        shardClips.push_back(clips[clip]);
+        shardStats.m_Weight += weights[clip];
+      }
+    }
+    std::cout << "Shard " << g_ShardIndex + 1 << "/" << g_ShardCount << ": " << shardClips.size() << " of " << clips.size() << " clips, "
+              << g_ShardBalanceNames[(int32_t)g_ShardBalance] << " " << shardStats.m_Weight << std::endl;
+    clips.swap(shardClips);
+    shardStats.m_Balance = g_ShardBalanceNames[(int32_t)g_ShardBalance];
+    shardStats.m_ClipCount = (uint32_t)clips.size();
+  }
+
+  std::error_code errorCode;
+  std::filesystem::create_directories(outputFolder, errorCode);
+  ExtractionManifest manifest;
+  manifest.Load(outputFolder / (isSharded ? GetShardFileName("manifest", g_ShardIndex, g_ShardCount) : "manifest.txt"));
+
+  // The clips extracted by the previous runs, once merged, do not have to be extracted again by the shard they now belong to
+  ExtractionManifest mergedManifest;
+  if (isSharded)
+  {
+    mergedManifest.Load(outputFolder / "manifest.txt");
+
+    // The clips which moved to another shard (when clips are added or removed) are now in the manifest of that shard
+    std::vector<std::string> movedClips;
+    for (const auto& [sourcePath, entry] : manifest.GetEntries())
+    {
+      if (std::none_of(clips.begin(), clips.end(), [&](const ClipSource& clip) { return clip.m_Path.string() == sourcePath; }))
+      {
+        movedClips.push_back(sourcePath);
+      }
+    }
+    for (const std::string& sourcePath : movedClips)
+    {
+      manifest.Erase(sourcePath);
+    }
+  }
+
+  // A clip is still marked as started if the previous run was interrupted while extracting it: it restarts from
+  // its checkpoint if it has one, otherwise what was already written is removed
+  for (const auto& [sourcePath, entry] : manifest.GetEntries())
+  {
+    if ((entry.m_Status == "started") && !std::filesystem::exists(entry.m_OutputFolder + g_CheckpointName, errorCode))
+    {
+      std::cout << sourcePath << " : removing the outputs of an interrupted extraction" << std::endl;
+      RemoveClipOutputs(entry);
+    }
+  }
+
+  uint32_t extractedCount = 0;
+  uint32_t skippedCount = 0;
+  uint32_t failedCount = 0;
+  ACFDecoder acfDecoder;          // One for the batch, so the clips reuse its buffers
+  for (const ClipSource& clip : clips)
+  {
+    const std::filesystem::path& path(clip.m_Path);
+
+    ManifestEntry entry;
+    entry.m_SourcePath     = path.string();
+    entry.m_Size           = clip.m_Size;
+    entry.m_WriteTime      = clip.m_WriteTime;
+    entry.m_DecoderVersion = g_DecoderVersion;
+    entry.m_OutputFormat   = (g_ScaleFactor > 1) ? std::string((g_ScaleFilter == ScaleFilter::e_Nearest) ? "pcx-nearest" : "pcx-pixelart") + std::to_string(g_ScaleFactor) : "pcx";
+    entry.m_OutputFolder   = (outputFolder / path.stem()).string() + (char)std::filesystem::path::preferred_separator;
+
+    // Nothing is read when the size and date did not change
+    const ManifestEntry* previousEntry = manifest.Find(entry.m_SourcePath);
+    const ManifestEntry* mergedEntry = mergedManifest.Find(entry.m_SourcePath);
+    if (!previousEntry && mergedEntry && (mergedEntry->m_Status == "done"))
+    {
+      previousEntry = mergedEntry;
+    }
+    bool isSameExtraction = previousEntry && (previousEntry->m_Status == "done") && (previousEntry->m_DecoderVersion == entry.m_DecoderVersion) &&
+                            (previousEntry->m_OutputFormat == entry.m_OutputFormat) && (previousEntry->m_OutputFolder == entry.m_OutputFolder);
+    if (isSameExtraction && (previousEntry->m_Size == entry.m_Size) && (previousEntry->m_WriteTime == entry.m_WriteTime))
+    {
+      if (previousEntry == mergedEntry)
+      {
+        manifest.Set(*mergedEntry);
+        manifest.Save();
+      }
+      shardStats.m_FrameCount += previousEntry->m_FrameCount;
+      skippedCount++;
+      continue;
+    }
+
+    std::vector<std::byte> fileContent;
+    std::span<const std::byte> content;
+    if (!clip.GetContent(fileContent, content))
+    {
+      failedCount++;
+      continue;
+    }
+    entry.m_ContentHash = ComputeContentHash(content);
+
+    // Touched but same content: only the date changes in the manifest
+    if (isSameExtraction && (previousEntry->m_ContentHash == entry.m_ContentHash))
+    {
+      entry.m_Status     = "done";
+      entry.m_FrameCount = previousEntry->m_FrameCount;
+      manifest.Set(entry);
+      manifest.Save();
+      shardStats.m_FrameCount += entry.m_FrameCount;
+      skippedCount++;
+      continue;
+    }
+
+    // Interrupted extraction of the same content: the outputs written before the checkpoint are kept
+    bool isResumed = previousEntry && (previousEntry->m_Status == "started") && (previousEntry->m_DecoderVersion == entry.m_DecoderVersion) &&
+                     (previousEntry->m_OutputFormat == entry.m_OutputFormat) && (previousEntry->m_OutputFolder == entry.m_OutputFolder) &&
+                     (previousEntry->m_ContentHash == entry.m_ContentHash);
+    if (previousEntry && !isResumed)
+    {
+      RemoveClipOutputs(*previousEntry);
+    }
+    else if (!isResumed)
+    {
+      ACFDecoder::RemoveCheckpoint(entry.m_OutputFolder + g_CheckpointName);
+    }
+    std::filesystem::create_directories(entry.m_OutputFolder, errorCode);
+
+    // The frame count is not known yet, the directory gives the most frames the extraction can write
+    ChunkDirectory chunkDirectory;
+    chunkDirectory.Build(content);
+    entry.m_Status     = "started";
+    entry.m_FrameCount = chunkDirectory.GetFrameCount();
+    manifest.Set(entry);
+    manifest.Save();
+
+    bool isDecoded;
+    {
+      PcxSink pcxSink(entry.m_OutputFolder);
+      ScalerSink scalerSink(pcxSink, g_ScaleFilter, g_ScaleFactor);
+      CameraSink cameraSink(entry.m_OutputFolder + "SCENE.VUE");
+      WavSink wavSink(entry.m_OutputFolder + "SOUND.WAV");
+      FrameSink* frameSink = (g_ScaleFactor > 1) ? (FrameSink*)&scalerSink : &pcxSink;
+      acfDecoder.AddFrameSink(frameSink);
+      acfDecoder.AddFrameSink(&cameraSink);
+      acfDecoder.AddFrameSink(&wavSink);
+      isDecoded = acfDecoder.ParseACF(content, entry.m_OutputFolder + g_CheckpointName);
+      acfDecoder.RemoveFrameSink(frameSink);
+      acfDecoder.RemoveFrameSink(&cameraSink);
+      acfDecoder.RemoveFrameSink(&wavSink);
+    }
+    if (!isDecoded)
+    {
+      // The sinks are closed, so the files written before the error can be removed
+      std::cout << path << " : could not be decoded" << std::endl;
+      RemoveClipOutputs(entry);
+      entry.m_Status = "failed";
+      manifest.Set(entry);
+      manifest.Save();
+      failedCount++;
+      continue;
+    }
+
+    entry.m_Status = "done";
+    manifest.Set(entry);
+    manifest.Save();
+    shardStats.m_FrameCount += entry.m_FrameCount;
+    extractedCount++;
+  }
+
+  std::cout << extractedCount << " clips extracted, " << skippedCount << " unchanged, " << failedCount << " failed" << std::endl;
+  if (isSharded)
+  {
+    for (const ClipSource& clip : clips)
+    {
+      shardStats.m_ByteCount += clip.m_Size;
+    }
+    shardStats.m_ExtractedCount = extractedCount;
+    shardStats.m_SkippedCount   = skippedCount;
+    shardStats.m_FailedCount    = failedCount;
+    shardStats.m_Seconds        = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    if (!shardStats.Save(outputFolder / GetShardFileName("stats", g_ShardIndex, g_ShardCount)))
+    {
+      std::cout << "Could not write the stats of the shard" << std::endl;
+      return false;
+    }
+  }
+  return failedCount == 0;
+}
+
+
+// Combines the manifests and the stats of the shards of a sharded extraction, which all have to be finished
+bool MergeShards(const std::filesystem::path& sourceFolder, const std::filesystem::path& outputFolder, uint32_t shardCount)
+{
+  IsoImage isoImage;
+  std::vector<ClipSource> clips;
+  if (!FindClips(sourceFolder, isoImage, clips))
+  {
+    return false;
+  }
+
+  // The previous merge is kept for the clips no shard has in its manifest
+  ExtractionManifest mergedManifest;
+  mergedManifest.Load(outputFolder / "manifest.txt");
+  ShardStats mergedStats;
+  std::map<std::string, std::vector<uint32_t>> clipShards;      // Shards which extracted each clip
+  uint32_t unfinishedCount = 0;
+  std::error_code errorCode;
+  for (uint32_t shard = 0; shard < shardCount; shard++)
+  {
+    std::filesystem::path manifestPath = outputFolder / GetShardFileName("manifest", shard, shardCount);
+    ShardStats shardStats;
+    if (!std::filesystem::exists(manifestPath, errorCode) || !shardStats.Load(outputFolder / GetShardFileName("stats", shard, shardCount)))
+    {
+      std::cout << "Shard " << shard + 1 << "/" << shardCount << ": not finished, no manifest or no stats" << std::endl;
+      unfinishedCount++;
+      continue;
+    }
+    std::cout << "Shard " << shard + 1 << "/" << shardCount << ": " << shardStats.m_ClipCount << " clips, " << shardStats.m_Balance << " " << shardStats.m_Weight << ", "
+              << shardStats.m_ExtractedCount << " extracted, " << shardStats.m_SkippedCount << " unchanged, " << shardStats.m_FailedCount << " failed, "
+              << shardStats.m_FrameCount << " frames in " << shardStats.m_Seconds << "s" << std::endl;
+    mergedStats.Add(shardStats);
+
+    ExtractionManifest shardManifest;
+    shardManifest.Load(manifestPath);
+    for (const auto& [sourcePath, entry] : shardManifest.GetEntries())
+    {
+      const ManifestEntry* mergedEntry = mergedManifest.Find(sourcePath);
+      if (entry.m_Status == "done")
+      {
+        clipShards[sourcePath].push_back(shard);
+      }
+      if ((entry.m_Status == "done") || !mergedEntry || (mergedEntry->m_Status != "done"))
+      {
+        mergedManifest.Set(entry);
+      }
+    }
+  }
+
+  if (unfinishedCount)
+  {
+    std::cout << "Nothing merged, " << unfinishedCount << " shards are not finished" << std::endl;
+    return false;
+  }
+
+  uint32_t missingCount = 0;
+  uint32_t duplicatedCount = 0;
+  for (const ClipSource& clip : clips)
+  {
+    auto shards = clipShards.find(clip.m_Path.string());
+    if (shards == clipShards.end())
+    {
+      const ManifestEntry* mergedEntry = mergedManifest.Find(clip.m_Path.string());
+      std::cout << clip.m_Path << (((mergedEntry != nullptr) && (mergedEntry->m_Status == "failed")) ? " : failed, could not be decoded" : " : missing, not extracted by any shard") << std::endl;
+      missingCount++;
+    }
+    else if (shards->second.size() > 1)
+    {
+      std::cout << clip.m_Path << " : extracted by the shards";
+      for (uint32_t shard : shards->second)
+      {
+        std::cout << " " << shard + 1;
+      }
+      std::cout << std::endl;
+      duplicatedCount++;
+    }
+  }
+
+  if (!mergedManifest.Save() || !mergedStats.Save(outputFolder / "stats.txt"))
+  {
+    std::cout << "Could not write the merged manifest and stats" << std::endl;
+    return false;
+  }
+  std::cout << clips.size() << " clips, " << missingCount << " missing, " << duplicatedCount << " duplicated, " << mergedStats.m_FrameCount << " frames in "
+            << mergedStats.m_Seconds << "s (slowest shard)" << std::endl;
+  return !missingCount && !duplicatedCount;
+}
+
+
+
+// Audio only: the chunks are walked without decoding any frame
+bool ExtractAudio(const std::filesystem::path& sourcePath, const std::filesystem::path& wavPath)
+{
+  std::vector<std::byte> fileContent;
+  if (!ACFDecoder::LoadClip(sourcePath, fileContent))
+  {
+    return false;
+  }
+  WavSink wavSink(wavPath);
+  ACFDecoder acfDecoder;
+  acfDecoder.AddFrameSink(&wavSink);
+  acfDecoder.ScanACF(fileContent);
+  if (!wavSink.GetDataSize())
+  {
+    std::cout << sourcePath << " : no sound found" << std::endl;
+    return false;
+  }
+  std::cout << wavSink.GetDataSize() << " bytes of samples written to " << wavPath << std::endl;
+  return true;
+}
+
+
+//
+// Motion export, for the analysis tools (scene cuts, static shots, camera moves): the opcode and the average motion
+// vector of each tile of each frame, found without decoding any pixel (see ACFDecoder::ScanMotion).
+// The .motion file is little endian, a header followed by one record per frame, each record storing its values
+// column by column:
+//   header:  "ACFMOTN1", uint16 tile columns, uint16 tile rows, uint32 frame count
+//   frame:   int32 frame number, uint8 1 for a keyframe, uint8 0, uint16 changed tiles (all but the plain zero motion
+//            ones), uint16 moving tiles (copied from another place of the previous frame), then the opcode of each
+//            tile (uint8), the horizontal motion of each tile (int16) and the vertical motion of each tile (int16)
+//
+class MotionWriter
+{
+public:
+  MotionWriter(const std::filesystem::path& motionPath)
+    : m_File(motionPath, std::ios::binary)
+  {
+    WriteHeader(0, 0);
+  }
+
+  bool IsValid() const
+  {
+    return m_File.good();
+  }
+
+  void AddFrame(const MotionView& motion)
+  {
+    uint32_t tileCount = motion.m_TileColumns * motion.m_TileRows;
+    if (!m_FrameCount)
+    {
+      m_File.seekp(0);
+      WriteHeader(motion.m_TileColumns, motion.m_TileRows);
+    }
+
+    m_Record.resize(10 + tileCount * 5);
+    uint8_t* opcodes = m_Record.data() + 10;
+    int16_t* motionX = (int16_t*)(opcodes + tileCount);
+    int16_t* motionY = motionX + tileCount;
+    uint16_t changedTileCount = 0;
+    uint16_t movingTileCount = 0;
+    for (uint32_t tile = 0; tile < tileCount; tile++)
+    {
+      const TileReference& reference = motion.m_Tiles[tile];
+      int32_t tileX, tileY;
+      reference.GetMotion((tile % motion.m_TileColumns) * 8 + (tile / motion.m_TileColumns) * 64 * motion.m_TileColumns, motion.m_TileColumns * 8, tileX, tileY);
+      opcodes[tile] = reference.m_Opcode;
+      motionX[tile] = (int16_t)tileX;
+      motionY[tile] = (int16_t)tileY;
+      changedTileCount += (reference.m_Opcode != 1) ? 1 : 0;
+      movingTileCount += (motionX[tile] || motionY[tile]) ? 1 : 0;
+    }
+    memcpy(m_Record.data(), &motion.m_FrameNumber, 4);
+    m_Record[4] = motion.m_IsKeyFrame ? 1 : 0;
+    m_Record[5] = 0;
+    memcpy(m_Record.data() + 6, &changedTileCount, 2);
+    memcpy(m_Record.data() + 8, &movingTileCount, 2);
+    m_File.write((const char*)m_Record.data(), m_Record.size());
+
+    m_FrameCount++;
+    m_TileCount += tileCount;
+    m_ChangedTileCount += changedTileCount;
+  }
+
+  // Patches the frame count
+  bool Finish()
+  {
+    m_File.seekp(12);
+    m_File.write((const char*)&m_FrameCount, 4);
+    m_File.close();
+    return !m_File.fail();
+  }
+
+  uint32_t GetFrameCount() const        { return m_FrameCount; }
+  uint64_t GetTileCount() const         { return m_TileCount; }
+  uint64_t GetChangedTileCount() const  { return m_ChangedTileCount; }
+
+private:
+  void WriteHeader(uint16_t tileColumns, uint16_t tileRows)
+  {
+    m_File.write("ACFMOTN1", 8);
+    m_File.write((const char*)&tileColumns, 2);
+    m_File.write((const char*)&tileRows, 2);
+    m_File.write((const char*)&m_FrameCount, 4);
+  }
+
+private:
+  std::ofstream           m_File;
+  std::vector<uint8_t>    m_Record;
+  uint32_t                m_FrameCount = 0;
+  uint64_t                m_TileCount = 0;
+  uint64_t                m_ChangedTileCount = 0;
+};
+
+
+bool ExportMotion(const ClipSource& clip, MotionWriter& motionWriter)
+{
+  std::vector<std::byte> fileContent;
+  std::span<const std::byte> acfFile;
+  if (!clip.GetContent(fileContent, acfFile) || !motionWriter.IsValid())
+  {
+    return false;
+  }
+  ACFDecoder acfDecoder;
+  for (const MotionView& motion : acfDecoder.ScanMotion(acfFile))
+  {
+    motionWriter.AddFrame(motion);
+  }
+  return motionWriter.Finish() && motionWriter.GetFrameCount();
+}
+
+
+// All the clips of a folder or of a disc image, one .motion file per clip, the clips are shared between threads
+bool ExportMotionFolder(const std::filesystem::path& source, const std::filesystem::path& outputFolder)
+{
+  IsoImage isoImage;
+  std::vector<ClipSource> clips;
+  if (!FindClips(source, isoImage, clips))
+  {
+    return false;
+  }
+  std::error_code errorCode;
+  std::filesystem::create_directories(outputFolder, errorCode);
+
+  auto startTime = std::chrono::steady_clock::now();
+  std::atomic<size_t> nextClip = 0;
+  std::atomic<uint32_t> failureCount = 0;
+  std::atomic<uint64_t> frameCount = 0;
+  std::atomic<uint64_t> tileCount = 0;
+  std::atomic<uint64_t> changedTileCount = 0;
+  auto worker = [&]()
+    {
+      size_t clip;
+      while ((clip = nextClip++) < clips.size())
+      {
+        std::filesystem::path motionPath = outputFolder / clips[clip].m_Path.stem();
+        motionPath += ".motion";
+        MotionWriter motionWriter(motionPath);
+        if (!ExportMotion(clips[clip], motionWriter))
+        {
+          failureCount++;
+        }
+        frameCount += motionWriter.GetFrameCount();
+        tileCount += motionWriter.GetTileCount();
+        changedTileCount += motionWriter.GetChangedTileCount();
+      }
+    };
+
+  std::vector<std::thread> threads;
+  uint32_t threadCount = std::min<uint32_t>(std::max(1u, std::thread::hardware_concurrency()), (uint32_t)clips.size());
+  for (uint32_t thread = 1; thread < threadCount; thread++)
+  {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : threads)
+  {
+    thread.join();
+  }
+
+  auto time = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+  std::cout << clips.size() << " clips, " << frameCount << " frames, " << 100.0 * changedTileCount / std::max<uint64_t>(tileCount, 1)
+            << "% changed tiles, " << failureCount << " failed, in " << time << "s" << std::endl;
+  return failureCount == 0;
+}
+
+
+// Decodes the file to the shared memory ring, for the live viewers
+bool ShareACF(const char* sourcePath, const std::string& sharedName, uint32_t slotCount, bool paced)
+{
+  SharedMemorySink sharedMemorySink(sharedName, slotCount, 640, 480, paced);
+  if (!sharedMemorySink.IsValid())
+  {
+    return false;
+  }
+  ACFDecoder acfDecoder;
+  acfDecoder.AddFrameSink(&sharedMemorySink);
+  return acfDecoder.DecodeFile(sourcePath);
+}
+
+
+// Minimal viewer: reads the frames published by "share" and tells how many were received and lost
+bool WatchSharedFrames(const std::string& sharedName)
+{
+  SharedFrameReader reader;
+  auto startTime = std::chrono::steady_clock::now();
+  while (!reader.Open(sharedName))
+  {
+    if (std::chrono::steady_clock::now() - startTime > std::chrono::seconds(10))
+    {
+      std::cout << sharedName << " : no shared frames found" << std::endl;
+      return false;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+
+  uint32_t frameCount = 0;
+  while (!reader.HasEnded())
+  {
+    FrameView frame;
+    if (!reader.AcquireFrame(frame))
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      continue;
+    }
+    uint32_t checksum = 0;
+    for (uint32_t pixel = 0; pixel < frame.m_Width * frame.m_Height; pixel++)
+    {
+      checksum = checksum * 31 + frame.m_Pixels[pixel];
+    }
+    int32_t frameNumber = frame.m_FrameNumber;
+    if (reader.ReleaseFrame())
+    {
+      std::cout << "Frame " << frameNumber << " checksum " << checksum << std::endl;
+      frameCount++;
+    }
+  }
+  std::cout << frameCount << " frames received, " << reader.GetSkippedCount() << " lost" << std::endl;
+  return true;
+}
+
+
+
+
+//
+// Paced playback, to check that the decoder keeps up with the play rate: each frame is decoded one frame period
+// before its presentation time, and given to the sink at that time. The slack is the time left between the end of
+// the decoding and the presentation time. A late frame is dropped, but still decoded as the next ones depend on it.
+// The frames with less than a quarter of a period of slack are at risk, and their opcodes are counted to tell
+// which kinds of tiles cost the most.
+//
+class PlaybackStats
+{
+public:
+  class FrameTime
+  {
+  public:
+    int32_t   m_FrameNumber;
+    double    m_DecodeTime;     ///< Milliseconds
+    bool      m_IsKeyFrame;
+  };
+
+  // Only the opcodes of the tiles which passed the validation are counted, the other ones may be past the chunk
+  void AddFrame(const ACFDecoder& acfDecoder, const FrameView& frame, double decodeTime, double slack, double period)
+  {
+    const ChunkEntry& entry = acfDecoder.m_ChunkDirectory.GetFrameEntry(frame.m_FrameNumber);
+    const FrameData* frameData = acfDecoder.m_ChunkDirectory.GetChunk(entry)->GetData<FrameData>();
+    bool isAtRisk = (slack < period / 4);
+    for (int32_t tile = 0; tile < acfDecoder.m_ValidTileCount; tile++)
+    {
+      uint32_t opcode = frameData->GetOpcode(tile);
+      m_OpcodeUsage[opcode]++;
+      m_RiskOpcodeUsage[opcode] += isAtRisk ? 1 : 0;
+    }
+
+    m_FrameTimes.push_back({ frame.m_FrameNumber, decodeTime, entry.m_Type == ChunkType::e_KeyFrame });
+    m_LateCount += (slack < 0) ? 1 : 0;
+    m_RiskCount += isAtRisk ? 1 : 0;
+    m_MinSlack = std::min(m_MinSlack, slack);
+    m_SlackSum += slack;
+  }
+
+  void AddPresentation(double jitter)
+  {
+    m_PresentedCount++;
+    m_JitterSum += jitter;
+    m_MaxJitter = std::max(m_MaxJitter, jitter);
+  }
+
+  void Report(TextWriter& writer, const std::string& clipName, double playRate)
+  {
+    size_t frameCount = m_FrameTimes.size();
+    writer << clipName << ": " << (uint64_t)frameCount << " frames at " << playRate << " fps, " << m_LateCount << " late, " << m_RiskCount << " at risk, slack min "
+           << TextWriter::Fixed{ m_MinSlack, 2 } << " ms average " << TextWriter::Fixed{ m_SlackSum / std::max<size_t>(frameCount, 1), 2 } << " ms, jitter average "
+           << TextWriter::Fixed{ m_JitterSum / std::max<uint32_t>(m_PresentedCount, 1), 3 } << " ms max " << TextWriter::Fixed{ m_MaxJitter, 3 } << " ms\n";
+
+    std::sort(m_FrameTimes.begin(), m_FrameTimes.end(), [](const FrameTime& a, const FrameTime& b) { return a.m_DecodeTime > b.m_DecodeTime; });
+    writer << "  slowest frames:";
+    for (size_t frame = 0; frame < std::min<size_t>(frameCount, 3); frame++)
+    {
+      writer << " " << m_FrameTimes[frame].m_FrameNumber << (m_FrameTimes[frame].m_IsKeyFrame ? " (KeyFrame " : " (DltFrame ") << TextWriter::Fixed{ m_FrameTimes[frame].m_DecodeTime, 3 } << " ms)";
+    }
+    writer << "\n";
+
+    if (m_RiskCount)
+    {
+      // Share of the tiles of the frames at risk, compared to the share in the whole clip
+      uint64_t riskTileCount = 0;
+      uint64_t tileCount = 0;
+      uint32_t opcodes[64];
+      for (uint32_t opcode = 0; opcode < 64; opcode++)
+      {
+        riskTileCount += m_RiskOpcodeUsage[opcode];
+        tileCount += m_OpcodeUsage[opcode];
+        opcodes[opcode] = opcode;
+      }
+      std::sort(opcodes, opcodes + 64, [this](uint32_t a, uint32_t b) { return m_RiskOpcodeUsage[a] > m_RiskOpcodeUsage[b]; });
+      writer << "  opcodes of the frames at risk (share of their tiles, share in the clip):";
+      for (uint32_t opcode = 0; (opcode < 5) && m_RiskOpcodeUsage[opcodes[opcode]]; opcode++)
+      {
+        writer << " " << opcodes[opcode] << " " << TextWriter::Fixed{ 100.0 * m_RiskOpcodeUsage[opcodes[opcode]] / riskTileCount, 1 } << "% "
+               << TextWriter::Fixed{ 100.0 * m_OpcodeUsage[opcodes[opcode]] / tileCount, 1 } << "%";
+      }
+      writer << "\n";
+    }
+  }
+
+  uint32_t GetLateCount() const { return m_LateCount; }
+
+private:
+  std::vector<FrameTime>  m_FrameTimes;
+  uint32_t                m_LateCount = 0;
+  uint32_t                m_RiskCount = 0;
+  uint32_t                m_PresentedCount = 0;
+  double                  m_MinSlack = 1e9;
+  double                  m_SlackSum = 0;
+  double                  m_JitterSum = 0;
+  double                  m_MaxJitter = 0;
+  uint64_t                m_OpcodeUsage[64] = { 0 };
+  uint64_t                m_RiskOpcodeUsage[64] = { 0 };
+};
+
+
+// speed multiplies the play rate of the clip, to see how much margin the decoder has
+bool PlayClip(const ClipSource& clip, double speed, FrameSink& frameSink, PlaybackStats& stats, TextWriter& writer)
+{
+  std::vector<std::byte> fileContent;
+  std::span<const std::byte> acfFile;
+  if (!clip.GetContent(fileContent, acfFile))
+  {
+    return false;
+  }
+
+  using Clock = std::chrono::steady_clock;
+  auto milliseconds = [](Clock::duration duration) { return std::chrono::duration<double, std::milli>(duration).count(); };
+
+  ACFDecoder acfDecoder;
+  double playRate = 0;
+  Clock::duration period{};
+  Clock::time_point firstDeadline;
+  Clock::time_point issueTime = Clock::now();
+  for (const FrameView& frame : acfDecoder.DecodeFrames(acfFile))
+  {
+    Clock::time_point decodedTime = Clock::now();
+    if (!period.count())
+    {
+      // The clock starts with the first frame, shown one period after its decoding started
+      playRate = (acfDecoder.m_Format->play_rate ? acfDecoder.m_Format->play_rate : 12) * speed;
+      period = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / playRate));
+      firstDeadline = issueTime + period;
+    }
+    Clock::time_point deadline = firstDeadline + frame.m_FrameNumber * period;
+
+    double slack = milliseconds(deadline - decodedTime);
+    stats.AddFrame(acfDecoder, frame, milliseconds(decodedTime - issueTime), slack, milliseconds(period));
+    if (slack >= 0)
+    {
+      std::this_thread::sleep_until(deadline);
+      stats.AddPresentation(milliseconds(Clock::now() - deadline));
+      frameSink.OnFrame(frame);
+    }
+    issueTime = Clock::now();       // The next frame is due one period after this one, so its decoding starts now
+  }
+
+  if (!period.count())
+  {
+    std::cout << clip.m_Path << " : no frame decoded" << std::endl;
+    return false;
+  }
+  stats.Report(writer, clip.m_Path.string(), playRate);
+  writer.Flush();
+  return true;
+}
+
+
+// Plays all the clips one after the other, optionally to the shared memory ring so "watch" or a viewer can show them
+bool PlayACF(const std::filesystem::path& source, double speed, const std::string& sharedName)
+{
+  IsoImage isoImage;
+  std::vector<ClipSource> clips;
+  if (!FindClips(source, isoImage, clips))
+  {
+    return false;
+  }
+
+  NullSink nullSink;
+  std::unique_ptr<SharedMemorySink> sharedMemorySink;
+  if (!sharedName.empty())
+  {
+    sharedMemorySink = std::make_unique<SharedMemorySink>(sharedName, 8, 640, 480, false);
+    if (!sharedMemorySink->IsValid())
+    {
+      return false;
+    }
+  }
+
+  // The clips follow each other in the same sink, the viewers are told about the end after the last one
+  FrameSink& frameSink = sharedMemorySink ? (FrameSink&)*sharedMemorySink : nullSink;
+  TextWriter writer(std::cout);
+  uint32_t lateClipCount = 0;
+  uint32_t failedCount = 0;
+  for (const ClipSource& clip : clips)
+  {
+    PlaybackStats stats;
+    if (!PlayClip(clip, speed, frameSink, stats, writer))
+    {
+      failedCount++;
+    }
+    lateClipCount += stats.GetLateCount() ? 1 : 0;
+  }
+  frameSink.OnEnd();
+  writer << (uint32_t)clips.size() << " clips played, " << lateClipCount << " with late frames, " << failedCount << " failed\n";
+  return !failedCount && !lateClipCount;
+}
+
+
+// Decoding speed alone: the file is decoded several times to a NullSink with each frame layout, or the encoder test
+// clip if no file is given
+bool BenchmarkDecoder(const char* sourcePath, int32_t repeatCount)
+{
+  std::vector<std::byte> acfFile;
+  if (sourcePath)
+  {
+    if (!ACFDecoder::LoadClip(sourcePath, acfFile))
+    {
+      return false;
+    }
+  }
+  else
+  {
+    std::vector<ImageBuffer> images;
+    std::vector<Palette> palettes;
+    acfFile = EncodeTestClip(30, images, palettes);
+  }
+
+  NullSink nullSink;
+  ACFDecoder acfDecoder;
+  acfDecoder.AddFrameSink(&nullSink);
+  for (FrameLayout frameLayout : { FrameLayout::e_Linear, FrameLayout::e_Tiled })
+  {
+    acfDecoder.SetFrameLayout(frameLayout);
+    auto startTime = std::chrono::steady_clock::now();
+    int32_t frameCount = 0;
+    for (int32_t repeat = 0; repeat < repeatCount; repeat++)
+    {
+      acfDecoder.ParseACF(acfFile);
+      frameCount += acfDecoder.m_FrameNumber;
+    }
+    auto decodeTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    std::cout << g_FrameLayoutNames[(int32_t)frameLayout] << " layout: " << frameCount << " frames decoded in " << decodeTime << "s (" << frameCount / decodeTime << " frames per second)" << std::endl;
+  }
+  return true;
+}
+
+
+// Region decoding speed, compared with the full decoding which also gives the pixels the region has to match
+bool BenchmarkRegion(const std::filesystem::path& sourcePath, const FrameRegion& region, int32_t firstFrame, int32_t frameCount)
+{
+  std::vector<std::byte> acfFile;
+  if (!ACFDecoder::LoadClip(sourcePath, acfFile))
+  {
+    return false;
+  }
+
+  std::vector<std::vector<uint8_t>> fullPixels;
+  ACFDecoder acfDecoder;
+  auto startTime = std::chrono::steady_clock::now();
+  for (const FrameView& frame : acfDecoder.DecodeFrames(acfFile, firstFrame, frameCount))
+  {
+    fullPixels.emplace_back(frame.m_Pixels, frame.m_Pixels + frame.m_Width * frame.m_Height);
+  }
+  auto fullTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+  startTime = std::chrono::steady_clock::now();
+  size_t regionFrameCount = 0;
+  uint32_t differentFrameCount = 0;
+  for (const FrameView& frame : acfDecoder.DecodeRegion(acfFile, region, firstFrame, frameCount))
+  {
+    for (int32_t y = std::max(region.m_Y, 0); (y < region.m_Y + region.m_Height) && (y < (int32_t)frame.m_Height) && (regionFrameCount < fullPixels.size()); y++)
+    {
+      int32_t x = std::max(region.m_X, 0);
+      int32_t width = std::min<int32_t>(region.m_X + region.m_Width, frame.m_Width) - x;
+      size_t offset = (size_t)y * frame.m_Width + x;
+      if ((width > 0) && memcmp(frame.m_Pixels + offset, fullPixels[regionFrameCount].data() + offset, width))
+      {
+        differentFrameCount++;
+        break;
+      }
+    }
+    regionFrameCount++;
+  }
+  auto regionTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+  std::cout << fullPixels.size() << " frames decoded in " << fullTime << "s, the region in " << regionTime << "s, " << differentFrameCount << " frames different" << std::endl;
+  return (regionFrameCount == fullPixels.size()) && !differentFrameCount;
+}
+
+
+
+
+static_assert(_HAS_CXX17 == 1           , "C++17 or higher required");
+
+int main(int argc, char* argv[])
+{
+  std::cout << "ACF Extractor 1.0" << std::endl;
+  //std::cout << _HAS_CXX17 << ":" << std::endl;
+
+
+  try
+  {
+    // ACF2PCX --cpu <scalar|sse4|avx2|avx512> <command...> uses a lower level than what the processor supports
+    if ((argc > 2) && (std::string(argv[1]) == "--cpu"))
+    {
+      auto level = std::find_if(std::begin(g_CpuLevelNames), std::end(g_CpuLevelNames), [&](const char* name) { return name == std::string(argv[2]); });
+      if ((level == std::end(g_CpuLevelNames)) || !SetCpuLevel((CpuLevel)(level - std::begin(g_CpuLevelNames))))
+      {
+        std::cout << "CPU level " << argv[2] << " is not supported, the best one here is " << g_CpuLevelNames[(int32_t)g_DetectedCpuLevel] << std::endl;
+        return 1;
+      }
+      argc -= 2;
+      argv += 2;
+    }
+    std::cout << "CPU kernels: " << g_CpuLevelNames[(int32_t)g_CpuLevel] << std::endl;
+
+    // ACF2PCX --scale <nearest|pixelart> <2|3|4> batch ... writes upscaled frames
+    if ((argc > 3) && (std::string(argv[1]) == "--scale"))
+    {
+      std::string filter = argv[2];
+      g_ScaleFilter = (filter == "pixelart") ? ScaleFilter::e_PixelArt : ScaleFilter::e_Nearest;
+      g_ScaleFactor = std::atoi(argv[3]);
+      if (((filter != "nearest") && (filter != "pixelart")) || (g_ScaleFactor < 2) || (g_ScaleFactor > 4))
+      {
+        std::cout << "Usage: ACF2PCX --scale <nearest|pixelart> <2|3|4> <command...>" << std::endl;
+        return 1;
+      }
+      argc -= 3;
+      argv += 3;
+    }
+
+    // ACF2PCX --shard <i>/<N> <size|frames> batch ... only extracts the part i of N of the clips
+    if ((argc > 3) && (std::string(argv[1]) == "--shard"))
+    {
+      const char* shard = argv[2];
+      const char* slash = strchr(shard, '/');
+      int32_t shardIndex = std::atoi(shard);
+      int32_t shardCount = slash ? std::atoi(slash + 1) : 0;
+      auto balance = std::find_if(std::begin(g_ShardBalanceNames), std::end(g_ShardBalanceNames), [&](const char* name) { return name == std::string(argv[3]); });
+      if ((shardIndex < 1) || (shardIndex > shardCount) || (balance == std::end(g_ShardBalanceNames)))
+      {
+        std::cout << "Usage: ACF2PCX --shard <shard, from 1 to the shard count>/<shard count> <size|frames> <command...>" << std::endl;
+        return 1;
+      }
+      g_ShardIndex   = shardIndex - 1;
+      g_ShardCount   = shardCount;
+      g_ShardBalance = (ShardBalance)(balance - std::begin(g_ShardBalanceNames));
+      argc -= 3;
+      argv += 3;
+    }
+
+    // ACF2PCX --log <off|summary|chunk|tile> <command...> changes how much the decoder reports
+    if ((argc > 2) && (std::string(argv[1]) == "--log"))
+    {
+      auto level = std::find_if(std::begin(g_LogLevelNames), std::end(g_LogLevelNames), [&](const char* name) { return name == std::string(argv[2]); });
+      if (level == std::end(g_LogLevelNames))
+      {
+        std::cout << "Usage: ACF2PCX --log <off|summary|chunk|tile> <command...>" << std::endl;
+        return 1;
+      }
+      g_LogLevel = (LogLevel)(level - std::begin(g_LogLevelNames));
+      if (g_LogLevel > g_LogMaxLevel)
+      {
+        std::cout << "The " << argv[2] << " messages are not compiled in, ACF_LOG_MAX_LEVEL is " << (int32_t)g_LogMaxLevel << std::endl;
+      }
+      argc -= 2;
+      argv += 2;
+    }
+
+    std::string command = (argc > 1) ? argv[1] : "";
+    if (command == "encode")
+    {
+      // ACF2PCX encode <folder with PCX_n.pcx files> <target.acf> [key rate] [play rate]
+      if (argc < 4)
+      {
+        std::cout << "Usage: ACF2PCX encode <source folder> <target file> [key rate] [play rate]" << std::endl;
+        return 1;
+      }
+      uint32_t keyRate  = (argc > 4) ? std::atoi(argv[4]) : 10;
+      uint32_t playRate = (argc > 5) ? std::atoi(argv[5]) : 12;
+      return EncodePcxFolder(argv[2], argv[3], keyRate, playRate) ? 0 : 1;
+    }
+    if (command == "test")
+    {
+      // Encoder round trip test
+      return TestEncoder() ? 0 : 1;
+    }
+    if (command == "scan")
+    {
+      // ACF2PCX scan <source file> [metadata file or -] [camera file]
+      if (argc < 3)
+      {
+        std::cout << "Usage: ACF2PCX scan <source file> [metadata file or - for the console] [camera file]" << std::endl;
+        return 1;
+      }
+      std::string metadataPath = (argc > 3) ? argv[3] : "-";
+      std::unique_ptr<TextWriter> metadataWriter = (metadataPath == "-") ? std::make_unique<TextWriter>(std::cout) : std::make_unique<TextWriter>(metadataPath);
+      ACFDecoder acfDecoder;
+      return acfDecoder.ScanFile(argv[2], *metadataWriter, (argc > 4) ? argv[4] : "") ? 0 : 1;
+    }
+    if (command == "thumbs")
+    {
+      // ACF2PCX thumbs <source file, folder or .iso image> <output folder> [scale] [columns]
+      uint32_t scale   = (argc > 4) ? std::atoi(argv[4]) : 4;
+      uint32_t columns = (argc > 5) ? std::atoi(argv[5]) : 8;
+      if ((argc < 4) || !std::has_single_bit(scale) || (scale > 8) || !columns)
+      {
+        std::cout << "Usage: ACF2PCX thumbs <source file, folder or .iso image> <output folder> [scale: 1, 2, 4 or 8] [columns]" << std::endl;
+        return 1;
+      }
+      return CreateContactSheets(argv[2], argv[3], std::countr_zero(scale), columns) ? 0 : 1;
+    }
+    if (command == "serve")
+    {
+      // ACF2PCX serve <socket path> [memory budget in MB] [worker count]
+      if (argc < 3)
+      {
+        std::cout << "Usage: ACF2PCX serve <socket path> [memory budget in MB] [worker count]" << std::endl;
+        return 1;
+      }
+      size_t memoryBudget  = (size_t)((argc > 3) ? std::atoi(argv[3]) : 256) * 1024 * 1024;
+      uint32_t workerCount = (argc > 4) ? std::atoi(argv[4]) : std::thread::hardware_concurrency();
+      FrameServer frameServer(memoryBudget, workerCount);
+      return frameServer.Run(argv[2]) ? 0 : 1;
+    }
+    if (command == "batch")
+    {
+      // ACF2PCX batch <source folder or .iso image> <output folder>
+      if (argc < 4)
+      {
+        std::cout << "Usage: ACF2PCX batch <source folder or .iso image> <output folder>" << std::endl;
+        return 1;
+      }
+      return ExtractFolder(argv[2], argv[3]) ? 0 : 1;
+    }
+    if (command == "merge")
+    {
+      // ACF2PCX merge <source folder or .iso image> <output folder> <shard count>
+      if ((argc < 5) || (std::atoi(argv[4]) < 1))
+      {
+        std::cout << "Usage: ACF2PCX merge <source folder or .iso image> <output folder> <shard count>" << std::endl;
+        return 1;
+      }
+      return MergeShards(argv[2], argv[3], std::atoi(argv[4])) ? 0 : 1;
+    }
+    if ((command == "verify") || (command == "--verify"))
+    {
+      // ACF2PCX verify <source file> <golden file>
+      if (argc < 4)
+      {
+        std::cout << "Usage: ACF2PCX verify <source file> <golden file, created if it does not exist>" << std::endl;
+        return 1;
+      }
+      return VerifyACF(argv[2], argv[3]) ? 0 : 1;
+    }
+    if (command == "audio")
+    {
+      // ACF2PCX audio <source file> <wav file>
+      if (argc < 4)
+      {
+        std::cout << "Usage: ACF2PCX audio <source file> <wav file>" << std::endl;
+        return 1;
+      }
+      return ExtractAudio(argv[2], argv[3]) ? 0 : 1;
+    }
+    if (command == "share")
+    {
+      // ACF2PCX share <source file> <shared memory name> [slot count] [paced]
+      if (argc < 4)
+      {
+        std::cout << "Usage: ACF2PCX share <source file> <shared memory name, like /acf> [slot count] [1 to play at the clip rate]" << std::endl;
+        return 1;
+      }
+      uint32_t slotCount = (argc > 4) ? std::max(1, std::atoi(argv[4])) : 8;
+      bool paced = (argc > 5) && std::atoi(argv[5]);
+      return ShareACF(argv[2], argv[3], slotCount, paced) ? 0 : 1;
+    }
+    if (command == "watch")
+    {
+      // ACF2PCX watch <shared memory name>
+      if (argc < 3)
+      {
+        std::cout << "Usage: ACF2PCX watch <shared memory name>" << std::endl;
+        return 1;
+      }
+      return WatchSharedFrames(argv[2]) ? 0 : 1;
+    }
+    if (command == "play")
+    {
+      // ACF2PCX play <source file, folder or .iso image> [speed] [shared memory name]
+      if (argc < 3)
+      {
+        std::cout << "Usage: ACF2PCX play <source file, folder or .iso image> [speed, 1 for the play rate] [shared memory name]" << std::endl;
+        return 1;
+      }
+      double speed = (argc > 3) ? std::atof(argv[3]) : 1.0;
+      return PlayACF(argv[2], (speed > 0) ? speed : 1.0, (argc > 4) ? argv[4] : "") ? 0 : 1;
+    }
+    if (command == "bench")
+    {
+      // ACF2PCX bench [source file] [repeat count]
+      return BenchmarkDecoder((argc > 2) ? argv[2] : nullptr, (argc > 3) ? std::atoi(argv[3]) : 10) ? 0 : 1;
+    }
+    if (command == "motion")
+    {
+      // ACF2PCX motion <source file, folder or .iso image> <output folder>
+      if (argc < 4)
+      {
+        std::cout << "Usage: ACF2PCX motion <source file, folder or .iso image> <output folder>" << std::endl;
+        return 1;
+      }
+      return ExportMotionFolder(argv[2], argv[3]) ? 0 : 1;
+    }
+    if (command == "repack")
+    {
+      // ACF2PCX repack <source file, folder or .iso image> <output folder> [compress]
+      if (argc < 4)
+      {
+        std::cout << "Usage: ACF2PCX repack <source file, folder or .iso image> <output folder> [1 to compress the frames]" << std::endl;
+        return 1;
+      }
+      return RepackFolder(argv[2], argv[3], (argc > 4) && std::atoi(argv[4])) ? 0 : 1;
+    }
+    if (command == "region")
+    {
+      // ACF2PCX region <source file> <x> <y> <width> <height> [first frame] [frame count]
+      if (argc < 7)
+      {
+        std::cout << "Usage: ACF2PCX region <source file> <x> <y> <width> <height> [first frame] [frame count]" << std::endl;
+        return 1;
+      }
+      FrameRegion region = { std::atoi(argv[3]), std::atoi(argv[4]), std::atoi(argv[5]), std::atoi(argv[6]) };
+      return BenchmarkRegion(argv[2], region, (argc > 7) ? std::atoi(argv[7]) : 0, (argc > 8) ? std::atoi(argv[8]) : INT32_MAX) ? 0 : 1;
+    }
+
 #if 0  // Batch mode
     //
     // Corrupted:
@@ -1321,13 +3939,14 @@ int main()
         }
 
         ACFDecoder acfDecoder;
-        acfDecoder.ExportACF(path, exportFolder);
+        acfDecoder.ExportACF(path, exportFolder, exportFolder + "SCENE.VUE");
       }
     }
 #else  // One one file decoder
     ACFDecoder acfDecoder;
     //acfDecoder.ExportACF("D:\\TimeCo\\FullGogGame\\ISO\\SCN-01-0.ACF", "C:\\Projects\\TimeCommando\\Exported\\ACF2PCX\\SCN-01-0\\");
-    acfDecoder.ExportACF("D:\\TimeCo\\FullGogGame\\ISO\\SCN-00-0.ACF", "C:\\Projects\\TimeCommando\\Exported\\ACF2PCX\\SCN-00-0\\");
+    // D:\\PROJET\\TIME\\SCENE\\STAGE00\\RUN0\\SCENE.VUE
+    acfDecoder.ExportACF("D:\\TimeCo\\FullGogGame\\ISO\\SCN-00-0.ACF", "C:\\Projects\\TimeCommando\\Exported\\ACF2PCX\\SCN-00-0\\", "D:\\TimeCo\\Mount_D\\Projet\\Time\\Scene\\STAGE00\\RUN0\\SCENE.VUE");
 #endif
   }
 
@@ -0,0 +1,3658 @@
+﻿//
+// ACF Decoder
+//
+// Everything needed to decode ACF files: the chunk and frame structures, and the ACFDecoder itself.
+// This header has no dependency on the ACF2PCX program and can be included by other tools: the decoded frames
+// are given to FrameSink objects registered on the decoder, ACF2PCX is just using a sink writing PCX files.
+//
+// See ACF2PCX.cpp for the history and the details about the format.
+//
+
+#pragma once
+
+#include <cassert>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cmath>
+#include <filesystem> 
+#include <iostream>
+#include <format>
+#include <algorithm>
+#include <bit>
+#include <coroutine>
+#include <exception>
+#include <iterator>
+#include <utility>
+#include <memory>
+#include <charconv>
+#include <string_view>
+#include <span>
+#include <type_traits>
+#include <thread>
+#include <atomic>
+
+#include "Logger.h"
+#include "BlockCodec.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define ACF_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// The SIMD versions of the kernels are compiled with the instruction set they need, whatever the compiler settings
+#if defined(ACF_X86) && defined(__GNUC__)
+#define ACF_TARGET(features) __attribute__((target(features)))
+#else
+#define ACF_TARGET(features)
+#endif
+
+
+// To increase each time a change in the decoder changes the decoded pictures, so the extracted files get updated
+inline constexpr uint32_t g_DecoderVersion = 1;
+
+inline constexpr int32_t  g_CheckpointInterval = 16;          ///< Frames between two saves of the decoding checkpoint
+inline constexpr const char* g_CheckpointName  = "checkpoint.txt";
+
+
+inline uint32_t g_DiagonalOffsets_1[64] =
+{ 0, 1, 320, 640, 321, 2, 3, 322, 641, 960, 1280, 961, 642, 323, 4, 5, 324, 643, 962, 1281, 1600, 1920, 1601, 1282, 963, 644, 325, 6, 7,
+  326, 645,  964, 1283, 1602, 1921, 2240, 2241, 1922, 1603, 1284, 965, 646, 327, 647, 966, 1285, 1604, 1923, 2242, 2243, 1924, 1605, 1286,
+  967, 1287, 1606, 1925, 2244, 2245, 1926, 1607, 1927, 2246, 2247 };
+
+inline uint32_t g_DiagonalOffsets_2[64] =
+{ 7, 6, 327, 647, 326, 5, 4, 325, 646, 967, 1287, 966, 645, 324, 3, 2, 323, 644, 965, 1286, 1607, 1927, 1606, 1285, 964, 643, 322, 1, 0,
+  321, 642, 963, 1284, 1605, 1926, 2247, 2246, 1925, 1604, 1283, 962, 641, 320, 640, 961, 1282, 1603, 1924, 2245, 2244, 1923, 1602, 1281,
+  960, 1280, 1601, 1922, 2243, 2242, 1921, 1600, 1920, 2241, 2240 };
+
+inline uint32_t g_SplitTileOffsets[4] = { 0, 4, 320*4, 320*4 + 4 };
+
+
+inline uint16_t ReadU16(const uint8_t*& ptr)                 { uint16_t value = (*(uint16_t*)(ptr)); ptr += 2; return value; }
+inline int16_t ReadS16(const uint8_t*& ptr)                  { int16_t value = (*(int16_t*)(ptr)); ptr += 2; return value; }
+
+inline uint32_t ReadU32(const uint8_t*& ptr, int skip = 4)   { uint32_t value = (*(uint32_t*)(ptr)); ptr += skip; return value; }
+
+inline int16_t ReadXYOffset(const uint8_t*& ptr, int stride) { int16_t value = (*(int8_t*)(ptr)) + (*(int8_t*)(ptr + 1)) * stride / 2; ptr += 2; return value; }
+
+
+//
+// Buffered text output, used for the metadata and the camera files: the numbers are formatted with std::to_chars
+// directly in the buffer, which is written to the stream each time it is full, so nothing grows with the file length.
+//
+class TextWriter
+{
+public:
+  // Number printed with a fixed count of decimals
+  class Fixed
+  {
+  public:
+    double    m_Value;
+    int32_t   m_Precision;
+  };
+
+public:
+  TextWriter(std::ostream& output)
+    : m_Output(&output)
+  {}
+
+  TextWriter(const std::filesystem::path& outputPath)
+    : m_File(outputPath, std::ios::binary)
+    , m_Output(&m_File)
+  {}
+
+  TextWriter(const TextWriter&) = delete;
+  TextWriter& operator=(const TextWriter&) = delete;
+
+  ~TextWriter()
+  {
+    Flush();
+  }
+
+  bool IsValid() const
+  {
+    return m_Output->good();
+  }
+
+  TextWriter& operator<<(std::string_view text)
+  {
+    while (text.size() > sizeof(m_Buffer) - m_Size)
+    {
+      size_t length = sizeof(m_Buffer) - m_Size;
+      memcpy(m_Buffer + m_Size, text.data(), length);
+      m_Size += length;
+      text.remove_prefix(length);
+      Flush();
+    }
+    memcpy(m_Buffer + m_Size, text.data(), text.size());
+    m_Size += text.size();
+    return *this;
+  }
+
+  // Integers, and doubles with the shortest representation which reads back the same value (like std::format "{}")
+  template<typename T>
+    requires std::is_arithmetic_v<T>
+  TextWriter& operator<<(T value)
+  {
+    Reserve(g_MaxNumberLength);
+    m_Size = std::to_chars(m_Buffer + m_Size, m_Buffer + sizeof(m_Buffer), value).ptr - m_Buffer;
+    return *this;
+  }
+
+  TextWriter& operator<<(Fixed value)
+  {
+    Reserve(g_MaxNumberLength);
+    m_Size = std::to_chars(m_Buffer + m_Size, m_Buffer + sizeof(m_Buffer), value.m_Value, std::chars_format::fixed, value.m_Precision).ptr - m_Buffer;
+    return *this;
+  }
+
+  void Flush()
+  {
+    m_Output->write(m_Buffer, m_Size);
+    m_Size = 0;
+  }
+
+private:
+  static constexpr size_t g_MaxNumberLength = 400;   // The longest fixed notation double, enough for anything else
+
+  void Reserve(size_t length)
+  {
+    if (m_Size + length > sizeof(m_Buffer))
+    {
+      Flush();
+    }
+  }
+
+private:
+  std::ofstream   m_File;
+  std::ostream*   m_Output;
+  size_t          m_Size = 0;
+  char            m_Buffer[64 * 1024];
+};
+
+
+//
+// Stream written again and again without allocating, for the files written for each frame: std::ofstream allocates
+// its buffer each time it opens a file unless it was given one, so this one is given m_Buffer once and keeps it.
+//
+class OutputFile
+{
+public:
+  OutputFile()
+  {
+    m_Stream.rdbuf()->pubsetbuf(m_Buffer, sizeof(m_Buffer));
+  }
+
+  OutputFile(const OutputFile&) = delete;
+  OutputFile& operator=(const OutputFile&) = delete;
+
+  // Two versions, so the C strings are not converted to paths
+  std::ofstream& Open(const char* path)
+  {
+    m_Stream.open(path, std::ios::binary);
+    return m_Stream;
+  }
+
+  std::ofstream& Open(const std::filesystem::path& path)
+  {
+    m_Stream.open(path, std::ios::binary);
+    return m_Stream;
+  }
+
+  // False if the file could not be created or written
+  bool Close()
+  {
+    m_Stream.close();
+    bool isValid = !m_Stream.fail();
+    m_Stream.clear();
+    return isValid;
+  }
+
+  bool Write(const char* path, const void* data, size_t size)
+  {
+    Open(path).write((const char*)data, size);
+    return Close();
+  }
+
+private:
+  std::ofstream   m_Stream;
+  char            m_Buffer[4096];
+};
+
+
+
+class Format
+{
+public:
+  uint32_t     struct_size;
+  uint32_t     width;
+  uint32_t     height;
+  uint32_t     frame_size;
+  uint32_t     key_size;
+  uint32_t     key_rate;
+  uint32_t     play_rate;
+  uint32_t     sampling_rate;
+  uint32_t     sample_type;
+  uint32_t     sample_flags;
+  uint32_t     compressor;         ///< 0==ACF / 1==XCF
+};
+
+
+enum class Compressor : uint32_t
+{
+  e_ACF = 0,
+  e_XCF = 1,
+};
+
+
+
+
+class FrameLen
+{
+public:
+  const uint8_t* GetFrameSizeArray() const { return &frame_size_in_sectors;  }
+
+public:
+  static constexpr uint32_t g_HeaderSize = 4;   ///< biggest_frame_size, a chunk can have no frame size after it
+
+  uint32_t     biggest_frame_size;
+  uint8_t      frame_size_in_sectors;  // Actual first entry, it's an array, but the size depends of the actual chunk size
+};
+
+
+
+class FrameData
+{
+public:
+  const uint8_t* GetOpcodesArray() const                    { return opcodes; }
+  const uint8_t* GetAlignedData(uint32_t height) const      { return ((uint8_t*)opcodes) + (height / 8) * 30; }
+  const uint8_t* GetUnalignedData() const                   { return ((uint8_t*)this) + color_offset; }
+
+  // The tiles are numbered line by line, and the opcodes of 4 tiles are packed in 3 bytes
+  uint32_t GetOpcode(uint32_t tile) const
+  {
+    const uint8_t* codes = opcodes + (tile / 4) * 3;
+    return ((codes[0] | (codes[1] << 8) | (codes[2] << 16)) >> ((tile % 4) * 6)) & 63;
+  }
+
+public:
+  uint32_t     color_offset;
+  uint8_t      opcodes[30];       // Actually (height/8)*30 bytes, opcodes are stored as 6 bits per 8x8 bloc in the picture
+};
+
+
+class PaletteEntry
+{
+public:
+  uint8_t   m_Red;
+  uint8_t   m_Green;
+  uint8_t   m_Blue;
+};
+
+
+
+
+class Palette
+{
+public:
+  const uint8_t* GetBuffer() const { return &m_PaletteEntries[0].m_Red; }
+
+public:
+  PaletteEntry  m_PaletteEntries[256];
+};
+
+
+class Camera
+{
+public:
+  // One record of the SCENE.VUE file
+  void WriteCamera(TextWriter& writer, int32_t frameId) const
+  {
+    double computedAngle = (1200.0 * 3.14159265359) / atan((320.0 / 2) / (focal - 0.5)) / 180.0;   // Almost OK but wobbly!
+    writer << "frame " << frameId << " \r\ncamera " << cam_x << " " << cam_y << " " << cam_z << " " << target_x << " " << target_y << " " << target_z << " " << gamma << " " << computedAngle << "\r\n";
+  }
+
+public:
+  int32_t     cam_x;
+  int32_t     cam_z;
+  int32_t     cam_y;
+  int32_t     target_x;
+  int32_t     target_z;
+  int32_t     target_y;
+  int32_t     gamma;       ///< Aka "roll" but apparently ignored in the game?
+  int32_t     focal;
+};
+
+
+enum class ChunkType
+{
+  e_Unknown = 0,  // We don't know that one
+  e_End,
+  e_FrameLen,     ///< Used to know the size of each frame
+  e_Format,
+  e_Palette,
+  e_NulChunk,     ///< Used to pad data on aligned sectors to improve the loading performance 
+  e_KeyFrame,
+  e_DltFrame,
+  e_Recouvre,
+  e_Camera,
+  e_SoundBuf,
+  e_SoundFrm,
+  e_SoundEnd,
+  e_SAL_STRT,
+  e_SAL_PART,
+  e_SAL_END,
+  e_SAL_COMP,
+  e_SeekIndx,     ///< Index of all the chunks, after the End chunk of the repacked files (ACF2PCX repack)
+  e_PackedFr,     ///< KeyFrame or DltFrame compressed with BlockCodec, in the repacked files
+};
+
+
+// The chunk names are 8 characters, so they can be compared as a single 64 bit value.
+// Multiplying by a well chosen constant and keeping the top 5 bits gives a different slot to each of the known names,
+// so getting the type of a chunk is one multiplication and one comparison.
+constexpr uint64_t MakeChunkTag(const char* name)
+{
+  uint64_t tag = 0;
+  for (int32_t i = 7; i >= 0; i--)
+  {
+    tag = (tag << 8) | (uint8_t)name[i];
+  }
+  return tag;
+}
+
+constexpr uint32_t GetChunkTagSlot(uint64_t tag)
+{
+  return (uint32_t)((tag * 0xBCA5F87B447C999Dull) >> 59);
+}
+
+// Indexed by ChunkType
+constexpr const char* g_ChunkNames[] = { "Unknown ", "End     ", "FrameLen", "Format  ", "Palette ", "NulChunk", "KeyFrame", "DltFrame", "Recouvre", "Camera  ",
+                               "SoundBuf", "SoundFrm", "SoundEnd", "SAL_STRT", "SAL_PART", "SAL_END ", "SAL_COMP",
+                               "SeekIndx", "PackedFr" };
+
+class ChunkTypeTable
+{
+public:
+  constexpr ChunkTypeTable()
+  {
+    for (int32_t type = 1; type <= (int32_t)ChunkType::e_PackedFr; type++)
+    {
+      uint64_t tag = MakeChunkTag(g_ChunkNames[type]);
+      m_Tags[GetChunkTagSlot(tag)] = tag;
+      m_Types[GetChunkTagSlot(tag)] = (ChunkType)type;
+    }
+  }
+
+  constexpr ChunkType GetChunkType(uint64_t tag) const
+  {
+    uint32_t slot = GetChunkTagSlot(tag);
+    return (m_Tags[slot] == tag) ? m_Types[slot] : ChunkType::e_Unknown;
+  }
+
+  constexpr bool IsPerfect() const
+  {
+    for (int32_t type = 1; type <= (int32_t)ChunkType::e_PackedFr; type++)
+    {
+      if (GetChunkType(MakeChunkTag(g_ChunkNames[type])) != (ChunkType)type)
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+
+public:
+  uint64_t    m_Tags[32] = { 0 };
+  ChunkType   m_Types[32] = { ChunkType::e_Unknown };
+};
+
+constexpr ChunkTypeTable g_ChunkTypeTable;
+static_assert(g_ChunkTypeTable.IsPerfect(), "Two chunk names are using the same slot, the multiplier in GetChunkTagSlot needs to be changed");
+
+
+class Chunk
+{
+public:
+  ChunkType GetChunkType() const
+  {
+    uint64_t tag;
+    memcpy(&tag, m_Name, 8);
+    return g_ChunkTypeTable.GetChunkType(tag);
+  }
+
+  std::string_view GetChunkName() const
+  {
+    return std::string_view(m_Name, 8);
+  }
+
+  uint32_t GetChunkSize() const
+  {
+    return m_Size;
+  }
+
+  const Chunk* GetNextChunk() const
+  {
+    assert(sizeof(Chunk) == 12);
+    return GetChunkAtOffset(sizeof(Chunk) + m_Size);
+  }
+
+  const Chunk* GetChunkAtOffset(size_t offset) const
+  {
+    const char* pointer((const char*)this);
+    pointer += offset;
+    return (const Chunk*)pointer;
+  }
+
+  template<typename T>
+  const T* GetData() const
+  {
+    const char* pointer((const char*)(this + 1));
+    return (const T*)pointer;
+  }
+
+private:
+  char	    m_Name[8];
+  uint32_t  m_Size;
+};
+
+
+
+class ChunkEntry
+{
+public:
+  ChunkType   m_Type;
+  uint32_t    m_Offset;         ///< Position of the chunk header in the file
+  uint32_t    m_Size;           ///< Size of the data following the header
+  int32_t     m_FrameNumber;    ///< Frame decoded by this chunk, or the next frame to decode for the other types of chunks
+};
+
+
+//
+// Repacked files (ACF2PCX repack): the NulChunk padding, only useful to stream from a CD, is removed, and a SeekIndx
+// chunk is added after the End chunk, where the readers stop. It lists all the chunks before it, so the chunk
+// directory of a repacked file is built without walking the chunks (each entry is still checked against the header
+// it points to), and it ends with its own size, so it is found from the end of the file:
+//   uint32_t         entry count
+//   SeekIndexEntry   entries[entry count]
+//   uint32_t         size of the SeekIndx chunk, header included
+// The frames can also be PackedFr chunks: the name and the size of the original chunk, followed by its data
+// compressed with BlockCodec. ACFDecoder::LoadClip decompresses them, so the decoder itself never sees them.
+//
+class SeekIndexEntry
+{
+public:
+  char      m_Name[8];
+  uint32_t  m_Offset;         ///< Position of the chunk header in the file
+  uint32_t  m_Size;           ///< Size of the data following the header
+};
+
+
+//
+// Compact list of all the chunks of a file, built in one pass: the decoder and the other tools iterate this
+// instead of walking and classifying the chunks again, and the frame and keyframe lists can be used to seek.
+//
+class ChunkDirectory
+{
+public:
+  // Stops at the End chunk, or before the first chunk going past the end of the file.
+  // The SeekIndx chunk of the repacked files is used instead of walking the chunks.
+  bool Build(std::span<const std::byte> acfFile)
+  {
+    m_FileStart = acfFile.data();
+    m_Entries.clear();
+    m_Frames.clear();
+    m_KeyFrames.clear();
+    if (BuildFromSeekIndex(acfFile))
+    {
+      return true;
+    }
+
+    size_t offset = 0;
+    while (offset < acfFile.size())
+    {
+      const Chunk* chunk = (const Chunk*)(m_FileStart + offset);
+      if ((offset + sizeof(Chunk) > acfFile.size()) || (chunk->GetChunkSize() > acfFile.size() - offset - sizeof(Chunk)))
+      {
+        ACF_LOG(LogLevel::e_Summary, "Chunk at offset " << offset << " goes past the end of the file");
+        return false;
+      }
+
+      ChunkEntry entry = { chunk->GetChunkType(), (uint32_t)offset, chunk->GetChunkSize(), (int32_t)m_Frames.size() };
+      AddEntry(entry);
+      if (entry.m_Type == ChunkType::e_End)
+      {
+        break;
+      }
+      offset += sizeof(Chunk) + entry.m_Size;
+    }
+    return true;
+  }
+
+  const std::vector<ChunkEntry>& GetEntries() const         { return m_Entries; }
+  const Chunk* GetChunk(const ChunkEntry& entry) const      { return (const Chunk*)(m_FileStart + entry.m_Offset); }
+
+  int32_t GetFrameCount() const                             { return (int32_t)m_Frames.size(); }
+  const ChunkEntry& GetFrameEntry(int32_t frame) const      { return m_Entries[m_Frames[frame]]; }
+  const std::vector<int32_t>& GetKeyFrames() const          { return m_KeyFrames; }
+
+  // Last keyframe at or before the frame, where decoding has to start to get that frame
+  int32_t GetKeyFrameBefore(int32_t frame) const
+  {
+    auto keyFrame = std::upper_bound(m_KeyFrames.begin(), m_KeyFrames.end(), frame);
+    return (keyFrame == m_KeyFrames.begin()) ? 0 : *(keyFrame - 1);
+  }
+
+  // Index in GetEntries() of the chunk starting at this offset, or -1 if no chunk starts there
+  int32_t FindEntry(uint32_t offset) const
+  {
+    auto entry = std::lower_bound(m_Entries.begin(), m_Entries.end(), offset, [](const ChunkEntry& entry, uint32_t offset) { return entry.m_Offset < offset; });
+    return ((entry != m_Entries.end()) && (entry->m_Offset == offset)) ? (int32_t)(entry - m_Entries.begin()) : -1;
+  }
+
+  // The SeekIndx chunk of a repacked file, or nullptr
+  static const Chunk* FindSeekIndex(std::span<const std::byte> acfFile)
+  {
+    uint32_t indexSize = 0;
+    if (acfFile.size() >= sizeof(Chunk) + 8)
+    {
+      memcpy(&indexSize, acfFile.data() + acfFile.size() - 4, 4);
+    }
+    if ((indexSize < sizeof(Chunk) + 8) || (indexSize > acfFile.size()))
+    {
+      return nullptr;
+    }
+    const Chunk* chunk = (const Chunk*)(acfFile.data() + acfFile.size() - indexSize);
+    return ((chunk->GetChunkType() == ChunkType::e_SeekIndx) && (chunk->GetChunkSize() == indexSize - sizeof(Chunk))) ? chunk : nullptr;
+  }
+
+private:
+  void AddEntry(const ChunkEntry& entry)
+  {
+    if ((entry.m_Type == ChunkType::e_KeyFrame) || (entry.m_Type == ChunkType::e_DltFrame))
+    {
+      if (entry.m_Type == ChunkType::e_KeyFrame)
+      {
+        m_KeyFrames.push_back(entry.m_FrameNumber);
+      }
+      m_Frames.push_back((uint32_t)m_Entries.size());
+    }
+    m_Entries.push_back(entry);
+  }
+
+  // The entries have to follow each other up to the End chunk, which is just before the index, and have the name and
+  // the size of the chunk header they point to, otherwise the index is stale or damaged and the chunks are walked
+  bool BuildFromSeekIndex(std::span<const std::byte> acfFile)
+  {
+    const Chunk* indexChunk = FindSeekIndex(acfFile);
+    if (!indexChunk)
+    {
+      return false;
+    }
+    const uint8_t* indexData = indexChunk->GetData<uint8_t>();
+    uint32_t entryCount;
+    memcpy(&entryCount, indexData, 4);
+    if ((uint64_t)entryCount * sizeof(SeekIndexEntry) + 8 != indexChunk->GetChunkSize())
+    {
+      return false;
+    }
+
+    uint64_t indexOffset = (const std::byte*)indexChunk - m_FileStart;
+    uint64_t nextOffset = 0;
+    for (uint32_t index = 0; index < entryCount; index++)
+    {
+      SeekIndexEntry indexEntry;
+      memcpy(&indexEntry, indexData + 4 + index * sizeof(SeekIndexEntry), sizeof(SeekIndexEntry));
+      if ((indexEntry.m_Offset != nextOffset) || (nextOffset + sizeof(Chunk) + indexEntry.m_Size > indexOffset))
+      {
+        break;
+      }
+      const Chunk* chunk = (const Chunk*)(m_FileStart + indexEntry.m_Offset);
+      if ((chunk->GetChunkName() != std::string_view(indexEntry.m_Name, 8)) || (chunk->GetChunkSize() != indexEntry.m_Size))
+      {
+        break;
+      }
+      AddEntry({ chunk->GetChunkType(), indexEntry.m_Offset, indexEntry.m_Size, (int32_t)m_Frames.size() });
+      nextOffset += sizeof(Chunk) + indexEntry.m_Size;
+    }
+    if (m_Entries.empty() || (m_Entries.back().m_Type != ChunkType::e_End) || (nextOffset != indexOffset))
+    {
+      ACF_LOG(LogLevel::e_Summary, "The seek index does not match the chunks, they are walked instead");
+      m_Entries.clear();
+      m_Frames.clear();
+      m_KeyFrames.clear();
+      return false;
+    }
+    return true;
+  }
+
+private:
+  const std::byte*          m_FileStart = nullptr;
+  std::vector<ChunkEntry>   m_Entries;
+  std::vector<uint32_t>     m_Frames;       ///< Index in m_Entries of each KeyFrame/DltFrame chunk
+  std::vector<int32_t>      m_KeyFrames;    ///< Frame numbers of the KeyFrame chunks
+};
+
+
+//
+// Where an interrupted decoding can restart: the last frame which was given to the sinks, and the chunks needed
+// to decode again from the keyframe before it (the keyframe itself, and the Format, Palette and FrameLen chunks
+// which were active when it was decoded). The file is a single line of text, replaced after each update so a
+// killed process always leaves either the previous or the new checkpoint.
+//
+class DecodeCheckpoint
+{
+public:
+  static constexpr uint32_t g_NoChunk = UINT32_MAX;
+
+  bool Load(const std::filesystem::path& checkpointPath)
+  {
+    std::ifstream is(checkpointPath, std::ios::binary);
+    return (bool)(is >> m_DecoderVersion >> m_FileSize >> m_LastFrame >> m_KeyFrameOffset >> m_FormatOffset >> m_PaletteOffset >> m_FrameLenOffset);
+  }
+
+  static std::filesystem::path GetTemporaryPath(const std::filesystem::path& checkpointPath)
+  {
+    std::filesystem::path temporaryPath = checkpointPath;
+    temporaryPath += ".tmp";
+    return temporaryPath;
+  }
+
+  // The temporary path and the stream come from the caller, so saving during the decoding does not allocate
+  bool Save(const std::filesystem::path& checkpointPath, const std::filesystem::path& temporaryPath, OutputFile& outputFile) const
+  {
+    {
+      TextWriter writer(outputFile.Open(temporaryPath));
+      writer << m_DecoderVersion << " " << m_FileSize << " " << m_LastFrame << " " << m_KeyFrameOffset << " " << m_FormatOffset << " " << m_PaletteOffset << " " << m_FrameLenOffset << "\n";
+    }
+    if (!outputFile.Close())
+    {
+      return false;
+    }
+    std::error_code errorCode;
+    std::filesystem::rename(temporaryPath, checkpointPath, errorCode);
+    return !errorCode;
+  }
+
+  // The checkpoint has to come from the same decoder and file, and all its chunks must still be where they were
+  bool Matches(const ChunkDirectory& chunkDirectory, uint64_t fileSize) const
+  {
+    auto hasChunk = [&](uint32_t offset, ChunkType type, bool isOptional)
+    {
+      int32_t entry = (offset == g_NoChunk) ? -1 : chunkDirectory.FindEntry(offset);
+      return (entry < 0) ? (isOptional && (offset == g_NoChunk)) : (chunkDirectory.GetEntries()[entry].m_Type == type);
+    };
+    return (m_DecoderVersion == g_DecoderVersion) && (m_FileSize == fileSize) && (m_LastFrame >= 0) &&
+           hasChunk(m_KeyFrameOffset, ChunkType::e_KeyFrame, false) && hasChunk(m_FormatOffset, ChunkType::e_Format, false) &&
+           hasChunk(m_PaletteOffset, ChunkType::e_Palette, true) && hasChunk(m_FrameLenOffset, ChunkType::e_FrameLen, true);
+  }
+
+public:
+  uint32_t  m_DecoderVersion = g_DecoderVersion;
+  uint64_t  m_FileSize       = 0;
+  int32_t   m_LastFrame      = -1;
+  uint32_t  m_KeyFrameOffset = g_NoChunk;
+  uint32_t  m_FormatOffset   = g_NoChunk;
+  uint32_t  m_PaletteOffset  = g_NoChunk;
+  uint32_t  m_FrameLenOffset = g_NoChunk;
+};
+
+
+
+
+
+//
+// Runtime CPU dispatch: the kernels working on whole lines, frames or files exist in several versions, the best one
+// the processor supports is selected at startup, and SetCpuLevel can force a lower level (ACF2PCX --cpu).
+// The opcode decoders are not part of it: they only move 8 byte rows, which already are single 64 bit moves.
+//
+enum class CpuLevel
+{
+  e_Scalar = 0,
+  e_Sse4,           ///< SSSE3, SSE4.1 and SSE4.2
+  e_Avx2,
+  e_Avx512,         ///< AVX-512 F and BW
+};
+
+inline constexpr const char* g_CpuLevelNames[] = { "scalar", "sse4", "avx2", "avx512" };
+
+
+inline CpuLevel DetectCpuLevel()
+{
+#if defined(ACF_X86) && defined(_MSC_VER)
+  int information[4];
+  __cpuid(information, 0);
+  int maxLeaf = information[0];
+  __cpuid(information, 1);
+  bool sse4    = (information[2] & (1 << 9)) && (information[2] & (1 << 19)) && (information[2] & (1 << 20));
+  bool osxsave = (information[2] & (1 << 27)) && (information[2] & (1 << 28));
+  uint64_t xcr0 = osxsave ? _xgetbv(0) : 0;          // Registers saved by the OS
+  bool avx2    = false;
+  bool avx512  = false;
+  if (maxLeaf >= 7)
+  {
+    __cpuidex(information, 7, 0);
+    avx2   = (information[1] & (1 << 5)) && ((xcr0 & 0x06) == 0x06);
+    avx512 = (information[1] & (1 << 16)) && (information[1] & (1 << 30)) && ((xcr0 & 0xE6) == 0xE6);
+  }
+#elif defined(ACF_X86)
+  __builtin_cpu_init();
+  bool sse4   = __builtin_cpu_supports("ssse3") && __builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("sse4.2");
+  bool avx2   = __builtin_cpu_supports("avx2");
+  bool avx512 = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+#else
+  bool sse4   = false;
+  bool avx2   = false;
+  bool avx512 = false;
+#endif
+  return (avx512 && avx2 && sse4) ? CpuLevel::e_Avx512 : (avx2 && sse4) ? CpuLevel::e_Avx2 : sse4 ? CpuLevel::e_Sse4 : CpuLevel::e_Scalar;
+}
+
+
+// All the versions of a kernel give exactly the same result
+class CpuKernels
+{
+public:
+  /// rgb gets 3 bytes per pixel, colors are the palette entries as R | G << 8 | B << 16
+  void (*m_ExpandPalette)(const uint8_t* pixels, size_t pixelCount, const uint32_t* colors, uint8_t* rgb);
+  /// Number of bytes equal to data[0] from data, between 1 and maxLength
+  uint32_t (*m_GetRunLength)(const uint8_t* data, uint32_t maxLength);
+  /// masks[i] has one bit per pixel (in raster order) telling if the 8x8 block at source + i differs from the tile
+  void (*m_GetDifferenceMasks)(const uint8_t* tile, const uint8_t* source, uint32_t stride, uint32_t count, uint64_t* masks);
+  /// CRC32C (Castagnoli) update, without the initial and final inversions
+  uint32_t (*m_Crc32c)(uint32_t crc, const uint8_t* data, size_t size);
+};
+
+
+namespace ScalarKernels
+{
+  inline void ExpandPalette(const uint8_t* pixels, size_t pixelCount, const uint32_t* colors, uint8_t* rgb)
+  {
+    for (size_t pixel = 0; pixel < pixelCount; pixel++)
+    {
+      uint32_t color = colors[pixels[pixel]];
+      rgb[pixel * 3 + 0] = (uint8_t)color;
+      rgb[pixel * 3 + 1] = (uint8_t)(color >> 8);
+      rgb[pixel * 3 + 2] = (uint8_t)(color >> 16);
+    }
+  }
+
+  inline uint32_t GetRunLength(const uint8_t* data, uint32_t maxLength)
+  {
+    uint32_t length = 1;
+    while ((length < maxLength) && (data[length] == data[0]))
+    {
+      length++;
+    }
+    return length;
+  }
+
+  inline void GetDifferenceMasks(const uint8_t* tile, const uint8_t* source, uint32_t stride, uint32_t count, uint64_t* masks)
+  {
+    for (uint32_t block = 0; block < count; block++)
+    {
+      uint64_t mask = 0;
+      for (uint32_t pixel = 0; pixel < 64; pixel++)
+      {
+        mask |= (uint64_t)(tile[pixel] != source[block + (pixel / 8) * stride + (pixel % 8)]) << pixel;
+      }
+      masks[block] = mask;
+    }
+  }
+
+  class Crc32cTable
+  {
+  public:
+    constexpr Crc32cTable()
+    {
+      for (uint32_t index = 0; index < 256; index++)
+      {
+        uint32_t crc = index;
+        for (int32_t bit = 0; bit < 8; bit++)
+        {
+          crc = (crc >> 1) ^ ((crc & 1) ? 0x82F63B78 : 0);      // Castagnoli polynomial, reversed
+        }
+        m_Table[index] = crc;
+      }
+    }
+
+    uint32_t m_Table[256] = {};
+  };
+
+  inline constexpr Crc32cTable g_Crc32cTable;
+
+  inline uint32_t Crc32c(uint32_t crc, const uint8_t* data, size_t size)
+  {
+    for (size_t offset = 0; offset < size; offset++)
+    {
+      crc = (crc >> 8) ^ g_Crc32cTable.m_Table[(crc ^ data[offset]) & 255];
+    }
+    return crc;
+  }
+}
+
+
+#ifdef ACF_X86
+namespace Sse4Kernels
+{
+  // 4 pixels per shuffle, the 16 byte store writes 4 bytes after the 12 useful ones
+  ACF_TARGET("sse4.2") inline void ExpandPalette(const uint8_t* pixels, size_t pixelCount, const uint32_t* colors, uint8_t* rgb)
+  {
+    const __m128i packRgb = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    size_t pixel = 0;
+    for (; pixel + 6 <= pixelCount; pixel += 4)
+    {
+      __m128i colors4 = _mm_setr_epi32(colors[pixels[pixel]], colors[pixels[pixel + 1]], colors[pixels[pixel + 2]], colors[pixels[pixel + 3]]);
+      _mm_storeu_si128((__m128i*)(rgb + pixel * 3), _mm_shuffle_epi8(colors4, packRgb));
+    }
+    ScalarKernels::ExpandPalette(pixels + pixel, pixelCount - pixel, colors, rgb + pixel * 3);
+  }
+
+  ACF_TARGET("sse4.2") inline uint32_t GetRunLength(const uint8_t* data, uint32_t maxLength)
+  {
+    const __m128i value = _mm_set1_epi8((char)data[0]);
+    uint32_t offset = 0;
+    for (; offset + 16 <= maxLength; offset += 16)
+    {
+      uint32_t equal = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + offset)), value));
+      if (equal != 0xFFFF)
+      {
+        return offset + std::countr_zero(~equal);
+      }
+    }
+    while ((offset < maxLength) && (data[offset] == data[0]))
+    {
+      offset++;
+    }
+    return offset;
+  }
+
+  ACF_TARGET("sse4.2") inline void GetDifferenceMasks(const uint8_t* tile, const uint8_t* source, uint32_t stride, uint32_t count, uint64_t* masks)
+  {
+    __m128i tileRows[4];
+    for (uint32_t y = 0; y < 8; y += 2)
+    {
+      tileRows[y / 2] = _mm_loadu_si128((const __m128i*)(tile + y * 8));
+    }
+    for (uint32_t block = 0; block < count; block++)
+    {
+      uint64_t mask = 0;
+      for (uint32_t y = 0; y < 8; y += 2)
+      {
+        __m128i sourceRows = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)(source + block + y * stride)), _mm_loadl_epi64((const __m128i*)(source + block + (y + 1) * stride)));
+        uint32_t equal     = _mm_movemask_epi8(_mm_cmpeq_epi8(tileRows[y / 2], sourceRows));
+        mask |= (uint64_t)(~equal & 0xFFFF) << (y * 8);
+      }
+      masks[block] = mask;
+    }
+  }
+
+  ACF_TARGET("sse4.2") inline uint32_t Crc32c(uint32_t crc, const uint8_t* data, size_t size)
+  {
+    size_t offset = 0;
+#if defined(_M_X64) || defined(__x86_64__)
+    uint64_t crc64 = crc;
+    for (; offset + 8 <= size; offset += 8)
+    {
+      uint64_t value;
+      memcpy(&value, data + offset, 8);
+      crc64 = _mm_crc32_u64(crc64, value);
+    }
+    crc = (uint32_t)crc64;
+#endif
+    for (; offset < size; offset++)
+    {
+      crc = _mm_crc32_u8(crc, data[offset]);
+    }
+    return crc;
+  }
+}
+
+
+namespace Avx2Kernels
+{
+  // 8 pixels per gather, each 128 bit half is packed to 12 bytes and stored with 16 bytes
+  ACF_TARGET("avx2") inline void ExpandPalette(const uint8_t* pixels, size_t pixelCount, const uint32_t* colors, uint8_t* rgb)
+  {
+    const __m256i packRgb = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1, 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    size_t pixel = 0;
+    for (; pixel + 11 <= pixelCount; pixel += 8)
+    {
+      __m256i indices = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(pixels + pixel)));
+      __m256i packed  = _mm256_shuffle_epi8(_mm256_i32gather_epi32((const int*)colors, indices, 4), packRgb);
+      _mm_storeu_si128((__m128i*)(rgb + pixel * 3), _mm256_castsi256_si128(packed));
+      _mm_storeu_si128((__m128i*)(rgb + pixel * 3 + 12), _mm256_extracti128_si256(packed, 1));
+    }
+    ScalarKernels::ExpandPalette(pixels + pixel, pixelCount - pixel, colors, rgb + pixel * 3);
+  }
+
+  ACF_TARGET("avx2") inline uint32_t GetRunLength(const uint8_t* data, uint32_t maxLength)
+  {
+    const __m256i value = _mm256_set1_epi8((char)data[0]);
+    uint32_t offset = 0;
+    for (; offset + 32 <= maxLength; offset += 32)
+    {
+      uint32_t equal = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(data + offset)), value));
+      if (equal != 0xFFFFFFFF)
+      {
+        return offset + std::countr_zero(~equal);
+      }
+    }
+    while ((offset < maxLength) && (data[offset] == data[0]))
+    {
+      offset++;
+    }
+    return offset;
+  }
+
+  // 4 rows per comparison
+  ACF_TARGET("avx2") inline void GetDifferenceMasks(const uint8_t* tile, const uint8_t* source, uint32_t stride, uint32_t count, uint64_t* masks)
+  {
+    const __m256i tileTop    = _mm256_loadu_si256((const __m256i*)tile);
+    const __m256i tileBottom = _mm256_loadu_si256((const __m256i*)(tile + 32));
+    for (uint32_t block = 0; block < count; block++)
+    {
+      const uint8_t* rows = source + block;
+      __m256i top    = _mm256_setr_epi64x(*(const int64_t*)rows, *(const int64_t*)(rows + stride), *(const int64_t*)(rows + 2 * stride), *(const int64_t*)(rows + 3 * stride));
+      __m256i bottom = _mm256_setr_epi64x(*(const int64_t*)(rows + 4 * stride), *(const int64_t*)(rows + 5 * stride), *(const int64_t*)(rows + 6 * stride), *(const int64_t*)(rows + 7 * stride));
+      uint32_t equalTop    = _mm256_movemask_epi8(_mm256_cmpeq_epi8(tileTop, top));
+      uint32_t equalBottom = _mm256_movemask_epi8(_mm256_cmpeq_epi8(tileBottom, bottom));
+      masks[block] = ~((uint64_t)equalBottom << 32 | equalTop);
+    }
+  }
+}
+
+
+namespace Avx512Kernels
+{
+  // Masked loads do not touch the bytes after maxLength, so one comparison is enough for the 63 bytes PCX runs
+  ACF_TARGET("avx512f,avx512bw") inline uint32_t GetRunLength(const uint8_t* data, uint32_t maxLength)
+  {
+    const __m512i value = _mm512_set1_epi8((char)data[0]);
+    uint32_t offset = 0;
+    while (offset < maxLength)
+    {
+      uint32_t length = std::min(64u, maxLength - offset);
+      __mmask64 valid = (length == 64) ? ~0ull : ((1ull << length) - 1);
+      __mmask64 equal = _mm512_mask_cmpeq_epi8_mask(valid, _mm512_maskz_loadu_epi8(valid, data + offset), value);
+      if (equal != valid)
+      {
+        return offset + (uint32_t)std::countr_zero(~equal);
+      }
+      offset += length;
+    }
+    return maxLength;
+  }
+
+  // The whole 8x8 block in one comparison, which directly gives the 64 bit mask
+  ACF_TARGET("avx512f,avx512bw") inline void GetDifferenceMasks(const uint8_t* tile, const uint8_t* source, uint32_t stride, uint32_t count, uint64_t* masks)
+  {
+    const __m512i tileRows = _mm512_loadu_si512(tile);
+    for (uint32_t block = 0; block < count; block++)
+    {
+      const uint8_t* rows = source + block;
+      __m512i sourceRows = _mm512_setr_epi64(*(const int64_t*)rows, *(const int64_t*)(rows + stride), *(const int64_t*)(rows + 2 * stride), *(const int64_t*)(rows + 3 * stride),
+                                             *(const int64_t*)(rows + 4 * stride), *(const int64_t*)(rows + 5 * stride), *(const int64_t*)(rows + 6 * stride), *(const int64_t*)(rows + 7 * stride));
+      masks[block] = _mm512_cmpneq_epi8_mask(tileRows, sourceRows);
+    }
+  }
+}
+#endif
+
+
+inline CpuKernels GetCpuKernels(CpuLevel level)
+{
+  switch (level)
+  {
+#ifdef ACF_X86
+  case CpuLevel::e_Avx512:  return { Avx2Kernels::ExpandPalette, Avx512Kernels::GetRunLength, Avx512Kernels::GetDifferenceMasks, Sse4Kernels::Crc32c };
+  case CpuLevel::e_Avx2:    return { Avx2Kernels::ExpandPalette, Avx2Kernels::GetRunLength, Avx2Kernels::GetDifferenceMasks, Sse4Kernels::Crc32c };
+  case CpuLevel::e_Sse4:    return { Sse4Kernels::ExpandPalette, Sse4Kernels::GetRunLength, Sse4Kernels::GetDifferenceMasks, Sse4Kernels::Crc32c };
+#endif
+  default:                  return { ScalarKernels::ExpandPalette, ScalarKernels::GetRunLength, ScalarKernels::GetDifferenceMasks, ScalarKernels::Crc32c };
+  }
+}
+
+
+inline const CpuLevel g_DetectedCpuLevel = DetectCpuLevel();
+inline CpuLevel       g_CpuLevel         = g_DetectedCpuLevel;
+inline CpuKernels     g_CpuKernels       = GetCpuKernels(g_CpuLevel);
+
+// Fails if the processor does not support that level
+inline bool SetCpuLevel(CpuLevel level)
+{
+  if (level > g_DetectedCpuLevel)
+  {
+    return false;
+  }
+  g_CpuLevel   = level;
+  g_CpuKernels = GetCpuKernels(level);
+  return true;
+}
+
+
+// Palette as 32 bit values for the ExpandPalette kernel
+inline void GetPaletteColors(const Palette& palette, uint32_t* colors)
+{
+  for (uint32_t color = 0; color < 256; color++)
+  {
+    const PaletteEntry& entry = palette.m_PaletteEntries[color];
+    colors[color] = entry.m_Red | (entry.m_Green << 8) | (entry.m_Blue << 16);
+  }
+}
+
+
+
+
+struct PCXHeader
+{
+  char password = 10;
+  char version = 5;
+  char encoding = 1;
+  char bits_per_pixel = 8;                  // 256 colors
+  short int xmin = 0, ymin = 0, xmax =0, ymax =0;
+  short int xres, yres;
+  unsigned char palette[48] = {0};
+  char reserved = 0;
+  char no_of_planes = 1;
+  short int bytes_per_line = 0;
+  short int palette_type = 0;
+  char filler[58] = { 0 };
+};
+
+
+class ImageBuffer
+{
+public:
+  ImageBuffer(uint32_t width, uint32_t height)
+    : m_Width(width)
+    , m_Height(height)
+  {
+    m_Buffer.resize((size_t)m_Width * (size_t)m_Height);
+  }
+
+  ImageBuffer()
+    : ImageBuffer(0, 0)
+  {}
+
+  // Black picture of the new size, the memory is only reallocated if it is bigger than all the previous ones
+  void Reset(uint32_t width, uint32_t height)
+  {
+    m_Width  = width;
+    m_Height = height;
+    m_Buffer.assign((size_t)m_Width * (size_t)m_Height, 0);
+  }
+
+  uint8_t* GetBuffer() { return m_Buffer.data(); }
+  const uint8_t* GetBuffer() const { return m_Buffer.data(); }
+
+  void SaveToPcx(const char* filename, const uint8_t* ptrpalette)
+  {
+    SaveToPcx(filename, GetBuffer(), m_Width, m_Height, ptrpalette);
+  }
+
+  // Static version for the pictures which are not in an ImageBuffer, the frame sinks use EncodePcx to keep the buffer
+  static void SaveToPcx(const char* filename, const uint8_t* screen, uint32_t width, uint32_t height, const uint8_t* ptrpalette)
+  {
+    std::vector<uint8_t> file_buf;
+    size_t size = EncodePcx(screen, width, height, ptrpalette, file_buf);
+
+    std::ofstream os(filename, std::ios::binary);
+    os.write((char*)file_buf.data(), size);
+    os.close();
+  }
+
+  // The whole PCX file, returns its size. The buffer only grows, so the sinks can use the same one for all the frames
+  static size_t EncodePcx(const uint8_t* screen, uint32_t width, uint32_t height, const uint8_t* ptrpalette, std::vector<uint8_t>& file_buf)
+  {
+    PCXHeader pcx_header;
+    pcx_header.xmax = width - 1;
+    pcx_header.ymax = height - 1;
+    pcx_header.xres = width;
+    pcx_header.yres = height;
+    pcx_header.bytes_per_line = width;
+
+    size_t maxSize = 128 + (size_t)width * height * 2 + 769;
+    if (file_buf.size() < maxSize)
+    {
+      file_buf.resize(maxSize);
+    }
+
+    memcpy(file_buf.data(), &pcx_header, 128);
+    size_t size = 128;
+    for (uint32_t k = 0; k < height; k++)
+    {
+      size += EncodePcxLine(screen + (size_t)width * k, width, file_buf.data() + size);
+    }
+
+    file_buf[size++] = 0x0C;
+    memcpy(file_buf.data() + size, ptrpalette, 768);
+    return size + 768;
+  }
+
+  // RLE encoding of one line, with runs of up to 63 pixels. The output needs room for 2 bytes per pixel
+  static uint32_t EncodePcxLine(const uint8_t* line, uint32_t width, uint8_t* output, const CpuKernels& cpuKernels = g_CpuKernels)
+  {
+    uint32_t size = 0;
+    for (uint32_t x = 0; x < width; )
+    {
+      uint8_t color = line[x];
+      uint32_t number = cpuKernels.m_GetRunLength(line + x, std::min(63u, width - x));
+      if ((number != 1) || ((color & 0xC0) == 0xC0))
+      {
+        output[size++] = (uint8_t)(number | 0xC0);
+      }
+      output[size++] = color;
+      x += number;
+    }
+    return size;
+  }
+
+  // Only supports what SaveToPcx generates: 8 bit, single plane, RLE encoded with a 256 colors palette at the end
+  bool LoadFromPcx(const char* filename, uint8_t* ptrpalette)
+  {
+    std::ifstream is(filename, std::ios::binary);
+    std::vector<uint8_t> content((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+    if (content.size() < 128 + 769)
+    {
+      return false;
+    }
+
+    PCXHeader pcx_header;
+    memcpy(&pcx_header, content.data(), 128);
+    if ((pcx_header.bits_per_pixel != 8) || (pcx_header.no_of_planes != 1) || (content[content.size() - 769] != 0x0C))
+    {
+      return false;
+    }
+
+    m_Width  = pcx_header.xmax - pcx_header.xmin + 1;
+    m_Height = pcx_header.ymax - pcx_header.ymin + 1;
+    m_Buffer.resize((size_t)m_Width * (size_t)m_Height);
+
+    const uint8_t* source = content.data() + 128;
+    const uint8_t* sourceEnd = content.data() + content.size() - 769;
+    for (uint32_t y = 0; y < m_Height; y++)
+    {
+      uint8_t* dest = GetBuffer() + y * m_Width;
+      int32_t x = 0;
+      while (x < pcx_header.bytes_per_line)
+      {
+        if (source >= sourceEnd)
+        {
+          return false;
+        }
+        uint8_t ch = *source++;
+        int32_t count = 1;
+        if ((ch & 0xC0) == 0xC0)
+        {
+          count = ch & 0x3F;
+          ch = *source++;
+        }
+        while (count--)
+        {
+          if (x < (int32_t)m_Width)   dest[x] = ch;
+          x++;
+        }
+      }
+    }
+
+    memcpy(ptrpalette, sourceEnd + 1, 768);
+    return true;
+  }
+
+  void SaveToRaw(const char* filename, const uint8_t* ptrpalette)
+  {
+    SaveToRaw(filename, GetBuffer(), m_Width, m_Height, ptrpalette);
+  }
+
+  static void SaveToRaw(const char* filename, const uint8_t* screen, uint32_t width, uint32_t height, const uint8_t* ptrpalette)
+  {
+    std::ofstream os(filename, std::ios::binary);
+    os.write((char*)screen, (size_t)width * (size_t)height);
+    os.close();
+  }
+
+public:
+  uint32_t                m_Width;
+  uint32_t                m_Height;
+  std::vector<uint8_t>    m_Buffer;
+};
+
+
+
+
+
+
+//
+// Minimal C++20 generator: the coroutine only runs up to the next co_yield when the iterator is incremented,
+// and destroying the generator destroys the coroutine, so the caller can stop at any point.
+// The yielded value stays in the coroutine, only a pointer is kept, so it is only valid until the next increment.
+//
+template<typename T>
+class Generator
+{
+public:
+  class promise_type
+  {
+  public:
+    Generator get_return_object()                     { return Generator(std::coroutine_handle<promise_type>::from_promise(*this)); }
+    std::suspend_always initial_suspend() noexcept    { return {}; }
+    std::suspend_always final_suspend() noexcept      { return {}; }
+    std::suspend_always yield_value(const T& value)   { m_Value = &value; return {}; }
+    void return_void()                                {}
+    void unhandled_exception()                        { m_Exception = std::current_exception(); }
+
+    const T*            m_Value = nullptr;
+    std::exception_ptr  m_Exception;
+  };
+
+  class Iterator
+  {
+  public:
+    Iterator& operator++()                            { Resume(m_Handle); return *this; }
+    const T& operator*() const                        { return *m_Handle.promise().m_Value; }
+    bool operator==(std::default_sentinel_t) const    { return m_Handle.done(); }
+
+    std::coroutine_handle<promise_type>  m_Handle;
+  };
+
+  Generator(Generator&& other) noexcept
+    : m_Handle(std::exchange(other.m_Handle, {}))
+  {}
+  Generator(const Generator&) = delete;
+  Generator& operator=(const Generator&) = delete;
+
+  ~Generator()
+  {
+    if (m_Handle)
+    {
+      m_Handle.destroy();
+    }
+  }
+
+  // Can only be iterated once
+  Iterator begin()                                    { Resume(m_Handle); return Iterator{ m_Handle }; }
+  std::default_sentinel_t end()                       { return {}; }
+
+private:
+  explicit Generator(std::coroutine_handle<promise_type> handle)
+    : m_Handle(handle)
+  {}
+
+  static void Resume(std::coroutine_handle<promise_type> handle)
+  {
+    handle.resume();
+    if (handle.promise().m_Exception)
+    {
+      std::rethrow_exception(std::exchange(handle.promise().m_Exception, {}));
+    }
+  }
+
+  std::coroutine_handle<promise_type>  m_Handle;
+};
+
+
+
+
+//
+// The decoded frames are given to the sinks registered on the ACFDecoder.
+// The view points directly on the decoder buffers, so it is only valid until OnFrame returns.
+//
+class FrameView
+{
+public:
+  const uint8_t*  m_Pixels;             ///< m_Width * m_Height palette indices
+  uint32_t        m_Width;
+  uint32_t        m_Height;
+  const Palette*  m_Palette;
+  int32_t         m_FrameNumber;
+};
+
+
+class FrameSink
+{
+public:
+  virtual ~FrameSink() = default;
+
+  virtual void OnFrame(const FrameView& frame) = 0;
+  virtual void OnChunk(const ChunkEntry& /*entry*/, const Chunk& /*chunk*/) {}  ///< Called for all the chunks, before they are processed
+  virtual void OnCamera(const Camera& /*camera*/, int32_t /*frameNumber*/) {}
+  virtual void OnEnd() {}
+};
+
+
+// Does nothing, used to measure the decoding speed alone
+class NullSink : public FrameSink
+{
+public:
+  void OnFrame(const FrameView& /*frame*/) override {}
+};
+
+
+// Path of the file written for each frame: the folder and the prefix are copied once, then only the number and the
+// extension are written for each frame, so the path is never reallocated
+class FramePath
+{
+public:
+  FramePath(std::string_view folder, std::string_view prefix, std::string_view extension)
+    : m_Extension(extension)
+  {
+    m_Path.append(folder).append(prefix);
+    m_PrefixSize = m_Path.size();
+    m_Path.resize(m_PrefixSize + g_MaxNumberLength + m_Extension.size() + 1);
+  }
+
+  const char* Get(int32_t frameNumber)
+  {
+    char* end = std::to_chars(m_Path.data() + m_PrefixSize, m_Path.data() + m_Path.size(), frameNumber).ptr;
+    memcpy(end, m_Extension.data(), m_Extension.size());
+    end[m_Extension.size()] = 0;
+    return m_Path.c_str();
+  }
+
+private:
+  static constexpr size_t g_MaxNumberLength = 11;     // "-2147483648"
+
+  std::string   m_Path;
+  std::string   m_Extension;
+  size_t        m_PrefixSize;
+};
+
+
+class PcxSink : public FrameSink
+{
+public:
+  PcxSink(const std::string& outputFolder)
+    : m_FramePath(outputFolder, "PCX_", ".pcx")
+  {}
+
+  void OnFrame(const FrameView& frame) override
+  {
+    size_t size = ImageBuffer::EncodePcx(frame.m_Pixels, frame.m_Width, frame.m_Height, frame.m_Palette->GetBuffer(), m_FileContent);
+    m_OutputFile.Write(m_FramePath.Get(frame.m_FrameNumber), m_FileContent.data(), size);
+  }
+
+private:
+  FramePath             m_FramePath;
+  OutputFile            m_OutputFile;
+  std::vector<uint8_t>  m_FileContent;      ///< Allocated by the first frame, then reused
+};
+
+
+class RawSink : public FrameSink
+{
+public:
+  RawSink(const std::string& outputFolder)
+    : m_FramePath(outputFolder, "RAW_", ".raw")
+  {}
+
+  void OnFrame(const FrameView& frame) override
+  {
+    m_OutputFile.Write(m_FramePath.Get(frame.m_FrameNumber), frame.m_Pixels, (size_t)frame.m_Width * frame.m_Height);
+  }
+
+private:
+  FramePath     m_FramePath;
+  OutputFile    m_OutputFile;
+};
+
+
+// Writes the VUE file with all the camera data, the file is only created if the ACF has camera records
+class CameraSink : public FrameSink
+{
+public:
+  CameraSink(const std::filesystem::path& cameraPath)
+    : m_CameraPath(cameraPath)
+  {}
+
+  void OnFrame(const FrameView& /*frame*/) override {}
+
+  void OnCamera(const Camera& camera, int32_t frameNumber) override
+  {
+    if (!m_Writer)
+    {
+      m_Writer = std::make_unique<TextWriter>(m_CameraPath);
+    }
+    camera.WriteCamera(*m_Writer, frameNumber);
+  }
+
+  void OnEnd() override
+  {
+    m_Writer.reset();
+  }
+
+private:
+  std::filesystem::path         m_CameraPath;
+  std::unique_ptr<TextWriter>   m_Writer;
+};
+
+
+// Clip description for the tools which do not need the pictures, one "name value..." line per item
+class MetadataSink : public FrameSink
+{
+public:
+  MetadataSink(TextWriter& writer, bool writeCameras)
+    : m_Writer(writer)
+    , m_WriteCameras(writeCameras)
+  {}
+
+  void OnFrame(const FrameView& /*frame*/) override {}
+
+  void OnChunk(const ChunkEntry& entry, const Chunk& chunk) override
+  {
+    switch (entry.m_Type)
+    {
+    case ChunkType::e_Format:
+      if (entry.m_Size >= sizeof(Format))
+      {
+        const Format* format = chunk.GetData<Format>();
+        m_PlayRate = format->play_rate;
+        m_Writer << "format " << format->width << " " << format->height << " frame_size " << format->frame_size << " key_size " << format->key_size
+                 << " key_rate " << format->key_rate << " play_rate " << format->play_rate << " sampling_rate " << format->sampling_rate
+                 << " sample_type " << format->sample_type << " sample_flags " << format->sample_flags << " compressor "
+                 << (((Compressor)format->compressor == Compressor::e_ACF) ? "ACF" : ((Compressor)format->compressor == Compressor::e_XCF) ? "XCF" : "unknown") << "\n";
+      }
+      break;
+
+    case ChunkType::e_Palette:
+      m_Writer << "palette " << entry.m_FrameNumber << "\n";
+      break;
+
+    case ChunkType::e_FrameLen:
+      if (entry.m_Size >= FrameLen::g_HeaderSize)
+      {
+        // One byte per frame after the biggest frame size
+        const FrameLen* frameLen = chunk.GetData<FrameLen>();
+        uint32_t frameCount = entry.m_Size - FrameLen::g_HeaderSize;
+        const uint8_t* sectors = frameLen->GetFrameSizeArray();
+        uint32_t minSectors = frameCount ? 255 : 0;
+        uint32_t maxSectors = 0;
+        uint64_t totalSectors = 0;
+        for (uint32_t frame = 0; frame < frameCount; frame++)
+        {
+          minSectors = std::min<uint32_t>(minSectors, sectors[frame]);
+          maxSectors = std::max<uint32_t>(maxSectors, sectors[frame]);
+          totalSectors += sectors[frame];
+        }
+        m_Writer << "framelen " << frameCount << " biggest " << frameLen->biggest_frame_size << " sectors " << minSectors << " " << maxSectors << " "
+                 << TextWriter::Fixed{ frameCount ? (double)totalSectors / frameCount : 0.0, 2 } << " total " << totalSectors << "\n";
+      }
+      break;
+
+    case ChunkType::e_KeyFrame:
+      m_KeyFrameCount++;
+      m_KeyFrameBytes += entry.m_Size;
+      break;
+
+    case ChunkType::e_DltFrame:
+      m_DltFrameCount++;
+      m_DltFrameBytes += entry.m_Size;
+      break;
+
+    default:
+      break;
+    }
+  }
+
+  void OnCamera(const Camera& camera, int32_t frameNumber) override
+  {
+    if (m_WriteCameras)
+    {
+      m_Writer << "camera " << frameNumber << " " << camera.cam_x << " " << camera.cam_y << " " << camera.cam_z << " " << camera.target_x << " "
+               << camera.target_y << " " << camera.target_z << " " << camera.gamma << " " << camera.focal << "\n";
+    }
+  }
+
+  void OnEnd() override
+  {
+    uint32_t frameCount = m_KeyFrameCount + m_DltFrameCount;
+    m_Writer << "frames " << frameCount << " keyframes " << m_KeyFrameCount << " keyframe_bytes " << m_KeyFrameBytes << " deltaframe_bytes " << m_DltFrameBytes;
+    if (m_PlayRate)
+    {
+      m_Writer << " seconds " << TextWriter::Fixed{ (double)frameCount / m_PlayRate, 2 };
+    }
+    m_Writer << "\n";
+    m_Writer.Flush();
+  }
+
+private:
+  TextWriter&   m_Writer;
+  bool          m_WriteCameras;
+  uint32_t      m_PlayRate = 0;
+  uint32_t      m_KeyFrameCount = 0;
+  uint32_t      m_DltFrameCount = 0;
+  uint64_t      m_KeyFrameBytes = 0;
+  uint64_t      m_DltFrameBytes = 0;
+};
+
+
+
+// Memory layout of the pictures in the decoder, see ACFDecoder::StartTileRow
+enum class FrameLayout
+{
+  e_Linear,         ///< Line after line
+  e_Tiled,          ///< 8x8 tile after 8x8 tile, each tile line after line, only for the 320 pixels wide ACF clips
+};
+
+inline constexpr const char* g_FrameLayoutNames[] = { "linear", "tiled" };
+
+
+// Rectangle of pixels asked to ACFDecoder::DecodeRegion
+class FrameRegion
+{
+public:
+  int32_t   m_X;
+  int32_t   m_Y;
+  int32_t   m_Width;
+  int32_t   m_Height;
+};
+
+
+//
+// What decoding one tile of a frame needs, found by ACFDecoder::ValidateFrame: where the tile data starts in the
+// two streams, so the tiles before it do not have to be decoded to find it, and where the 8x8 block or the four
+// 4x4 blocks copied from the previous frame come from (none for the tiles which do not use the previous frame).
+// Only the offsets are kept by the walk, the rectangles and the vectors are computed for the tiles which need them.
+//
+class TileReference
+{
+public:
+  void AddSource(int32_t sourceOffset)
+  {
+    m_SourceOffsets[m_SourceCount++] = sourceOffset;
+  }
+
+  // Rectangle of tiles of the previous frame the pixels are copied from, inclusive, or false if there is none
+  bool GetSourceTiles(int32_t width, int32_t& left, int32_t& top, int32_t& right, int32_t& bottom) const
+  {
+    int32_t blockSize = (m_SourceCount == 1) ? 8 : 4;
+    left = top = INT32_MAX;
+    right = bottom = -1;
+    for (uint32_t source = 0; source < m_SourceCount; source++)
+    {
+      int32_t blockLeft   = m_SourceOffsets[source] % width;
+      int32_t blockTop    = m_SourceOffsets[source] / width;
+      int32_t blockRight  = blockLeft + blockSize - 1;
+      int32_t blockBottom = blockTop + blockSize - 1;
+      if (blockRight >= width)
+      {
+        // The block wraps around to the next lines
+        blockLeft = 0;
+        blockRight = width - 1;
+        blockBottom++;
+      }
+      left   = std::min(left, blockLeft / 8);
+      top    = std::min(top, blockTop / 8);
+      right  = std::max(right, blockRight / 8);
+      bottom = std::max(bottom, blockBottom / 8);
+    }
+    return m_SourceCount != 0;
+  }
+
+  // Average motion vector of the blocks, in pixels
+  void GetMotion(int32_t tileOffset, int32_t width, int32_t& motionX, int32_t& motionY) const
+  {
+    motionX = motionY = 0;
+    for (uint32_t source = 0; source < m_SourceCount; source++)
+    {
+      int32_t destinationOffset = tileOffset + ((m_SourceCount == 4) ? (source & 1) * 4 + (source >> 1) * 4 * width : 0);
+      motionX += m_SourceOffsets[source] % width - destinationOffset % width;
+      motionY += m_SourceOffsets[source] / width - destinationOffset / width;
+    }
+    if (m_SourceCount)
+    {
+      motionX /= (int32_t)m_SourceCount;
+      motionY /= (int32_t)m_SourceCount;
+    }
+  }
+
+public:
+  uint32_t  m_AlignedOffset = 0;            ///< From the start of the chunk
+  uint32_t  m_UnAlignedOffset = 0;
+  uint8_t   m_Opcode = 0;
+  uint8_t   m_SourceCount = 0;              ///< 0, 1 for an 8x8 block, or 4 for the 4x4 blocks in the reading order
+  int32_t   m_SourceOffsets[4] = {};        ///< In the previous frame
+};
+
+
+// Motion of one frame, found without decoding it, see ACFDecoder::ScanMotion
+class MotionView
+{
+public:
+  const TileReference*  m_Tiles;            ///< m_TileColumns * m_TileRows tiles
+  uint32_t              m_TileColumns;
+  uint32_t              m_TileRows;
+  int32_t               m_FrameNumber;
+  bool                  m_IsKeyFrame;
+};
+
+
+
+
+class ACFDecoder
+{
+public:
+  ACFDecoder() = default;
+  ACFDecoder(const ACFDecoder&) = delete;
+  ACFDecoder& operator=(const ACFDecoder&) = delete;
+
+  // The sinks are not owned by the decoder, and get all the frames and camera data decoded by ParseACF
+  void AddFrameSink(FrameSink* frameSink)
+  {
+    m_FrameSinks.push_back(frameSink);
+  }
+
+  void RemoveFrameSink(FrameSink* frameSink)
+  {
+    m_FrameSinks.erase(std::remove(m_FrameSinks.begin(), m_FrameSinks.end(), frameSink), m_FrameSinks.end());
+  }
+
+  // Layout of the decoder buffers, used from the next Format chunk; the sinks always get linear pictures
+  void SetFrameLayout(FrameLayout frameLayout)
+  {
+    m_FrameLayout = frameLayout;
+  }
+
+
+  void SetPixel(int x, int y, uint8_t color)
+  {
+    m_CurrentTile[x + (y * m_Width)] = color;
+  }
+
+
+  // 3 bytes (6 bitsx4) for the position, 4 bytes for colors
+  void Update4()
+  {
+    uint32_t value = *(uint32_t*)m_UnAlignedStream;	// Que 3 octets int‚ressants (Little Endian)
+    m_UnAlignedStream += 3;
+
+    for (int32_t i = 0; i < 4; i++)
+    {
+      SetPixel(value & 7 , ((value >> 3) & 7), *m_AlignedStream++);
+      value >>= 6;
+    }
+  }
+
+
+  void Update8()
+  {
+    Update4();
+    Update4();
+  }
+
+
+
+  void Update16()
+  {
+    for (int32_t y = 0; y < 8; y++)
+    {
+      uint8_t mask = *m_AlignedStream++;
+      for (int32_t x = 0; x < 8; x++)
+      {
+        if (mask & 1)
+        {
+          SetPixel(x,y, *m_UnAlignedStream++);
+        }
+        mask >>= 1;
+      }
+    }
+  }
+
+
+
+  void BlockCopy8x8(uint8_t* dest, const uint8_t* source)
+  {
+    for (int32_t y = 0; y < 8; y++)
+    {
+      memcpy(dest + y * m_Width, source + y * m_Width, 8);
+    }
+  }
+
+  void BlockCopy4x4(uint8_t* dest, const uint8_t* source)
+  {
+    for (int32_t y = 0; y < 4; y++)
+    {
+      memcpy(dest + y * m_Width, source + y * m_Width, 4);
+    }
+  }
+
+  // Copies a block of the previous frame, at a position given as an offset in a linear picture, like the opcodes do
+  void CopyPrevious8x8(uint8_t* dest, int32_t sourceOffset)
+  {
+    if (m_IsTiled)  GatherTiledBlock(dest, sourceOffset, 8);
+    else            BlockCopy8x8(dest, m_PreviousFrameBuffer + sourceOffset);
+  }
+
+  void CopyPrevious4x4(uint8_t* dest, int32_t sourceOffset)
+  {
+    if (m_IsTiled)  GatherTiledBlock(dest, sourceOffset, 4);
+    else            BlockCopy4x4(dest, m_PreviousFrameBuffer + sourceOffset);
+  }
+
+  // The lines of the block are read from the tiles they cross, the same bytes a linear copy would read, including
+  // the ones after the end of a line which are at the start of the next line
+  void GatherTiledBlock(uint8_t* dest, int32_t sourceOffset, int32_t blockSize)
+  {
+    int32_t sourceX = sourceOffset % m_Width;
+    int32_t sourceY = sourceOffset / m_Width;
+    if (!(sourceX & 7) && !(sourceY & 7) && (blockSize == 8))
+    {
+      // Aligned block: a whole tile
+      const uint8_t* tile = m_PreviousFrameBuffer + GetTiledOffset(sourceX, sourceY);
+      for (int32_t y = 0; y < 8; y++)
+      {
+        memcpy(dest + y * m_Width, tile + y * 8, 8);
+      }
+      return;
+    }
+    if (sourceX + blockSize <= m_Width)
+    {
+      // Each line is in one tile or in two tiles next to each other, which are 64 bytes apart
+      int32_t shift = sourceX & 7;
+      const uint8_t* tileLine = m_PreviousFrameBuffer + GetTiledOffset(sourceX, sourceY) - shift;
+      for (int32_t y = 0; y < blockSize; y++, tileLine += 8)
+      {
+        if ((y > 0) && !((sourceY + y) & 7))
+        {
+          tileLine += m_Width * 8 - 64;     // From the bottom of a tile to the top of the one under it
+        }
+        uint8_t line[16];
+        memcpy(line, tileLine, 8);
+        if (shift + blockSize > 8)
+        {
+          memcpy(line + 8, tileLine + 64, 8);
+        }
+        if (blockSize == 8)   memcpy(dest + y * m_Width, line + shift, 8);
+        else                  memcpy(dest + y * m_Width, line + shift, 4);
+      }
+      return;
+    }
+    for (int32_t y = 0; y < blockSize; y++)
+    {
+      int32_t x = sourceX;
+      int32_t line = sourceY + y;
+      uint8_t* output = dest + y * m_Width;
+      for (int32_t remaining = blockSize; remaining; )
+      {
+        int32_t size = std::min(remaining, 8 - (x & 7));
+        memcpy(output, m_PreviousFrameBuffer + GetTiledOffset(x, line), size);
+        output += size;
+        remaining -= size;
+        x += size;
+        if (x == m_Width)
+        {
+          x = 0;
+          line++;
+        }
+      }
+    }
+  }
+
+  int32_t GetTiledOffset(int32_t x, int32_t y) const
+  {
+    return ((y >> 3) * (m_Width >> 3) + (x >> 3)) * 64 + (y & 7) * 8 + (x & 7);
+  }
+
+
+  void ZeroMotionDecode()
+  {
+    CopyPrevious8x8(m_CurrentTile, m_TileOffset);
+  }
+
+
+  void ShortMotion8Decode()
+  {
+    int32_t value = *m_UnAlignedStream++;
+    int32_t dx = (((value & 15) << 28) >> 28);
+    int32_t dy = ((value << 24) >> 28);
+    CopyPrevious8x8(m_CurrentTile, m_TileOffset + (4 + m_Width * 4) + dx + dy * m_Width);
+  }
+
+  void ShortMotion4Decode()
+  {
+    int32_t value = *m_AlignedStream++;
+    int32_t dx = (((value & 15) << 28) >> 28);
+    int32_t dy = ((value << 24) >> 28);
+    CopyPrevious4x4(m_CurrentTile, m_TileOffset + 2 + m_Width * 2 + dx + dy * m_Width);
+    value = *m_AlignedStream++;
+    dx = (((value & 15) << 28) >> 28);
+    dy = ((value << 24) >> 28);
+    CopyPrevious4x4(m_CurrentTile + 4, m_TileOffset + 2 + m_Width * 2 + dx + dy * m_Width + 4);
+    value = *m_AlignedStream++;
+    dx = (((value & 15) << 28) >> 28);
+    dy = ((value << 24) >> 28);
+    CopyPrevious4x4(m_CurrentTile + m_Width * 4, m_TileOffset + 2 + m_Width * 2 + dx + dy * m_Width + m_Width * 4);
+    value = *m_AlignedStream++;
+    dx = (((value & 15) << 28) >> 28);
+    dy = ((value << 24) >> 28);
+    CopyPrevious4x4(m_CurrentTile + m_Width * 4 + 4, m_TileOffset + 2 + m_Width * 2 + dx + dy * m_Width + m_Width * 4 + 4);
+  }
+
+
+  void Motion8Decode()
+  {
+    CopyPrevious8x8(m_CurrentTile, *(uint16_t*)m_UnAlignedStream);
+    m_UnAlignedStream += 2;
+  }
+
+  void Motion4Decode()
+  {
+    CopyPrevious4x4(m_CurrentTile, ReadU16(m_AlignedStream));
+    CopyPrevious4x4(m_CurrentTile + 4, ReadU16(m_AlignedStream));
+    CopyPrevious4x4(m_CurrentTile + m_Width * 4, ReadU16(m_AlignedStream));
+    CopyPrevious4x4(m_CurrentTile + m_Width * 4 + 4, ReadU16(m_AlignedStream));
+  }
+
+
+  void ROMotion8Decode()
+  {
+    CopyPrevious8x8(m_CurrentTile, m_TileOffset + ReadS16(m_UnAlignedStream) + 4 + m_Width * 4);
+  }
+  void ROMotion4Decode()
+  {
+    CopyPrevious4x4(m_CurrentTile, m_TileOffset + ReadS16(m_AlignedStream) + 2 + m_Width * 2);
+    CopyPrevious4x4(m_CurrentTile + 4, m_TileOffset + 4 + ReadS16(m_AlignedStream) + 2 + m_Width * 2);
+    CopyPrevious4x4(m_CurrentTile + m_Width * 4, m_TileOffset + m_Width * 4 + ReadS16(m_AlignedStream) + 2 + m_Width * 2);
+    CopyPrevious4x4(m_CurrentTile + m_Width * 4 + 4, m_TileOffset + m_Width * 4 + 4 + ReadS16(m_AlignedStream) + 2 + m_Width * 2);
+  }
+
+
+
+
+
+  void RCMotion8Decode()
+  {
+    CopyPrevious8x8(m_CurrentTile, m_TileOffset + ReadXYOffset(m_UnAlignedStream,m_Width) + 4 + m_Width * 4);
+  }
+  void RCMotion4Decode()
+  {
+    CopyPrevious4x4(m_CurrentTile, m_TileOffset + ReadXYOffset(m_AlignedStream, m_Width) + 2 + m_Width * 2);
+    CopyPrevious4x4(m_CurrentTile + 4, m_TileOffset + ReadXYOffset(m_AlignedStream, m_Width) + 2 + m_Width * 2 + 4);
+    CopyPrevious4x4(m_CurrentTile + m_Width * 4, m_TileOffset + ReadXYOffset(m_AlignedStream, m_Width) + 2 + m_Width * 2 + m_Width * 4);
+    CopyPrevious4x4(m_CurrentTile + m_Width * 4 + 4, m_TileOffset + ReadXYOffset(m_AlignedStream, m_Width) + 2 + m_Width * 2 + m_Width * 4 + 4);
+  }
+
+
+
+
+  // Load one byte, apply it to the entire tile
+  void SingleColorFillDecode()
+  {
+    uint8_t colorTile = *m_UnAlignedStream++;
+
+    for (int32_t y = 0; y < 8; y++)
+    {
+      memset(m_CurrentTile + y * m_Width, colorTile, 8);
+    }
+  }
+
+  // Load four bytes, one for each quadrant of the tile
+  void FourColorFillDecode()
+  {
+    uint8_t colorTopLeft = *m_AlignedStream++;
+    uint8_t colorTopRight = *m_AlignedStream++;
+    uint8_t colorBottomLeft = *m_AlignedStream++;
+    uint8_t colorBottomRight = *m_AlignedStream++;
+
+    for (int32_t y = 0; y < 4; y++)
+    {
+      memset(m_CurrentTile + y * m_Width, colorTopLeft, 4);
+      memset(m_CurrentTile + y * m_Width + 4, colorTopRight, 4);
+      memset(m_CurrentTile + (y + 4) * m_Width, colorBottomLeft, 4);
+      memset(m_CurrentTile + (y + 4) * m_Width + 4, colorBottomRight, 4);
+    }
+  }
+
+
+
+
+
+  //
+  //
+  // 10 octets:
+  // - 8 octets formant 8x8x1 bits d‚signant chacun la couleur … utiliser
+  // - 2 octets de couleur (indice dans la palette)
+  //
+  //
+  void OneBitTileDecode()
+  {
+    for (int32_t y = 0; y < 8; y++)
+    {
+      uint8_t a = *m_AlignedStream++;
+      for (int32_t x = 0; x < 8; x++)
+      {
+        SetPixel(x, y, m_UnAlignedStream[a & 1]);
+        a >>= 1;
+      }
+    }
+    m_UnAlignedStream += 2;
+  }
+
+
+  //
+  // 20 octets:
+  // - 4 octets de couleur (indice dans la palette)
+  // - 16 octets formant 8x8x2 bits d‚signant chacun la couleur … utiliser
+  //
+  void TwoBitTileDecode()
+  {
+    const uint8_t* colors = m_AlignedStream;
+    m_AlignedStream += 4;
+    for (int32_t y = 0; y < 8; y++)
+    {
+      int32_t a = *(uint16_t*)m_AlignedStream;
+      m_AlignedStream += 2;
+      for (int32_t x = 0; x < 8; x++)
+      {
+        SetPixel(x, y, colors[a & 3]);
+        a >>= 2;
+      }
+    }
+  }
+
+
+
+
+
+  //
+  // 32 octets:
+  // - 24 octets formant 8x8x3 bits d‚signant chacun la couleur … utiliser
+  // - 8 octets de couleur (indice dans la palette)
+  //
+  void ThreeBitTileDecode()
+  {
+    for (int32_t y = 0; y < 8; y++)
+    {
+      uint32_t a = ReadU32(m_AlignedStream, 3);
+      for (int32_t x = 0; x < 8; x++)
+      {
+        SetPixel(x, y, m_UnAlignedStream[a & 7]);
+        a >>= 3;
+      }
+    }
+    m_UnAlignedStream += 8;
+  }
+
+
+
+
+  //
+  // 48 octets:
+  // - 32 octets formant 8x8x4 bits d‚signant chacun la couleur … utiliser
+  // - 16 octets de couleur (indice dans la palette)
+  //
+  void FourBitTileDecode()
+  {
+    for (int32_t y = 0; y < 8; y++)
+    {
+      uint32_t a = ReadU32(m_AlignedStream);
+      for (int32_t x = 0; x < 8; x++)
+      {
+        SetPixel(x, y, m_UnAlignedStream[a & 15]);
+        a >>= 4;
+      }
+    }
+    m_UnAlignedStream += 16;
+  }
+
+
+
+  void OneBitSplitTileDecode()
+  {
+    for (uint32_t offset : g_SplitTileOffsets)
+    {
+      uint16_t a = ReadU16(m_AlignedStream);
+      for (int32_t y = 0; y < 4; y++)
+      {
+        for (int32_t x = 0; x < 4; x++)
+        {
+          m_CurrentTile[x + y * m_Width + offset] = m_AlignedStream[a & 1];
+          a >>= 1;
+        }
+      }
+      m_AlignedStream += 2;
+    }
+  }
+  
+
+  void TwoBitSplitTileDecode()
+  {
+    for (uint32_t offset : g_SplitTileOffsets)
+    {
+      uint32_t a = ReadU32(m_AlignedStream);
+      for (int32_t y = 0; y < 4; y++)
+      {
+        for (int32_t x = 0; x < 4; x++)
+        {
+          m_CurrentTile[x + y * m_Width + offset] = m_AlignedStream[a & 3];
+          a >>= 2;
+        }
+      }
+      m_AlignedStream += 4;
+    }
+  }
+
+ 
+  void ThreeBitSplitTileDecode()
+  {
+    for (uint32_t offset : g_SplitTileOffsets)
+    {
+      uint32_t a = 0;
+      for (int32_t y = 0; y < 4; y++)
+      {
+        if (!(y & 1))
+        {
+          a = ReadU32(m_AlignedStream, 3);
+        }
+        for (int32_t x = 0; x < 4; x++)
+        {
+          m_CurrentTile[x + y * m_Width + offset] = m_UnAlignedStream[a & 7];
+          a >>= 3;
+        }
+      }
+      m_UnAlignedStream += 8;
+    }
+  }
+
+
+  //
+  // 20 bytes:
+  // - 4 octets (Couleurs de base)
+  // - 16 octets (4x4) pour indiquer les correspondances.
+  //
+  void CrossDecode()
+  {
+    uint32_t value = ReadU32(m_AlignedStream);
+    for (uint32_t offset : g_SplitTileOffsets)
+    {
+      uint8_t* dest = m_CurrentTile + offset;
+      if (value & 1)  dest[0] = m_AlignedStream[1];
+      else	      dest[0] = m_AlignedStream[0];
+
+      dest[0] = m_AlignedStream[(value & 1)];	    // 0 ou 1
+      dest[1] = m_AlignedStream[0];		    // 0
+      dest[2] = m_AlignedStream[0];		    // 0
+      dest[3] = m_AlignedStream[((value & 2) >> 1) * 3];    // 0 ou 3
+
+      dest[320] = m_AlignedStream[1];		    // 1
+      dest[321] = m_AlignedStream[(value & 4) >> 2];	    // 0 ou 1
+      dest[322] = m_AlignedStream[((value & 8) >> 3) * 3];    // 0 ou 3
+      dest[323] = m_AlignedStream[3];		    // 3
+
+      dest[640] = m_AlignedStream[1];		    // 1
+      dest[641] = m_AlignedStream[1 + ((value & 16) >> 4)];   // 1 ou 2
+      dest[642] = m_AlignedStream[2 + ((value & 32) >> 5)];   // 2 ou 3
+      dest[643] = m_AlignedStream[3];		    // 3
+
+      dest[960] = m_AlignedStream[1 + ((value & 64) >> 6)];   // 1 ou 2
+      dest[961] = m_AlignedStream[2];		    // 2
+      dest[962] = m_AlignedStream[2];		    // 2
+      dest[963] = m_AlignedStream[2 + ((value & 128) >> 7)];  // 2 ou 3
+
+      m_AlignedStream += 4;
+      value >>= 8;
+    }
+  }
+
+
+
+  void PrimeDecode()
+  {
+    int32_t prime_color = *m_UnAlignedStream++;
+    for (int32_t y = 0; y < 8; y++)
+    {
+      uint8_t a = *m_AlignedStream++;
+      for (int32_t x = 0; x < 8; x++)
+      {
+        if (a & 1)  SetPixel(x, y, *m_UnAlignedStream++);
+        else	    SetPixel(x, y, prime_color);
+        a >>= 1;
+      }
+    }
+  }
+
+
+
+
+  // All 64 colors to directly copy to the buffer. No trick of any kind
+  void RawTileDecode()
+  {
+    for (int32_t y = 0; y < 8; y++)
+    {
+      memcpy(m_CurrentTile + y * m_Width, m_AlignedStream, 8);
+      m_AlignedStream += 8;
+    }
+  }
+
+
+
+  
+  // Similar to RawTileDecode, but all the colors are in the same bank, thus using only 4 bits per pixel
+  void OneBankTileDecode()
+  {
+    uint8_t bank = *m_UnAlignedStream++;
+
+    for (int32_t y = 0; y < 8; y++)
+    {
+      for (int32_t x = 0; x < 8; x++)
+      {
+        if (x & 1)    SetPixel(x,y, bank + ((*m_AlignedStream++) >> 4));
+        else	      SetPixel(x,y, bank + ((*m_AlignedStream) & 15));
+      }
+    }
+  }
+
+  // Similar to OneBankTileDecode, but with colors in two different banks, and thus using 5 bits per pixel
+  // 41 octets:
+  // - 40 octets formant 8x8x5 bits qui d‚finissent la couleur (dans l'intervalle [0,15]), et le num‚ro de la banque.
+  // - 1 octet formant 2x4 bits qui donnent les num‚ros des 2 banques de couleur … utiliser. (Il faut multiplier par 16)
+  //
+  void TwoBanksTileDecode()
+  {
+    uint8_t bank[2];
+
+    bank[0] = ((*m_UnAlignedStream) & 0x0f) << 4;
+    bank[1] = ((*m_UnAlignedStream) & 0xf0);
+    m_UnAlignedStream++;
+
+    for (uint32_t y = 0; y < 8; y++)
+    {
+      uint32_t part1 = *(int32_t*)m_AlignedStream;		// On r‚cupŠre ainsi 5 octets...
+      uint32_t part2 = *(int32_t*)(m_AlignedStream + 4);
+      m_AlignedStream += 5;
+      for (uint32_t x = 0; x < 8; x++)
+      {
+        SetPixel(x, y, bank[(part1 & 16) >> 4] + (part1 & 15));   // Bit 4: Banque … utiliser / Bits 0-3:Couleur
+        part1 >>= 5;
+        part1 |= (part2 << 27);
+        part2 >>= 5;
+      }
+    }
+  }
+
+
+
+  void BlockDecodeHorizontal()
+  {
+    uint8_t last_color = 0;
+
+    for (uint32_t y = 0; y < 8; y++)
+    {
+      uint8_t a = *m_AlignedStream++;
+      for (uint32_t x = 0; x < 8; x++)
+      {
+        if (a & 1)	last_color = *m_UnAlignedStream++;
+        a >>= 1;
+        SetPixel(x, y, last_color);
+      }
+    }
+  }
+  void BlockDecodeVertical()
+  {
+    uint8_t last_color = 0;
+
+    for (int32_t x = 0; x < 8; x++)
+    {
+      uint8_t a = *m_AlignedStream++;
+      for (int32_t y = 0; y < 8; y++)
+      {
+        if (a & 1)	last_color = *m_UnAlignedStream++;
+        a >>= 1;
+        SetPixel(x, y, last_color);
+      }
+    }
+  }
+
+
+
+  void BlockDecode2()
+  {
+    uint8_t last_color = 0;
+
+    uint32_t* offsets = g_DiagonalOffsets_1;
+
+    for (int32_t y = 0; y < 8; y++)
+    {
+      uint8_t a = *m_AlignedStream++;
+      for (int32_t x = 0; x < 8; x++)
+      {
+        if (a & 1)	last_color = *m_UnAlignedStream++;
+        a >>= 1;
+        m_CurrentTile[*offsets++] = last_color;
+      }
+    }
+  }
+
+  void BlockDecode3()
+  {
+    uint8_t last_color = 0;
+
+    uint32_t* offsets = g_DiagonalOffsets_2;
+
+    for (int32_t y = 0; y < 8; y++)
+    {
+      uint8_t a = *m_AlignedStream++;
+      for (int32_t x = 0; x < 8; x++)
+      {
+        if (a & 1)	last_color = *m_UnAlignedStream++;
+        a >>= 1;
+        m_CurrentTile[*offsets++] = last_color;
+      }
+    }
+  }
+
+
+
+
+
+  void BlockBank1DecodeHorizontal()
+  {
+    uint8_t last_color = 0;
+    uint8_t bank = (*m_UnAlignedStream) << 4;	// R‚cupŠre la banque
+    uint8_t flag = 1;
+
+    for (int32_t y = 0; y < 8; y++)
+    {
+      uint8_t a = *m_AlignedStream++;
+      for (int32_t x = 0; x < 8; x++)
+      {
+        if (a & 1)
+        {
+          if (flag)
+          {
+            last_color = (*m_UnAlignedStream) >> 4;
+            flag = 0;
+            m_UnAlignedStream++;
+          }
+          else
+          {
+            last_color = (*m_UnAlignedStream) & 15;
+            flag++;
+          }
+        }
+        a >>= 1;
+        SetPixel(x, y, bank + last_color);
+      }
+    }
+    if (flag)	m_UnAlignedStream++;
+  }
+
+
+  void BlockBank1DecodeVertical()
+  {
+    uint8_t last_color = 0;
+    uint8_t bank = (*m_UnAlignedStream) << 4;	// R‚cupŠre la banque
+    uint8_t flag = 1;
+
+    for (int32_t x = 0; x < 8; x++)
+    {
+      uint8_t a = *m_AlignedStream++;
+      for (int32_t y = 0; y < 8; y++)
+      {
+        if (a & 1)
+        {
+          if (flag)
+          {
+            last_color = (*m_UnAlignedStream) >> 4;
+            flag = 0;
+            m_UnAlignedStream++;
+          }
+          else
+          {
+            last_color = (*m_UnAlignedStream) & 15;
+            flag++;
+          }
+        }
+        a >>= 1;
+        SetPixel(x, y, bank + last_color);
+      }
+    }
+    if (flag)	m_UnAlignedStream++;
+  }
+
+
+  void BlockBank1Decode2()
+  {
+    uint8_t last_color = 0;
+    uint8_t bank = (*m_UnAlignedStream) << 4;	// R‚cupŠre la banque
+    uint8_t flag = 1;
+
+    uint32_t* offsets = g_DiagonalOffsets_1;
+
+    for (int32_t y = 0; y < 8; y++)
+    {
+      uint8_t a = *m_AlignedStream++;
+      for (int32_t x = 0; x < 8; x++)
+      {
+        if (a & 1)
+        {
+          if (flag)
+          {
+            last_color = (*m_UnAlignedStream) >> 4;
+            flag = 0;
+            m_UnAlignedStream++;
+          }
+          else
+          {
+            last_color = (*m_UnAlignedStream) & 15;
+            flag++;
+          }
+        }
+        a >>= 1;
+        m_CurrentTile[*offsets++] = bank + last_color;
+      }
+    }
+    if (flag)	m_UnAlignedStream++;
+  }
+
+  void BlockBank1Decode3()
+  {
+    uint8_t last_color = 0;
+    uint8_t bank = (*m_UnAlignedStream) << 4;	// Get the bank number
+    uint8_t flag = 1;
+
+    uint32_t* offsets = g_DiagonalOffsets_2;
+
+    for (int32_t y = 0; y < 8; y++)
+    {
+      uint8_t a = *m_AlignedStream++;
+      for (int32_t x = 0; x < 8; x++)
+      {
+        if (a & 1)
+        {
+          if (flag)
+          {
+            last_color = (*m_UnAlignedStream) >> 4;
+            flag = 0;
+            m_UnAlignedStream++;
+          }
+          else
+          {
+            last_color = (*m_UnAlignedStream) & 15;
+            flag++;
+          }
+        }
+        a >>= 1;
+        m_CurrentTile[*offsets++] = bank + last_color;
+      }
+    }
+    if (flag)	m_UnAlignedStream++;
+  }
+
+
+
+
+
+  void DecodeTile(int32_t opcode)
+  {
+    switch (opcode)
+    {
+    case 0: RawTileDecode(); break;
+
+    case 1: ZeroMotionDecode(); break;
+    case 2: ZeroMotionDecode(); Update4(); break;
+    case 3: ZeroMotionDecode(); Update8(); break;
+    case 4: ZeroMotionDecode(); Update16(); break;
+
+    case 5: ShortMotion8Decode(); break;
+    case 6: ShortMotion8Decode(); Update4(); break;
+    case 7: ShortMotion8Decode(); Update8(); break;
+    case 8: ShortMotion8Decode(); Update16(); break;
+
+    case 9: Motion8Decode(); break;
+    case 10: Motion8Decode(); Update4(); break;
+    case 11: Motion8Decode(); Update8(); break;
+    case 12: Motion8Decode(); Update16(); break;
+
+    case 13: ShortMotion4Decode(); break;
+    case 14: ShortMotion4Decode(); Update4(); break;
+    case 15: ShortMotion4Decode(); Update8(); break;
+    case 16: ShortMotion4Decode(); Update16(); break;
+
+    case 17: Motion4Decode(); break;
+    case 18: Motion4Decode(); Update4(); break;
+    case 19: Motion4Decode(); Update8(); break;
+    case 20: Motion4Decode(); Update16(); break;
+
+    case 21: SingleColorFillDecode(); break;
+    case 22: SingleColorFillDecode(); Update4(); break;
+    case 23: SingleColorFillDecode(); Update8(); break;
+    case 24: SingleColorFillDecode(); Update16(); break;
+
+    case 25: FourColorFillDecode(); break;
+    case 26: FourColorFillDecode(); Update4(); break;
+    case 27: FourColorFillDecode(); Update8(); break;
+    case 28: FourColorFillDecode(); Update16(); break;
+
+    case 29: OneBitTileDecode(); break;
+    case 30: TwoBitTileDecode(); break;
+    case 31: ThreeBitTileDecode(); break;
+    case 32: FourBitTileDecode(); break;
+
+    case 33: OneBitSplitTileDecode(); break;
+    case 34: TwoBitSplitTileDecode(); break;
+    case 35: ThreeBitSplitTileDecode(); break;
+
+    case 36: CrossDecode(); break;
+    case 37: PrimeDecode(); break;
+
+    case 38: OneBankTileDecode(); break;
+    case 39: TwoBanksTileDecode(); break;
+
+    case 40: BlockDecodeHorizontal(); break;
+    case 41: BlockDecodeVertical(); break;
+    case 42: BlockDecode2(); break;
+    case 43: BlockDecode3(); break;
+
+    case 44: BlockBank1DecodeHorizontal(); break;
+    case 45: BlockBank1DecodeVertical(); break;
+    case 46: BlockBank1Decode2(); break;
+    case 47: BlockBank1Decode3(); break;
+
+    case 48: ROMotion8Decode(); break;
+    case 49: ROMotion8Decode(); Update4(); break;
+    case 50: ROMotion8Decode(); Update8(); break;
+    case 51: ROMotion8Decode(); Update16(); break;
+
+    case 52: RCMotion8Decode(); break;
+    case 53: RCMotion8Decode(); Update4(); break;
+    case 54: RCMotion8Decode(); Update8(); break;
+    case 55: RCMotion8Decode(); Update16(); break;
+
+    case 56: ROMotion4Decode(); break;
+    case 57: ROMotion4Decode(); Update4(); break;
+    case 58: ROMotion4Decode(); Update8(); break;
+    case 59: ROMotion4Decode(); Update16(); break;
+
+    case 60: RCMotion4Decode(); break;
+    case 61: RCMotion4Decode(); Update4(); break;
+    case 62: RCMotion4Decode(); Update8(); break;
+    case 63: RCMotion4Decode(); Update16(); break;
+    }
+  }
+
+
+  // Bytes needed after the end of a stream by the opcodes reading 32 bits values to extract 24 bits or less
+  static constexpr uint32_t g_StreamOverRead = 4;
+
+  bool CheckMotion(int32_t sourceOffset, int32_t blockSize)
+  {
+    return (sourceOffset >= 0) && (sourceOffset + (blockSize - 1) * m_Width + blockSize <= m_Width * m_Height);
+  }
+
+  //
+  // Walks the opcodes and the two streams of the current frame the same way DecompressFrame does, but without
+  // touching the pictures: this computes the exact amount of bytes each tile reads and checks the streams
+  // stay in the chunk and all the motion vectors point inside the previous frame.
+  // The variable amounts (Update16, Prime and Block opcodes) are obtained by counting the bits of the 8 mask
+  // bytes at once, so the cost is a fraction of the actual decoding.
+  //
+  // Returns the number of tiles which can be decoded safely, if that's not all of them m_ValidationError tells why.
+  // With references (tileCount of them), the stream positions and the motion sources of each tile are kept there;
+  // the tiles from the faulty one are given as zero motion tiles, as the slow path of DecodeAcfFrame does.
+  //
+  int32_t ValidateFrame(TileReference* references = nullptr)
+  {
+    const int32_t tileCount = (m_Width / 8) * (m_Height / 8);
+    const uint8_t* chunkStart = m_CurrentChunk->GetData<uint8_t>();
+    const uint8_t* chunkEnd   = chunkStart + m_CurrentChunk->GetChunkSize();
+    const FrameData* frameData = m_CurrentChunk->GetData<FrameData>();
+
+    // The tiles from the faulty one keep the previous picture
+    auto setZeroMotion = [&](int32_t firstTile)
+      {
+        for (int32_t tile = firstTile; references && (tile < tileCount); tile++)
+        {
+          int32_t tileOffset = (tile % (m_Width / 8)) * 8 + (tile / (m_Width / 8)) * 8 * m_Width;
+          references[tile] = { 0, 0, 1, 0, {} };
+          references[tile].AddSource(tileOffset);
+        }
+      };
+
+    uint32_t opcodeSize = std::max((uint32_t)(m_Height / 8) * 30, (uint32_t)(tileCount + 3) / 4 * 3 + 1);
+    if ((chunkEnd > m_FileEnd) || (sizeof(uint32_t) + opcodeSize > m_CurrentChunk->GetChunkSize()) || (frameData->color_offset > m_CurrentChunk->GetChunkSize()))
+    {
+      m_ValidationError = "frame header does not fit in the chunk";
+      setZeroMotion(0);
+      return 0;
+    }
+
+    const uint8_t* ptr_opcode = frameData->GetOpcodesArray();
+    const uint8_t* aligned    = frameData->GetAlignedData(m_Height);
+    const uint8_t* unAligned  = frameData->GetUnalignedData();
+    const uint8_t* readLimit  = std::min(chunkEnd + g_StreamOverRead, m_FileEnd);
+
+    // Returns the position of the next 'size' bytes of a stream, or nullptr if they are not in the chunk
+    auto read = [&](const uint8_t*& stream, uint32_t size) -> const uint8_t*
+      {
+        const uint8_t* data = stream;
+        stream += size;
+        return ((stream <= chunkEnd) && (stream + g_StreamOverRead <= readLimit)) ? data : nullptr;
+      };
+    auto readMask = [&](const uint8_t*& stream, uint32_t& bitCount) -> bool
+      {
+        const uint8_t* mask = read(stream, 8);
+        bitCount = mask ? std::popcount(*(const uint64_t*)mask) : 0;
+        return mask;
+      };
+    auto shortMotion = [&](int32_t value) -> int32_t
+      {
+        return (((value & 15) << 28) >> 28) + ((value << 24) >> 28) * m_Width;
+      };
+    TileReference* reference = nullptr;
+    auto checkMotion = [&](int32_t sourceOffset, int32_t blockSize) -> bool
+      {
+        if (!CheckMotion(sourceOffset, blockSize))
+        {
+          return false;
+        }
+        if (reference)
+        {
+          reference->AddSource(sourceOffset);
+        }
+        return true;
+      };
+
+    int32_t codes = -1;
+    for (int32_t tile = 0; tile < tileCount; tile++)
+    {
+      if (codes == -1)
+      {
+        codes = ((*(int32_t*)ptr_opcode) | 0xff000000);
+        ptr_opcode += 3;
+      }
+      int32_t opcode = codes & 63;
+      codes >>= 6;
+
+      int32_t tileOffset = (tile % (m_Width / 8)) * 8 + (tile / (m_Width / 8)) * 8 * m_Width;
+      if (references)
+      {
+        reference = &references[tile];
+        *reference = { (uint32_t)(aligned - chunkStart), (uint32_t)(unAligned - chunkStart), (uint8_t)opcode, 0, {} };
+      }
+      int32_t update = ((opcode >= 1) && (opcode <= 28)) ? (opcode - 1) % 4 : (opcode >= 48) ? (opcode - 48) % 4 : 0;
+      const uint8_t* data = nullptr;
+      uint32_t bitCount = 0;
+      bool valid = true;
+      switch (opcode - update)
+      {
+      case 0:   valid = read(aligned, 64); break;
+      case 1:   checkMotion(tileOffset, 8); break;
+      case 5:   valid = (data = read(unAligned, 1)) && checkMotion(tileOffset + 4 + m_Width * 4 + shortMotion(data[0]), 8); break;
+      case 9:   valid = (data = read(unAligned, 2)) && checkMotion(*(uint16_t*)data, 8); break;
+      case 48:  valid = (data = read(unAligned, 2)) && checkMotion(tileOffset + *(int16_t*)data + 4 + m_Width * 4, 8); break;
+      case 52:  valid = (data = read(unAligned, 2)) && checkMotion(tileOffset + (int8_t)data[0] + ((int8_t)data[1]) * m_Width / 2 + 4 + m_Width * 4, 8); break;
+      case 13:
+      case 17:
+      case 56:
+      case 60:
+        valid = (data = read(aligned, (opcode - update == 13) ? 4 : 8));
+        for (int32_t quadrant = 0; (quadrant < 4) && valid; quadrant++)
+        {
+          int32_t quadrantOffset = tileOffset + (quadrant & 1) * 4 + (quadrant >> 1) * 4 * m_Width;
+          switch (opcode - update)
+          {
+          case 13:  valid = checkMotion(quadrantOffset + 2 + m_Width * 2 + shortMotion(data[quadrant]), 4); break;
+          case 17:  valid = checkMotion(((uint16_t*)data)[quadrant], 4); break;
+          case 56:  valid = checkMotion(quadrantOffset + ((int16_t*)data)[quadrant] + 2 + m_Width * 2, 4); break;
+          case 60:  valid = checkMotion(quadrantOffset + (int8_t)data[quadrant * 2] + ((int8_t)data[quadrant * 2 + 1]) * m_Width / 2 + 2 + m_Width * 2, 4); break;
+          }
+        }
+        break;
+      case 21:  valid = read(unAligned, 1); break;
+      case 25:  valid = read(aligned, 4); break;
+      case 29:  valid = read(aligned, 8) && read(unAligned, 2); break;
+      case 30:  valid = read(aligned, 20); break;
+      case 31:  valid = read(aligned, 24) && read(unAligned, 8); break;
+      case 32:  valid = read(aligned, 32) && read(unAligned, 16); break;
+      case 33:  valid = read(aligned, 16); break;
+      case 34:  valid = read(aligned, 32); break;
+      case 35:  valid = read(aligned, 24) && read(unAligned, 32); break;
+      case 36:  valid = read(aligned, 20); break;
+      case 37:  valid = read(unAligned, 1) && readMask(aligned, bitCount) && read(unAligned, bitCount); break;
+      case 38:  valid = read(unAligned, 1) && read(aligned, 32); break;
+      case 39:  valid = read(unAligned, 1) && read(aligned, 40); break;
+      case 40:
+      case 41:
+      case 42:
+      case 43:  valid = readMask(aligned, bitCount) && read(unAligned, bitCount); break;
+      case 44:
+      case 45:
+      case 46:
+      case 47:  valid = readMask(aligned, bitCount) && read(unAligned, (bitCount + 2) / 2); break;   // The bank nibble and one nibble per color change
+      }
+
+      switch (update)
+      {
+      case 1:   valid = valid && read(unAligned, 3) && read(aligned, 4); break;
+      case 2:   valid = valid && read(unAligned, 6) && read(aligned, 8); break;
+      case 3:   valid = valid && readMask(aligned, bitCount) && read(unAligned, bitCount); break;
+      }
+
+      // These opcodes have a 320 pixels stride hardcoded
+      if (((opcode >= 33) && (opcode <= 36)) || (opcode == 42) || (opcode == 43) || (opcode == 46) || (opcode == 47))
+      {
+        valid = valid && (tileOffset + 7 * 320 + 8 <= m_Width * m_Height);
+      }
+
+      if (!valid)
+      {
+        m_ValidationError = std::format("tile {} (opcode {}) reads outside of the chunk or of the previous frame", tile, opcode);
+        setZeroMotion(tile);
+        return tile;
+      }
+    }
+    return tileCount;
+  }
+
+
+  //
+  // Each compressor has its own frame decoder, chosen by SetFormat when the Format chunk is read: the codec is only
+  // checked once per clip, and the tile loop of each decoder is specialized for its own opcodes.
+  //
+  using FrameDecoder = void (ACFDecoder::*)();
+
+  static FrameDecoder GetFrameDecoder(uint32_t compressor)
+  {
+    switch ((Compressor)compressor)
+    {
+    case Compressor::e_ACF:   return &ACFDecoder::DecodeAcfFrame;
+    default:                  return nullptr;         // The XCF opcodes are not documented, see SetFormat
+    }
+  }
+
+  // Decodes the current frame chunk in m_CurrentBuffer, using m_PreviousBuffer as the reference
+  void DecodeFrameData()
+  {
+    (this->*m_FrameDecoder)();
+  }
+
+
+  void DecodeAcfFrame()
+  {
+    m_PreviousFrameBuffer = m_PreviousBuffer->GetBuffer();
+
+    const FrameData* frameData = m_CurrentChunk->GetData<FrameData>();
+    m_UnAlignedStream = frameData->GetUnalignedData();                      // Pointer on things that can be out of alignment 
+    m_AlignedStream   = frameData->GetAlignedData(m_Height);                // Pointer on data guaranteed to be aligned on a 32 bit multiple
+
+    const uint8_t* ptr_opcode = frameData->GetOpcodesArray();               // Pointer on the list of decoding methods
+
+    // Untrusted data: only frames which have been validated go through the fast path
+    int32_t validTileCount = ValidateFrame();
+    m_ValidTileCount = validTileCount;
+    if (validTileCount == (m_Width / 8) * (m_Height / 8))
+    {
+      int32_t codes = -1;                                                   // "-1" means "need to read the 3 next bytes from the stream"
+      for (int32_t y = 0; y < (m_Height/8); y++)
+      {
+        StartTileRow(y);
+        for (int32_t x = 0; x < (m_Width/8); x++)
+        {
+          if (codes == -1)
+          {
+            codes = ((*(int32_t*)ptr_opcode) | 0xff000000);
+            ptr_opcode += 3;
+          }
+
+          ACF_LOG(LogLevel::e_Tile, "Frame " << m_FrameNumber << " tile " << x << "," << y << ": opcode " << (codes & 63));
+          DecodeTile(codes & 63);
+
+          codes >>= 6;		        // Get the next opcode by shifting. We will reload the next 3 bytes when the variable reaches the value -1
+
+          m_TileOffset += 8;	        // Next 8x8 block
+          m_CurrentTile += 8;	        // Next 8x8 block
+        }
+        EndTileRow(y);
+      }
+    }
+    else
+    {
+      // Slow path: the tiles before the faulty one are decoded normally, the other ones keep the previous picture
+      ACF_LOG(LogLevel::e_Summary, "Frame " << m_FrameNumber << ": " << m_ValidationError << ", only " << validTileCount << " tiles decoded");
+      int32_t codes = -1;
+      for (int32_t tile = 0; tile < (m_Width / 8) * (m_Height / 8); tile++)
+      {
+        if (!(tile % (m_Width / 8)))
+        {
+          StartTileRow(tile / (m_Width / 8));
+        }
+        if (tile < validTileCount)
+        {
+          if (codes == -1)
+          {
+            codes = ((*(int32_t*)ptr_opcode) | 0xff000000);
+            ptr_opcode += 3;
+          }
+          ACF_LOG(LogLevel::e_Tile, "Frame " << m_FrameNumber << " tile " << tile % (m_Width / 8) << "," << tile / (m_Width / 8) << ": opcode " << (codes & 63));
+          DecodeTile(codes & 63);
+          codes >>= 6;
+        }
+        else
+        {
+          ZeroMotionDecode();
+        }
+
+        m_TileOffset += 8;
+        m_CurrentTile += 8;
+        if ((tile % (m_Width / 8)) == (m_Width / 8) - 1)
+        {
+          EndTileRow(tile / (m_Width / 8));
+        }
+      }
+    }
+  }
+
+
+  //
+  // With the tiled layout, the 64 pixels of each tile are stored together, so a motion vector pointing on a tile
+  // reads one cache line instead of 8 lines 320 bytes apart. The opcodes still decode a row of tiles at a time with
+  // the linear layout, in m_TileRow which stays in the L1 cache, and the row is then stored tile by tile.
+  // The pictures are converted to the linear layout only when they are given out (GetFrameView).
+  //
+  void StartTileRow(int32_t tileY)
+  {
+    m_TileOffset  = tileY * 8 * m_Width;
+    m_CurrentTile = m_IsTiled ? m_TileRow.data() : m_CurrentBuffer->GetBuffer() + m_TileOffset;
+  }
+
+  void EndTileRow(int32_t tileY)
+  {
+    if (m_IsTiled)
+    {
+      uint8_t* tiles = m_CurrentBuffer->GetBuffer() + tileY * 8 * m_Width;
+      for (int32_t tileX = 0; tileX < m_Width / 8; tileX++)
+      {
+        for (int32_t y = 0; y < 8; y++)
+        {
+          memcpy(tiles + tileX * 64 + y * 8, m_TileRow.data() + y * m_Width + tileX * 8, 8);
+        }
+      }
+    }
+  }
+
+  static void ConvertTiledToLinear(const uint8_t* tiled, uint8_t* linear, int32_t width, int32_t height)
+  {
+    for (int32_t tile = 0; tile < (width / 8) * (height / 8); tile++)
+    {
+      uint8_t* output = linear + (tile / (width / 8)) * 8 * width + (tile % (width / 8)) * 8;
+      for (int32_t y = 0; y < 8; y++)
+      {
+        memcpy(output + y * width, tiled + tile * 64 + y * 8, 8);
+      }
+    }
+  }
+
+  static void ConvertLinearToTiled(const uint8_t* linear, uint8_t* tiled, int32_t width, int32_t height)
+  {
+    for (int32_t tile = 0; tile < (width / 8) * (height / 8); tile++)
+    {
+      const uint8_t* input = linear + (tile / (width / 8)) * 8 * width + (tile % (width / 8)) * 8;
+      for (int32_t y = 0; y < 8; y++)
+      {
+        memcpy(tiled + tile * 64 + y * 8, input + y * width, 8);
+      }
+    }
+  }
+
+
+  // Only decodes the flagged tiles, each one starting at the stream positions ValidateFrame found for it
+  void DecodeAcfRegion(const TileReference* references, const uint8_t* neededTiles)
+  {
+    const uint8_t* chunkStart = m_CurrentChunk->GetData<uint8_t>();
+    m_PreviousFrameBuffer = m_PreviousBuffer->GetBuffer();
+    for (int32_t tile = 0; tile < (m_Width / 8) * (m_Height / 8); tile++)
+    {
+      if (neededTiles[tile])
+      {
+        m_TileOffset  = (tile % (m_Width / 8)) * 8 + (tile / (m_Width / 8)) * 8 * m_Width;
+        m_CurrentTile = m_CurrentBuffer->GetBuffer() + m_TileOffset;
+        m_AlignedStream   = chunkStart + references[tile].m_AlignedOffset;
+        m_UnAlignedStream = chunkStart + references[tile].m_UnAlignedOffset;
+        DecodeTile(references[tile].m_Opcode);
+      }
+    }
+  }
+
+
+  FrameView GetFrameView()
+  {
+    if (m_IsTiled)
+    {
+      m_LinearBuffer.resize((size_t)m_Width * m_Height);
+      ConvertTiledToLinear(m_CurrentBuffer->GetBuffer(), m_LinearBuffer.data(), m_Width, m_Height);
+      return { m_LinearBuffer.data(), (uint32_t)m_Width, (uint32_t)m_Height, m_Palette, m_FrameNumber };
+    }
+    return { m_CurrentBuffer->GetBuffer(), (uint32_t)m_Width, (uint32_t)m_Height, m_Palette, m_FrameNumber };
+  }
+
+
+  // Without notifySinks, the frame is only decoded to be the reference of the next one
+  void DecompressFrame(bool notifySinks = true)
+  {
+    DecodeFrameData();
+
+    // Give the decoded picture to the sinks
+    if (notifySinks && m_Palette)
+    {
+      FrameView frameView = GetFrameView();
+      for (FrameSink* frameSink : m_FrameSinks)
+      {
+        frameSink->OnFrame(frameView);
+      }
+    }
+    else if (notifySinks)
+    {
+      ACF_LOG(LogLevel::e_Summary, "Frame " << m_FrameNumber << ": no palette defined, frame skipped");
+    }
+    m_FrameNumber++;
+
+    // Swap the buffers
+    std::swap(m_CurrentBuffer, m_PreviousBuffer);
+  }
+
+
+  // The buffers belong to the decoder and keep their memory, decoding another file (or a Format chunk in the middle of
+  // a file) only allocates if the pictures are bigger than all the previous ones
+  void CreateBuffers()
+  {
+    m_ImageBuffers[0].Reset(m_Width, m_Height);
+    m_ImageBuffers[1].Reset(m_Width, m_Height);
+    m_CurrentBuffer  = &m_ImageBuffers[0];
+    m_PreviousBuffer = &m_ImageBuffers[1];
+  }
+
+
+
+  void NotifyEnd()
+  {
+    for (FrameSink* frameSink : m_FrameSinks)
+    {
+      frameSink->OnEnd();
+    }
+  }
+
+
+  void StartParsing(std::span<const std::byte> acfFile)
+  {
+    m_FileEnd = (const uint8_t*)acfFile.data() + acfFile.size();
+    m_ChunkDirectory.Build(acfFile);      // Truncated files are decoded up to the last complete chunk
+
+    // Nothing must be left from a previously decoded file
+    m_Format   = nullptr;
+    m_Palette  = nullptr;
+    m_FrameLen = nullptr;
+    m_Camera   = nullptr;
+    m_FrameDecoder = &ACFDecoder::DecodeAcfFrame;
+    m_IsTiled = false;
+
+    CreateBuffers();
+
+    m_FrameNumber = 0;
+  }
+
+
+  // The chunks read as a structure have to hold all of it: the shorter ones are logged and ignored, so a damaged clip
+  // keeps the previous palette instead of reading past its chunk
+  template<typename T>
+  const T* GetChunkData(const ChunkEntry& entry, uint32_t minimumSize = sizeof(T)) const
+  {
+    if (entry.m_Size < minimumSize)
+    {
+      ACF_LOG(LogLevel::e_Summary, "Chunk '" << g_ChunkNames[(int32_t)entry.m_Type] << "' too short (" << entry.m_Size << " bytes), ignored");
+      return nullptr;
+    }
+    return m_ChunkDirectory.GetChunk(entry)->GetData<T>();
+  }
+
+
+  // The clips the decoder cannot decode (like the XCF ones, whose opcodes are not documented) are rejected here, before
+  // their first frame, so the sinks never get wrong pictures and the callers see the clip as failed
+  bool SetFormat()
+  {
+    if (m_CurrentChunk->GetChunkSize() < sizeof(Format))
+    {
+      ACF_LOG(LogLevel::e_Summary, "Format chunk too short (" << m_CurrentChunk->GetChunkSize() << " bytes)");
+      return false;
+    }
+    m_Format = m_CurrentChunk->GetData<Format>();
+    if ((m_Format->width == 0) || (m_Format->height == 0) || (m_Format->width % 8) || (m_Format->height % 8))
+    {
+      ACF_LOG(LogLevel::e_Summary, "Invalid format " << m_Format->width << "x" << m_Format->height);
+      return false;
+    }
+    m_FrameDecoder = GetFrameDecoder(m_Format->compressor);
+    if (!m_FrameDecoder)
+    {
+      if ((Compressor)m_Format->compressor == Compressor::e_XCF)
+      {
+        ACF_LOG(LogLevel::e_Summary, "XCF compressed clips are not supported");
+      }
+      else
+      {
+        ACF_LOG(LogLevel::e_Summary, "Unknown compressor " << m_Format->compressor);
+      }
+      return false;
+    }
+    m_Width = m_Format->width;
+    m_Height = m_Format->height;
+    m_IsTiled = (m_FrameLayout == FrameLayout::e_Tiled) && (m_Width == 320) && (m_FrameDecoder == &ACFDecoder::DecodeAcfFrame);     // Some opcodes have a 320 pixels stride hardcoded
+    m_TileRow.resize(m_IsTiled ? (size_t)m_Width * 8 : 0);
+    CreateBuffers();
+    return true;
+  }
+
+
+  //
+  // With a checkpoint path, the progress is saved there every g_CheckpointInterval frames, and the checkpoint is
+  // removed once the end is reached. If the path already has a checkpoint for this file, decoding restarts at its
+  // keyframe instead of the first frame: the frames up to the last one given to the sinks are decoded again but
+  // not given again. The chunks and camera records before the keyframe are still given (without decoding anything),
+  // so the outputs which are not frames, like the VUE file, are complete.
+  //
+  bool ParseACF(std::span<const std::byte> acfFile, const std::filesystem::path& checkpointPath = {})
+  {
+    StartParsing(acfFile);
+
+    const std::vector<ChunkEntry>& entries = m_ChunkDirectory.GetEntries();
+    DecodeCheckpoint chunkState;              // Chunks active at the current point of the file
+    DecodeCheckpoint checkpoint;              // Chunks active at the last keyframe
+    chunkState.m_FileSize = acfFile.size();
+    size_t firstEntry = 0;
+    int32_t lastWrittenFrame = -1;
+    std::filesystem::path checkpointTemporaryPath = checkpointPath.empty() ? std::filesystem::path() : DecodeCheckpoint::GetTemporaryPath(checkpointPath);
+    if (!checkpointPath.empty() && checkpoint.Load(checkpointPath) && checkpoint.Matches(m_ChunkDirectory, acfFile.size()))
+    {
+      firstEntry = m_ChunkDirectory.FindEntry(checkpoint.m_KeyFrameOffset);
+      lastWrittenFrame = checkpoint.m_LastFrame;
+      for (size_t index = 0; index < firstEntry; index++)
+      {
+        const Chunk* chunk = m_ChunkDirectory.GetChunk(entries[index]);
+        const Camera* camera = (entries[index].m_Type == ChunkType::e_Camera) ? GetChunkData<Camera>(entries[index]) : nullptr;
+        for (FrameSink* frameSink : m_FrameSinks)
+        {
+          frameSink->OnChunk(entries[index], *chunk);
+          if (camera)
+          {
+            frameSink->OnCamera(*camera, entries[index].m_FrameNumber);
+          }
+        }
+      }
+
+      chunkState = checkpoint;
+      m_CurrentChunk = m_ChunkDirectory.GetChunk(entries[m_ChunkDirectory.FindEntry(checkpoint.m_FormatOffset)]);
+      if (!SetFormat())
+      {
+        return false;
+      }
+      if (checkpoint.m_PaletteOffset != DecodeCheckpoint::g_NoChunk)
+      {
+        m_Palette = GetChunkData<Palette>(entries[m_ChunkDirectory.FindEntry(checkpoint.m_PaletteOffset)]);
+      }
+      if (checkpoint.m_FrameLenOffset != DecodeCheckpoint::g_NoChunk)
+      {
+        m_FrameLen = GetChunkData<FrameLen>(entries[m_ChunkDirectory.FindEntry(checkpoint.m_FrameLenOffset)], FrameLen::g_HeaderSize);
+      }
+      m_FrameNumber = entries[firstEntry].m_FrameNumber;
+      ACF_LOG(LogLevel::e_Summary, "Resuming after frame " << lastWrittenFrame << ", from the keyframe " << m_FrameNumber);
+    }
+
+    for (size_t index = firstEntry; index < entries.size(); index++)
+    {
+      const ChunkEntry& entry = entries[index];
+      m_CurrentChunk = m_ChunkDirectory.GetChunk(entry);
+
+      // Show the name of the current chunk, which is not even formatted at the default log level
+      ACF_LOG(LogLevel::e_Chunk, "Chunk: '" << g_ChunkNames[(int32_t)entry.m_Type] << "' (" << entry.m_Size << " bytes long)");
+      for (FrameSink* frameSink : m_FrameSinks)
+      {
+        frameSink->OnChunk(entry, *m_CurrentChunk);
+      }
+
+      // Process the current chunk
+      switch (entry.m_Type)
+      {
+      case ChunkType::e_End:
+        ACF_LOG(LogLevel::e_Chunk, "Reached the end");
+        NotifyEnd();
+        RemoveCheckpoint(checkpointPath);
+        return true;
+
+      case ChunkType::e_Unknown:
+        ACF_LOG(LogLevel::e_Summary, "Unknown chunk '" << m_CurrentChunk->GetChunkName() << "' detected.");
+        break;
+
+      case ChunkType::e_NulChunk:  // Nothing to do, nul chunks are just for padding/alignment to get better CD streaming performance
+        break;
+
+      case ChunkType::e_PackedFr:  // Repacked file which did not go through LoadClip or UnpackFrames
+        ACF_LOG(LogLevel::e_Summary, "Frame " << m_FrameNumber << ": compressed frame, the file has to be unpacked first (UnpackFrames)");
+        break;
+
+      case ChunkType::e_Format:
+        if (!SetFormat())
+        {
+          return false;
+        }
+        chunkState.m_FormatOffset = entry.m_Offset;
+        break;
+
+      case ChunkType::e_FrameLen:
+        if (const FrameLen* frameLen = GetChunkData<FrameLen>(entry, FrameLen::g_HeaderSize))
+        {
+          m_FrameLen = frameLen;
+          chunkState.m_FrameLenOffset = entry.m_Offset;
+        }
+        break;
+
+      case ChunkType::e_Palette:
+        if (const Palette* palette = GetChunkData<Palette>(entry))
+        {
+          m_Palette = palette;
+          chunkState.m_PaletteOffset = entry.m_Offset;
+        }
+        break;
+
+      case ChunkType::e_Camera:
+        if (const Camera* camera = GetChunkData<Camera>(entry))
+        {
+          m_Camera = camera;
+          for (FrameSink* frameSink : m_FrameSinks)
+          {
+            frameSink->OnCamera(*m_Camera, m_FrameNumber);
+          }
+        }
+        break;
+
+      case ChunkType::e_KeyFrame:
+      case ChunkType::e_DltFrame:
+        if (entry.m_Type == ChunkType::e_KeyFrame)
+        {
+          checkpoint = chunkState;
+          checkpoint.m_KeyFrameOffset = entry.m_Offset;
+        }
+        DecompressFrame(m_FrameNumber > lastWrittenFrame);
+        if (!checkpointPath.empty() && !(m_FrameNumber % g_CheckpointInterval) && (m_FrameNumber - 1 > lastWrittenFrame))
+        {
+          checkpoint.m_LastFrame = m_FrameNumber - 1;
+          checkpoint.Save(checkpointPath, checkpointTemporaryPath, m_CheckpointFile);
+        }
+        break;
+
+      default:
+        break;
+      }
+    }
+
+    NotifyEnd();
+    RemoveCheckpoint(checkpointPath);
+    return true;  // Sometimes there's no End chunk
+  }
+
+
+  static void RemoveCheckpoint(const std::filesystem::path& checkpointPath)
+  {
+    if (!checkpointPath.empty())
+    {
+      std::error_code errorCode;
+      std::filesystem::remove(checkpointPath, errorCode);
+    }
+  }
+
+
+
+  // Metadata only: the sinks get the chunks and the camera records, but the frames are never decoded
+  bool ScanACF(std::span<const std::byte> acfFile)
+  {
+    m_FileEnd = (const uint8_t*)acfFile.data() + acfFile.size();
+    m_ChunkDirectory.Build(acfFile);
+
+    for (const ChunkEntry& entry : m_ChunkDirectory.GetEntries())
+    {
+      m_CurrentChunk = m_ChunkDirectory.GetChunk(entry);
+      for (FrameSink* frameSink : m_FrameSinks)
+      {
+        frameSink->OnChunk(entry, *m_CurrentChunk);
+      }
+
+      const Camera* camera = (entry.m_Type == ChunkType::e_Camera) ? GetChunkData<Camera>(entry) : nullptr;
+      if (camera)
+      {
+        m_Camera = camera;
+        for (FrameSink* frameSink : m_FrameSinks)
+        {
+          frameSink->OnCamera(*m_Camera, entry.m_FrameNumber);
+        }
+      }
+    }
+    m_FrameNumber = m_ChunkDirectory.GetFrameCount();
+
+    NotifyEnd();
+    return true;
+  }
+
+
+  //
+  // Lazy decoding, without any sink: a frame is only decoded when the caller asks for it, and stopping the
+  // iteration stops the decoding. Decoding starts at the last keyframe before firstFrame, the frames in between
+  // are decoded but not returned, and at most frameCount frames are returned.
+  // With keyFramesOnly, only the KeyFrame chunks are decoded and returned, the delta frames are just skipped.
+  // knownFrame is an already decoded frame of the same file, between that keyframe and firstFrame: decoding
+  // then restarts from its picture instead of the keyframe, as a delta frame only needs the previous picture.
+  // The views point on the decoder buffers, so they are only valid until the next iteration, and acfFile
+  // has to stay alive as long as the generator is used.
+  //
+  Generator<FrameView> DecodeFrames(std::span<const std::byte> acfFile, int32_t firstFrame = 0, int32_t frameCount = INT32_MAX, bool keyFramesOnly = false, const FrameView* knownFrame = nullptr)
+  {
+    StartParsing(acfFile);
+
+    int32_t startFrame = m_ChunkDirectory.GetKeyFrameBefore(firstFrame);
+    if (knownFrame && ((knownFrame->m_FrameNumber < startFrame) || (knownFrame->m_FrameNumber >= firstFrame)))
+    {
+      knownFrame = nullptr;
+    }
+    if (knownFrame)
+    {
+      startFrame = knownFrame->m_FrameNumber + 1;
+    }
+    const int64_t endFrame   = (int64_t)firstFrame + frameCount;
+
+    for (const ChunkEntry& entry : m_ChunkDirectory.GetEntries())
+    {
+      m_CurrentChunk = m_ChunkDirectory.GetChunk(entry);
+      switch (entry.m_Type)
+      {
+      case ChunkType::e_End:
+        co_return;
+
+      case ChunkType::e_Format:
+        if (!SetFormat())
+        {
+          co_return;
+        }
+        break;
+
+      case ChunkType::e_FrameLen:
+        if (const FrameLen* frameLen = GetChunkData<FrameLen>(entry, FrameLen::g_HeaderSize))
+        {
+          m_FrameLen = frameLen;
+        }
+        break;
+
+      case ChunkType::e_Palette:
+        if (const Palette* palette = GetChunkData<Palette>(entry))
+        {
+          m_Palette = palette;
+        }
+        break;
+
+      case ChunkType::e_Camera:
+        if (const Camera* camera = GetChunkData<Camera>(entry))
+        {
+          m_Camera = camera;
+        }
+        break;
+
+      case ChunkType::e_KeyFrame:
+      case ChunkType::e_DltFrame:
+        if (m_FrameNumber >= endFrame)
+        {
+          co_return;
+        }
+        if ((m_FrameNumber >= startFrame) && (!keyFramesOnly || (entry.m_Type == ChunkType::e_KeyFrame)))
+        {
+          if (knownFrame && (m_FrameNumber == startFrame))
+          {
+            if ((knownFrame->m_Width != (uint32_t)m_Width) || (knownFrame->m_Height != (uint32_t)m_Height))
+            {
+              co_return;
+            }
+            if (m_IsTiled)
+            {
+              ConvertLinearToTiled(knownFrame->m_Pixels, m_PreviousBuffer->GetBuffer(), m_Width, m_Height);
+            }
+            else
+            {
+              memcpy(m_PreviousBuffer->GetBuffer(), knownFrame->m_Pixels, (size_t)m_Width * m_Height);
+            }
+          }
+          DecodeFrameData();
+          if ((m_FrameNumber >= firstFrame) && m_Palette)
+          {
+            FrameView frameView = GetFrameView();
+            co_yield frameView;
+          }
+          std::swap(m_CurrentBuffer, m_PreviousBuffer);
+        }
+        m_FrameNumber++;
+        break;
+
+      default:
+        break;
+      }
+    }
+  }
+
+
+  //
+  // Region of interest version of DecodeFrames: only the pixels of the region are valid in the returned frames.
+  // A first pass runs ValidateFrame on all the frames from the keyframe before firstFrame to the last one asked,
+  // which gives the stream positions and the motion sources of every tile. Going backward from the last frame,
+  // the tiles needed in a frame are the ones in the region if that frame is returned, plus the sources of the
+  // tiles needed in the next frame: the second pass only decodes these tiles, and skips the data of the other ones.
+  // The ACF clips of the game are 320 pixels wide, the other widths (and the other compressors) are decoded whole,
+  // as some opcodes write with a 320 pixels stride, and so are the clips decoded with the tiled layout.
+  //
+  Generator<FrameView> DecodeRegion(std::span<const std::byte> acfFile, FrameRegion region, int32_t firstFrame = 0, int32_t frameCount = INT32_MAX)
+  {
+    StartParsing(acfFile);
+
+    const int32_t startFrame = m_ChunkDirectory.GetKeyFrameBefore(firstFrame);
+    const int64_t endFrame   = (int64_t)firstFrame + frameCount;
+
+    // First pass: the tile references of each frame, none for the frames to decode whole
+    std::vector<std::vector<TileReference>> frameReferences;
+    for (const ChunkEntry& entry : m_ChunkDirectory.GetEntries())
+    {
+      m_CurrentChunk = m_ChunkDirectory.GetChunk(entry);
+      if ((entry.m_Type == ChunkType::e_End) || (((entry.m_Type == ChunkType::e_KeyFrame) || (entry.m_Type == ChunkType::e_DltFrame)) && (entry.m_FrameNumber >= endFrame)))
+      {
+        break;
+      }
+      if ((entry.m_Type == ChunkType::e_Format) && !SetFormat())
+      {
+        co_return;
+      }
+      if (((entry.m_Type == ChunkType::e_KeyFrame) || (entry.m_Type == ChunkType::e_DltFrame)) && (entry.m_FrameNumber >= startFrame))
+      {
+        std::vector<TileReference>& references = frameReferences.emplace_back();
+        if ((m_FrameDecoder == &ACFDecoder::DecodeAcfFrame) && (m_Width == 320) && !m_IsTiled)
+        {
+          references.resize((m_Width / 8) * (m_Height / 8));
+          ValidateFrame(references.data());
+        }
+      }
+    }
+
+    // Backward pass: the tiles needed in each frame
+    const int32_t tileColumns = m_Width / 8;
+    const int32_t tileCount   = tileColumns * (m_Height / 8);
+    std::vector<uint8_t> regionTiles(tileCount);
+    for (int32_t y = std::max(region.m_Y, 0) / 8; y < std::min((region.m_Y + region.m_Height + 7) / 8, m_Height / 8); y++)
+    {
+      for (int32_t x = std::max(region.m_X, 0) / 8; x < std::min((region.m_X + region.m_Width + 7) / 8, tileColumns); x++)
+      {
+        regionTiles[y * tileColumns + x] = 1;
+      }
+    }
+    std::vector<std::vector<uint8_t>> frameNeededTiles(frameReferences.size());
+    std::vector<uint8_t> neededTiles = regionTiles;
+    for (size_t frame = frameReferences.size(); frame-- > 0; )
+    {
+      const std::vector<TileReference>& references = frameReferences[frame];
+      std::vector<uint8_t> previousNeededTiles = (startFrame + (int32_t)frame - 1 >= firstFrame) ? regionTiles : std::vector<uint8_t>(tileCount);
+      if (references.size() != (size_t)tileCount)
+      {
+        std::fill(neededTiles.begin(), neededTiles.end(), 1);
+        std::fill(previousNeededTiles.begin(), previousNeededTiles.end(), 1);
+      }
+      else
+      {
+        for (int32_t tile = 0; tile < tileCount; tile++)
+        {
+          int32_t left, top, right, bottom;
+          if (neededTiles[tile] && references[tile].GetSourceTiles(m_Width, left, top, right, bottom))
+          {
+            for (int32_t y = top; y <= bottom; y++)
+            {
+              std::fill_n(&previousNeededTiles[y * tileColumns + left], right - left + 1, 1);
+            }
+          }
+        }
+      }
+      frameNeededTiles[frame] = std::move(neededTiles);
+      neededTiles = std::move(previousNeededTiles);
+    }
+
+    // Second pass: the same as DecodeFrames, with the tiles needed only
+    StartParsing(acfFile);
+    for (const ChunkEntry& entry : m_ChunkDirectory.GetEntries())
+    {
+      m_CurrentChunk = m_ChunkDirectory.GetChunk(entry);
+      switch (entry.m_Type)
+      {
+      case ChunkType::e_End:
+        co_return;
+
+      case ChunkType::e_Format:
+        if (!SetFormat())
+        {
+          co_return;
+        }
+        break;
+
+      case ChunkType::e_Palette:
+        if (const Palette* palette = GetChunkData<Palette>(entry))
+        {
+          m_Palette = palette;
+        }
+        break;
+
+      case ChunkType::e_KeyFrame:
+      case ChunkType::e_DltFrame:
+        if ((m_FrameNumber >= endFrame) || (m_FrameNumber - startFrame >= (int32_t)frameReferences.size()))
+        {
+          co_return;
+        }
+        if (m_FrameNumber >= startFrame)
+        {
+          const std::vector<TileReference>& references = frameReferences[m_FrameNumber - startFrame];
+          if (references.empty())
+          {
+            DecodeFrameData();
+          }
+          else
+          {
+            DecodeAcfRegion(references.data(), frameNeededTiles[m_FrameNumber - startFrame].data());
+          }
+          if ((m_FrameNumber >= firstFrame) && m_Palette)
+          {
+            FrameView frameView = GetFrameView();
+            co_yield frameView;
+          }
+          std::swap(m_CurrentBuffer, m_PreviousBuffer);
+        }
+        m_FrameNumber++;
+        break;
+
+      default:
+        break;
+      }
+    }
+  }
+
+
+  //
+  // The opcode and the motion of each tile of each frame, without decoding any pixel: ValidateFrame reads the
+  // opcodes and the motion vectors, and only counts the bytes of the other tiles to skip them. The frames of the
+  // other compressors are skipped, and the tiles after an error in a frame are given as zero motion tiles.
+  // The views are only valid until the next iteration.
+  //
+  Generator<MotionView> ScanMotion(std::span<const std::byte> acfFile)
+  {
+    StartParsing(acfFile);
+
+    std::vector<TileReference> references;
+    for (const ChunkEntry& entry : m_ChunkDirectory.GetEntries())
+    {
+      m_CurrentChunk = m_ChunkDirectory.GetChunk(entry);
+      switch (entry.m_Type)
+      {
+      case ChunkType::e_End:
+        co_return;
+
+      case ChunkType::e_Format:
+        if (!SetFormat())
+        {
+          co_return;
+        }
+        break;
+
+      case ChunkType::e_KeyFrame:
+      case ChunkType::e_DltFrame:
+        if (m_FrameDecoder == &ACFDecoder::DecodeAcfFrame)
+        {
+          references.resize((m_Width / 8) * (m_Height / 8));      // ValidateFrame sets all of them
+          ValidateFrame(references.data());
+          MotionView motionView = { references.data(), (uint32_t)m_Width / 8, (uint32_t)m_Height / 8, m_FrameNumber, entry.m_Type == ChunkType::e_KeyFrame };
+          co_yield motionView;
+        }
+        m_FrameNumber++;
+        break;
+
+      default:
+        break;
+      }
+    }
+  }
+
+
+
+  // Loads the whole file in memory, as it is: the clips go through LoadClip
+  static bool LoadFile(const std::filesystem::path& sourcePath, std::vector<std::byte>& fileContent)
+  {
+    if (std::filesystem::exists(sourcePath))
+    {
+      // We have a valid file, let's get the size and try to load it
+      std::error_code errorCode;
+      const auto fileSize = std::filesystem::file_size(sourcePath, errorCode);  // errorCode is available since C++17, without it, error handling is done by throwing an exception
+      if (!errorCode)
+      {
+        ACF_LOG(LogLevel::e_Summary, sourcePath << " size= " << fileSize);
+        fileContent.resize(fileSize);
+        std::ifstream is(sourcePath, std::ios::binary);
+        is.read(reinterpret_cast<char*>(fileContent.data()), fileSize);
+
+        if (is.gcount() == fileSize)
+        {
+          // It's in the box
+          return true;
+        }
+        else
+        {
+          // Got an error when trying to get the size
+          ACF_LOG(LogLevel::e_Summary, sourcePath << " file size " << fileSize << " does not match loaded size " << is.gcount());
+        }
+      }
+      else
+      {
+        // Got an error when trying to get the size
+        ACF_LOG(LogLevel::e_Summary, sourcePath << " : " << errorCode.message());
+      }
+    }
+    else
+    {
+      // Not found
+      ACF_LOG(LogLevel::e_Summary, sourcePath << " was not found");
+    }
+    return false;
+  }
+
+
+  // Loads an ACF file, ready to decode: the compressed frames of the repacked clips are unpacked
+  static bool LoadClip(const std::filesystem::path& sourcePath, std::vector<std::byte>& fileContent)
+  {
+    return LoadFile(sourcePath, fileContent) && UnpackFrames(fileContent);
+  }
+
+
+  // The PackedFr chunks of a repacked file are decompressed back to KeyFrame and DltFrame chunks, each frame on any of the
+  // threads, and the SeekIndx chunk is removed since the offsets change. Nothing is done for the other files.
+  static bool UnpackFrames(std::vector<std::byte>& fileContent)
+  {
+    ChunkDirectory chunkDirectory;
+    chunkDirectory.Build(fileContent);
+    const std::vector<ChunkEntry>& entries = chunkDirectory.GetEntries();
+    if (std::none_of(entries.begin(), entries.end(), [](const ChunkEntry& entry) { return entry.m_Type == ChunkType::e_PackedFr; }))
+    {
+      return true;
+    }
+
+    // The chunks are placed first, with the header and the size of the original frames
+    std::vector<std::byte> unpackedContent;
+    std::vector<std::pair<const ChunkEntry*, size_t>> packedFrames;      // Entry, and position of the unpacked data
+    for (const ChunkEntry& entry : entries)
+    {
+      const std::byte* chunk = (const std::byte*)chunkDirectory.GetChunk(entry);
+      if (entry.m_Type != ChunkType::e_PackedFr)
+      {
+        unpackedContent.insert(unpackedContent.end(), chunk, chunk + sizeof(Chunk) + entry.m_Size);
+        continue;
+      }
+      uint32_t frameSize = 0;
+      if (entry.m_Size >= sizeof(Chunk))
+      {
+        memcpy(&frameSize, chunk + sizeof(Chunk) + 8, 4);
+      }
+      if ((entry.m_Size < sizeof(Chunk)) || (unpackedContent.size() + sizeof(Chunk) + frameSize > UINT32_MAX))
+      {
+        ACF_LOG(LogLevel::e_Summary, "Packed frame " << entry.m_FrameNumber << " is damaged");
+        return false;
+      }
+      unpackedContent.insert(unpackedContent.end(), chunk + sizeof(Chunk), chunk + sizeof(Chunk) * 2);
+      packedFrames.push_back({ &entry, unpackedContent.size() });
+      unpackedContent.resize(unpackedContent.size() + frameSize);
+    }
+
+    std::atomic<size_t> nextFrame = 0;
+    std::atomic<bool> isValid = true;
+    auto unpack = [&]()
+      {
+        for (size_t frame = nextFrame++; frame < packedFrames.size(); frame = nextFrame++)
+        {
+          const ChunkEntry& entry = *packedFrames[frame].first;
+          const std::byte* packedData = (const std::byte*)chunkDirectory.GetChunk(entry) + sizeof(Chunk) * 2;
+          uint32_t frameSize;
+          memcpy(&frameSize, packedData - 4, 4);
+          if (!BlockCodec::Decompress({ packedData, entry.m_Size - sizeof(Chunk) }, { unpackedContent.data() + packedFrames[frame].second, frameSize }))
+          {
+            ACF_LOG(LogLevel::e_Summary, "Packed frame " << entry.m_FrameNumber << " is damaged");
+            isValid = false;
+          }
+        }
+      };
+    std::vector<std::thread> threads;
+    uint32_t threadCount = std::min<uint32_t>(std::thread::hardware_concurrency(), (uint32_t)packedFrames.size() / 16);
+    for (uint32_t thread = 1; thread < threadCount; thread++)
+    {
+      threads.emplace_back(unpack);
+    }
+    unpack();
+    for (std::thread& thread : threads)
+    {
+      thread.join();
+    }
+    fileContent.swap(unpackedContent);
+    return isValid;
+  }
+
+
+  // Decodes the file to the registered sinks, see ParseACF for the checkpoint
+  bool DecodeFile(const std::filesystem::path& sourcePath, const std::filesystem::path& checkpointPath = {})
+  {
+    m_SourcePath = sourcePath;
+
+    if (LoadClip(sourcePath, m_FileContent))
+    {
+      if (ParseACF(m_FileContent, checkpointPath))
+      {
+        // Yeah \o/
+        return true;
+      }
+      else
+      {
+        // Got an error when trying to parse the ACF file
+        ACF_LOG(LogLevel::e_Summary, sourcePath << " : could not parse ACF format");
+      }
+    }
+    return false;
+  }
+
+
+  // Writes the clip metadata, and the camera data to cameraPath if not empty (or with the metadata if empty)
+  bool ScanFile(const std::filesystem::path& sourcePath, TextWriter& metadataWriter, const std::filesystem::path& cameraPath = {})
+  {
+    m_SourcePath = sourcePath;
+
+    if (!LoadClip(sourcePath, m_FileContent))
+    {
+      return false;
+    }
+
+    MetadataSink metadataSink(metadataWriter, cameraPath.empty());
+    CameraSink cameraSink(cameraPath);
+    AddFrameSink(&metadataSink);
+    if (!cameraPath.empty())
+    {
+      AddFrameSink(&cameraSink);
+    }
+
+    bool result = ScanACF(m_FileContent);
+
+    RemoveFrameSink(&metadataSink);
+    RemoveFrameSink(&cameraSink);
+    return result;
+  }
+
+
+  // Writes all the frames as PCX files in the output folder, and the camera data to cameraPath if not empty.
+  // An interrupted export restarts from the checkpoint left in the output folder.
+  bool ExportACF(const std::filesystem::path& sourcePath, const std::string& outputFolder, const std::filesystem::path& cameraPath = {})
+  {
+    PcxSink pcxSink(outputFolder);
+    CameraSink cameraSink(cameraPath);
+    AddFrameSink(&pcxSink);
+    if (!cameraPath.empty())
+    {
+      AddFrameSink(&cameraSink);
+    }
+
+    bool result = DecodeFile(sourcePath, outputFolder + g_CheckpointName);
+
+    RemoveFrameSink(&pcxSink);
+    RemoveFrameSink(&cameraSink);
+    return result;
+  }
+
+public:
+  int32_t         m_Width  = 320;
+  int32_t         m_Height = 240;
+  int32_t         m_FrameNumber = 0;
+
+  ChunkDirectory  m_ChunkDirectory;
+  const Chunk*    m_CurrentChunk = nullptr;
+
+  const Format*   m_Format   = nullptr;
+  const Palette*  m_Palette  = nullptr;
+  const FrameLen* m_FrameLen = nullptr;
+  const Camera*   m_Camera   = nullptr;
+
+  ImageBuffer     m_ImageBuffers[2];                ///< The current and previous pictures, swapped after each frame
+  ImageBuffer*    m_PreviousBuffer = nullptr;
+  uint8_t*        m_PreviousFrameBuffer = nullptr;
+
+  ImageBuffer*    m_CurrentBuffer = nullptr;
+  uint8_t*        m_CurrentTile = nullptr;
+  int32_t         m_TileOffset = 0;                 ///< Position of the current tile in a linear picture
+
+  FrameLayout           m_FrameLayout = FrameLayout::e_Linear;
+  bool                  m_IsTiled = false;          ///< The buffers use the tiled layout
+  std::vector<uint8_t>  m_TileRow;                  ///< Row of tiles being decoded, with the tiled layout
+  std::vector<uint8_t>  m_LinearBuffer;             ///< Current picture converted to the linear layout, with the tiled layout
+
+  const uint8_t* m_AlignedStream = nullptr;
+  const uint8_t* m_UnAlignedStream = nullptr;
+
+  const uint8_t*  m_FileEnd = nullptr;
+  std::string     m_ValidationError;
+  int32_t         m_ValidTileCount = 0;             ///< Tiles of the last decoded frame which passed ValidateFrame
+
+  FrameDecoder    m_FrameDecoder = &ACFDecoder::DecodeAcfFrame;
+
+  std::vector<FrameSink*> m_FrameSinks;
+
+  std::filesystem::path   m_SourcePath;
+  std::vector<std::byte>  m_FileContent;            ///< Last file loaded by DecodeFile or ScanFile, its memory is reused by the next one
+  OutputFile              m_CheckpointFile;
+};
+
+
+
+static_assert(sizeof(PaletteEntry) == 3 , "Palette entries are supposed to be 8 bit RGB triplets (3 bytes)");
+static_assert(sizeof(Palette) == 256 * 3, "A Palette should contain 256 8 bit RGB triples (768 bytes)");
@@ -0,0 +1,234 @@
+//
+// Audio output
+//
+// The sound of a clip is in the SoundBuf and SoundFrm chunks, interleaved with the frames, followed by a SoundEnd
+// chunk. Their data is raw PCM, described by the Format chunk with the Miles Sound System values the original
+// player gave to its audio driver: sample_type is one of the DIG_F_* formats (8 or 16 bit, mono or stereo), and
+// sample_flags tells if the samples are signed (DIG_PCM_SIGN) and if the stereo channels are swapped (DIG_PCM_ORDER).
+//
+// WavSink gets these chunks from the decoder chunk walk, so the file is read once for both the pictures and the
+// sound. The decoder only copies the chunk data to a bounded queue, the conversion to the WAV sample format and the
+// writing are done by a thread of their own, and the decoder only waits if that thread is g_AudioQueueSize blocks late.
+// The blocks of the queue are swapped with the one of the writer thread instead of being freed, so once they are as
+// big as the chunks of the clip, the decoder copies the sound without allocating.
+//
+
+#pragma once
+
+#include "ACFDecoder.h"
+
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+
+enum SampleType : uint32_t
+{
+  e_SampleMono8    = 0,        ///< DIG_F_MONO_8
+  e_SampleMono16   = 1,        ///< DIG_F_MONO_16
+  e_SampleStereo8  = 2,        ///< DIG_F_STEREO_8
+  e_SampleStereo16 = 3,        ///< DIG_F_STEREO_16
+};
+
+enum SampleFlags : uint32_t
+{
+  e_SampleSigned   = 1,        ///< DIG_PCM_SIGN
+  e_SampleReversed = 2,        ///< DIG_PCM_ORDER, right channel first
+};
+
+inline constexpr size_t g_AudioQueueSize = 64;
+
+
+class WavHeader
+{
+public:
+  char      m_Riff[4]         = { 'R', 'I', 'F', 'F' };
+  uint32_t  m_RiffSize        = 36;
+  char      m_Wave[4]         = { 'W', 'A', 'V', 'E' };
+  char      m_Fmt[4]          = { 'f', 'm', 't', ' ' };
+  uint32_t  m_FmtSize         = 16;
+  uint16_t  m_AudioFormat     = 1;          ///< PCM
+  uint16_t  m_ChannelCount    = 1;
+  uint32_t  m_SampleRate      = 0;
+  uint32_t  m_ByteRate        = 0;
+  uint16_t  m_BlockAlign      = 0;
+  uint16_t  m_BitsPerSample   = 0;
+  char      m_Data[4]         = { 'd', 'a', 't', 'a' };
+  uint32_t  m_DataSize        = 0;
+};
+
+static_assert(sizeof(WavHeader) == 44, "The WAV header is supposed to be 44 bytes long");
+
+
+// Writes the sound chunks to a WAV file, which is only created if the clip has sound
+class WavSink : public FrameSink
+{
+public:
+  WavSink(const std::filesystem::path& wavPath)
+    : m_WavPath(wavPath)
+  {}
+
+  WavSink(const WavSink&) = delete;
+  WavSink& operator=(const WavSink&) = delete;
+
+  ~WavSink()
+  {
+    Finish();
+  }
+
+  void OnFrame(const FrameView& /*frame*/) override {}
+
+  void OnChunk(const ChunkEntry& entry, const Chunk& chunk) override
+  {
+    switch (entry.m_Type)
+    {
+    case ChunkType::e_Format:
+      if (entry.m_Size >= sizeof(Format))
+      {
+        m_Format = *chunk.GetData<Format>();
+        m_HasFormat = true;
+      }
+      break;
+
+    case ChunkType::e_SoundBuf:
+    case ChunkType::e_SoundFrm:
+      if (entry.m_Size && Start())
+      {
+        const uint8_t* data = chunk.GetData<uint8_t>();
+        std::unique_lock<std::mutex> lock(m_QueueMutex);
+        m_QueueCondition.wait(lock, [this]() { return m_QueueCount < g_AudioQueueSize; });
+        m_Queue[(m_QueueStart + m_QueueCount) % g_AudioQueueSize].assign(data, data + entry.m_Size);
+        m_QueueCount++;
+        m_QueueCondition.notify_all();
+      }
+      break;
+
+    case ChunkType::e_SoundEnd:
+      Finish();
+      break;
+
+    default:
+      break;
+    }
+  }
+
+  void OnEnd() override
+  {
+    Finish();
+  }
+
+  // Number of bytes of samples written to the WAV file, only valid after the end
+  uint32_t GetDataSize() const { return m_Header.m_DataSize; }
+
+private:
+  // Creates the file and the writer thread on the first sound chunk
+  bool Start()
+  {
+    if (m_Thread.joinable() || m_IsFinished)
+    {
+      return m_Thread.joinable();
+    }
+    m_IsFinished = true;          // No second try if this one fails
+    if (!m_HasFormat || !m_Format.sampling_rate || (m_Format.sample_type > e_SampleStereo16))
+    {
+      std::cout << m_WavPath << " : sound chunks without a valid sound format, the sound is not extracted" << std::endl;
+      return false;
+    }
+    m_File.open(m_WavPath, std::ios::binary);
+    if (!m_File)
+    {
+      std::cout << m_WavPath << " : could not create the file" << std::endl;
+      return false;
+    }
+
+    m_Is16Bits = (m_Format.sample_type == e_SampleMono16) || (m_Format.sample_type == e_SampleStereo16);
+    m_IsStereo = (m_Format.sample_type == e_SampleStereo8) || (m_Format.sample_type == e_SampleStereo16);
+    m_Header.m_ChannelCount  = m_IsStereo ? 2 : 1;
+    m_Header.m_SampleRate    = m_Format.sampling_rate;
+    m_Header.m_BitsPerSample = m_Is16Bits ? 16 : 8;
+    m_Header.m_BlockAlign    = m_Header.m_ChannelCount * m_Header.m_BitsPerSample / 8;
+    m_Header.m_ByteRate      = m_Header.m_SampleRate * m_Header.m_BlockAlign;
+    m_File.write((const char*)&m_Header, sizeof(m_Header));       // The sizes are patched at the end
+
+    m_IsFinished = false;
+    m_Thread = std::thread([this]() { WriteSamples(); });
+    return true;
+  }
+
+  void Finish()
+  {
+    if (m_Thread.joinable())
+    {
+      {
+        std::lock_guard<std::mutex> lock(m_QueueMutex);
+        m_IsFinished = true;
+        m_QueueCondition.notify_all();
+      }
+      m_Thread.join();
+
+      m_Header.m_RiffSize = 36 + m_Header.m_DataSize;
+      m_File.seekp(0);
+      m_File.write((const char*)&m_Header, sizeof(m_Header));
+      m_File.close();
+    }
+    m_IsFinished = true;
+  }
+
+  // Writer thread: the WAV format wants unsigned 8 bit samples, signed 16 bit samples, and the left channel first
+  void WriteSamples()
+  {
+    std::vector<uint8_t> block;
+    while (true)
+    {
+      {
+        std::unique_lock<std::mutex> lock(m_QueueMutex);
+        m_QueueCondition.wait(lock, [this]() { return m_QueueCount || m_IsFinished; });
+        if (!m_QueueCount)
+        {
+          return;
+        }
+        block.swap(m_Queue[m_QueueStart]);        // The previous block goes back to the queue, with its memory
+        m_QueueStart = (m_QueueStart + 1) % g_AudioQueueSize;
+        m_QueueCount--;
+        m_QueueCondition.notify_all();
+      }
+
+      uint32_t sampleSize = m_Header.m_BitsPerSample / 8;
+      block.resize(block.size() - block.size() % m_Header.m_BlockAlign);       // A partial sample can only come from a damaged chunk
+      bool isSigned = (m_Format.sample_flags & e_SampleSigned) != 0;
+      if (m_Is16Bits ? !isSigned : isSigned)
+      {
+        for (size_t offset = sampleSize - 1; offset < block.size(); offset += sampleSize)
+        {
+          block[offset] ^= 0x80;
+        }
+      }
+      if (m_IsStereo && (m_Format.sample_flags & e_SampleReversed))
+      {
+        for (size_t offset = 0; offset < block.size(); offset += m_Header.m_BlockAlign)
+        {
+          std::swap_ranges(&block[offset], &block[offset] + sampleSize, &block[offset] + sampleSize);
+        }
+      }
+      m_File.write((const char*)block.data(), block.size());
+      m_Header.m_DataSize += (uint32_t)block.size();
+    }
+  }
+
+private:
+  std::filesystem::path             m_WavPath;
+  std::ofstream                     m_File;
+  Format                            m_Format = {};
+  bool                              m_HasFormat = false;
+  bool                              m_Is16Bits = false;
+  bool                              m_IsStereo = false;
+  WavHeader                         m_Header;
+
+  std::thread                       m_Thread;
+  std::mutex                        m_QueueMutex;
+  std::condition_variable           m_QueueCondition;
+  std::vector<uint8_t>              m_Queue[g_AudioQueueSize];      ///< Ring of m_QueueCount blocks from m_QueueStart
+  size_t                            m_QueueStart = 0;
+  size_t                            m_QueueCount = 0;
+  bool                              m_IsFinished = false;
+};
@@ -0,0 +1,164 @@
+//
+// Block compression of the frames of the repacked clips (ACF2PCX repack)
+//
+// A byte oriented LZ77 in the style of LZ4: no entropy coding, so decompressing is mostly memcpy, and each block only
+// needs itself and its output buffer, so the frames of a clip can be decompressed in parallel.
+// A block is a list of sequences, each one being:
+// - a token: the literal count in the high 4 bits, the match length minus 4 in the low 4 bits, 15 meaning that more
+//   bytes follow in the stream (each one is added to the count, until one is not 255)
+// - the literals
+// - the distance of the match back in the output (16 bits), then the extra match length bytes
+// The last sequence of the block only has literals, and stops at the end of the block.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <vector>
+
+
+class BlockCodec
+{
+public:
+  static constexpr uint32_t g_MinMatch    = 4;
+  static constexpr uint32_t g_MaxDistance = 65535;
+  static constexpr uint32_t g_HashBits    = 12;
+
+  static void Compress(std::span<const std::byte> input, std::vector<std::byte>& output)
+  {
+    const uint8_t* source = (const uint8_t*)input.data();
+    const size_t size = input.size();
+    std::vector<uint32_t> positions(1 << g_HashBits, UINT32_MAX);     // Last position of each hash of 4 bytes
+
+    size_t literalStart = 0;
+    size_t position = 0;
+    while (position + g_MinMatch <= size)
+    {
+      uint32_t value;
+      memcpy(&value, source + position, 4);
+      uint32_t hash = (value * 2654435761u) >> (32 - g_HashBits);
+      uint32_t candidate = positions[hash];
+      positions[hash] = (uint32_t)position;
+      if ((candidate != UINT32_MAX) && (position - candidate <= g_MaxDistance) && !memcmp(source + candidate, source + position, g_MinMatch))
+      {
+        size_t length = g_MinMatch;
+        while ((position + length < size) && (source[candidate + length] == source[position + length]))
+        {
+          length++;
+        }
+        WriteSequence(output, source + literalStart, position - literalStart, position - candidate, length);
+        position += length;
+        literalStart = position;
+      }
+      else
+      {
+        position++;
+      }
+    }
+    WriteSequence(output, source + literalStart, size - literalStart, 0, 0);
+  }
+
+  // The output has to be exactly the size of the uncompressed block, false if the block is damaged
+  static bool Decompress(std::span<const std::byte> input, std::span<std::byte> output)
+  {
+    const uint8_t* in        = (const uint8_t*)input.data();
+    const uint8_t* inEnd     = in + input.size();
+    uint8_t*       outStart  = (uint8_t*)output.data();
+    uint8_t*       out       = outStart;
+    uint8_t*       outEnd    = out + output.size();
+    while (in < inEnd)
+    {
+      uint32_t token = *in++;
+      size_t literalCount = token >> 4;
+      if (((literalCount == 15) && !ReadLength(in, inEnd, literalCount)) || (literalCount > (size_t)(inEnd - in)) || (literalCount > (size_t)(outEnd - out)))
+      {
+        return false;
+      }
+      if (literalCount)
+      {
+        memcpy(out, in, literalCount);
+      }
+      in  += literalCount;
+      out += literalCount;
+      if (in == inEnd)
+      {
+        break;      // The last sequence
+      }
+
+      if (inEnd - in < 2)
+      {
+        return false;
+      }
+      size_t distance = in[0] | (in[1] << 8);
+      in += 2;
+      size_t length = (token & 15) + g_MinMatch;
+      if ((((token & 15) == 15) && !ReadLength(in, inEnd, length)) || !distance || (distance > (size_t)(out - outStart)) || (length > (size_t)(outEnd - out)))
+      {
+        return false;
+      }
+      const uint8_t* match = out - distance;
+      if (distance >= length)
+      {
+        memcpy(out, match, length);
+        out += length;
+      }
+      else
+      {
+        for (size_t index = 0; index < length; index++)
+        {
+          *out++ = match[index];     // Overlapping match, which repeats the last bytes
+        }
+      }
+    }
+    return out == outEnd;
+  }
+
+private:
+  // A length of 0 writes only the literals, for the last sequence
+  static void WriteSequence(std::vector<std::byte>& output, const uint8_t* literals, size_t literalCount, size_t distance, size_t length)
+  {
+    size_t matchCode = length ? length - g_MinMatch : 0;
+    output.push_back((std::byte)((std::min<size_t>(literalCount, 15) << 4) | std::min<size_t>(matchCode, 15)));
+    if (literalCount >= 15)
+    {
+      WriteLength(output, literalCount - 15);
+    }
+    output.insert(output.end(), (const std::byte*)literals, (const std::byte*)literals + literalCount);
+    if (length)
+    {
+      output.push_back((std::byte)(distance & 255));
+      output.push_back((std::byte)(distance >> 8));
+      if (matchCode >= 15)
+      {
+        WriteLength(output, matchCode - 15);
+      }
+    }
+  }
+
+  static void WriteLength(std::vector<std::byte>& output, size_t length)
+  {
+    for (; length >= 255; length -= 255)
+    {
+      output.push_back((std::byte)255);
+    }
+    output.push_back((std::byte)length);
+  }
+
+  static bool ReadLength(const uint8_t*& in, const uint8_t* inEnd, size_t& length)
+  {
+    uint8_t value;
+    do
+    {
+      if (in == inEnd)
+      {
+        return false;
+      }
+      value = *in++;
+      length += value;
+    } while (value == 255);
+    return true;
+  }
+};
@@ -0,0 +1,353 @@
+//
+// Frame upscaling
+//
+// The frames are scaled on the palette indices, before any palette expansion: the result is still an indexed
+// picture with the same palette, so it goes to the same writers as the original frames, and it is 4 to 16 times
+// less data to process than RGB pixels.
+//
+// Two filters:
+// - Nearest neighbour, each pixel becomes a square of factor x factor pixels
+// - Pixel art (Scale2x/Scale3x, the EPX family), which only compares pixels with each other and so works as well on
+//   indices as on colors: edges are smoothed without adding any new color. Scale4x is Scale2x applied twice.
+//
+// The SIMD versions process 16 pixels at a time and give exactly the same result as the scalar versions, which are
+// used on the other CPUs and with "--cpu scalar". The 2x and 4x versions only need SSE2, the 3x versions need the
+// SSSE3 byte shuffle to spread the pixels in groups of 3 (so the "sse4" level).
+//
+
+#pragma once
+
+#include "ACFDecoder.h"
+
+
+enum class ScaleFilter
+{
+  e_Nearest,
+  e_PixelArt,
+};
+
+
+namespace ScalerKernels
+{
+  //
+  // The rows have a one pixel border replicating the edges, so row[-1] and row[width] are valid, and the rows
+  // above and below the picture are copies of the first and last rows. first and last are pixel positions.
+  //
+  inline void Scale2xRow(const uint8_t* above, const uint8_t* row, const uint8_t* below, uint32_t first, uint32_t last, uint8_t* top, uint8_t* bottom)
+  {
+    for (int32_t x = first; x < (int32_t)last; x++)
+    {
+      uint8_t b = above[x], d = row[x - 1], e = row[x], f = row[x + 1], h = below[x];
+      bool isEdge = (b != h) && (d != f);
+      top[2 * x]        = (isEdge && (d == b)) ? d : e;
+      top[2 * x + 1]    = (isEdge && (b == f)) ? f : e;
+      bottom[2 * x]     = (isEdge && (d == h)) ? d : e;
+      bottom[2 * x + 1] = (isEdge && (h == f)) ? f : e;
+    }
+  }
+
+  inline void Scale3xRow(const uint8_t* above, const uint8_t* row, const uint8_t* below, uint32_t first, uint32_t last, uint8_t* top, uint8_t* middle, uint8_t* bottom)
+  {
+    for (int32_t x = first; x < (int32_t)last; x++)
+    {
+      uint8_t a = above[x - 1], b = above[x], c = above[x + 1];
+      uint8_t d = row[x - 1],   e = row[x],   f = row[x + 1];
+      uint8_t g = below[x - 1], h = below[x], i = below[x + 1];
+      bool isEdge = (b != h) && (d != f);
+      bool db = isEdge && (d == b), bf = isEdge && (b == f), dh = isEdge && (d == h), hf = isEdge && (h == f);
+      top[3 * x]        = db ? d : e;
+      top[3 * x + 1]    = ((db && (e != c)) || (bf && (e != a))) ? b : e;
+      top[3 * x + 2]    = bf ? f : e;
+      middle[3 * x]     = ((db && (e != g)) || (dh && (e != a))) ? d : e;
+      middle[3 * x + 1] = e;
+      middle[3 * x + 2] = ((bf && (e != i)) || (hf && (e != c))) ? f : e;
+      bottom[3 * x]     = dh ? d : e;
+      bottom[3 * x + 1] = ((dh && (e != i)) || (hf && (e != g))) ? h : e;
+      bottom[3 * x + 2] = hf ? f : e;
+    }
+  }
+
+  inline void NearestRow(const uint8_t* row, uint32_t first, uint32_t last, uint32_t factor, uint8_t* target)
+  {
+    for (uint32_t x = first; x < last; x++)
+    {
+      memset(target + x * factor, row[x], factor);
+    }
+  }
+
+#ifdef ACF_X86
+  inline __m128i Select(__m128i mask, __m128i value, __m128i otherValue)
+  {
+    return _mm_or_si128(_mm_and_si128(mask, value), _mm_andnot_si128(mask, otherValue));
+  }
+
+  inline void Scale2xRowSse2(const uint8_t* above, const uint8_t* row, const uint8_t* below, uint32_t width, uint8_t* top, uint8_t* bottom)
+  {
+    uint32_t x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+      __m128i b = _mm_loadu_si128((const __m128i*)(above + x));
+      __m128i d = _mm_loadu_si128((const __m128i*)(row + x - 1));
+      __m128i e = _mm_loadu_si128((const __m128i*)(row + x));
+      __m128i f = _mm_loadu_si128((const __m128i*)(row + x + 1));
+      __m128i h = _mm_loadu_si128((const __m128i*)(below + x));
+      __m128i isNotEdge = _mm_or_si128(_mm_cmpeq_epi8(b, h), _mm_cmpeq_epi8(d, f));
+      __m128i e0 = Select(_mm_andnot_si128(isNotEdge, _mm_cmpeq_epi8(d, b)), d, e);
+      __m128i e1 = Select(_mm_andnot_si128(isNotEdge, _mm_cmpeq_epi8(b, f)), f, e);
+      __m128i e2 = Select(_mm_andnot_si128(isNotEdge, _mm_cmpeq_epi8(d, h)), d, e);
+      __m128i e3 = Select(_mm_andnot_si128(isNotEdge, _mm_cmpeq_epi8(h, f)), f, e);
+      _mm_storeu_si128((__m128i*)(top + 2 * x),         _mm_unpacklo_epi8(e0, e1));
+      _mm_storeu_si128((__m128i*)(top + 2 * x + 16),    _mm_unpackhi_epi8(e0, e1));
+      _mm_storeu_si128((__m128i*)(bottom + 2 * x),      _mm_unpacklo_epi8(e2, e3));
+      _mm_storeu_si128((__m128i*)(bottom + 2 * x + 16), _mm_unpackhi_epi8(e2, e3));
+    }
+    Scale2xRow(above, row, below, x, width, top, bottom);
+  }
+
+  // Byte shuffles giving each part of 16 bytes of first0 second0 third0 first1 second1 third1...
+  class Interleave3Shuffles
+  {
+  public:
+    constexpr Interleave3Shuffles()
+    {
+      for (int32_t position = 0; position < 48; position++)
+      {
+        for (int32_t source = 0; source < 3; source++)
+        {
+          m_Shuffles[position / 16][source][position % 16] = ((position % 3) == source) ? (int8_t)(position / 3) : (int8_t)0x80;
+        }
+      }
+    }
+
+    alignas(16) int8_t m_Shuffles[3][3][16] = {};
+  };
+
+  inline constexpr Interleave3Shuffles g_Interleave3Shuffles;
+
+  ACF_TARGET("ssse3") inline void StoreInterleaved3(__m128i first, __m128i second, __m128i third, uint8_t* target)
+  {
+    for (int32_t part = 0; part < 3; part++)
+    {
+      const __m128i* shuffles = (const __m128i*)g_Interleave3Shuffles.m_Shuffles[part];
+      __m128i result = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(first, _mm_load_si128(shuffles)), _mm_shuffle_epi8(second, _mm_load_si128(shuffles + 1))),
+                                    _mm_shuffle_epi8(third, _mm_load_si128(shuffles + 2)));
+      _mm_storeu_si128((__m128i*)(target + part * 16), result);
+    }
+  }
+
+  ACF_TARGET("ssse3") inline void Scale3xRowSsse3(const uint8_t* above, const uint8_t* row, const uint8_t* below, uint32_t width, uint8_t* top, uint8_t* middle, uint8_t* bottom)
+  {
+    uint32_t x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+      __m128i a = _mm_loadu_si128((const __m128i*)(above + x - 1));
+      __m128i b = _mm_loadu_si128((const __m128i*)(above + x));
+      __m128i c = _mm_loadu_si128((const __m128i*)(above + x + 1));
+      __m128i d = _mm_loadu_si128((const __m128i*)(row + x - 1));
+      __m128i e = _mm_loadu_si128((const __m128i*)(row + x));
+      __m128i f = _mm_loadu_si128((const __m128i*)(row + x + 1));
+      __m128i g = _mm_loadu_si128((const __m128i*)(below + x - 1));
+      __m128i h = _mm_loadu_si128((const __m128i*)(below + x));
+      __m128i i = _mm_loadu_si128((const __m128i*)(below + x + 1));
+      __m128i isNotEdge = _mm_or_si128(_mm_cmpeq_epi8(b, h), _mm_cmpeq_epi8(d, f));
+      __m128i db = _mm_andnot_si128(isNotEdge, _mm_cmpeq_epi8(d, b));
+      __m128i bf = _mm_andnot_si128(isNotEdge, _mm_cmpeq_epi8(b, f));
+      __m128i dh = _mm_andnot_si128(isNotEdge, _mm_cmpeq_epi8(d, h));
+      __m128i hf = _mm_andnot_si128(isNotEdge, _mm_cmpeq_epi8(h, f));
+      __m128i ea = _mm_cmpeq_epi8(e, a), ec = _mm_cmpeq_epi8(e, c), eg = _mm_cmpeq_epi8(e, g), ei = _mm_cmpeq_epi8(e, i);
+      StoreInterleaved3(Select(db, d, e),
+                        Select(_mm_or_si128(_mm_andnot_si128(ec, db), _mm_andnot_si128(ea, bf)), b, e),
+                        Select(bf, f, e), top + 3 * x);
+      StoreInterleaved3(Select(_mm_or_si128(_mm_andnot_si128(eg, db), _mm_andnot_si128(ea, dh)), d, e),
+                        e,
+                        Select(_mm_or_si128(_mm_andnot_si128(ei, bf), _mm_andnot_si128(ec, hf)), f, e), middle + 3 * x);
+      StoreInterleaved3(Select(dh, d, e),
+                        Select(_mm_or_si128(_mm_andnot_si128(ei, dh), _mm_andnot_si128(eg, hf)), h, e),
+                        Select(hf, f, e), bottom + 3 * x);
+    }
+    Scale3xRow(above, row, below, x, width, top, middle, bottom);
+  }
+
+  ACF_TARGET("ssse3") inline void Nearest3xRowSsse3(const uint8_t* row, uint32_t width, uint8_t* target)
+  {
+    uint32_t x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+      __m128i pixels = _mm_loadu_si128((const __m128i*)(row + x));
+      StoreInterleaved3(pixels, pixels, pixels, target + 3 * x);
+    }
+    NearestRow(row, x, width, 3, target);
+  }
+
+  inline void NearestRowSse2(const uint8_t* row, uint32_t width, uint32_t factor, uint8_t* target)
+  {
+    uint32_t x = 0;
+    if ((factor == 2) || (factor == 4))
+    {
+      for (; x + 16 <= width; x += 16)
+      {
+        __m128i pixels = _mm_loadu_si128((const __m128i*)(row + x));
+        __m128i low  = _mm_unpacklo_epi8(pixels, pixels);
+        __m128i high = _mm_unpackhi_epi8(pixels, pixels);
+        if (factor == 2)
+        {
+          _mm_storeu_si128((__m128i*)(target + 2 * x), low);
+          _mm_storeu_si128((__m128i*)(target + 2 * x + 16), high);
+        }
+        else
+        {
+          _mm_storeu_si128((__m128i*)(target + 4 * x),      _mm_unpacklo_epi8(low, low));
+          _mm_storeu_si128((__m128i*)(target + 4 * x + 16), _mm_unpackhi_epi8(low, low));
+          _mm_storeu_si128((__m128i*)(target + 4 * x + 32), _mm_unpacklo_epi8(high, high));
+          _mm_storeu_si128((__m128i*)(target + 4 * x + 48), _mm_unpackhi_epi8(high, high));
+        }
+      }
+    }
+    NearestRow(row, x, width, factor, target);
+  }
+#endif
+}
+
+
+//
+// Scales indexed frames, the result stays in the scaler buffers until the next call.
+// With useSimd false, only the scalar versions are used (to test the SIMD versions against them).
+//
+class FrameScaler
+{
+public:
+  FrameScaler(ScaleFilter filter, uint32_t factor, bool useSimd = true)
+    : m_Filter(filter)
+    , m_Factor(factor)
+    , m_UseSimd(useSimd)
+  {}
+
+  uint32_t GetFactor() const { return m_Factor; }
+
+  FrameView Scale(const FrameView& frame)
+  {
+    uint32_t width  = frame.m_Width * m_Factor;
+    uint32_t height = frame.m_Height * m_Factor;
+    m_Output.resize((size_t)width * height);
+    if ((m_Filter == ScaleFilter::e_PixelArt) && (m_Factor == 4))
+    {
+      FrameView doubled = ScaleTo(frame, 2, m_Intermediate);
+      ScaleTo(doubled, 2, m_Output);
+    }
+    else
+    {
+      ScaleTo(frame, m_Factor, m_Output);
+    }
+    return { m_Output.data(), width, height, frame.m_Palette, frame.m_FrameNumber };
+  }
+
+private:
+  FrameView ScaleTo(const FrameView& frame, uint32_t factor, std::vector<uint8_t>& output)
+  {
+    const uint32_t width  = frame.m_Width;
+    const uint32_t height = frame.m_Height;
+    const uint32_t targetWidth = width * factor;
+    output.resize((size_t)targetWidth * height * factor);
+
+#ifdef ACF_X86
+    const bool useSimd = m_UseSimd && (g_CpuLevel != CpuLevel::e_Scalar);
+    const bool useShuffles = useSimd && (g_CpuLevel >= CpuLevel::e_Sse4);
+#endif
+    if (m_Filter == ScaleFilter::e_Nearest)
+    {
+      for (uint32_t y = 0; y < height; y++)
+      {
+        uint8_t* target = output.data() + (size_t)y * factor * targetWidth;
+#ifdef ACF_X86
+        if (useShuffles && (factor == 3))
+        {
+          ScalerKernels::Nearest3xRowSsse3(frame.m_Pixels + (size_t)y * width, width, target);
+        }
+        else if (useSimd)
+        {
+          ScalerKernels::NearestRowSse2(frame.m_Pixels + (size_t)y * width, width, factor, target);
+        }
+        else
+#endif
+        {
+          ScalerKernels::NearestRow(frame.m_Pixels + (size_t)y * width, 0, width, factor, target);
+        }
+        for (uint32_t copy = 1; copy < factor; copy++)
+        {
+          memcpy(target + copy * targetWidth, target, targetWidth);
+        }
+      }
+      return { output.data(), targetWidth, height * factor, frame.m_Palette, frame.m_FrameNumber };
+    }
+
+    // The borders replicate the edges of the picture
+    const uint32_t stride = width + 32;
+    m_Padded.resize((size_t)stride * (height + 2));
+    for (uint32_t y = 0; y < height + 2; y++)
+    {
+      const uint8_t* source = frame.m_Pixels + (size_t)std::clamp((int32_t)y - 1, 0, (int32_t)height - 1) * width;
+      uint8_t* padded = m_Padded.data() + (size_t)y * stride + 16;
+      memcpy(padded, source, width);
+      padded[-1] = source[0];
+      padded[width] = source[width - 1];
+    }
+
+    for (uint32_t y = 0; y < height; y++)
+    {
+      const uint8_t* row = m_Padded.data() + (size_t)(y + 1) * stride + 16;
+      uint8_t* top = output.data() + (size_t)y * factor * targetWidth;
+#ifdef ACF_X86
+      if (useSimd && (factor == 2))
+      {
+        ScalerKernels::Scale2xRowSse2(row - stride, row, row + stride, width, top, top + targetWidth);
+      }
+      else if (useShuffles)
+      {
+        ScalerKernels::Scale3xRowSsse3(row - stride, row, row + stride, width, top, top + targetWidth, top + 2 * targetWidth);
+      }
+      else
+#endif
+      if (factor == 2)
+      {
+        ScalerKernels::Scale2xRow(row - stride, row, row + stride, 0, width, top, top + targetWidth);
+      }
+      else
+      {
+        ScalerKernels::Scale3xRow(row - stride, row, row + stride, 0, width, top, top + targetWidth, top + 2 * targetWidth);
+      }
+    }
+    return { output.data(), targetWidth, height * factor, frame.m_Palette, frame.m_FrameNumber };
+  }
+
+private:
+  ScaleFilter           m_Filter;
+  uint32_t              m_Factor;
+  bool                  m_UseSimd;
+  std::vector<uint8_t>  m_Padded;
+  std::vector<uint8_t>  m_Intermediate;
+  std::vector<uint8_t>  m_Output;
+};
+
+
+// Gives the scaled frames to another sink, the other calls are just forwarded
+class ScalerSink : public FrameSink
+{
+public:
+  ScalerSink(FrameSink& targetSink, ScaleFilter filter, uint32_t factor)
+    : m_TargetSink(targetSink)
+    , m_Scaler(filter, factor)
+  {}
+
+  void OnFrame(const FrameView& frame) override
+  {
+    m_TargetSink.OnFrame(m_Scaler.Scale(frame));
+  }
+
+  void OnChunk(const ChunkEntry& entry, const Chunk& chunk) override   { m_TargetSink.OnChunk(entry, chunk); }
+  void OnCamera(const Camera& camera, int32_t frameNumber) override     { m_TargetSink.OnCamera(camera, frameNumber); }
+  void OnEnd() override                                                 { m_TargetSink.OnEnd(); }
+
+private:
+  FrameSink&    m_TargetSink;
+  FrameScaler   m_Scaler;
+};
@@ -0,0 +1,467 @@
+﻿//
+// ACF Frame Server
+//
+// Daemon mode used by the interactive tools: the clips stay loaded and indexed, the decoded frames are kept in a
+// LRU cache, and the requests come from a local socket (AF_UNIX, which Windows 10 also supports through afunix.h).
+//
+// The protocol is one text line per request, answered by one text line, optionally followed by binary data:
+//   frame <frame number> <indexed|rgb> <clip path>    ->  ok <frame number> <width> <height> <data size>\n<data>
+//   stats                                              ->  ok <hits> <misses> <cached frames> <cached bytes> <budget>
+// Errors are answered by "error <message>". "indexed" data is the palette indices followed by the 768 bytes of
+// the palette, "rgb" data is 3 bytes per pixel.
+//
+// Any decoded frame is a valid restart point for the next frames of the same group of pictures, so all the frames
+// decoded to answer a request go in the cache: scrubbing forward costs one frame decode, scrubbing backward costs
+// nothing once the frames have been seen, and the keyframes act as checkpoints for the groups not seen yet.
+//
+// The memory budget only covers the decoded frames: the clips are loaded on their first request and stay in memory,
+// uncompressed, until the server stops, so the files served have to fit in memory next to the budget.
+//
+
+#pragma once
+
+#include "ACFDecoder.h"
+
+#include <map>
+#include <list>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <future>
+#include <atomic>
+#include <sstream>
+#include <condition_variable>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <afunix.h>
+#pragma comment(lib, "ws2_32.lib")
+using SocketHandle = SOCKET;
+const SocketHandle g_InvalidSocket = INVALID_SOCKET;
+inline void CloseSocket(SocketHandle socketHandle)   { closesocket(socketHandle); }
+#else
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+using SocketHandle = int;
+const SocketHandle g_InvalidSocket = -1;
+inline void CloseSocket(SocketHandle socketHandle)   { close(socketHandle); }
+#endif
+
+#ifdef MSG_NOSIGNAL
+const int g_SendFlags = MSG_NOSIGNAL;                 // A viewer closing the connection must not kill the server with SIGPIPE
+#else
+const int g_SendFlags = 0;
+#endif
+
+
+// A clip stays in memory with its chunk directory for the whole life of the server
+class ServerClip
+{
+public:
+  uint32_t                m_ClipId = 0;
+  std::vector<std::byte>  m_File;
+  ChunkDirectory          m_ChunkDirectory;
+};
+
+
+class CachedFrame
+{
+public:
+  FrameView GetFrameView() const
+  {
+    return { m_Pixels.data(), m_Width, m_Height, &m_Palette, m_FrameNumber };
+  }
+
+  size_t GetMemorySize() const
+  {
+    return sizeof(CachedFrame) + m_Pixels.size();
+  }
+
+public:
+  std::vector<uint8_t>    m_Pixels;
+  Palette                 m_Palette;
+  uint32_t                m_Width = 0;
+  uint32_t                m_Height = 0;
+  int32_t                 m_FrameNumber = 0;
+};
+
+
+//
+// Decoded frames of all the clips, the least recently used ones are dropped when the memory budget is exceeded.
+// The frames are shared pointers, so a frame being sent stays valid even if the cache drops it meanwhile.
+//
+class FrameCache
+{
+public:
+  FrameCache(size_t memoryBudget)
+    : m_MemoryBudget(memoryBudget)
+  {}
+
+  std::shared_ptr<const CachedFrame> Find(uint32_t clipId, int32_t frameNumber)
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    auto entry = m_Entries.find({ clipId, frameNumber });
+    if (entry == m_Entries.end())
+    {
+      m_MissCount++;
+      return nullptr;
+    }
+    m_HitCount++;
+    m_UseOrder.splice(m_UseOrder.begin(), m_UseOrder, entry->second);
+    return entry->second->second;
+  }
+
+  // Closest cached frame in [firstFrame, lastFrame], the last one first
+  std::shared_ptr<const CachedFrame> FindBefore(uint32_t clipId, int32_t firstFrame, int32_t lastFrame)
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    auto entry = m_Entries.upper_bound({ clipId, lastFrame });
+    if ((entry == m_Entries.begin()) || ((--entry)->first.first != clipId) || (entry->first.second < firstFrame))
+    {
+      return nullptr;
+    }
+    m_UseOrder.splice(m_UseOrder.begin(), m_UseOrder, entry->second);
+    return entry->second->second;
+  }
+
+  void Insert(uint32_t clipId, std::shared_ptr<const CachedFrame> frame)
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    Key key = { clipId, frame->m_FrameNumber };
+    if (m_Entries.count(key))
+    {
+      return;
+    }
+    m_MemorySize += frame->GetMemorySize();
+    m_UseOrder.emplace_front(key, std::move(frame));
+    m_Entries[key] = m_UseOrder.begin();
+
+    while ((m_MemorySize > m_MemoryBudget) && (m_UseOrder.size() > 1))
+    {
+      m_MemorySize -= m_UseOrder.back().second->GetMemorySize();
+      m_Entries.erase(m_UseOrder.back().first);
+      m_UseOrder.pop_back();
+    }
+  }
+
+  std::string GetStats()
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return std::to_string(m_HitCount) + " " + std::to_string(m_MissCount) + " " + std::to_string(m_UseOrder.size()) + " " + std::to_string(m_MemorySize) + " " + std::to_string(m_MemoryBudget);
+  }
+
+private:
+  using Key = std::pair<uint32_t, int32_t>;   ///< Clip and frame number, ordered so the frames of a clip are together
+  using UseList = std::list<std::pair<Key, std::shared_ptr<const CachedFrame>>>;
+
+  std::mutex                        m_Mutex;
+  UseList                           m_UseOrder;   ///< Most recently used first
+  std::map<Key, UseList::iterator>  m_Entries;
+  size_t                            m_MemoryBudget;
+  size_t                            m_MemorySize = 0;
+  uint64_t                          m_HitCount = 0;
+  uint64_t                          m_MissCount = 0;
+};
+
+
+
+class FrameServer
+{
+public:
+  FrameServer(size_t memoryBudget, uint32_t workerCount)
+    : m_FrameCache(memoryBudget)
+    , m_WorkerCount(std::max(1u, workerCount))
+  {}
+
+  FrameServer(const FrameServer&) = delete;
+  FrameServer& operator=(const FrameServer&) = delete;
+
+
+  // Only returns if the socket could not be created
+  bool Run(const std::string& socketPath)
+  {
+#ifdef _WIN32
+    WSADATA wsaData;
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path))
+    {
+      std::cout << socketPath << " : socket path too long" << std::endl;
+      return false;
+    }
+    memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+
+    SocketHandle listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    std::error_code errorCode;
+    std::filesystem::remove(socketPath, errorCode);           // Left by a previous run
+    if ((listenSocket == g_InvalidSocket) || bind(listenSocket, (const sockaddr*)&address, sizeof(address)) || listen(listenSocket, 16))
+    {
+      std::cout << socketPath << " : could not create the socket" << std::endl;
+      if (listenSocket != g_InvalidSocket)
+      {
+        CloseSocket(listenSocket);
+      }
+      return false;
+    }
+    std::cout << "Serving frames on " << socketPath << " with " << m_WorkerCount << " workers" << std::endl;
+
+    // Each worker has its own decoder and serves one request at a time, from any connection
+    std::vector<std::thread> workers;
+    for (uint32_t worker = 0; worker < m_WorkerCount; worker++)
+    {
+      workers.emplace_back([this]() { WorkerLoop(); });
+    }
+
+    while (true)
+    {
+      SocketHandle clientSocket = accept(listenSocket, nullptr, nullptr);
+      if (clientSocket != g_InvalidSocket)
+      {
+        std::thread([this, clientSocket]() { ConnectionLoop(clientSocket); }).detach();
+      }
+    }
+  }
+
+
+private:
+  class PendingRequest
+  {
+  public:
+    SocketHandle        m_ClientSocket = g_InvalidSocket;
+    std::string         m_Request;
+    std::promise<bool>  m_Result;         ///< False when the connection has to be closed
+  };
+
+
+  // Each connection has a thread which only waits for its requests, so an idle client does not hold a worker (and
+  // its decoder). The next request is read once the answer is sent, which keeps the answers in the request order.
+  void ConnectionLoop(SocketHandle clientSocket)
+  {
+    std::string request;
+    while (ReceiveLine(clientSocket, request))
+    {
+      std::future<bool> result;
+      {
+        std::lock_guard<std::mutex> lock(m_QueueMutex);
+        PendingRequest& pendingRequest = m_PendingRequests.emplace_back();
+        pendingRequest.m_ClientSocket = clientSocket;
+        pendingRequest.m_Request      = std::move(request);
+        result = pendingRequest.m_Result.get_future();
+        m_QueueCondition.notify_one();
+      }
+      if (!result.get())
+      {
+        break;
+      }
+    }
+    CloseSocket(clientSocket);
+  }
+
+
+  void WorkerLoop()
+  {
+    ACFDecoder acfDecoder;
+    while (true)
+    {
+      PendingRequest pendingRequest;
+      {
+        std::unique_lock<std::mutex> lock(m_QueueMutex);
+        m_QueueCondition.wait(lock, [this]() { return !m_PendingRequests.empty(); });
+        pendingRequest = std::move(m_PendingRequests.front());
+        m_PendingRequests.pop_front();
+      }
+      pendingRequest.m_Result.set_value(ServeRequest(pendingRequest.m_ClientSocket, pendingRequest.m_Request, acfDecoder));
+    }
+  }
+
+
+  // Returns false when the connection has to be closed
+  bool ServeRequest(SocketHandle clientSocket, const std::string& request, ACFDecoder& acfDecoder)
+  {
+    std::istringstream requestStream(request);
+    std::string command;
+    requestStream >> command;
+
+    if (command == "stats")
+    {
+      return SendAll(clientSocket, "ok " + m_FrameCache.GetStats() + "\n");
+    }
+    if (command != "frame")
+    {
+      return SendAll(clientSocket, "error unknown command\n");
+    }
+
+    int32_t frameNumber = -1;
+    std::string format;
+    std::string clipPath;
+    requestStream >> frameNumber >> format >> std::ws;
+    std::getline(requestStream, clipPath);
+    if ((frameNumber < 0) || ((format != "indexed") && (format != "rgb")) || clipPath.empty())
+    {
+      return SendAll(clientSocket, "error usage: frame <frame number> <indexed|rgb> <clip path>\n");
+    }
+
+    std::shared_ptr<const ServerClip> clip = GetClip(clipPath);
+    if (!clip)
+    {
+      return SendAll(clientSocket, "error could not load the clip\n");
+    }
+    std::shared_ptr<const CachedFrame> frame = GetFrame(*clip, frameNumber, acfDecoder);
+    if (!frame)
+    {
+      return SendAll(clientSocket, "error frame not available\n");
+    }
+
+    std::vector<uint8_t> data;
+    if (format == "indexed")
+    {
+      data.resize(frame->m_Pixels.size() + sizeof(Palette));
+      memcpy(data.data(), frame->m_Pixels.data(), frame->m_Pixels.size());
+      memcpy(data.data() + frame->m_Pixels.size(), &frame->m_Palette, sizeof(Palette));
+    }
+    else
+    {
+      uint32_t colors[256];
+      GetPaletteColors(frame->m_Palette, colors);
+      data.resize(frame->m_Pixels.size() * 3);
+      g_CpuKernels.m_ExpandPalette(frame->m_Pixels.data(), frame->m_Pixels.size(), colors, data.data());
+    }
+    std::string header = "ok " + std::to_string(frame->m_FrameNumber) + " " + std::to_string(frame->m_Width) + " " + std::to_string(frame->m_Height) + " " + std::to_string(data.size()) + "\n";
+    return SendAll(clientSocket, header) && SendAll(clientSocket, std::string_view((const char*)data.data(), data.size()));
+  }
+
+
+  // The first request on a clip loads it outside of the lock, the other requests on the same clip wait for the
+  // load to finish, and the requests on the other clips are not blocked. A clip which could not be loaded is
+  // forgotten, so the next request tries again.
+  std::shared_ptr<const ServerClip> GetClip(const std::string& clipPath)
+  {
+    std::promise<std::shared_ptr<const ServerClip>> loadedClip;
+    std::shared_future<std::shared_ptr<const ServerClip>> pendingClip;
+    uint32_t clipId = 0;
+    {
+      std::lock_guard<std::mutex> lock(m_ClipMutex);
+      auto clip = m_Clips.find(clipPath);
+      if (clip != m_Clips.end())
+      {
+        pendingClip = clip->second;
+      }
+      else
+      {
+        m_Clips[clipPath] = loadedClip.get_future().share();
+        clipId = m_NextClipId++;
+      }
+    }
+    if (pendingClip.valid())
+    {
+      return pendingClip.get();
+    }
+
+    auto newClip = std::make_shared<ServerClip>();
+    newClip->m_ClipId = clipId;
+    if (!ACFDecoder::LoadClip(clipPath, newClip->m_File))
+    {
+      newClip = nullptr;
+      std::lock_guard<std::mutex> lock(m_ClipMutex);
+      m_Clips.erase(clipPath);
+    }
+    else
+    {
+      newClip->m_ChunkDirectory.Build(newClip->m_File);
+    }
+    loadedClip.set_value(newClip);
+    return newClip;
+  }
+
+
+  // Decodes from the closest cached frame of the same group of pictures, or from the keyframe
+  std::shared_ptr<const CachedFrame> GetFrame(const ServerClip& clip, int32_t frameNumber, ACFDecoder& acfDecoder)
+  {
+    std::shared_ptr<const CachedFrame> frame = m_FrameCache.Find(clip.m_ClipId, frameNumber);
+    if (frame || (frameNumber >= clip.m_ChunkDirectory.GetFrameCount()))
+    {
+      return frame;
+    }
+
+    int32_t keyFrame = clip.m_ChunkDirectory.GetKeyFrameBefore(frameNumber);
+    std::shared_ptr<const CachedFrame> checkpoint = m_FrameCache.FindBefore(clip.m_ClipId, keyFrame, frameNumber - 1);
+    FrameView checkpointView;
+    int32_t firstFrame = keyFrame;
+    if (checkpoint)
+    {
+      checkpointView = checkpoint->GetFrameView();
+      firstFrame = checkpoint->m_FrameNumber + 1;
+    }
+
+    for (const FrameView& frameView : acfDecoder.DecodeFrames(clip.m_File, firstFrame, frameNumber - firstFrame + 1, false, checkpoint ? &checkpointView : nullptr))
+    {
+      auto decodedFrame = std::make_shared<CachedFrame>();
+      decodedFrame->m_Pixels.assign(frameView.m_Pixels, frameView.m_Pixels + (size_t)frameView.m_Width * frameView.m_Height);
+      decodedFrame->m_Palette     = *frameView.m_Palette;
+      decodedFrame->m_Width       = frameView.m_Width;
+      decodedFrame->m_Height      = frameView.m_Height;
+      decodedFrame->m_FrameNumber = frameView.m_FrameNumber;
+      m_FrameCache.Insert(clip.m_ClipId, decodedFrame);
+      if (frameView.m_FrameNumber == frameNumber)
+      {
+        frame = decodedFrame;
+      }
+    }
+    return frame;
+  }
+
+
+  static bool ReceiveLine(SocketHandle clientSocket, std::string& line)
+  {
+    line.clear();
+    char character;
+    while (recv(clientSocket, &character, 1, 0) == 1)
+    {
+      if (character == '\n')
+      {
+        if (!line.empty() && (line.back() == '\r'))
+        {
+          line.pop_back();
+        }
+        return true;
+      }
+      line += character;
+      if (line.size() > 4096)
+      {
+        return false;
+      }
+    }
+    return false;
+  }
+
+
+  static bool SendAll(SocketHandle clientSocket, std::string_view data)
+  {
+    while (!data.empty())
+    {
+      auto sentSize = send(clientSocket, data.data(), (int)std::min<size_t>(data.size(), 1 << 30), g_SendFlags);
+      if (sentSize <= 0)
+      {
+        return false;
+      }
+      data.remove_prefix(sentSize);
+    }
+    return true;
+  }
+
+
+private:
+  FrameCache                m_FrameCache;
+  uint32_t                  m_WorkerCount;
+
+  std::mutex                                                                    m_ClipMutex;
+  std::map<std::string, std::shared_future<std::shared_ptr<const ServerClip>>>  m_Clips;      ///< Never evicted, see the top of the file
+  uint32_t                                                                      m_NextClipId = 0;
+
+  std::mutex                  m_QueueMutex;
+  std::condition_variable     m_QueueCondition;
+  std::list<PendingRequest>   m_PendingRequests;
+};
@@ -0,0 +1,225 @@
+//
+// ISO 9660 disc images
+//
+// The game discs are kept as .iso images: the image is memory mapped, and the files found in its directories are
+// given as views on the mapping, so the clips can be decoded straight from the image without copying anything.
+// The files start on a 2048 byte sector of the image, so the views keep the alignment the decoder expects.
+//
+// Only the plain ISO 9660 directories are read (no Joliet or Rock Ridge names, which the 8.3 MS-DOS names of the
+// game files do not need), and only images of 2048 byte sectors (not the raw 2352 byte sectors of BIN/CUE dumps).
+//
+
+#pragma once
+
+#include "ACFDecoder.h"
+
+#include <set>
+#include <cctype>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+// Read only mapping of a whole file
+class MappedFile
+{
+public:
+  MappedFile() = default;
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  ~MappedFile()
+  {
+    Close();
+  }
+
+  bool Open(const std::filesystem::path& path)
+  {
+    Close();
+#ifdef _WIN32
+    m_File = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr);
+    LARGE_INTEGER size;
+    if ((m_File == INVALID_HANDLE_VALUE) || !GetFileSizeEx(m_File, &size) || !size.QuadPart)
+    {
+      Close();
+      return false;
+    }
+    m_Mapping = CreateFileMappingW(m_File, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    m_Data = m_Mapping ? MapViewOfFile(m_Mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+    m_Size = m_Data ? (size_t)size.QuadPart : 0;
+#else
+    int descriptor = open(path.c_str(), O_RDONLY);
+    if (descriptor < 0)
+    {
+      return false;
+    }
+    struct stat status;
+    if (!fstat(descriptor, &status) && (status.st_size > 0))
+    {
+      m_Data = mmap(nullptr, status.st_size, PROT_READ, MAP_SHARED, descriptor, 0);
+      m_Size = (m_Data == MAP_FAILED) ? 0 : status.st_size;
+      m_Data = (m_Data == MAP_FAILED) ? nullptr : m_Data;
+    }
+    close(descriptor);
+#endif
+    return m_Data != nullptr;
+  }
+
+  void Close()
+  {
+#ifdef _WIN32
+    if (m_Data)                           UnmapViewOfFile(m_Data);
+    if (m_Mapping)                        CloseHandle(m_Mapping);
+    if (m_File != INVALID_HANDLE_VALUE)   CloseHandle(m_File);
+    m_Mapping = nullptr;
+    m_File = INVALID_HANDLE_VALUE;
+#else
+    if (m_Data)     munmap(m_Data, m_Size);
+#endif
+    m_Data = nullptr;
+    m_Size = 0;
+  }
+
+  std::span<const std::byte> GetContent() const   { return { (const std::byte*)m_Data, m_Size }; }
+
+private:
+  void*         m_Data = nullptr;
+  size_t        m_Size = 0;
+#ifdef _WIN32
+  HANDLE        m_File = INVALID_HANDLE_VALUE;
+  HANDLE        m_Mapping = nullptr;
+#endif
+};
+
+
+class IsoFile
+{
+public:
+  std::string   m_Path;           ///< Path in the image, with '/' separators and without the ";1" version
+  uint64_t      m_Offset = 0;     ///< Position of the file data in the image
+  uint32_t      m_Size = 0;
+};
+
+
+class IsoImage
+{
+public:
+  static constexpr uint32_t g_SectorSize = 2048;
+
+  // Maps the image and lists all its files
+  bool Open(const std::filesystem::path& imagePath)
+  {
+    m_Files.clear();
+    m_VisitedDirectories.clear();
+    if (!m_MappedFile.Open(imagePath))
+    {
+      std::cout << imagePath << " : could not map the file" << std::endl;
+      return false;
+    }
+
+    // The Primary Volume Descriptor is the first descriptor of type 1, from sector 16 to the terminator (type 255)
+    std::span<const std::byte> image = m_MappedFile.GetContent();
+    for (uint64_t sector = 16; (sector + 1) * g_SectorSize <= image.size(); sector++)
+    {
+      const uint8_t* descriptor = (const uint8_t*)image.data() + sector * g_SectorSize;
+      if (memcmp(descriptor + 1, "CD001", 5) || (descriptor[0] == 255))
+      {
+        break;
+      }
+      if (descriptor[0] == 1)
+      {
+        const uint8_t* rootRecord = descriptor + 156;
+        ReadDirectory(GetUInt32(rootRecord + 2), GetUInt32(rootRecord + 10), "");
+        return true;
+      }
+    }
+    std::cout << imagePath << " : not an ISO 9660 image" << std::endl;
+    return false;
+  }
+
+  const std::vector<IsoFile>& GetFiles() const { return m_Files; }
+
+  // The files whose name ends with this extension, in any case
+  std::vector<IsoFile> FindFiles(std::string_view extension) const
+  {
+    std::vector<IsoFile> files;
+    for (const IsoFile& file : m_Files)
+    {
+      if ((file.m_Path.size() >= extension.size()) &&
+          std::equal(extension.begin(), extension.end(), file.m_Path.end() - extension.size(), [](char a, char b) { return std::toupper((uint8_t)a) == std::toupper((uint8_t)b); }))
+      {
+        files.push_back(file);
+      }
+    }
+    return files;
+  }
+
+  // View on the file content, valid as long as the image is open
+  std::span<const std::byte> GetFileData(const IsoFile& file) const
+  {
+    return m_MappedFile.GetContent().subspan(file.m_Offset, file.m_Size);
+  }
+
+private:
+  static uint32_t GetUInt32(const uint8_t* bothEndian)
+  {
+    return bothEndian[0] | (bothEndian[1] << 8) | (bothEndian[2] << 16) | ((uint32_t)bothEndian[3] << 24);    // The little endian half
+  }
+
+  // Directory records never cross a sector boundary, the end of a sector is padded with zeroes
+  void ReadDirectory(uint32_t sector, uint32_t size, const std::string& path)
+  {
+    std::span<const std::byte> image = m_MappedFile.GetContent();
+    if (((uint64_t)sector * g_SectorSize + size > image.size()) || !m_VisitedDirectories.insert(sector).second)
+    {
+      return;     // Damaged image, or a directory seen before
+    }
+
+    const uint8_t* start = (const uint8_t*)image.data() + (uint64_t)sector * g_SectorSize;
+    uint32_t offset = 0;
+    while (offset < size)
+    {
+      const uint8_t* record = start + offset;
+      uint32_t recordSize = record[0];
+      uint32_t nameSize = (recordSize >= 33) ? record[32] : 0;
+      if (!recordSize || (33 + nameSize > recordSize) || (offset + recordSize > size))
+      {
+        offset = (offset / g_SectorSize + 1) * g_SectorSize;
+        continue;
+      }
+      offset += recordSize;
+
+      std::string name((const char*)record + 33, nameSize);
+      if ((nameSize == 1) && (((uint8_t)name[0] == 0) || ((uint8_t)name[0] == 1)))
+      {
+        continue;     // "." and ".."
+      }
+      uint32_t extentSector = GetUInt32(record + 2);
+      uint32_t extentSize = GetUInt32(record + 10);
+      if (record[25] & 2)
+      {
+        ReadDirectory(extentSector, extentSize, path + name + "/");
+      }
+      else if ((uint64_t)extentSector * g_SectorSize + extentSize <= image.size())
+      {
+        name = name.substr(0, name.find(';'));
+        if (!name.empty() && (name.back() == '.'))
+        {
+          name.pop_back();      // Files without extension are stored as "NAME."
+        }
+        m_Files.push_back({ path + name, (uint64_t)extentSector * g_SectorSize, extentSize });
+      }
+    }
+  }
+
+private:
+  MappedFile            m_MappedFile;
+  std::vector<IsoFile>  m_Files;
+  std::set<uint32_t>    m_VisitedDirectories;
+};
@@ -0,0 +1,366 @@
+//
+// Logging
+//
+// The decoder reports what it does through ACF_LOG, with a level telling how detailed the message is:
+// - e_Summary: once per clip or for errors (invalid format, damaged frame, resuming from a checkpoint...)
+// - e_Chunk: once per chunk of the file
+// - e_Tile: once per 8x8 tile, which is only compiled in when ACF_LOG_MAX_LEVEL is 3
+//
+// The messages under g_LogLevel are not even formatted. The other ones are formatted with std::to_chars in a fixed
+// size LogMessage, copied to a ring owned by the calling thread, and written to std::cout by a background thread.
+// The rings have a single writer and a single reader, so adding a message is a couple of atomic operations: the
+// decoder never waits for the console, and if the console is so slow that a ring is full the message is dropped
+// (and counted) instead. Logger::Flush() waits until everything already logged is written.
+//
+// The logger also owns the buffer of std::cout: the other console output (results, summaries, errors) is written a
+// line at a time, after the messages already logged, so a report never comes before the decoder messages it follows
+// and the two never share a line. Nothing has to flush the logger before writing to std::cout.
+//
+
+#pragma once
+
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+
+enum class LogLevel : int32_t
+{
+  e_Off     = 0,
+  e_Summary = 1,
+  e_Chunk   = 2,
+  e_Tile    = 3,
+};
+
+inline constexpr const char* g_LogLevelNames[] = { "off", "summary", "chunk", "tile" };
+
+// The messages above this level are removed by the compiler
+#ifndef ACF_LOG_MAX_LEVEL
+#define ACF_LOG_MAX_LEVEL 2
+#endif
+inline constexpr LogLevel g_LogMaxLevel = (LogLevel)ACF_LOG_MAX_LEVEL;
+
+inline LogLevel g_LogLevel = LogLevel::e_Summary;     ///< Set before starting the decoders, the per chunk messages are off by default
+
+inline bool IsLogEnabled(LogLevel level)
+{
+  return (level <= g_LogMaxLevel) && (level <= g_LogLevel);
+}
+
+
+// One line of text, truncated if it does not fit
+class LogMessage
+{
+public:
+  LogMessage& operator<<(std::string_view text)
+  {
+    size_t length = std::min(text.size(), sizeof(m_Text) - m_Size);
+    memcpy(m_Text + m_Size, text.data(), length);
+    m_Size += (uint16_t)length;
+    return *this;
+  }
+
+  LogMessage& operator<<(char character)
+  {
+    return *this << std::string_view(&character, 1);
+  }
+
+  template<typename T>
+    requires std::is_arithmetic_v<T>
+  LogMessage& operator<<(T value)
+  {
+    std::to_chars_result result = std::to_chars(m_Text + m_Size, m_Text + sizeof(m_Text), value);
+    if (result.ec == std::errc())
+    {
+      m_Size = (uint16_t)(result.ptr - m_Text);
+    }
+    return *this;
+  }
+
+  // Quoted, like std::cout does (a template so the strings are not converted to paths)
+  template<typename T>
+    requires std::is_same_v<T, std::filesystem::path>
+  LogMessage& operator<<(const T& path)
+  {
+    return *this << '"' << path.string() << '"';
+  }
+
+  std::string_view GetText() const { return { m_Text, m_Size }; }
+
+private:
+  char      m_Text[254];
+  uint16_t  m_Size = 0;
+};
+
+
+// Messages of one thread: only this thread adds messages, only the logger thread removes them
+class LogRing
+{
+public:
+  static constexpr uint32_t g_Capacity = 256;
+
+  bool Push(const LogMessage& message)
+  {
+    uint32_t head = m_Head.load(std::memory_order_relaxed);
+    if (head - m_Tail.load(std::memory_order_acquire) == g_Capacity)
+    {
+      m_DroppedCount.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    m_Messages[head % g_Capacity] = message;
+    m_Head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Appends the pending messages to the text, one per line
+  void Drain(std::string& text)
+  {
+    uint32_t tail = m_Tail.load(std::memory_order_relaxed);
+    uint32_t head = m_Head.load(std::memory_order_acquire);
+    for (; tail != head; tail++)
+    {
+      text += m_Messages[tail % g_Capacity].GetText();
+      text += '\n';
+    }
+    m_Tail.store(tail, std::memory_order_release);
+  }
+
+  bool IsEmpty() const
+  {
+    return m_Head.load(std::memory_order_acquire) == m_Tail.load(std::memory_order_acquire);
+  }
+
+  uint32_t TakeDroppedCount()
+  {
+    return m_DroppedCount.exchange(0, std::memory_order_relaxed);
+  }
+
+public:
+  std::atomic<bool>       m_IsUsed = false;       ///< Owned by a running thread, the rings of finished threads are reused
+
+private:
+  LogMessage              m_Messages[g_Capacity];
+  std::atomic<uint32_t>   m_Head = 0;
+  std::atomic<uint32_t>   m_Tail = 0;
+  std::atomic<uint32_t>   m_DroppedCount = 0;
+};
+
+
+class Logger
+{
+public:
+  static constexpr std::chrono::milliseconds g_DrainPeriod{ 5 };
+
+  Logger()
+    : m_ConsoleBuffer(*this)
+  {
+    m_ConsoleOutput = std::cout.rdbuf(&m_ConsoleBuffer);
+  }
+
+  Logger(const Logger&) = delete;
+  Logger& operator=(const Logger&) = delete;
+
+  ~Logger()
+  {
+    if (m_Thread.joinable())
+    {
+      m_IsStopping = true;
+      m_Thread.join();
+    }
+    std::cout.flush();
+    std::cout.rdbuf(m_ConsoleOutput);
+    Drain();
+  }
+
+  void Log(const LogMessage& message)
+  {
+    GetRing().Push(message);
+  }
+
+  // Writes everything logged so far by any thread
+  void Flush()
+  {
+    Drain();
+  }
+
+private:
+  // Buffer of std::cout, see the top of the file
+  class ConsoleBuffer : public std::streambuf
+  {
+  public:
+    ConsoleBuffer(Logger& logger)
+      : m_Logger(logger)
+    {}
+
+  protected:
+    int_type overflow(int_type character) override
+    {
+      if (!traits_type::eq_int_type(character, traits_type::eof()))
+      {
+        char text = traits_type::to_char_type(character);
+        xsputn(&text, 1);
+      }
+      return traits_type::not_eof(character);
+    }
+
+    std::streamsize xsputn(const char* text, std::streamsize size) override
+    {
+      std::lock_guard<std::mutex> drainLock(m_Logger.m_DrainMutex);
+      m_Line.append(text, (size_t)size);
+      size_t lineEnd = m_Line.rfind('\n');
+      if (lineEnd != std::string::npos)
+      {
+        m_Logger.WriteConsole(std::string_view(m_Line).substr(0, lineEnd + 1));
+        m_Line.erase(0, lineEnd + 1);
+      }
+      return size;
+    }
+
+    int sync() override
+    {
+      std::lock_guard<std::mutex> drainLock(m_Logger.m_DrainMutex);
+      m_Logger.WriteConsole(m_Line);
+      m_Line.clear();
+      return 0;
+    }
+
+  private:
+    Logger&       m_Logger;
+    std::string   m_Line;         ///< Written once complete, or when std::cout is flushed
+  };
+
+  // The messages already logged are written first, m_DrainMutex has to be locked
+  void WriteConsole(std::string_view text)
+  {
+    DrainLocked();
+    if (!text.empty())
+    {
+      m_ConsoleOutput->sputn(text.data(), (std::streamsize)text.size());
+      m_ConsoleOutput->pubsync();
+    }
+  }
+
+  // Releases the ring when its thread ends
+  class RingOwner
+  {
+  public:
+    ~RingOwner()
+    {
+      if (m_Ring)
+      {
+        m_Ring->m_IsUsed = false;
+      }
+    }
+
+    LogRing* m_Ring = nullptr;
+  };
+
+  LogRing& GetRing()
+  {
+    thread_local RingOwner owner;
+    if (!owner.m_Ring)
+    {
+      std::lock_guard<std::mutex> lock(m_RingsMutex);
+      for (const std::unique_ptr<LogRing>& ring : m_Rings)
+      {
+        if (!ring->m_IsUsed && ring->IsEmpty())
+        {
+          owner.m_Ring = ring.get();
+          break;
+        }
+      }
+      if (!owner.m_Ring)
+      {
+        m_Rings.push_back(std::make_unique<LogRing>());
+        owner.m_Ring = m_Rings.back().get();
+      }
+      owner.m_Ring->m_IsUsed = true;
+      if (!m_Thread.joinable())
+      {
+        m_Thread = std::thread([this]() { Run(); });
+      }
+    }
+    return *owner.m_Ring;
+  }
+
+  void Run()
+  {
+    while (!m_IsStopping)
+    {
+      if (!Drain())
+      {
+        std::this_thread::sleep_for(g_DrainPeriod);
+      }
+    }
+  }
+
+  // Returns false if there was nothing to write
+  bool Drain()
+  {
+    std::lock_guard<std::mutex> drainLock(m_DrainMutex);
+    return DrainLocked();
+  }
+
+  bool DrainLocked()
+  {
+    m_Text.clear();
+    uint32_t droppedCount = 0;
+    {
+      std::lock_guard<std::mutex> lock(m_RingsMutex);
+      for (const std::unique_ptr<LogRing>& ring : m_Rings)
+      {
+        ring->Drain(m_Text);
+        droppedCount += ring->TakeDroppedCount();
+      }
+    }
+    if (droppedCount)
+    {
+      LogMessage message;
+      message << droppedCount << " log messages dropped\n";
+      m_Text += message.GetText();
+    }
+    if (m_Text.empty())
+    {
+      return false;
+    }
+    m_ConsoleOutput->sputn(m_Text.data(), (std::streamsize)m_Text.size());
+    m_ConsoleOutput->pubsync();
+    return true;
+  }
+
+private:
+  std::mutex                              m_RingsMutex;       ///< Only taken when a thread logs for the first time, and by the logger thread
+  std::vector<std::unique_ptr<LogRing>>   m_Rings;
+  std::mutex                              m_DrainMutex;
+  std::string                             m_Text;
+  std::thread                             m_Thread;
+  std::atomic<bool>                       m_IsStopping = false;
+  ConsoleBuffer                           m_ConsoleBuffer;
+  std::streambuf*                         m_ConsoleOutput = nullptr;  ///< The buffer std::cout had before
+};
+
+inline Logger g_Logger;
+
+
+#define ACF_LOG(level, message)       \
+  do                                  \
+  {                                   \
+    if (IsLogEnabled(level))          \
+    {                                 \
+      LogMessage logMessage;          \
+      logMessage << message;          \
+      g_Logger.Log(logMessage);       \
+    }                                 \
+  } while (false)
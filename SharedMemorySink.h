@@ -0,0 +1,314 @@
+﻿//
+// Shared memory output
+//
+// The decoded frames are published in a ring of slots in a named shared memory block, so a viewer or an analysis
+// tool running in another process can read them in place, without any file or copy in between.
+//
+// There is one writer (the decoder) and any number of readers, without any lock: each slot has a sequence number
+// which is odd while the writer fills it, and becomes 2 * (index + 1) once frame number "index" of the stream is
+// complete. A reader checks the sequence before and after using the slot: if it changed, the writer went around
+// the ring and reused the slot meanwhile, and the frame has to be skipped. The writer never waits for the readers.
+//
+
+#pragma once
+
+#include "ACFDecoder.h"
+
+#include <atomic>
+#include <thread>
+#include <chrono>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+class SharedRingHeader
+{
+public:
+  static constexpr uint32_t g_Magic = 0x52464341;           ///< "ACFR"
+
+  uint32_t                m_Magic;
+  uint32_t                m_SlotCount;
+  uint32_t                m_SlotSize;                       ///< Bytes from one slot to the next one
+  uint32_t                m_MaxPixelCount;
+  std::atomic<uint64_t>   m_PublishedCount;                 ///< Number of frames published since the start
+  std::atomic<uint32_t>   m_Ended;                          ///< Set after the last frame
+};
+
+
+class SharedRingSlot
+{
+public:
+  const uint8_t* GetPixels() const                          { return (const uint8_t*)(this + 1); }
+  uint8_t* GetPixels()                                      { return (uint8_t*)(this + 1); }
+
+  std::atomic<uint64_t>   m_Sequence;
+  uint32_t                m_Width;
+  uint32_t                m_Height;
+  int32_t                 m_FrameNumber;                    ///< Frame number in the ACF file
+  uint32_t                m_Padding;
+  Palette                 m_Palette;
+  // Followed by m_Width * m_Height palette indices
+};
+
+
+// Maps a named shared memory block, created by the writer and opened by the readers
+class SharedMemoryBlock
+{
+public:
+  SharedMemoryBlock() = default;
+  SharedMemoryBlock(const SharedMemoryBlock&) = delete;
+  SharedMemoryBlock& operator=(const SharedMemoryBlock&) = delete;
+
+  ~SharedMemoryBlock()
+  {
+    Close();
+  }
+
+  // size is only used when creating the block, the readers get the size of the existing block
+  bool Open(const std::string& name, size_t size, bool create)
+  {
+    Close();
+#ifdef _WIN32
+    if (create)
+    {
+      m_Handle = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32), (DWORD)size, name.c_str());
+    }
+    else
+    {
+      m_Handle = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name.c_str());
+    }
+    if (!m_Handle)
+    {
+      return false;
+    }
+    m_Data = MapViewOfFile(m_Handle, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    MEMORY_BASIC_INFORMATION information;
+    m_Size = (m_Data && VirtualQuery(m_Data, &information, sizeof(information))) ? information.RegionSize : 0;
+#else
+    int descriptor = shm_open(name.c_str(), create ? (O_CREAT | O_RDWR | O_TRUNC) : O_RDWR, 0644);
+    if (descriptor < 0)
+    {
+      return false;
+    }
+    struct stat status;
+    if ((create && ftruncate(descriptor, size)) || fstat(descriptor, &status))
+    {
+      close(descriptor);
+      return false;
+    }
+    m_Size = status.st_size;
+    m_Data = mmap(nullptr, m_Size, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0);
+    close(descriptor);
+    if (m_Data == MAP_FAILED)
+    {
+      m_Data = nullptr;
+    }
+    if (create)
+    {
+      m_Name = name;
+    }
+#endif
+    return m_Data != nullptr;
+  }
+
+  void Close()
+  {
+#ifdef _WIN32
+    if (m_Data)     UnmapViewOfFile(m_Data);
+    if (m_Handle)   CloseHandle(m_Handle);
+    m_Handle = nullptr;
+#else
+    if (m_Data)     munmap(m_Data, m_Size);
+    if (!m_Name.empty())
+    {
+      shm_unlink(m_Name.c_str());     // The readers which mapped it keep their mapping
+      m_Name.clear();
+    }
+#endif
+    m_Data = nullptr;
+    m_Size = 0;
+  }
+
+  void* GetData() const   { return m_Data; }
+  size_t GetSize() const  { return m_Size; }
+
+private:
+  void*         m_Data = nullptr;
+  size_t        m_Size = 0;
+#ifdef _WIN32
+  HANDLE        m_Handle = nullptr;
+#else
+  std::string   m_Name;
+#endif
+};
+
+
+//
+// Publishes the frames in the ring. With pacing, the frames are published at the play rate of the Format chunk,
+// otherwise as fast as they are decoded.
+//
+class SharedMemorySink : public FrameSink
+{
+public:
+  SharedMemorySink(const std::string& name, uint32_t slotCount, uint32_t maxWidth, uint32_t maxHeight, bool paced)
+    : m_Paced(paced)
+  {
+    uint32_t maxPixelCount = maxWidth * maxHeight;
+    uint32_t slotSize = (sizeof(SharedRingSlot) + maxPixelCount + 63) & ~63;       // Each slot on its own cache lines
+    size_t headerSize = (sizeof(SharedRingHeader) + 63) & ~63;
+    if (m_Block.Open(name, headerSize + (size_t)slotSize * slotCount, true))
+    {
+      m_Header = new (m_Block.GetData()) SharedRingHeader();
+      m_Header->m_Magic         = SharedRingHeader::g_Magic;
+      m_Header->m_SlotCount     = slotCount;
+      m_Header->m_SlotSize      = slotSize;
+      m_Header->m_MaxPixelCount = maxPixelCount;
+      m_Slots = (uint8_t*)m_Block.GetData() + headerSize;
+      for (uint32_t slot = 0; slot < slotCount; slot++)
+      {
+        new (m_Slots + (size_t)slot * slotSize) SharedRingSlot();
+      }
+    }
+    else
+    {
+      std::cout << name << " : could not create the shared memory" << std::endl;
+    }
+  }
+
+  bool IsValid() const { return m_Header != nullptr; }
+
+  void OnChunk(const ChunkEntry& entry, const Chunk& chunk) override
+  {
+    if ((entry.m_Type == ChunkType::e_Format) && (entry.m_Size >= sizeof(Format)))
+    {
+      m_PlayRate = chunk.GetData<Format>()->play_rate;
+    }
+  }
+
+  void OnFrame(const FrameView& frame) override
+  {
+    if (!m_Header || (frame.m_Width * frame.m_Height > m_Header->m_MaxPixelCount))
+    {
+      return;
+    }
+
+    if (m_Paced && m_PlayRate)
+    {
+      if (!m_PublishedCount)
+      {
+        m_StartTime = std::chrono::steady_clock::now();
+      }
+      std::this_thread::sleep_until(m_StartTime + std::chrono::duration<double>((double)m_PublishedCount / m_PlayRate));
+    }
+
+    uint64_t index = m_PublishedCount++;
+    SharedRingSlot* slot = (SharedRingSlot*)(m_Slots + (index % m_Header->m_SlotCount) * m_Header->m_SlotSize);
+    slot->m_Sequence.store(2 * index + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);      // Readers must see the odd value before any new data
+    slot->m_Width       = frame.m_Width;
+    slot->m_Height      = frame.m_Height;
+    slot->m_FrameNumber = frame.m_FrameNumber;
+    slot->m_Palette     = *frame.m_Palette;
+    memcpy(slot->GetPixels(), frame.m_Pixels, (size_t)frame.m_Width * frame.m_Height);
+    slot->m_Sequence.store(2 * index + 2, std::memory_order_release);
+    m_Header->m_PublishedCount.store(index + 1, std::memory_order_release);
+  }
+
+  void OnEnd() override
+  {
+    if (m_Header)
+    {
+      m_Header->m_Ended.store(1, std::memory_order_release);
+    }
+  }
+
+private:
+  SharedMemoryBlock   m_Block;
+  SharedRingHeader*   m_Header = nullptr;
+  uint8_t*            m_Slots = nullptr;
+  bool                m_Paced;
+  uint32_t            m_PlayRate = 0;
+  uint64_t            m_PublishedCount = 0;
+  std::chrono::steady_clock::time_point  m_StartTime;
+};
+
+
+//
+// Reader side, for the viewers: the frames are read in place in the shared memory. AcquireFrame gives a view on
+// the oldest frame not read yet which is still in the ring, ReleaseFrame tells if the writer left the slot alone
+// meanwhile: if not, what was read from the view has to be thrown away.
+//
+class SharedFrameReader
+{
+public:
+  bool Open(const std::string& name)
+  {
+    if (!m_Block.Open(name, 0, false) || (m_Block.GetSize() < sizeof(SharedRingHeader)))
+    {
+      return false;
+    }
+    m_Header = (const SharedRingHeader*)m_Block.GetData();
+    m_Slots = (const uint8_t*)m_Block.GetData() + ((sizeof(SharedRingHeader) + 63) & ~63);
+    return (m_Header->m_Magic == SharedRingHeader::g_Magic) && (m_Block.GetSize() >= (size_t)(m_Slots - (const uint8_t*)m_Block.GetData()) + (size_t)m_Header->m_SlotCount * m_Header->m_SlotSize);
+  }
+
+  bool HasEnded() const
+  {
+    return m_Header->m_Ended.load(std::memory_order_acquire) && (m_NextIndex >= m_Header->m_PublishedCount.load(std::memory_order_acquire));
+  }
+
+  uint64_t GetSkippedCount() const { return m_SkippedCount; }
+
+  // Returns false if no new frame is available
+  bool AcquireFrame(FrameView& frame)
+  {
+    while (true)
+    {
+      uint64_t publishedCount = m_Header->m_PublishedCount.load(std::memory_order_acquire);
+      if (m_NextIndex >= publishedCount)
+      {
+        return false;
+      }
+      if (publishedCount - m_NextIndex > m_Header->m_SlotCount)
+      {
+        // The writer went around the ring, the oldest frames are lost
+        m_SkippedCount += publishedCount - m_Header->m_SlotCount - m_NextIndex;
+        m_NextIndex = publishedCount - m_Header->m_SlotCount;
+      }
+
+      uint64_t index = m_NextIndex++;
+      m_AcquiredSlot = (const SharedRingSlot*)(m_Slots + (index % m_Header->m_SlotCount) * m_Header->m_SlotSize);
+      m_AcquiredSequence = 2 * index + 2;
+      if (m_AcquiredSlot->m_Sequence.load(std::memory_order_acquire) == m_AcquiredSequence)
+      {
+        frame = { m_AcquiredSlot->GetPixels(), m_AcquiredSlot->m_Width, m_AcquiredSlot->m_Height, &m_AcquiredSlot->m_Palette, m_AcquiredSlot->m_FrameNumber };
+        return true;
+      }
+      m_SkippedCount++;
+    }
+  }
+
+  bool ReleaseFrame()
+  {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    bool isValid = (m_AcquiredSlot->m_Sequence.load(std::memory_order_relaxed) == m_AcquiredSequence);
+    m_SkippedCount += isValid ? 0 : 1;
+    return isValid;
+  }
+
+private:
+  SharedMemoryBlock         m_Block;
+  const SharedRingHeader*   m_Header = nullptr;
+  const uint8_t*            m_Slots = nullptr;
+  const SharedRingSlot*     m_AcquiredSlot = nullptr;
+  uint64_t                  m_AcquiredSequence = 0;
+  uint64_t                  m_NextIndex = 0;
+  uint64_t                  m_SkippedCount = 0;
+};